@@ -0,0 +1,354 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Local flow archive (-w): expired flows are copied as fixed size records
+ * straight into mmap()ed segment files. See archive.h for the format.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "convtime.h"
+#include "treetype.h"
+#include "softflowd.h"
+#include "archive.h"
+
+#include <sys/mman.h>
+
+struct ARCHIVE {
+	char path[1024];		/* Segment file name prefix */
+	char name[1024 + 32];		/* Current segment */
+	u_int32_t capacity;		/* Records per segment */
+	long rotate_interval;		/* Seconds per segment, 0 for none */
+	u_int sync_records;		/* Records between syncs, 0 for none */
+
+	int fd;				/* Current segment, -1 if none */
+	u_char *map;			/* Mapping of the current segment */
+	size_t map_size;
+	u_int32_t count;		/* Records in the current segment */
+	u_int32_t synced;		/* Records synced to disk */
+	time_t started;			/* When the segment was started */
+	u_int segment;			/* Segments started so far */
+
+	/* Statistics */
+	u_int64_t records;		/* Records written */
+	u_int64_t dropped;		/* Flows that could not be written */
+	u_int64_t syncs;		/* Batches synced to disk */
+};
+
+#define ARCHIVE_SIZE(n)		(sizeof(struct ARCHIVE_HEADER) + \
+				    (size_t)(n) * sizeof(struct ARCHIVE_RECORD))
+#define ARCHIVE_HDR(a)		((struct ARCHIVE_HEADER *)(a)->map)
+#define ARCHIVE_REC(a, i)	((struct ARCHIVE_RECORD *)((a)->map + \
+				    sizeof(struct ARCHIVE_HEADER)) + (i))
+
+/* Parse a size with an optional k, m or g suffix. Returns 0 if invalid */
+static u_int64_t
+archive_parse_size(const char *s)
+{
+	u_int64_t v;
+	char *ep;
+
+	v = strtoull(s, &ep, 10);
+	switch (*ep) {
+	case 'g': case 'G':
+		v *= 1024;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		v *= 1024;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		v *= 1024;
+		ep++;
+		break;
+	}
+	return (*s == '\0' || *ep != '\0' ? 0 : v);
+}
+
+/*
+ * Write the records added since the last sync to disk, and note in the
+ * header how many there are so a reader can find them after a crash.
+ */
+static void
+archive_sync(struct ARCHIVE *a)
+{
+	size_t start, end, page;
+
+	if (a->count == a->synced)
+		return;
+	ARCHIVE_HDR(a)->record_count = htole64(a->count);
+
+	page = (size_t)sysconf(_SC_PAGESIZE);
+	start = ARCHIVE_SIZE(a->synced);
+	start -= start % page;
+	end = ARCHIVE_SIZE(a->count);
+	if (msync(a->map + start, end - start, MS_SYNC) == -1 ||
+	    msync(a->map, page, MS_SYNC) == -1)
+		logit(LOG_WARNING, "archive: msync %s: %s", a->name,
+		    strerror(errno));
+	a->synced = a->count;
+	a->syncs++;
+}
+
+/* Finish the current segment and cut it down to the records written */
+static void
+archive_close_segment(struct ARCHIVE *a)
+{
+	if (a->map == NULL)
+		return;
+	archive_sync(a);
+	ARCHIVE_HDR(a)->record_count = htole64(a->count);
+	ARCHIVE_HDR(a)->flags |= htole16(ARCHIVE_F_CLOSED);
+	if (msync(a->map, sizeof(struct ARCHIVE_HEADER), MS_SYNC) == -1)
+		logit(LOG_WARNING, "archive: msync %s: %s", a->name,
+		    strerror(errno));
+	munmap(a->map, a->map_size);
+	a->map = NULL;
+	if (ftruncate(a->fd, ARCHIVE_SIZE(a->count)) == -1)
+		logit(LOG_WARNING, "archive: ftruncate %s: %s", a->name,
+		    strerror(errno));
+	close(a->fd);
+	a->fd = -1;
+}
+
+/* Start a new segment. Returns 0 on success or -1 on failure */
+static int
+archive_open_segment(struct ARCHIVE *a, const struct timeval *now)
+{
+	struct ARCHIVE_HEADER *hdr;
+	char stamp[32];
+	time_t t;
+	int err;
+
+	t = now->tv_sec;
+	strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", gmtime(&t));
+	if ((size_t)snprintf(a->name, sizeof(a->name), "%s.%s.%u", a->path,
+	    stamp, a->segment) >= sizeof(a->name)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	a->map_size = ARCHIVE_SIZE(a->capacity);
+
+	if ((a->fd = open(a->name, O_RDWR|O_CREAT|O_EXCL, 0644)) == -1)
+		goto fail;
+#ifdef HAVE_POSIX_FALLOCATE
+	/* Allocate up front, as running out of space later raises SIGBUS */
+	if ((err = posix_fallocate(a->fd, 0, a->map_size)) != 0) {
+		errno = err;
+		goto fail;
+	}
+#else
+	if (ftruncate(a->fd, a->map_size) == -1)
+		goto fail;
+#endif
+	if ((a->map = mmap(NULL, a->map_size, PROT_READ|PROT_WRITE,
+	    MAP_SHARED, a->fd, 0)) == MAP_FAILED) {
+		a->map = NULL;
+		goto fail;
+	}
+
+	hdr = ARCHIVE_HDR(a);
+	memcpy(hdr->magic, ARCHIVE_MAGIC, sizeof(hdr->magic));
+	hdr->version = htole16(ARCHIVE_VERSION);
+	hdr->header_size = htole16(sizeof(struct ARCHIVE_HEADER));
+	hdr->record_size = htole16(sizeof(struct ARCHIVE_RECORD));
+	hdr->created = htole64(t);
+	hdr->capacity = htole32(a->capacity);
+	hdr->segment = htole32(a->segment);
+
+	a->count = a->synced = 0;
+	a->started = t;
+	a->segment++;
+	return (0);
+
+ fail:
+	err = errno;
+	logit(LOG_ERR, "archive: %s: %s", a->name, strerror(err));
+	if (a->fd != -1) {
+		close(a->fd);
+		unlink(a->name);
+	}
+	a->fd = -1;
+	/* Try again with the next segment name */
+	a->segment++;
+	return (-1);
+}
+
+/* Fill in an archive record from a flow */
+static void
+archive_record(struct ARCHIVE_RECORD *r, const struct FLOW *flow)
+{
+	int i, len;
+
+	r->start_usec = htole64(flow->flow_start.tv_sec * 1000000ULL +
+	    flow->flow_start.tv_usec);
+	r->finish_usec = htole64(flow->flow_last.tv_sec * 1000000ULL +
+	    flow->flow_last.tv_usec);
+	len = flow->af == AF_INET ? 4 : 16;
+	for (i = 0; i < 2; i++) {
+		r->octets[i] = htole64(flow->octets[i]);
+		r->packets[i] = htole64(flow->packets[i]);
+		memcpy(r->addr[i], &flow->addr[i], len);
+		r->port[i] = htole16(ntohs(flow->port[i]));
+		r->tcp_flags[i] = flow->tcp_flags[i];
+		r->tos[i] = flow->tos[i];
+	}
+	r->af = flow->af == AF_INET ? 4 : 6;
+	r->protocol = flow->protocol;
+	r->vlanid = htole16(flow->vlanid);
+	r->if_index = htole16(flow->if_index);
+	r->flags = flow->interim ? ARCHIVE_R_INTERIM : 0;
+}
+
+/*
+ * Parse a -w argument, path[,size=bytes][,rotate=time][,sync=records],
+ * and set up the archive. The first segment is started by the first
+ * write. Returns NULL, after printing why, if the argument is invalid.
+ */
+struct ARCHIVE *
+archive_setup(const char *spec)
+{
+	struct ARCHIVE *a;
+	char *copy, *opt, *cp, *ep;
+	const char *dir;
+	u_int64_t size, slots;
+	long v;
+
+	if ((a = calloc(1, sizeof(*a))) == NULL ||
+	    (copy = strdup(spec)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		free(a);
+		return (NULL);
+	}
+	a->fd = -1;
+	size = ARCHIVE_DEFAULT_SIZE;
+	a->sync_records = ARCHIVE_DEFAULT_SYNC;
+
+	cp = copy;
+	opt = strsep(&cp, ",");
+	if (*opt == '\0' || strlcpy(a->path, opt, sizeof(a->path)) >=
+	    sizeof(a->path)) {
+		fprintf(stderr, "Invalid archive path \"%s\"\n", opt);
+		goto fail;
+	}
+	while ((opt = strsep(&cp, ",")) != NULL) {
+		if (strncmp(opt, "size=", 5) == 0) {
+			if ((size = archive_parse_size(opt + 5)) == 0)
+				goto bad;
+		} else if (strncmp(opt, "rotate=", 7) == 0) {
+			if ((v = convtime(opt + 7)) == -1)
+				goto bad;
+			a->rotate_interval = v;
+		} else if (strncmp(opt, "sync=", 5) == 0) {
+			v = strtol(opt + 5, &ep, 10);
+			if (opt[5] == '\0' || *ep != '\0' || v < 0)
+				goto bad;
+			a->sync_records = v;
+		} else
+			goto bad;
+	}
+
+	slots = (size - MIN(size, sizeof(struct ARCHIVE_HEADER))) /
+	    sizeof(struct ARCHIVE_RECORD);
+	if (slots == 0) {
+		fprintf(stderr, "Archive segment size too small\n");
+		goto fail;
+	}
+	a->capacity = MIN(slots, 0xffffffffULL);
+
+	/* Catch an unwritable directory now rather than at the first flow */
+	dir = copy;	/* Now just the path */
+	if ((cp = strrchr(dir, '/')) == NULL)
+		dir = ".";
+	else if (cp == dir)
+		dir = "/";
+	else
+		*cp = '\0';
+	if (access(dir, W_OK) == -1) {
+		fprintf(stderr, "Archive directory %s: %s\n", dir,
+		    strerror(errno));
+		goto fail;
+	}
+	free(copy);
+	return (a);
+
+ bad:
+	fprintf(stderr, "Invalid archive option \"%s\"\n", opt);
+ fail:
+	free(copy);
+	free(a);
+	return (NULL);
+}
+
+/*
+ * Append flows to the archive, starting a new segment when the current
+ * one is full or older than the rotation interval. Returns -1 if any
+ * flow could not be written, 0 otherwise.
+ */
+int
+archive_write(struct ARCHIVE *a, struct FLOW **flows, int num_flows,
+    const struct timeval *now)
+{
+	int i;
+
+	if (a->map != NULL && a->rotate_interval != 0 &&
+	    now->tv_sec - a->started >= a->rotate_interval)
+		archive_close_segment(a);
+
+	for (i = 0; i < num_flows; i++) {
+		if (a->map != NULL && a->count == a->capacity)
+			archive_close_segment(a);
+		if (a->map == NULL && archive_open_segment(a, now) == -1) {
+			a->dropped += num_flows - i;
+			return (-1);
+		}
+		archive_record(ARCHIVE_REC(a, a->count++), flows[i]);
+		a->records++;
+		if (a->sync_records != 0 &&
+		    a->count - a->synced >= a->sync_records)
+			archive_sync(a);
+	}
+	return (0);
+}
+
+/* Close the archive, finishing its current segment */
+void
+archive_close(struct ARCHIVE *a)
+{
+	if (a == NULL)
+		return;
+	archive_close_segment(a);
+	free(a);
+}
+
+void
+archive_statistics(struct ARCHIVE *a, FILE *out)
+{
+	fprintf(out, "Archive: %"PRIu64" records in %u segments "
+	    "(%"PRIu64" dropped, %"PRIu64" syncs)\n", a->records,
+	    a->segment, a->dropped, a->syncs);
+	if (a->map != NULL)
+		fprintf(out, "Archive segment: %s (%u of %u records)\n",
+		    a->name, a->count, a->capacity);
+}
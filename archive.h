@@ -0,0 +1,102 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ARCHIVE_H
+#define _ARCHIVE_H
+
+#include "common.h"
+
+/*
+ * Flow archive format (-w).
+ *
+ * An archive is a series of segment files named
+ * <path>.<YYYYMMDDhhmmss>.<n>, where the time (UTC) is when the segment
+ * was started and n counts the segments written by this run. Each
+ * segment is an ARCHIVE_HEADER followed by fixed size ARCHIVE_RECORDs,
+ * one per exported flow, in the order they were exported. All integers
+ * are little-endian.
+ *
+ * A segment is created at its full size and filled in through mmap().
+ * When it is closed, its header gets ARCHIVE_F_CLOSED and the final
+ * record count, and the file is cut down to the records written. A
+ * segment that was not closed (say, after a crash) has record_count as
+ * of its last sync; readers should then carry on until the first record
+ * with an af of zero or the end of the file.
+ */
+#define ARCHIVE_MAGIC		"SFDARCH"	/* 8 bytes with NUL */
+#define ARCHIVE_VERSION		2	/* 1 had no if_index; reads as 0 */
+
+#define ARCHIVE_F_CLOSED	0x0001	/* record_count is final */
+
+struct ARCHIVE_HEADER {
+	u_int8_t magic[8];		/* ARCHIVE_MAGIC */
+	u_int16_t version;		/* ARCHIVE_VERSION */
+	u_int16_t header_size;		/* sizeof(struct ARCHIVE_HEADER) */
+	u_int16_t record_size;		/* sizeof(struct ARCHIVE_RECORD) */
+	u_int16_t flags;		/* ARCHIVE_F_* */
+	u_int64_t created;		/* Segment start, seconds since epoch */
+	u_int64_t record_count;		/* Records in the segment */
+	u_int32_t capacity;		/* Record slots the segment was made with */
+	u_int32_t segment;		/* n in the file name */
+	u_int8_t reserved[24];		/* Zero */
+} __packed;
+
+#define ARCHIVE_R_INTERIM	0x01	/* Interim report (-A) */
+
+/*
+ * One flow. Endpoint 0 and 1 are the flow's endpoints in canonical
+ * order; octets[0] and packets[0] count traffic from endpoint 0 to
+ * endpoint 1. IPv4 addresses take the first 4 bytes of addr[].
+ */
+struct ARCHIVE_RECORD {
+	u_int64_t start_usec;		/* First packet, usec since epoch */
+	u_int64_t finish_usec;		/* Last packet, usec since epoch */
+	u_int64_t octets[2];
+	u_int64_t packets[2];
+	u_int8_t addr[2][16];		/* Network byte order */
+	u_int16_t port[2];		/* ICMP: type * 256 + code as dst port */
+	u_int8_t af;			/* 4 or 6; 0 marks an unused slot */
+	u_int8_t protocol;
+	u_int8_t tcp_flags[2];
+	u_int8_t tos[2];
+	u_int16_t vlanid;
+	u_int8_t flags;			/* ARCHIVE_R_* */
+	u_int16_t if_index;		/* Capture interface (-i idx:) */
+	u_int8_t reserved;		/* Zero */
+} __packed;
+
+/* Defaults for the -w options */
+#define ARCHIVE_DEFAULT_SIZE	(64 * 1024 * 1024)	/* Bytes per segment */
+#define ARCHIVE_DEFAULT_SYNC	16384			/* Records per sync */
+
+struct ARCHIVE;
+struct FLOW;
+
+struct ARCHIVE *archive_setup(const char *spec);
+int archive_write(struct ARCHIVE *a, struct FLOW **flows, int num_flows,
+    const struct timeval *now);
+void archive_close(struct ARCHIVE *a);
+void archive_statistics(struct ARCHIVE *a, FILE *out);
+
+#endif /* _ARCHIVE_H */
@@ -0,0 +1,803 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Columnar flow output (-o): expired flows are collected into column
+ * buffers and written out as Apache Arrow IPC record batches. See
+ * arrow.h for the columns.
+ *
+ * Arrow describes schemas and batches with FlatBuffers. Rather than
+ * depend on a FlatBuffers library, the few tables needed are built by
+ * the small front-to-back builder below: each table is followed by what
+ * it refers to, and offsets are filled in once their target is placed.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "convtime.h"
+#include "treetype.h"
+#include "softflowd.h"
+#include "arrow.h"
+
+#include <sys/uio.h>
+
+/* Values from the Arrow format's Schema.fbs and Message.fbs */
+#define ARROW_METADATA_V5	4
+#define ARROW_MSG_SCHEMA	1
+#define ARROW_MSG_RECORD_BATCH	3
+#define ARROW_TYPE_INT		2
+#define ARROW_TYPE_TIMESTAMP	10
+#define ARROW_TYPE_FIXED_BINARY	15
+#define ARROW_UNIT_MICROSECOND	2
+
+#define ARROW_MAGIC		"ARROW1"	/* Padded to 8 at the start */
+#define ARROW_CONTINUATION	0xffffffff
+
+#define FB_ALIGN(x, a)		(((x) + (a) - 1) & ~((size_t)(a) - 1))
+#define FB_MAX_FIELDS		8
+
+/* A FlatBuffer under construction */
+struct FB {
+	u_char *buf;
+	size_t len, size;
+};
+
+enum {
+	ARROW_C_START, ARROW_C_END, ARROW_C_VERSION, ARROW_C_PROTOCOL,
+	ARROW_C_SRC_ADDR, ARROW_C_DST_ADDR, ARROW_C_SRC_PORT, ARROW_C_DST_PORT,
+	ARROW_C_OCTETS, ARROW_C_PACKETS, ARROW_C_REV_OCTETS,
+	ARROW_C_REV_PACKETS, ARROW_C_TCP_FLAGS, ARROW_C_REV_TCP_FLAGS,
+	ARROW_C_TOS, ARROW_C_VLAN, ARROW_C_IF_INDEX, ARROW_C_INTERIM,
+	ARROW_COLUMNS
+};
+
+static const struct ARROW_COLUMN {
+	const char *name;
+	u_int8_t type;			/* ARROW_TYPE_* */
+	u_int8_t width;			/* Bytes per value */
+} arrow_columns[ARROW_COLUMNS] = {
+	[ARROW_C_START] =	{ "flow_start", ARROW_TYPE_TIMESTAMP, 8 },
+	[ARROW_C_END] =		{ "flow_end", ARROW_TYPE_TIMESTAMP, 8 },
+	[ARROW_C_VERSION] =	{ "ip_version", ARROW_TYPE_INT, 1 },
+	[ARROW_C_PROTOCOL] =	{ "protocol", ARROW_TYPE_INT, 1 },
+	[ARROW_C_SRC_ADDR] =	{ "src_addr", ARROW_TYPE_FIXED_BINARY, 16 },
+	[ARROW_C_DST_ADDR] =	{ "dst_addr", ARROW_TYPE_FIXED_BINARY, 16 },
+	[ARROW_C_SRC_PORT] =	{ "src_port", ARROW_TYPE_INT, 2 },
+	[ARROW_C_DST_PORT] =	{ "dst_port", ARROW_TYPE_INT, 2 },
+	[ARROW_C_OCTETS] =	{ "octets", ARROW_TYPE_INT, 8 },
+	[ARROW_C_PACKETS] =	{ "packets", ARROW_TYPE_INT, 8 },
+	[ARROW_C_REV_OCTETS] =	{ "reverse_octets", ARROW_TYPE_INT, 8 },
+	[ARROW_C_REV_PACKETS] =	{ "reverse_packets", ARROW_TYPE_INT, 8 },
+	[ARROW_C_TCP_FLAGS] =	{ "tcp_flags", ARROW_TYPE_INT, 1 },
+	[ARROW_C_REV_TCP_FLAGS] = { "reverse_tcp_flags", ARROW_TYPE_INT, 1 },
+	[ARROW_C_TOS] =		{ "tos", ARROW_TYPE_INT, 1 },
+	[ARROW_C_VLAN] =	{ "vlan_id", ARROW_TYPE_INT, 2 },
+	[ARROW_C_IF_INDEX] =	{ "if_index", ARROW_TYPE_INT, 2 },
+	[ARROW_C_INTERIM] =	{ "interim", ARROW_TYPE_INT, 1 },
+};
+
+static char arrow_magic[8] = ARROW_MAGIC;
+static u_char arrow_zero[8];
+
+/* A record batch in the current file, for the footer */
+struct ARROW_BLOCK {
+	u_int64_t offset;		/* Of the message in the file */
+	u_int32_t meta_len;		/* Including the 8 byte prefix */
+	u_int64_t body_len;
+};
+
+struct ARROW {
+	char path[1024];		/* File name prefix, "-" for stdout */
+	char name[1024 + 40];		/* Current file */
+	char part[1024 + 48];		/* Current file while being written */
+	int to_stdout;
+	int stream;			/* IPC stream rather than file format */
+	u_int batch_rows;		/* Rows per record batch */
+	long rotate_interval;		/* Seconds per file, 0 for none */
+	long flush_interval;		/* Max seconds a batch is held */
+
+	int fd;				/* Current output, -1 if none */
+	int failed;			/* stdout can no longer be written */
+	u_int64_t offset;		/* Bytes written to the current output */
+	time_t started;			/* When the current file was started */
+	u_int file;			/* Files started so far */
+	struct ARROW_BLOCK *blocks;	/* Batches in the current file */
+	u_int num_blocks, max_blocks;
+
+	u_char *col[ARROW_COLUMNS];	/* Column buffers of the open batch */
+	u_int rows;			/* Rows in the open batch */
+	time_t batch_started;		/* When its first row was added */
+
+	struct FB fb;			/* Message metadata */
+
+	/* Statistics */
+	u_int64_t rows_written;
+	u_int64_t batches;
+	u_int64_t dropped;		/* Flows that could not be written */
+};
+
+/* Append n zeroed bytes at the given alignment and return their position */
+static size_t
+fb_alloc(struct FB *fb, size_t n, size_t align)
+{
+	size_t pos, size;
+
+	pos = FB_ALIGN(fb->len, align);
+	if (pos + n > fb->size) {
+		size = MAX(fb->size * 2, 1024);
+		while (size < pos + n)
+			size *= 2;
+		if ((fb->buf = realloc(fb->buf, size)) == NULL) {
+			logit(LOG_ERR, "Out of memory building Arrow metadata");
+			exit(1);
+		}
+		fb->size = size;
+	}
+	memset(fb->buf + fb->len, '\0', pos + n - fb->len);
+	fb->len = pos + n;
+	return (pos);
+}
+
+static void
+fb_put16(struct FB *fb, size_t pos, u_int16_t v)
+{
+	v = htole16(v);
+	memcpy(fb->buf + pos, &v, sizeof(v));
+}
+
+static void
+fb_put32(struct FB *fb, size_t pos, u_int32_t v)
+{
+	v = htole32(v);
+	memcpy(fb->buf + pos, &v, sizeof(v));
+}
+
+static void
+fb_put64(struct FB *fb, size_t pos, u_int64_t v)
+{
+	v = htole64(v);
+	memcpy(fb->buf + pos, &v, sizeof(v));
+}
+
+/* Point the offset at slot to target, which must come after it */
+static void
+fb_link(struct FB *fb, size_t slot, size_t target)
+{
+	fb_put32(fb, slot, target - slot);
+}
+
+/*
+ * Add a table whose field i is size[i] bytes, or absent if 0, preceded
+ * by its vtable. Returns the position of the table and sets at[i] to
+ * that of each field, which the caller fills in.
+ */
+static size_t
+fb_table(struct FB *fb, const u_int8_t *size, u_int n, size_t *at)
+{
+	size_t vtable, table, off[FB_MAX_FIELDS], end;
+	u_int i, s;
+
+	vtable = fb_alloc(fb, 4 + 2 * n, 2);
+	/* Largest fields first, so each is naturally aligned */
+	end = 4;
+	for (s = 8; s > 0; s /= 2) {
+		for (i = 0; i < n; i++) {
+			if (size[i] != s)
+				continue;
+			end = FB_ALIGN(end, s);
+			off[i] = end;
+			end += s;
+		}
+	}
+	table = fb_alloc(fb, end, 8);
+	fb_put32(fb, table, table - vtable);
+	fb_put16(fb, vtable, 4 + 2 * n);
+	fb_put16(fb, vtable + 2, end);
+	for (i = 0; i < n; i++) {
+		at[i] = size[i] == 0 ? 0 : table + off[i];
+		fb_put16(fb, vtable + 4 + 2 * i, size[i] == 0 ? 0 : off[i]);
+	}
+	return (table);
+}
+
+/* Add a vector; returns the position of its length, elements follow */
+static size_t
+fb_vector(struct FB *fb, u_int count, size_t elem_size, size_t align)
+{
+	size_t pos;
+
+	while ((fb->len + 4) % align != 0)
+		fb_alloc(fb, 1, 1);
+	pos = fb_alloc(fb, 4 + count * elem_size, 4);
+	fb_put32(fb, pos, count);
+	return (pos);
+}
+
+static size_t
+fb_string(struct FB *fb, const char *s)
+{
+	size_t pos, len;
+
+	len = strlen(s);
+	pos = fb_alloc(fb, 4 + len + 1, 4);
+	fb_put32(fb, pos, len);
+	memcpy(fb->buf + pos + 4, s, len);
+	return (pos);
+}
+
+/* Add the Schema table describing arrow_columns */
+static size_t
+arrow_fb_schema(struct FB *fb)
+{
+	/* Schema: endianness, fields */
+	static const u_int8_t schema_fields[] = { 2, 4 };
+	/* Field: name, nullable, type_type, type, dictionary, children */
+	static const u_int8_t field_fields[] = { 4, 1, 1, 4, 0, 4 };
+	/* Int: bitWidth, is_signed */
+	static const u_int8_t int_fields[] = { 4, 1 };
+	/* Timestamp: unit, timezone */
+	static const u_int8_t timestamp_fields[] = { 2, 4 };
+	/* FixedSizeBinary: byteWidth */
+	static const u_int8_t binary_fields[] = { 4 };
+	const struct ARROW_COLUMN *c;
+	size_t schema, fields, type, sat[2], fat[6], tat[2];
+	u_int i;
+
+	schema = fb_table(fb, schema_fields, 2, sat);
+	fb_put16(fb, sat[0], 0);	/* Little-endian */
+	fields = fb_vector(fb, ARROW_COLUMNS, 4, 4);
+	fb_link(fb, sat[1], fields);
+	for (i = 0; i < ARROW_COLUMNS; i++) {
+		c = &arrow_columns[i];
+		fb_link(fb, fields + 4 + 4 * i,
+		    fb_table(fb, field_fields, 6, fat));
+		fb->buf[fat[1]] = 0;	/* Not nullable */
+		fb->buf[fat[2]] = c->type;
+		fb_link(fb, fat[0], fb_string(fb, c->name));
+		switch (c->type) {
+		case ARROW_TYPE_TIMESTAMP:
+			type = fb_table(fb, timestamp_fields, 2, tat);
+			fb_put16(fb, tat[0], ARROW_UNIT_MICROSECOND);
+			fb_link(fb, tat[1], fb_string(fb, "UTC"));
+			break;
+		case ARROW_TYPE_FIXED_BINARY:
+			type = fb_table(fb, binary_fields, 1, tat);
+			fb_put32(fb, tat[0], c->width);
+			break;
+		default:
+			type = fb_table(fb, int_fields, 2, tat);
+			fb_put32(fb, tat[0], c->width * 8);
+			fb->buf[tat[1]] = 0;	/* Unsigned */
+			break;
+		}
+		fb_link(fb, fat[3], type);
+		fb_link(fb, fat[5], fb_vector(fb, 0, 4, 4));
+	}
+	return (schema);
+}
+
+/*
+ * Start a Message of the given type in a.fb. Returns the position of
+ * its header offset, which the caller points at the header table.
+ */
+static size_t
+arrow_fb_message(struct ARROW *a, u_int8_t type, u_int64_t body_len)
+{
+	/* Message: version, header_type, header, bodyLength */
+	static const u_int8_t message_fields[] = { 2, 1, 4, 8 };
+	size_t root, at[4];
+
+	a->fb.len = 0;
+	root = fb_alloc(&a->fb, 4, 4);
+	fb_link(&a->fb, root, fb_table(&a->fb, message_fields, 4, at));
+	fb_put16(&a->fb, at[0], ARROW_METADATA_V5);
+	a->fb.buf[at[1]] = type;
+	fb_put64(&a->fb, at[3], body_len);
+	return (at[2]);
+}
+
+/* Write iov[0..n-1] in full. Returns 0 on success or -1 on error */
+static int
+arrow_writev(struct ARROW *a, struct iovec *iov, int n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = writev(a->fd, iov, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		a->offset += r;
+		for (; n > 0 && (size_t)r >= iov->iov_len; iov++, n--)
+			r -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Write the message in a.fb followed by the body in iov[2..n-1]; iov[0]
+ * and iov[1] are filled in here. Returns the length of the metadata
+ * including its prefix, or 0 on error.
+ */
+static u_int32_t
+arrow_write_message(struct ARROW *a, struct iovec *iov, int n)
+{
+	u_int32_t prefix[2], meta_len;
+
+	/* The body must start 8-byte aligned */
+	meta_len = FB_ALIGN(a->fb.len + 8, 8) - 8;
+	fb_alloc(&a->fb, meta_len - a->fb.len, 1);
+	prefix[0] = htole32(ARROW_CONTINUATION);
+	prefix[1] = htole32(meta_len);
+	iov[0].iov_base = prefix;
+	iov[0].iov_len = sizeof(prefix);
+	iov[1].iov_base = a->fb.buf;
+	iov[1].iov_len = meta_len;
+	if (arrow_writev(a, iov, n) == -1)
+		return (0);
+	return (sizeof(prefix) + meta_len);
+}
+
+/* Write the end of stream marker and, for files, the footer */
+static int
+arrow_write_trailer(struct ARROW *a)
+{
+	/* Footer: version, schema, dictionaries, recordBatches */
+	static const u_int8_t footer_fields[] = { 2, 4, 4, 4 };
+	u_int32_t eos[2], footer_len;
+	struct iovec iov[4];
+	size_t root, blocks, pos, at[4];
+	u_int i;
+
+	eos[0] = htole32(ARROW_CONTINUATION);
+	eos[1] = 0;
+	iov[0].iov_base = eos;
+	iov[0].iov_len = sizeof(eos);
+	if (a->stream)
+		return (arrow_writev(a, iov, 1));
+
+	a->fb.len = 0;
+	root = fb_alloc(&a->fb, 4, 4);
+	fb_link(&a->fb, root, fb_table(&a->fb, footer_fields, 4, at));
+	fb_put16(&a->fb, at[0], ARROW_METADATA_V5);
+	fb_link(&a->fb, at[1], arrow_fb_schema(&a->fb));
+	fb_link(&a->fb, at[2], fb_vector(&a->fb, 0, 24, 8));
+	blocks = fb_vector(&a->fb, a->num_blocks, 24, 8);
+	fb_link(&a->fb, at[3], blocks);
+	for (i = 0; i < a->num_blocks; i++) {
+		pos = blocks + 4 + 24 * i;
+		fb_put64(&a->fb, pos, a->blocks[i].offset);
+		fb_put32(&a->fb, pos + 8, a->blocks[i].meta_len);
+		fb_put64(&a->fb, pos + 16, a->blocks[i].body_len);
+	}
+	footer_len = htole32(a->fb.len);
+	iov[1].iov_base = a->fb.buf;
+	iov[1].iov_len = a->fb.len;
+	iov[2].iov_base = &footer_len;
+	iov[2].iov_len = sizeof(footer_len);
+	iov[3].iov_base = arrow_magic;
+	iov[3].iov_len = strlen(ARROW_MAGIC);
+	return (arrow_writev(a, iov, 4));
+}
+
+/* Finish the current file and move it into place */
+static void
+arrow_close_file(struct ARROW *a)
+{
+	if (a->fd == -1 || a->to_stdout)
+		return;
+	if (arrow_write_trailer(a) == -1 || close(a->fd) == -1) {
+		logit(LOG_ERR, "arrow: %s: %s", a->part, strerror(errno));
+		unlink(a->part);
+	} else if (rename(a->part, a->name) == -1) {
+		logit(LOG_ERR, "arrow: rename %s: %s", a->part,
+		    strerror(errno));
+	}
+	a->fd = -1;
+}
+
+/* Give up on the current output after a write error */
+static void
+arrow_abandon(struct ARROW *a)
+{
+	if (a->to_stdout) {
+		logit(LOG_ERR, "arrow: stdout: %s; no further output",
+		    strerror(errno));
+		a->failed = 1;
+		a->fd = -1;
+		return;
+	}
+	logit(LOG_ERR, "arrow: %s: %s", a->part, strerror(errno));
+	close(a->fd);
+	unlink(a->part);
+	a->fd = -1;
+}
+
+/* Start a new file, or stdout, with the schema. Returns 0 or -1 */
+static int
+arrow_open(struct ARROW *a, const struct timeval *now)
+{
+	struct iovec iov[3];
+	char stamp[32];
+	size_t slot;
+	time_t t;
+
+	if (a->failed)
+		return (-1);
+	a->offset = 0;
+	a->num_blocks = 0;
+	a->started = now->tv_sec;
+	if (a->to_stdout)
+		a->fd = STDOUT_FILENO;
+	else {
+		t = now->tv_sec;
+		strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", gmtime(&t));
+		if ((size_t)snprintf(a->name, sizeof(a->name), "%s.%s.%u.%s",
+		    a->path, stamp, a->file++, a->stream ? "arrows" : "arrow") >=
+		    sizeof(a->name) || (size_t)snprintf(a->part,
+		    sizeof(a->part), "%s.part", a->name) >= sizeof(a->part))
+			errno = ENAMETOOLONG;
+		else
+			a->fd = open(a->part, O_WRONLY|O_CREAT|O_EXCL, 0644);
+		if (a->fd == -1) {
+			logit(LOG_ERR, "arrow: %s: %s", a->part,
+			    strerror(errno));
+			return (-1);
+		}
+	}
+
+	if (!a->stream) {
+		/* File magic, padded to 8 bytes */
+		iov[0].iov_base = arrow_magic;
+		iov[0].iov_len = sizeof(arrow_magic);
+		if (arrow_writev(a, iov, 1) == -1) {
+			arrow_abandon(a);
+			return (-1);
+		}
+	}
+	slot = arrow_fb_message(a, ARROW_MSG_SCHEMA, 0);
+	fb_link(&a->fb, slot, arrow_fb_schema(&a->fb));
+	if (arrow_write_message(a, iov, 2) == 0) {
+		arrow_abandon(a);
+		return (-1);
+	}
+	return (0);
+}
+
+/* Write the open batch as a record batch. Returns 0 or -1 on error */
+static int
+arrow_flush(struct ARROW *a, const struct timeval *now)
+{
+	/* RecordBatch: length, nodes, buffers */
+	static const u_int8_t batch_fields[] = { 8, 4, 4 };
+	struct iovec iov[2 + 2 * ARROW_COLUMNS];
+	struct ARROW_BLOCK *blocks;
+	size_t len, slot, nodes, buffers, pos, at[3];
+	u_int64_t body_len;
+	u_int32_t meta_len;
+	int c, n;
+
+	if (a->rows == 0)
+		return (0);
+	if (a->fd == -1 && arrow_open(a, now) == -1) {
+		a->dropped += a->rows;
+		a->rows = 0;
+		return (-1);
+	}
+
+	/* Each column is a (zero length) validity buffer and its values */
+	body_len = 0;
+	for (c = 0; c < ARROW_COLUMNS; c++)
+		body_len += FB_ALIGN(a->rows * arrow_columns[c].width, 8);
+	slot = arrow_fb_message(a, ARROW_MSG_RECORD_BATCH, body_len);
+	fb_link(&a->fb, slot, fb_table(&a->fb, batch_fields, 3, at));
+	fb_put64(&a->fb, at[0], a->rows);
+	nodes = fb_vector(&a->fb, ARROW_COLUMNS, 16, 8);
+	fb_link(&a->fb, at[1], nodes);
+	buffers = fb_vector(&a->fb, 2 * ARROW_COLUMNS, 16, 8);
+	fb_link(&a->fb, at[2], buffers);
+
+	n = 2;
+	body_len = 0;
+	for (c = 0; c < ARROW_COLUMNS; c++) {
+		len = a->rows * arrow_columns[c].width;
+		/* FieldNode: length, null_count */
+		fb_put64(&a->fb, nodes + 4 + 16 * c, a->rows);
+		/* Buffer: offset, length */
+		pos = buffers + 4 + 32 * c;
+		fb_put64(&a->fb, pos, body_len);
+		fb_put64(&a->fb, pos + 16, body_len);
+		fb_put64(&a->fb, pos + 24, len);
+		iov[n].iov_base = a->col[c];
+		iov[n++].iov_len = len;
+		iov[n].iov_base = arrow_zero;
+		iov[n++].iov_len = FB_ALIGN(len, 8) - len;
+		body_len += FB_ALIGN(len, 8);
+	}
+
+	pos = a->offset;
+	if ((meta_len = arrow_write_message(a, iov, n)) == 0) {
+		arrow_abandon(a);
+		a->dropped += a->rows;
+		a->rows = 0;
+		return (-1);
+	}
+	if (!a->stream) {
+		if (a->num_blocks == a->max_blocks) {
+			if ((blocks = realloc(a->blocks,
+			    MAX(a->max_blocks * 2, 64) *
+			    sizeof(*blocks))) == NULL) {
+				logit(LOG_ERR, "Out of memory for Arrow "
+				    "batches");
+				exit(1);
+			}
+			a->blocks = blocks;
+			a->max_blocks = MAX(a->max_blocks * 2, 64);
+		}
+		a->blocks[a->num_blocks].offset = pos;
+		a->blocks[a->num_blocks].meta_len = meta_len;
+		a->blocks[a->num_blocks++].body_len = body_len;
+	}
+	a->rows_written += a->rows;
+	a->batches++;
+	a->rows = 0;
+	return (0);
+}
+
+static void
+arrow_put(struct ARROW *a, int c, u_int64_t v)
+{
+	u_char *p;
+	u_int16_t v16;
+	u_int64_t v64;
+
+	p = a->col[c] + (size_t)a->rows * arrow_columns[c].width;
+	switch (arrow_columns[c].width) {
+	case 1:
+		*p = v;
+		break;
+	case 2:
+		v16 = htole16(v);
+		memcpy(p, &v16, sizeof(v16));
+		break;
+	default:
+		v64 = htole64(v);
+		memcpy(p, &v64, sizeof(v64));
+		break;
+	}
+}
+
+static void
+arrow_put_addr(struct ARROW *a, int c, const struct FLOW *flow, int i)
+{
+	u_char *p;
+
+	p = a->col[c] + (size_t)a->rows * 16;
+	if (flow->af == AF_INET) {
+		/* IPv4-mapped */
+		memset(p, '\0', 10);
+		p[10] = p[11] = 0xff;
+		memcpy(p + 12, &flow->addr[i], 4);
+	} else
+		memcpy(p, &flow->addr[i], 16);
+}
+
+/* Add a flow to the open batch */
+static void
+arrow_row(struct ARROW *a, const struct FLOW *flow)
+{
+	arrow_put(a, ARROW_C_START, flow->flow_start.tv_sec * 1000000ULL +
+	    flow->flow_start.tv_usec);
+	arrow_put(a, ARROW_C_END, flow->flow_last.tv_sec * 1000000ULL +
+	    flow->flow_last.tv_usec);
+	arrow_put(a, ARROW_C_VERSION, flow->af == AF_INET ? 4 : 6);
+	arrow_put(a, ARROW_C_PROTOCOL, flow->protocol);
+	arrow_put_addr(a, ARROW_C_SRC_ADDR, flow, 0);
+	arrow_put_addr(a, ARROW_C_DST_ADDR, flow, 1);
+	arrow_put(a, ARROW_C_SRC_PORT, ntohs(flow->port[0]));
+	arrow_put(a, ARROW_C_DST_PORT, ntohs(flow->port[1]));
+	arrow_put(a, ARROW_C_OCTETS, flow->octets[0]);
+	arrow_put(a, ARROW_C_PACKETS, flow->packets[0]);
+	arrow_put(a, ARROW_C_REV_OCTETS, flow->octets[1]);
+	arrow_put(a, ARROW_C_REV_PACKETS, flow->packets[1]);
+	arrow_put(a, ARROW_C_TCP_FLAGS, flow->tcp_flags[0]);
+	arrow_put(a, ARROW_C_REV_TCP_FLAGS, flow->tcp_flags[1]);
+	arrow_put(a, ARROW_C_TOS, flow->tos[0]);
+	arrow_put(a, ARROW_C_VLAN, flow->vlanid);
+	arrow_put(a, ARROW_C_IF_INDEX, flow->if_index);
+	arrow_put(a, ARROW_C_INTERIM, flow->interim != 0);
+	a->rows++;
+}
+
+/* Whether the output is a stream on stdout, which nothing else may use */
+int
+arrow_to_stdout(const struct ARROW *a)
+{
+	return (a->to_stdout);
+}
+
+/*
+ * Parse a -o argument, path[,batch=rows][,flush=time][,rotate=time]
+ * [,format=file|stream], and set up the output. A path of "-" writes a
+ * stream to stdout. Files are started by the first batch written.
+ * Returns NULL, after printing why, if the argument is invalid.
+ */
+struct ARROW *
+arrow_setup(const char *spec)
+{
+	struct ARROW *a;
+	char *copy, *opt, *cp, *ep;
+	const char *dir;
+	long v;
+	int c;
+
+	if ((a = calloc(1, sizeof(*a))) == NULL ||
+	    (copy = strdup(spec)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		free(a);
+		return (NULL);
+	}
+	a->fd = -1;
+	a->batch_rows = ARROW_DEFAULT_BATCH;
+	a->flush_interval = ARROW_DEFAULT_FLUSH;
+
+	cp = copy;
+	opt = strsep(&cp, ",");
+	if (*opt == '\0' || strlcpy(a->path, opt, sizeof(a->path)) >=
+	    sizeof(a->path)) {
+		fprintf(stderr, "Invalid Arrow output path \"%s\"\n", opt);
+		goto fail;
+	}
+	a->to_stdout = a->stream = strcmp(a->path, "-") == 0;
+	while ((opt = strsep(&cp, ",")) != NULL) {
+		if (strncmp(opt, "batch=", 6) == 0) {
+			v = strtol(opt + 6, &ep, 10);
+			if (opt[6] == '\0' || *ep != '\0' || v < 1 ||
+			    v > ARROW_MAX_BATCH)
+				goto bad;
+			a->batch_rows = v;
+		} else if (strncmp(opt, "flush=", 6) == 0) {
+			if ((v = convtime(opt + 6)) == -1)
+				goto bad;
+			a->flush_interval = v;
+		} else if (strncmp(opt, "rotate=", 7) == 0 && !a->to_stdout) {
+			if ((v = convtime(opt + 7)) == -1)
+				goto bad;
+			a->rotate_interval = v;
+		} else if (strcmp(opt, "format=stream") == 0)
+			a->stream = 1;
+		else if (strcmp(opt, "format=file") == 0 && !a->to_stdout)
+			a->stream = 0;
+		else
+			goto bad;
+	}
+
+	for (c = 0; c < ARROW_COLUMNS; c++) {
+		if ((a->col[c] = calloc(a->batch_rows,
+		    arrow_columns[c].width)) == NULL) {
+			fprintf(stderr, "Out of memory for Arrow batches\n");
+			goto fail;
+		}
+	}
+
+	/* Catch an unwritable directory now rather than at the first flow */
+	if (!a->to_stdout) {
+		dir = copy;	/* Now just the path */
+		if ((cp = strrchr(dir, '/')) == NULL)
+			dir = ".";
+		else if (cp == dir)
+			dir = "/";
+		else
+			*cp = '\0';
+		if (access(dir, W_OK) == -1) {
+			fprintf(stderr, "Arrow output directory %s: %s\n",
+			    dir, strerror(errno));
+			goto fail;
+		}
+	}
+	free(copy);
+	return (a);
+
+ bad:
+	fprintf(stderr, "Invalid Arrow output option \"%s\"\n", opt);
+ fail:
+	for (c = 0; c < ARROW_COLUMNS; c++)
+		free(a->col[c]);
+	free(copy);
+	free(a);
+	return (NULL);
+}
+
+/*
+ * Add flows to the open batch, writing it out when it is full or has
+ * been held longer than the flush interval, and starting a new file
+ * after the rotation interval. Returns -1 if any flow could not be
+ * written, 0 otherwise.
+ */
+int
+arrow_write(struct ARROW *a, struct FLOW **flows, int num_flows,
+    const struct timeval *now)
+{
+	int i, r;
+
+	r = 0;
+	if (a->rows != 0 && a->flush_interval != 0 &&
+	    now->tv_sec - a->batch_started >= a->flush_interval &&
+	    arrow_flush(a, now) == -1)
+		r = -1;
+	if (a->fd != -1 && a->rotate_interval != 0 &&
+	    now->tv_sec - a->started >= a->rotate_interval) {
+		if (arrow_flush(a, now) == -1)
+			r = -1;
+		arrow_close_file(a);
+	}
+
+	for (i = 0; i < num_flows; i++) {
+		if (a->rows == 0)
+			a->batch_started = now->tv_sec;
+		arrow_row(a, flows[i]);
+		if (a->rows == a->batch_rows && arrow_flush(a, now) == -1)
+			r = -1;
+	}
+	return (r);
+}
+
+/* Write out the open batch and finish the output */
+void
+arrow_close(struct ARROW *a)
+{
+	struct timeval now;
+	int c;
+
+	if (a == NULL)
+		return;
+	gettimeofday(&now, NULL);
+	arrow_flush(a, &now);
+	if (a->to_stdout && a->fd != -1) {
+		if (arrow_write_trailer(a) == -1)
+			logit(LOG_ERR, "arrow: stdout: %s", strerror(errno));
+	} else
+		arrow_close_file(a);
+	for (c = 0; c < ARROW_COLUMNS; c++)
+		free(a->col[c]);
+	free(a->blocks);
+	free(a->fb.buf);
+	free(a);
+}
+
+void
+arrow_statistics(struct ARROW *a, FILE *out)
+{
+	fprintf(out, "Arrow output: %"PRIu64" rows in %"PRIu64" batches, "
+	    "%u files (%"PRIu64" dropped)\n", a->rows_written, a->batches,
+	    a->file, a->dropped);
+	if (a->fd != -1 && !a->to_stdout)
+		fprintf(out, "Arrow file: %s (%u batches)\n", a->part,
+		    a->num_blocks);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ARROW_H
+#define _ARROW_H
+
+#include "common.h"
+
+/*
+ * Columnar flow output (-o).
+ *
+ * Flows are written as Apache Arrow IPC record batches with one row per
+ * flow and the columns below, none of them nullable. src is the flow's
+ * first endpoint in softflowd's canonical order, and octets and packets
+ * count traffic from src to dst; the reverse_ columns count the other
+ * direction. IPv4 addresses are stored IPv4-mapped (::ffff:a.b.c.d).
+ *
+ *	flow_start, flow_end	timestamp[us, UTC]
+ *	ip_version, protocol	uint8
+ *	src_addr, dst_addr	fixed_size_binary[16]
+ *	src_port, dst_port	uint16 (ICMP: type * 256 + code in dst_port)
+ *	octets, packets		uint64
+ *	reverse_octets		uint64
+ *	reverse_packets		uint64
+ *	tcp_flags		uint8
+ *	reverse_tcp_flags	uint8
+ *	tos			uint8
+ *	vlan_id			uint16
+ *	interim			uint8 (1 for an interim report, -A)
+ *
+ * Output is either a series of Arrow IPC files named
+ * <path>.<YYYYMMDDhhmmss>.<n>.arrow (.arrows in stream format), each
+ * renamed into place once complete, or an IPC stream on stdout.
+ */
+
+/* Defaults for the -o options */
+#define ARROW_DEFAULT_BATCH	65536		/* Rows per record batch */
+#define ARROW_DEFAULT_FLUSH	60		/* Max seconds a batch is held */
+#define ARROW_MAX_BATCH		(1024 * 1024)
+
+struct ARROW;
+struct FLOW;
+
+struct ARROW *arrow_setup(const char *spec);
+int arrow_write(struct ARROW *a, struct FLOW **flows, int num_flows,
+    const struct timeval *now);
+int arrow_to_stdout(const struct ARROW *a);
+void arrow_close(struct ARROW *a);
+void arrow_statistics(struct ARROW *a, FILE *out);
+
+#endif /* _ARROW_H */
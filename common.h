@@ -33,6 +33,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/un.h>
@@ -131,6 +132,22 @@
 # endif
 #endif
 
+/* Little-endian conversions, for systems without them */
+#ifndef htole64
+# if BYTE_ORDER == LITTLE_ENDIAN
+#  define htole16(x)	((u_int16_t)(x))
+#  define htole32(x)	((u_int32_t)(x))
+#  define htole64(x)	((u_int64_t)(x))
+# else
+#  define htole16(x)	__builtin_bswap16(x)
+#  define htole32(x)	__builtin_bswap32(x)
+#  define htole64(x)	__builtin_bswap64(x)
+# endif
+# define le16toh(x)	htole16(x)
+# define le32toh(x)	htole32(x)
+# define le64toh(x)	htole64(x)
+#endif
+
 #if !defined(HAVE_INT8_T) && defined(OUR_CFG_INT8_T)
 typedef OUR_CFG_INT8_T int8_t;
 #endif
@@ -0,0 +1,309 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "common.h"
+#include "treetype.h"
+#include "softflowd.h"
+#include "dedup.h"
+
+struct DEDUP_ENTRY {
+	u_int64_t fp;			/* 0 if never used */
+	u_int32_t seen;			/* Milliseconds, wrapping */
+	u_int16_t src;			/* Capture it was seen on */
+};
+
+struct DEDUP {
+	u_int32_t window;		/* Milliseconds */
+	struct DEDUP_ENTRY *table;
+	u_int32_t mask;			/* Table size - 1 */
+
+	/* Interfaces (trust=) whose packets are never suppressed */
+	char *spec;
+	char *trust[MAX_CAPTURES];
+	int trust_used[MAX_CAPTURES];
+	int num_trust;
+
+	/* Statistics */
+	u_int64_t checked;
+	u_int64_t suppressed;
+	u_int64_t evicted;		/* Replaced while still in window */
+};
+
+#define FNV64_OFFSET	0xcbf29ce484222325ULL
+#define FNV64_PRIME	0x100000001b3ULL
+
+static u_int64_t
+fnv64(const u_char *p, size_t len)
+{
+	u_int64_t h = FNV64_OFFSET;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= FNV64_PRIME;
+	}
+	return (h);
+}
+
+/* Where a transport protocol keeps its checksum, or -1 */
+static int
+l4_sum_offset(int proto)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+		return (16);
+	case IPPROTO_UDP:
+		return (6);
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		return (2);
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * Fingerprint a packet starting at its IP header. Returns 0 if it is too
+ * short to fingerprint.
+ */
+static u_int64_t
+dedup_fingerprint(int af, const u_char *pkt, u_int caplen)
+{
+	const struct ip *ip = (const struct ip *)pkt;
+	const struct ip6_hdr *ip6 = (const struct ip6_hdr *)pkt;
+	const struct ip6_frag *frag;
+	u_char key[64];
+	u_int32_t flowlabel;
+	u_int16_t off;
+	size_t len, hl;
+	int proto, sum;
+	u_int64_t fp;
+
+	len = 0;
+	if (af == AF_INET) {
+		if (caplen < sizeof(*ip) || ip->ip_v != 4 ||
+		    (hl = ip->ip_hl * 4) < sizeof(*ip))
+			return (0);
+		memcpy(key, &ip->ip_src, 4);
+		memcpy(key + 4, &ip->ip_dst, 4);
+		memcpy(key + 8, &ip->ip_id, 2);
+		memcpy(key + 10, &ip->ip_len, 2);
+		/* DF may be cleared on the way, the offset and MF may not */
+		off = ip->ip_off & htons(IP_OFFMASK|IP_MF);
+		memcpy(key + 12, &off, 2);
+		key[14] = proto = ip->ip_p;
+		len = 15;
+		if ((ntohs(ip->ip_off) & IP_OFFMASK) != 0)
+			proto = -1;
+	} else if (af == AF_INET6) {
+		if (caplen < sizeof(*ip6))
+			return (0);
+		hl = sizeof(*ip6);
+		memcpy(key, &ip6->ip6_src, 16);
+		memcpy(key + 16, &ip6->ip6_dst, 16);
+		flowlabel = ip6->ip6_flow & htonl(0x000fffff);
+		memcpy(key + 32, &flowlabel, 4);
+		memcpy(key + 36, &ip6->ip6_plen, 2);
+		key[38] = proto = ip6->ip6_nxt;
+		len = 39;
+		/* A fragment header has an identification to use */
+		if (proto == IPPROTO_FRAGMENT &&
+		    caplen >= hl + sizeof(*frag)) {
+			frag = (const struct ip6_frag *)(pkt + hl);
+			memcpy(key + len, &frag->ip6f_ident, 4);
+			memcpy(key + len + 4, &frag->ip6f_offlg, 2);
+			len += 6;
+			proto = (frag->ip6f_offlg & IP6F_OFF_MASK) == 0 ?
+			    frag->ip6f_nxt : -1;
+			hl += sizeof(*frag);
+		}
+	} else
+		return (0);
+
+	if ((sum = l4_sum_offset(proto)) != -1 && caplen >= hl + sum + 2) {
+		memcpy(key + len, pkt + hl + sum, 2);
+		len += 2;
+	}
+
+	fp = fnv64(key, len);
+	return (fp == 0 ? 1 : fp);
+}
+
+/* Parse "window[,entries=N][,trust=interface]..." */
+struct DEDUP *
+dedup_setup(const char *spec)
+{
+	struct DEDUP *d;
+	char *opt, *cp, *ep;
+	long v;
+	u_int32_t entries;
+
+	if ((d = calloc(1, sizeof(*d))) == NULL ||
+	    (d->spec = strdup(spec)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		free(d);
+		return (NULL);
+	}
+	entries = DEDUP_DEFAULT_ENTRIES;
+
+	cp = d->spec;
+	opt = strsep(&cp, ",");
+	v = strtol(opt, &ep, 10);
+	if (*opt == '\0' || *ep != '\0' || v < 1 || v > DEDUP_MAX_WINDOW) {
+		fprintf(stderr, "Invalid duplicate window \"%s\" (1-%d ms)\n",
+		    opt, DEDUP_MAX_WINDOW);
+		goto fail;
+	}
+	d->window = v;
+	while ((opt = strsep(&cp, ",")) != NULL) {
+		if (strncmp(opt, "entries=", 8) == 0) {
+			v = strtol(opt + 8, &ep, 10);
+			if (opt[8] == '\0' || *ep != '\0' || v < DEDUP_PROBE ||
+			    v > DEDUP_MAX_ENTRIES)
+				goto bad;
+			entries = v;
+		} else if (strncmp(opt, "trust=", 6) == 0) {
+			if (opt[6] == '\0' || d->num_trust == MAX_CAPTURES)
+				goto bad;
+			d->trust[d->num_trust++] = opt + 6;
+		} else
+			goto bad;
+	}
+
+	/* Round up to a power of two */
+	for (d->mask = DEDUP_PROBE; d->mask < entries; d->mask <<= 1)
+		;
+	if ((d->table = calloc(d->mask, sizeof(*d->table))) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto fail;
+	}
+	d->mask--;
+	return (d);
+
+ bad:
+	fprintf(stderr, "Invalid duplicate suppression option \"%s\"\n", opt);
+ fail:
+	free(d->spec);
+	free(d);
+	return (NULL);
+}
+
+/* Whether packets from the named interface are exempt (trust=) */
+int
+dedup_trusted(struct DEDUP *d, const char *name)
+{
+	int i, ret;
+
+	for (ret = i = 0; i < d->num_trust; i++) {
+		if (strcmp(d->trust[i], name) == 0)
+			ret = d->trust_used[i] = 1;
+	}
+	return (ret);
+}
+
+/* A trust= interface that no dedup_trusted() call has asked about */
+const char *
+dedup_unknown_trust(const struct DEDUP *d)
+{
+	int i;
+
+	for (i = 0; i < d->num_trust; i++) {
+		if (!d->trust_used[i])
+			return (d->trust[i]);
+	}
+	return (NULL);
+}
+
+/*
+ * Check a packet, starting at its IP header, seen on capture src at
+ * now_ms. Returns 1 if it is a copy of one seen on another capture
+ * within the window and should be dropped, otherwise remembers it and
+ * returns 0.
+ */
+int
+dedup_check(struct DEDUP *d, int src, int af, const u_char *pkt,
+    u_int caplen, u_int64_t now_ms)
+{
+	struct DEDUP_ENTRY *e, *victim;
+	u_int64_t fp;
+	u_int32_t now;
+	int i, victim_live;
+
+	if ((fp = dedup_fingerprint(af, pkt, caplen)) == 0)
+		return (0);
+	d->checked++;
+	now = (u_int32_t)now_ms;
+
+	victim = NULL;
+	victim_live = 0;
+	for (i = 0; i < DEDUP_PROBE; i++) {
+		e = &d->table[(fp + i) & d->mask];
+		if (e->fp == 0 || now - e->seen > d->window) {
+			/* Free or expired: the best place for a new entry */
+			if (victim == NULL || victim_live) {
+				victim = e;
+				victim_live = 0;
+			}
+			continue;
+		}
+		if (e->fp == fp) {
+			if (e->src != src) {
+				d->suppressed++;
+				return (1);
+			}
+			e->seen = now;
+			return (0);
+		}
+		if (victim == NULL ||
+		    (victim_live && now - e->seen > now - victim->seen)) {
+			victim = e;
+			victim_live = 1;
+		}
+	}
+	if (victim_live)
+		d->evicted++;
+	victim->fp = fp;
+	victim->seen = now;
+	victim->src = src;
+	return (0);
+}
+
+void
+dedup_close(struct DEDUP *d)
+{
+	if (d == NULL)
+		return;
+	free(d->table);
+	free(d->spec);
+	free(d);
+}
+
+void
+dedup_statistics(struct DEDUP *d, FILE *out)
+{
+	fprintf(out, "Duplicate packets suppressed: %"PRIu64" of %"PRIu64
+	    " checked (%ums window)\n", d->suppressed, d->checked, d->window);
+	fprintf(out, "Duplicate fingerprints: %u slots, %"PRIu64" replaced "
+	    "within the window\n", d->mask + 1, d->evicted);
+}
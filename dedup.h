@@ -0,0 +1,65 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include "common.h"
+
+/*
+ * Cross-interface duplicate suppression (-u).
+ *
+ * When several interfaces see the same traffic (both sides of a
+ * firewall, overlapping SPAN ports), each packet is fingerprinted
+ * before flow tracking and dropped if a packet with the same
+ * fingerprint was seen on another interface within the window.
+ *
+ * An IPv4 fingerprint covers the addresses, IP ID, total length,
+ * protocol, fragment offset and the TCP, UDP or ICMP checksum. The IP
+ * header checksum is left out as it changes with the TTL at each hop.
+ * IPv6 has no IP ID, so the flow label and payload length stand in.
+ *
+ * Fingerprints are kept in a fixed size open addressed table with the
+ * time they were last seen; entries older than the window are free for
+ * reuse, and if none is free the oldest in the probe run is replaced.
+ */
+
+/* Defaults and limits for the -u options */
+#define DEDUP_DEFAULT_ENTRIES	65536		/* Fingerprints remembered */
+#define DEDUP_MAX_ENTRIES	(16 * 1024 * 1024)
+#define DEDUP_MAX_WINDOW	10000		/* Milliseconds */
+#define DEDUP_PROBE		8		/* Slots looked at per packet */
+
+struct DEDUP;
+
+struct DEDUP *dedup_setup(const char *spec);
+int dedup_trusted(struct DEDUP *d, const char *name);
+const char *dedup_unknown_trust(const struct DEDUP *d);
+int dedup_check(struct DEDUP *d, int src, int af, const u_char *pkt,
+    u_int caplen, u_int64_t now_ms);
+void dedup_close(struct DEDUP *d);
+void dedup_statistics(struct DEDUP *d, FILE *out);
+
+#endif /* _DEDUP_H */
@@ -27,7 +27,6 @@
 
 #include <curl/curl.h>
 
-#define MAX_LEN_ES_BULK 16*1024
 struct ES_CON {
 	CURL *curl;
 	char url[512];
@@ -0,0 +1,252 @@
+/*
+ * Copyright 2016 Alexander Böhm <alxndr.boehm@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Flows formatted for the elasticsearch bulk API, as sent by the
+ * elasticsearch output and written by the NDJSON file output.
+ */
+
+#include "common.h"
+#include "treetype.h"
+#include "softflowd.h"
+#include "esbulk.h"
+
+/* Format a time */
+static const char *
+index_from_timestamp(const struct timeval* t, const char* index_prefix)
+{
+	struct tm *tm;
+	char buf[32];
+	static char ret[256];
+
+	tm = gmtime(&t->tv_sec);
+	strftime(buf, sizeof(buf), "%Y.%m.%d", tm);
+	snprintf(ret, sizeof(ret), "%s-%s", index_prefix, buf);
+
+	return (ret);
+}
+
+/* Format a time into ret, which is used several times per document */
+static const char *
+format_time_usec(const struct timeval* t, char *ret, size_t len)
+{
+	struct tm *tm;
+	char buf[32];
+
+	tm = gmtime(&t->tv_sec);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", tm);
+	snprintf(ret, len, "%s.%06ld", buf, (long)t->tv_usec);
+
+	return (ret);
+}
+
+/* Get a unique id from a flow  */ 
+static const char*
+flow_uid(const struct FLOW* flow, int in_flow, const char *now, char *ret,
+    size_t len)
+{
+	snprintf(ret, len, "%"PRIu64"_%s_%s",
+		flow->flow_seq,
+		now,
+		in_flow ? "in" : "out"
+	    );
+
+	return (ret);
+}
+
+static const char *
+proto2str(u_int8_t proto)
+{
+	static char buf[8];
+
+	switch (proto) {
+		case IPPROTO_ICMP: return "ICMP";
+		case IPPROTO_IGMP: return "IGMP";
+		case IPPROTO_IPIP: return "IPIP";
+		case IPPROTO_TCP: return "TCP";
+		case IPPROTO_EGP: return "EGP";
+		case IPPROTO_PUP: return "PUP";
+		case IPPROTO_UDP: return "UDP";
+#ifdef IPPROTO_IDP
+		case IPPROTO_IDP: return "IDP";
+#endif
+#ifdef IPPROTO_TP
+		case IPPROTO_TP: return "TP";
+#endif
+#ifdef IPPROTO_DCCP
+		case IPPROTO_DCCP: return "DCCP";
+#endif
+		case IPPROTO_IPV6: return "IPV6";
+		case IPPROTO_RSVP: return "RSVP";
+		case IPPROTO_GRE: return "GRE";
+		case IPPROTO_ESP: return "ESP";
+		case IPPROTO_AH: return "AH";
+#ifdef IPPROTO_MTP
+		case IPPROTO_MTP: return "MTP";
+#endif
+#ifdef IPPROTO_ENCAP
+		case IPPROTO_ENCAP: return "ENCAP";
+#endif
+		case IPPROTO_PIM: return "PIM";
+#ifdef IPPROTO_COMP
+		case IPPROTO_COMP: return "COMP";
+#endif
+		case IPPROTO_SCTP: return "SCTP";
+#ifdef IPPROTO_UDPLITE
+		case IPPROTO_UDPLITE: return "UDPLITE";
+#endif
+		case IPPROTO_RAW: return "RAW";
+		case IPPROTO_ICMPV6: return "ICMPV6";
+		case IPPROTO_IP: return "IP";
+		default: snprintf(buf, sizeof(buf), "%u", proto); break;
+	}
+	
+	return buf;
+}
+
+static const char *
+af2str(int family)
+{
+	static char buf[32];
+
+	switch (family) {
+	case AF_UNSPEC:		return "unspecified";
+#ifdef AF_BRIDGE
+	case AF_BRIDGE:		return "BRIDGE";
+#endif
+#ifdef AF_DECnet
+	case AF_DECnet:		return "DECnet";
+#endif
+	case AF_INET:		return "IP";
+	case AF_INET6:		return "IPv6";
+#ifdef AF_IPX
+	case AF_IPX:		return "IPX";
+#endif
+#ifdef AF_X25
+	case AF_X25:		return "X25";
+#endif
+#ifdef AF_AX25
+	case AF_AX25:		return "AX25";
+#endif
+#ifdef AF_ATMPVC
+	case AF_ATMPVC:		return "ATMPVC";
+#endif
+#ifdef AF_APPLETALK
+	case AF_APPLETALK:	return "AppleTALK";
+#endif
+	default:		snprintf(buf, sizeof(buf), "UNKNOWN(%u)", family); break;
+	}
+
+	return buf;
+}
+
+/*
+ * Format a flow into buf. Returns the length, or -1 if it does not fit.
+ * Index and document ids are based on now.
+ */
+int
+es_bulk_format(char *buf, size_t len, const struct FLOW *flow, int expired,
+    const char* es_index, const char* es_doc_type, const struct timeval *now)
+{
+	char addr1[64], addr2[64], index[256];
+	char stamp[64], start[64], finish[64], uid_in[256], uid_out[256];
+	int r;
+
+	inet_ntop(flow->af, &flow->addr[0], addr1, sizeof(addr1));
+	inet_ntop(flow->af, &flow->addr[1], addr2, sizeof(addr2));
+	strlcpy(index, index_from_timestamp(now, es_index), sizeof(index));
+	format_time_usec(now, stamp, sizeof(stamp));
+	format_time_usec(&flow->flow_start, start, sizeof(start));
+	format_time_usec(&flow->flow_last, finish, sizeof(finish));
+	flow_uid(flow, 1, stamp, uid_in, sizeof(uid_in));
+	flow_uid(flow, 0, stamp, uid_out, sizeof(uid_out));
+
+	r = snprintf(buf, len,
+		"{ \"index\": { \"_index\" : \"%s\", \"_type\" : \"%s\", \"_id\": \"%s\" } }\n"
+		"{"
+		" \"timestamp\": \"%s\" "
+		", \"seq\":%"PRIu64" "
+		", \"type\": \"softflow\" "
+		", \"src_addr\": \"%s:%hu\", \"src_ip\": \"%s\", \"src_port\": %u "
+		", \"dst_addr\": \"%s:%hu\", \"dst_ip\": \"%s\", \"dst_port\": %u "
+		", \"proto\": \"%s\" "
+		", \"octets\": %"PRIu64" "
+		", \"packets\": %"PRIu64" "
+		", \"start\": \"%s\" "
+		", \"finish\": \"%s\" "
+		", \"tcp_flags\": \"%02x\" "
+		", \"flowlabel\": \"%08x\" "
+		", \"expired\": %s "
+		", \"protocol_family\": \"%s\" "
+		", \"if_index\": %u "
+		"}\n"
+		"{ \"index\": { \"_index\" : \"%s\", \"_type\" : \"%s\", \"_id\": \"%s\" } }\n"
+		"{"
+		" \"timestamp\": \"%s\" "
+		", \"seq\":%"PRIu64" "
+		", \"src_addr\": \"%s:%hu\", \"src_ip\": \"%s\", \"src_port\": %u "
+		", \"dst_addr\": \"%s:%hu\", \"dst_ip\": \"%s\", \"dst_port\": %u "
+		", \"proto\": \"%s\" "
+		", \"octets\": %"PRIu64" "
+		", \"packets\": %"PRIu64" "
+		", \"start\": \"%s\" "
+		", \"finish\": \"%s\" "
+		", \"tcp_flags\": \"%02x\" "
+		", \"flowlabel\": \"%08x\" "
+		", \"expired\": %s "
+		", \"protocol_family\": \"%s\" "
+		", \"if_index\": %u "
+		"}\n",
+		index, es_doc_type, uid_in,
+		stamp,
+		flow->flow_seq,
+		addr1, ntohs(flow->port[0]), addr1, ntohs(flow->port[0]),
+		addr2, ntohs(flow->port[1]), addr2, ntohs(flow->port[1]),
+		proto2str(flow->protocol),
+		flow->octets[0], flow->packets[0], 
+		start,
+		finish,
+		flow->tcp_flags[0],
+		flow->ip6_flowlabel[0],
+		expired ? "true" : "false",
+		af2str(flow->af),
+		flow->if_index,
+		index, es_doc_type, uid_out,
+		stamp,
+		flow->flow_seq,
+		addr2, ntohs(flow->port[1]), addr2, ntohs(flow->port[1]),
+		addr1, ntohs(flow->port[0]), addr1, ntohs(flow->port[0]),
+		proto2str(flow->protocol),
+		flow->octets[1], flow->packets[1], 
+		start,
+		finish,
+		flow->tcp_flags[1],
+		flow->ip6_flowlabel[1],
+		expired ? "true" : "false",
+		af2str(flow->af),
+		flow->if_index
+	);
+
+	return (r < 0 || (size_t)r >= len ? -1 : r);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2016 Alexander Böhm <alxndr.boehm@gmail.com> All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ESBULK_H__
+#define __ESBULK_H__
+
+/*
+ * Flows formatted for the elasticsearch bulk API: an index action and a
+ * document for each direction, each on its own line. Shared by the
+ * elasticsearch (-e) and NDJSON file (-j) outputs.
+ */
+#define MAX_LEN_ES_BULK 16*1024
+#define ES_INDEX	"softflowd"	/* Index prefix, -YYYY.MM.DD added */
+#define ES_DOC_TYPE	"softflow"
+
+struct FLOW;
+
+int es_bulk_format(char *buf, size_t len, const struct FLOW *flow,
+    int expired, const char *index, const char *doc_type,
+    const struct timeval *now);
+
+#endif // __ESBULK_H__
@@ -0,0 +1,902 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* Needed for sendmmsg() on Linux */
+#endif
+
+#include "common.h"
+#include "log.h"
+#include "treetype.h"
+#include "softflowd.h"
+#include "export.h"
+
+/* Datagram buffers, shared by all batches (only one is active at once) */
+static u_char *export_buf = NULL;
+static size_t export_buf_size = 0;	/* Size of each buffer */
+
+#define EXPORT_BUF(i)	(export_buf + (i) * export_buf_size)
+
+/* Flows reordered by export_group_flows() */
+static struct FLOW **export_grouped = NULL;
+static u_int export_grouped_alloc = 0;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0	/* SIGPIPE is ignored instead */
+#endif
+
+/* Whether a send error means the collector is not accepting data */
+static int
+export_target_error(int err)
+{
+	switch (err) {
+	case ECONNREFUSED:
+	case ECONNRESET:
+	case EHOSTUNREACH:
+	case ENETUNREACH:
+	case ENOTCONN:
+	case EPIPE:
+	case ETIMEDOUT:
+#ifdef EHOSTDOWN
+	case EHOSTDOWN:
+#endif
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+/* Mark a target as failed, so that balancing passes it over for a while */
+static void
+export_target_down(struct NETFLOW_TARGET *target, int err)
+{
+	time_t now;
+
+	now = time(NULL);
+	if (target->down_until <= now) {
+		logit(LOG_WARNING, "export: target %s failed: %s",
+		    target->name, strerror(err));
+		target->failures++;
+	}
+	target->down_until = now + TARGET_RETRY_INTERVAL;
+}
+
+/*
+ * Drop the connection of a stream target, discarding what it has
+ * queued, and schedule the next attempt with exponential backoff.
+ */
+static void
+export_stream_lost(struct NETFLOW_TARGET *target, int err)
+{
+	struct EXPORT_QUEUE *q = target->queue;
+
+	if (target->fd != -1)
+		close(target->fd);
+	target->fd = -1;
+	export_target_down(target, err);
+
+	q->discarded += q->msgs;
+	q->head = q->len = q->msg_head = q->msgs = q->msg_done = 0;
+	/* The next connection starts without templates */
+	export_template_reset(&target->tmpl);
+
+	q->backoff = q->backoff == 0 ? STREAM_BACKOFF_MIN :
+	    MIN(q->backoff * 2, STREAM_BACKOFF_MAX);
+	q->next_connect = time(NULL) + q->backoff;
+	q->state = QUEUE_DOWN;
+}
+
+static void
+export_stream_up(struct NETFLOW_TARGET *target)
+{
+	struct EXPORT_QUEUE *q = target->queue;
+
+	logit(LOG_NOTICE, "export: connected to %s", target->name);
+	q->state = QUEUE_UP;
+	q->backoff = 0;
+	q->connects++;
+	target->down_until = 0;
+}
+
+/* Start a non-blocking connection to a stream target */
+static void
+export_stream_connect(struct NETFLOW_TARGET *target)
+{
+	int s, flags;
+
+	if ((s = socket(target->addr.ss_family, SOCK_STREAM,
+	    target->protocol)) == -1) {
+		export_stream_lost(target, errno);
+		return;
+	}
+	if ((flags = fcntl(s, F_GETFL)) == -1 ||
+	    fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
+		close(s);
+		export_stream_lost(target, errno);
+		return;
+	}
+	target->fd = s;
+	if (connect(s, (struct sockaddr *)&target->addr,
+	    target->addrlen) == 0)
+		export_stream_up(target);
+	else if (errno == EINPROGRESS)
+		target->queue->state = QUEUE_CONNECTING;
+	else
+		export_stream_lost(target, errno);
+}
+
+/* Append a message to a send queue. Returns -1 if it is full */
+static int
+export_queue_put(struct EXPORT_QUEUE *q, const u_char *msg, size_t len,
+    const struct timeval *now)
+{
+	size_t tail, n;
+	u_int i;
+
+	if (q->msgs >= EXPORT_QUEUE_MESSAGES ||
+	    len > EXPORT_QUEUE_SIZE - q->len)
+		return (-1);
+	tail = (q->head + q->len) % EXPORT_QUEUE_SIZE;
+	n = MIN(len, EXPORT_QUEUE_SIZE - tail);
+	memcpy(q->buf + tail, msg, n);
+	memcpy(q->buf, msg + n, len - n);
+	q->len += len;
+	i = (q->msg_head + q->msgs++) % EXPORT_QUEUE_MESSAGES;
+	q->msg_len[i] = len;
+	q->msg_time[i] = *now;
+	q->max_msgs = MAX(q->max_msgs, q->msgs);
+	return (0);
+}
+
+/*
+ * Remove n written bytes from the front of a send queue. Returns 1 if
+ * that completed the first message, which is then taken off the queue.
+ */
+static int
+export_queue_consume(struct EXPORT_QUEUE *q, size_t n)
+{
+	q->head = (q->head + n) % EXPORT_QUEUE_SIZE;
+	q->len -= n;
+	if ((q->msg_done += n) < q->msg_len[q->msg_head])
+		return (0);
+	q->msg_head = (q->msg_head + 1) % EXPORT_QUEUE_MESSAGES;
+	q->msgs--;
+	q->msg_done = 0;
+	return (1);
+}
+
+/*
+ * Top up the token buckets of a rate limited queue and check that they
+ * hold enough to send a message of len bytes. If not, note when they
+ * will in wait_until and return -1.
+ */
+static int
+export_queue_pace(struct EXPORT_QUEUE *q, size_t len,
+    const struct timeval *now)
+{
+	struct timeval tv;
+	double elapsed, wait;
+
+	if (q->rate_packets == 0 && q->rate_bytes == 0)
+		return (0);
+
+	timersub(now, &q->refilled, &tv);
+	elapsed = tv.tv_sec + tv.tv_usec / 1000000.0;
+	if (elapsed > 0) {
+		q->tokens_packets = MIN(q->depth_packets,
+		    q->tokens_packets + elapsed * q->rate_packets);
+		q->tokens_bytes = MIN(q->depth_bytes,
+		    q->tokens_bytes + elapsed * q->rate_bytes);
+		q->refilled = *now;
+	}
+
+	wait = 0;
+	if (q->rate_packets != 0 && q->tokens_packets < 1)
+		wait = (1 - q->tokens_packets) / q->rate_packets;
+	if (q->rate_bytes != 0 && q->tokens_bytes < len)
+		wait = MAX(wait, (len - q->tokens_bytes) / q->rate_bytes);
+	if (wait == 0) {
+		timerclear(&q->wait_until);
+		return (0);
+	}
+	tv.tv_sec = (time_t)wait;
+	tv.tv_usec = (wait - tv.tv_sec) * 1000000 + 1;
+	timeradd(now, &tv, &q->wait_until);
+	return (-1);
+}
+
+/*
+ * Write as much of a send queue as the socket and the rate limit allow.
+ * Queued datagrams that a UDP socket refuses are lost; for stream
+ * targets, an error drops the connection.
+ */
+static void
+export_queue_flush(struct NETFLOW_TARGET *target)
+{
+	struct EXPORT_QUEUE *q = target->queue;
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct timeval now, tv;
+	size_t n;
+	ssize_t r;
+	u_int64_t delay;
+	int first;
+
+	gettimeofday(&now, NULL);
+	q->blocked = 0;
+	while (q->state == QUEUE_UP && q->msgs > 0) {
+		first = q->msg_done == 0;
+		n = q->msg_len[q->msg_head] - q->msg_done;
+		if (first && export_queue_pace(q, n, &now) == -1)
+			break;
+
+		/* The rest of the first message, which may wrap around */
+		iov[0].iov_base = q->buf + q->head;
+		iov[0].iov_len = MIN(n, EXPORT_QUEUE_SIZE - q->head);
+		iov[1].iov_base = q->buf;
+		iov[1].iov_len = n - iov[0].iov_len;
+		memset(&msg, '\0', sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov[1].iov_len == 0 ? 1 : 2;
+		r = sendmsg(target->fd, &msg, MSG_NOSIGNAL);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == ENOBUFS) {
+				q->blocked = 1;
+				break;
+			}
+			if (q->stream) {
+				export_stream_lost(target, errno);
+				break;
+			}
+			if (export_target_error(errno))
+				export_target_down(target, errno);
+			target->packets_failed++;
+			export_queue_consume(q, n);
+			continue;
+		}
+
+		if (first) {
+			q->tokens_packets -= 1;
+			q->tokens_bytes -= n;
+		}
+		if (export_queue_consume(q, r)) {
+			timersub(&now, &q->msg_time[(q->msg_head +
+			    EXPORT_QUEUE_MESSAGES - 1) % EXPORT_QUEUE_MESSAGES],
+			    &tv);
+			delay = tv.tv_sec * 1000000ULL + tv.tv_usec;
+			q->delay_usec += delay;
+			q->max_delay_usec = MAX(q->max_delay_usec, delay);
+			target->packets_sent++;
+		}
+	}
+}
+
+static int export_queue_wait(struct NETFLOW_TARGET *target, size_t len,
+    int msec);
+
+/*
+ * Queue all datagrams of a batch for a target with a send queue, then
+ * write what the socket and rate limit allow. A datagram counts as
+ * exported once queued. If the queue is full, it is waited on when
+ * nothing is to be dropped (see export_queue_set_wait()).
+ */
+static void
+export_batch_queue(struct EXPORT_BATCH *batch, struct NETFLOW_TARGET *target)
+{
+	struct EXPORT_QUEUE *q = target->queue;
+	struct timeval now;
+	u_int i;
+	int full;
+
+	gettimeofday(&now, NULL);
+	for (i = 0, full = 0; i < batch->num; i++) {
+		if (!full && export_queue_put(q, EXPORT_BUF(i), batch->len[i],
+		    &now) == -1) {
+			if (q->wait && export_queue_wait(target, batch->len[i],
+			    EXPORT_DRAIN_MSEC) == 0) {
+				gettimeofday(&now, NULL);
+				full = export_queue_put(q, EXPORT_BUF(i),
+				    batch->len[i], &now) == -1;
+			} else
+				full = 1;
+		}
+		/* Later messages may need templates sent in a dropped one */
+		if (full) {
+			batch->error = ENOBUFS;
+			q->overflows++;
+			target->packets_failed++;
+			continue;
+		}
+		batch->delivered[i] = 1;
+	}
+	if (full && q->stream)
+		export_template_reset(&target->tmpl);
+	export_queue_flush(target);
+}
+
+/* Send all queued datagrams to one target, noting which got through */
+static void
+export_batch_send(struct EXPORT_BATCH *batch, struct NETFLOW_TARGET *target)
+{
+	u_int i;
+	int err, r;
+	socklen_t errsz;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[EXPORT_BATCH_MAX];
+	struct iovec iov[EXPORT_BATCH_MAX];
+#endif
+
+	if (target->queue != NULL) {
+		export_batch_queue(batch, target);
+		return;
+	}
+	if (target->fd == -1)
+		return;
+
+	errsz = sizeof(err);
+	/* Clear ICMP errors, which show an earlier datagram was refused */
+	if (getsockopt(target->fd, SOL_SOCKET, SO_ERROR, &err, &errsz) == 0 &&
+	    export_target_error(err))
+		export_target_down(target, err);
+
+#ifdef HAVE_SENDMMSG
+	memset(msgs, '\0', sizeof(msgs));
+	for (i = 0; i < batch->num; i++) {
+		iov[i].iov_base = EXPORT_BUF(i);
+		iov[i].iov_len = batch->len[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	for (i = 0; i < batch->num;) {
+		r = sendmmsg(target->fd, msgs + i, batch->num - i, 0);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			/* Drop the datagram that failed and carry on */
+			batch->error = errno;
+			if (export_target_error(errno))
+				export_target_down(target, errno);
+			target->packets_failed++;
+			i++;
+			continue;
+		}
+		for (; r > 0; r--) {
+			target->packets_sent++;
+			batch->delivered[i++] = 1;
+		}
+	}
+#else
+	for (i = 0; i < batch->num; i++) {
+		while ((r = send(target->fd, EXPORT_BUF(i),
+		    batch->len[i], 0)) == -1 && errno == EINTR)
+			;
+		if (r == -1) {
+			batch->error = errno;
+			if (export_target_error(errno))
+				export_target_down(target, errno);
+			target->packets_failed++;
+		} else {
+			target->packets_sent++;
+			batch->delivered[i] = 1;
+		}
+	}
+#endif
+}
+
+/* Send all queued datagrams to every target sharing them */
+static void
+export_batch_flush(struct EXPORT_BATCH *batch)
+{
+	struct NETFLOW_TARGET *target;
+	u_int i;
+
+	if (batch->num == 0)
+		return;
+
+	memset(batch->delivered, '\0', sizeof(batch->delivered));
+	for (target = batch->target; target != NULL; target = target->share)
+		export_batch_send(batch, target);
+
+	for (i = 0; i < batch->num; i++) {
+		if (batch->delivered[i]) {
+			batch->sent++;
+			batch->param->packets_sent++;
+			batch->param->flows_exported += batch->flows[i];
+			batch->param->records_sent += batch->records[i];
+		} else {
+			batch->failed++;
+			batch->param->flows_dropped += batch->flows[i];
+		}
+	}
+	batch->num = 0;
+}
+
+/*
+ * Allocate the datagram buffers for export packets of up to packet_size
+ * bytes. Returns 0 on success or -1 on allocation failure.
+ */
+int
+export_init(size_t packet_size)
+{
+	export_buf_size = MAX(packet_size, EXPORT_DATAGRAM_MIN);
+	if ((export_buf = calloc(EXPORT_BATCH_MAX, export_buf_size)) == NULL)
+		return (-1);
+	return (0);
+}
+
+/* Prepare a batch for sending to target and the targets sharing it */
+void
+export_batch_begin(struct EXPORT_BATCH *batch, struct NETFLOW_TARGET *target,
+    struct FLOWTRACKPARAMETERS *param)
+{
+	memset(batch, '\0', sizeof(*batch));
+	batch->target = target;
+	batch->param = param;
+}
+
+/*
+ * Return a zeroed buffer to build the next datagram in, sending the
+ * batch first if it is full.
+ */
+u_char *
+export_batch_slot(struct EXPORT_BATCH *batch)
+{
+	if (batch->num >= EXPORT_BATCH_MAX)
+		export_batch_flush(batch);
+	memset(EXPORT_BUF(batch->num), '\0', export_buf_size);
+	return (EXPORT_BUF(batch->num));
+}
+
+/* Queue the datagram built in the last slot */
+void
+export_batch_commit(struct EXPORT_BATCH *batch, size_t len,
+    u_int flows, u_int records)
+{
+	batch->len[batch->num] = len;
+	batch->flows[batch->num] = flows;
+	batch->records[batch->num] = records;
+	batch->num++;
+}
+
+/*
+ * Send anything left in the batch.
+ * Returns number of datagrams sent or -1 if any could not be sent to
+ * one of the targets
+ */
+int
+export_batch_finish(struct EXPORT_BATCH *batch)
+{
+	export_batch_flush(batch);
+	if (batch->error != 0)
+		logit(LOG_DEBUG, "export: send failed (%d datagram(s) lost): "
+		    "%s", batch->failed, strerror(batch->error));
+	return (batch->error != 0 ? -1 : batch->sent);
+}
+
+/*
+ * Give a target a send queue, rate limited as set in param. TCP and SCTP
+ * targets always have one and start connecting in the background; UDP
+ * targets only need one to be rate limited. Returns 0 on success or -1
+ * on allocation failure; connection failures are retried.
+ */
+int
+export_queue_init(struct NETFLOW_TARGET *target,
+    const struct FLOWTRACKPARAMETERS *param)
+{
+	struct EXPORT_QUEUE *q;
+	int flags;
+
+	if ((q = calloc(1, sizeof(*q))) == NULL)
+		return (-1);
+	if ((q->buf = malloc(EXPORT_QUEUE_SIZE)) == NULL) {
+		free(q);
+		return (-1);
+	}
+	q->stream = target->protocol != IPPROTO_UDP;
+	q->state = QUEUE_UP;
+
+	/* Buckets start full and hold at least one maximum size packet */
+	q->rate_packets = param->pace_packets;
+	q->rate_bytes = param->pace_bytes;
+	q->depth_packets = MAX(1.0,
+	    q->rate_packets * EXPORT_PACE_BURST_MSEC / 1000.0);
+	q->depth_bytes = MAX((double)export_buf_size,
+	    q->rate_bytes * EXPORT_PACE_BURST_MSEC / 1000.0);
+	q->tokens_packets = q->depth_packets;
+	q->tokens_bytes = q->depth_bytes;
+	gettimeofday(&q->refilled, NULL);
+
+	target->queue = q;
+	if (q->stream) {
+		target->fd = -1;
+		export_stream_connect(target);
+	} else if ((flags = fcntl(target->fd, F_GETFL)) == -1 ||
+	    fcntl(target->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		logit(LOG_WARNING, "export: fcntl(%s): %s", target->name,
+		    strerror(errno));
+	return (0);
+}
+
+/* Make progress on one target's send queue; see export_queue_service() */
+static void
+export_queue_service_target(struct NETFLOW_TARGET *target, time_t now)
+{
+	struct EXPORT_QUEUE *q = target->queue;
+	struct pollfd pfd;
+	u_char junk[512];
+	socklen_t errsz;
+	ssize_t r;
+	int err;
+
+	if (!q->stream) {
+		export_queue_flush(target);
+		return;
+	}
+	if (q->state == QUEUE_DOWN && now >= q->next_connect)
+		export_stream_connect(target);
+	if (q->state == QUEUE_CONNECTING) {
+		pfd.fd = target->fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 0) <= 0)
+			return;
+		errsz = sizeof(err);
+		if (getsockopt(target->fd, SOL_SOCKET, SO_ERROR, &err,
+		    &errsz) == -1)
+			err = errno;
+		if (err != 0) {
+			export_stream_lost(target, err);
+			return;
+		}
+		export_stream_up(target);
+	}
+	if (q->state != QUEUE_UP)
+		return;
+	/* Collectors send nothing back, so this only sees EOF */
+	while ((r = recv(target->fd, junk, sizeof(junk), 0)) > 0)
+		;
+	if (r == 0)
+		export_stream_lost(target, ECONNRESET);
+	else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		export_stream_lost(target, errno);
+	else
+		export_queue_flush(target);
+}
+
+/*
+ * Make progress on all send queues without blocking: reconnect stream
+ * targets whose backoff has expired, complete pending connections,
+ * notice connections closed by the collector and write out what the
+ * rate limits allow.
+ */
+void
+export_queue_service(struct NETFLOW_TARGET *targets)
+{
+	struct NETFLOW_TARGET *target;
+	time_t now;
+
+	now = time(NULL);
+	for (target = targets; target != NULL; target = target->next) {
+		if (target->queue != NULL)
+			export_queue_service_target(target, now);
+	}
+}
+
+/*
+ * Spend up to msec milliseconds making room for len bytes in a target's
+ * send queue. Returns -1 if there is still none, or at once if a stream
+ * target is not connected: it would stall every batch until it is.
+ */
+static int
+export_queue_wait(struct NETFLOW_TARGET *target, size_t len, int msec)
+{
+	struct EXPORT_QUEUE *q = target->queue;
+	struct pollfd pfd;
+	struct timeval start, now;
+	int elapsed;
+
+	gettimeofday(&start, NULL);
+	for (;;) {
+		export_queue_service_target(target, time(NULL));
+		if (q->msgs < EXPORT_QUEUE_MESSAGES &&
+		    len <= EXPORT_QUEUE_SIZE - q->len)
+			return (0);
+		if (q->state != QUEUE_UP)
+			return (-1);
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+		    (now.tv_usec - start.tv_usec) / 1000;
+		if (elapsed >= msec)
+			return (-1);
+		/*
+		 * Also sleeps while held by the rate limit, and for UDP,
+		 * which polls writable even on ENOBUFS
+		 */
+		pfd.fd = q->stream ? target->fd : -1;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, MIN(msec - elapsed,
+		    EXPORT_WAIT_POLL_MSEC)) == -1 && errno != EINTR)
+			return (-1);
+	}
+}
+
+/*
+ * Have queued targets wait for room, for up to EXPORT_DRAIN_MSEC, rather
+ * than drop packets when their queue is full. For reading capture
+ * files, where flows expire faster than a collector takes them, and
+ * the final flush. Stream targets that are not connected still drop.
+ */
+void
+export_queue_set_wait(struct NETFLOW_TARGET *targets, int wait)
+{
+	struct NETFLOW_TARGET *target;
+
+	for (target = targets; target != NULL; target = target->next) {
+		if (target->queue != NULL)
+			target->queue->wait = wait;
+	}
+}
+
+/*
+ * Add the send queues that need watching to a poll set and lower
+ * *timeout (in milliseconds, -1 for none) to the next reconnection or
+ * the time a rate limit lets the next packet go. Returns the number of
+ * entries added, at most one per target.
+ */
+int
+export_queue_pollfds(struct NETFLOW_TARGET *targets, struct pollfd *pfd,
+    int *timeout)
+{
+	struct NETFLOW_TARGET *target;
+	struct EXPORT_QUEUE *q;
+	struct timeval now, tv;
+	int n, ms, paced;
+
+	gettimeofday(&now, NULL);
+	for (n = 0, target = targets; target != NULL; target = target->next) {
+		if ((q = target->queue) == NULL)
+			continue;
+		if (q->state == QUEUE_DOWN) {
+			ms = q->next_connect > now.tv_sec ?
+			    (q->next_connect - now.tv_sec) * 1000 : 0;
+			if (*timeout == -1 || ms < *timeout)
+				*timeout = ms;
+			continue;
+		}
+		paced = q->msgs > 0 && timerisset(&q->wait_until);
+		if (paced) {
+			ms = 0;
+			if (timercmp(&q->wait_until, &now, >)) {
+				timersub(&q->wait_until, &now, &tv);
+				ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+			}
+			if (*timeout == -1 || ms < *timeout)
+				*timeout = ms;
+		}
+		/* A UDP socket polls writable while ENOBUFS lasts */
+		if (!q->stream && q->blocked && q->msgs > 0 && !paced &&
+		    (*timeout == -1 || EXPORT_RETRY_MSEC < *timeout))
+			*timeout = EXPORT_RETRY_MSEC;
+		pfd[n].events = q->stream ? POLLIN : 0;
+		if (q->state == QUEUE_CONNECTING ||
+		    (q->msgs > 0 && !paced && q->stream))
+			pfd[n].events |= POLLOUT;
+		if (pfd[n].events == 0)
+			continue;
+		pfd[n].fd = target->fd;
+		pfd[n++].revents = 0;
+	}
+	return (n);
+}
+
+/* Spend up to msec milliseconds writing out what is still queued */
+void
+export_queue_drain(struct NETFLOW_TARGET *targets, int msec)
+{
+	struct NETFLOW_TARGET *target;
+	struct pollfd pfd[MAX_EXPORT_TARGETS];
+	struct timeval start, now;
+	int n, pending, elapsed, timeout;
+
+	gettimeofday(&start, NULL);
+	for (;;) {
+		export_queue_service(targets);
+		for (pending = 0, target = targets; target != NULL;
+		    target = target->next) {
+			if (target->queue != NULL && target->queue->msgs > 0)
+				pending = 1;
+		}
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+		    (now.tv_usec - start.tv_usec) / 1000;
+		if (!pending || elapsed >= msec)
+			break;
+		timeout = msec - elapsed;
+		n = export_queue_pollfds(targets, pfd, &timeout);
+		if (poll(pfd, n, timeout) == -1 && errno != EINTR)
+			break;
+	}
+	for (target = targets; target != NULL; target = target->next) {
+		if (target->queue != NULL && target->queue->msgs > 0)
+			logit(LOG_WARNING, "export: %u message(s) for %s not "
+			    "sent", target->queue->msgs, target->name);
+	}
+}
+
+/* State of a target's send queue, for statistics */
+const char *
+export_queue_state(const struct NETFLOW_TARGET *target)
+{
+	switch (target->queue->state) {
+	case QUEUE_UP:
+		return (target->queue->stream ? "connected" : "ready");
+	case QUEUE_CONNECTING:
+		return ("connecting");
+	default:
+		return ("down");
+	}
+}
+
+/* Template (address family and protocol class) a flow is exported with */
+int
+export_flow_template(const struct FLOW *flow)
+{
+	int class;
+
+	switch (flow->protocol) {
+	case IPPROTO_TCP:
+		class = EXPORT_CLASS_TCP;
+		break;
+	case IPPROTO_UDP:
+		class = EXPORT_CLASS_UDP;
+		break;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		class = EXPORT_CLASS_ICMP;
+		break;
+	default:
+		class = EXPORT_CLASS_OTHER;
+		break;
+	}
+	return (flow->af == AF_INET ? class : EXPORT_NCLASSES + class);
+}
+
+/*
+ * Called by template exporters at the start of each datagram. Returns 1
+ * if a template refresh starts with this datagram, after marking all
+ * templates due again; the caller then also sends its option data.
+ */
+int
+export_template_refresh(struct TEMPLATE_STATE *ts,
+    const struct FLOWTRACKPARAMETERS *param, const struct timeval *now)
+{
+	int refresh;
+
+	if (!ts->started)
+		refresh = 1;
+	else if (ts->stream)
+		refresh = 0;
+	else
+		refresh = (param->template_packets != 0 &&
+		    ts->pkts_left <= 0) || (param->template_interval != 0 &&
+		    now->tv_sec >= ts->next_refresh);
+	if (refresh) {
+		ts->started = 1;
+		ts->pkts_left = param->template_packets;
+		ts->next_refresh = now->tv_sec + param->template_interval;
+		memset(ts->due, 1, sizeof(ts->due));
+	}
+	if (!ts->stream)
+		ts->pkts_left--;
+	return (refresh);
+}
+
+/* Have the templates sent again with the next datagram */
+void
+export_template_reset(struct TEMPLATE_STATE *ts)
+{
+	ts->started = 0;
+}
+
+/*
+ * Width index of the narrowest counter encoding that holds every counter
+ * of a flow. Octets are never fewer than packets, so only they matter.
+ */
+int
+export_counter_width(const struct FLOW *flow)
+{
+	u_int64_t max;
+	int w;
+
+	max = MAX(flow->octets[0], flow->octets[1]);
+	for (w = EXPORT_NWIDTHS - 1; w > 0; w--) {
+		if ((max >> (8 * EXPORT_WIDTH(w))) == 0)
+			break;
+	}
+	return (w);
+}
+
+/* Width index for a counter width in bytes, or -1 if there is none */
+int
+export_width_index(u_int width)
+{
+	int w;
+
+	for (w = 0; w < EXPORT_NWIDTHS; w++) {
+		if (EXPORT_WIDTH(w) == (int)width)
+			return (w);
+	}
+	return (-1);
+}
+
+/* Store the low "width" bytes of a counter in network order */
+void
+export_put_counter(u_char *p, u_int64_t v, u_int width)
+{
+	while (width-- > 0) {
+		p[width] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/*
+ * Order flows by "key" (one of nkeys values, normally the export
+ * template), keeping their relative order, so that each datagram
+ * switches data set as rarely as possible. Returns the reordered array
+ * (the caller's array is left untouched) or, if memory is short, the
+ * original one.
+ */
+struct FLOW **
+export_group_flows(struct FLOW **flows, int num_flows,
+    int (*key)(const struct FLOW *), int nkeys)
+{
+	struct FLOW **tmp;
+	u_int pos[EXPORT_MAX_GROUPS];
+	int i, k;
+
+	if ((u_int)num_flows > export_grouped_alloc) {
+		tmp = realloc(export_grouped, num_flows * sizeof(*tmp));
+		if (tmp == NULL) {
+			logit(LOG_WARNING, "Unable to group flows: out of memory");
+			return (flows);
+		}
+		export_grouped = tmp;
+		export_grouped_alloc = num_flows;
+	}
+	bzero(pos, sizeof(pos));
+	for (i = 0; i < num_flows; i++) {
+		k = key(flows[i]);
+		if (k + 1 < nkeys)
+			pos[k + 1]++;
+	}
+	for (k = 1; k < nkeys; k++)
+		pos[k] += pos[k - 1];
+	for (i = 0; i < num_flows; i++)
+		export_grouped[pos[key(flows[i])]++] = flows[i];
+
+	return (export_grouped);
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _EXPORT_H
+#define _EXPORT_H
+
+#include "common.h"
+#include "softflowd.h"
+
+/* Maximum number of datagrams handed to the kernel in one call */
+#define EXPORT_BATCH_MAX	64
+
+/* Minimum size of each datagram buffer, enough for v1 and v5 packets */
+#define EXPORT_DATAGRAM_MIN	1500
+
+/*
+ * A batch of export datagrams. Senders build each datagram directly in
+ * a buffer obtained from export_batch_slot() (at least export_packet_size
+ * bytes long) and queue it with
+ * export_batch_commit(); queued datagrams are sent together whenever the
+ * batch fills up and by export_batch_finish(), to the target and every
+ * target on its share chain.
+ *
+ * Only datagrams that actually reached at least one socket or send queue
+ * are counted towards packets_sent, flows_exported and records_sent; the
+ * flows in datagrams that could not be sent anywhere are counted in
+ * flows_dropped.
+ */
+struct EXPORT_BATCH {
+	struct NETFLOW_TARGET *target;
+	struct FLOWTRACKPARAMETERS *param;
+	u_int num;				/* Datagrams queued */
+	size_t len[EXPORT_BATCH_MAX];		/* Length of each datagram */
+	u_int flows[EXPORT_BATCH_MAX];		/* Flows carried by each */
+	u_int records[EXPORT_BATCH_MAX];	/* Records carried by each */
+	u_char delivered[EXPORT_BATCH_MAX];	/* Reached some target */
+	int sent;				/* Datagrams sent so far */
+	int failed;				/* Datagrams that failed */
+	int error;				/* errno of last failure */
+};
+
+/*
+ * Send queue of a TCP or SCTP target, or of a rate limited (-E) UDP
+ * target. Batches queue their datagrams here as messages, which are
+ * written out as the socket accepts them and the token buckets allow.
+ * Messages are kept whole: one that does not fit is dropped, and what a
+ * stream target still has queued when its connection is lost is
+ * discarded, as it may use templates the next connection has not seen.
+ */
+#define QUEUE_DOWN		0	/* Waiting to reconnect */
+#define QUEUE_CONNECTING	1	/* connect() in progress */
+#define QUEUE_UP		2	/* Connected, or not a stream */
+
+struct EXPORT_QUEUE {
+	int stream;				/* TCP or SCTP */
+	int state;				/* QUEUE_* */
+	time_t next_connect;			/* When to retry if down */
+	int backoff;				/* Current reconnect delay */
+	int blocked;				/* Socket buffer was full */
+	int wait;				/* Wait for room, don't drop */
+
+	u_char *buf;				/* Ring of queued messages */
+	size_t head;				/* First unwritten byte */
+	size_t len;				/* Bytes queued */
+	u_int32_t msg_len[EXPORT_QUEUE_MESSAGES]; /* Ring of message sizes */
+	struct timeval msg_time[EXPORT_QUEUE_MESSAGES]; /* When queued */
+	u_int msg_head;				/* First queued message */
+	u_int msgs;				/* Messages queued */
+	size_t msg_done;			/* Bytes of first one written */
+
+	/* Token buckets (-E), a rate of 0 is unlimited */
+	u_int rate_packets, rate_bytes;		/* Per second */
+	double depth_packets, depth_bytes;	/* Bucket sizes */
+	double tokens_packets, tokens_bytes;
+	struct timeval refilled;		/* Last topped up */
+	struct timeval wait_until;		/* Too few tokens until then */
+
+	/* Statistics */
+	u_int64_t connects;			/* Connections established */
+	u_int64_t discarded;			/* Lost with a connection */
+	u_int64_t overflows;			/* Queue was full */
+	u_int64_t delay_usec;			/* Total time spent queued */
+	u_int64_t max_delay_usec;		/* Longest time queued */
+	u_int max_msgs;				/* Longest queue */
+};
+
+/*
+ * Template exporters use one template per address family and protocol
+ * class, so that each record only carries the fields its class can fill
+ * in. Templates are numbered IPv4 classes first, then IPv6 classes.
+ */
+#define EXPORT_CLASS_TCP	0
+#define EXPORT_CLASS_UDP	1
+#define EXPORT_CLASS_ICMP	2
+#define EXPORT_CLASS_OTHER	3
+#define EXPORT_NCLASSES		4
+#define EXPORT_NTEMPLATES	(2 * EXPORT_NCLASSES)
+
+#define EXPORT_TEMPLATE_AF(t)	((t) < EXPORT_NCLASSES ? AF_INET : AF_INET6)
+#define EXPORT_TEMPLATE_CLASS(t)	((t) % EXPORT_NCLASSES)
+
+/*
+ * Reduced-size encodings of the packet and octet counters (RFC 7011,
+ * section 6.2), numbered widest first: width index w is 8 >> w bytes.
+ */
+#define EXPORT_NWIDTHS		4
+#define EXPORT_WIDTH(w)		(8 >> (w))
+
+/* Largest number of keys export_group_flows() can order flows by */
+#define EXPORT_MAX_GROUPS	(EXPORT_NTEMPLATES * EXPORT_NWIDTHS)
+
+#if EXPORT_MAX_GROUPS > MAX_EXPORT_TEMPLATES
+#error "MAX_EXPORT_TEMPLATES is too small"
+#endif
+
+int export_template_refresh(struct TEMPLATE_STATE *ts,
+    const struct FLOWTRACKPARAMETERS *param, const struct timeval *now);
+void export_template_reset(struct TEMPLATE_STATE *ts);
+
+int export_flow_template(const struct FLOW *flow);
+int export_counter_width(const struct FLOW *flow);
+int export_width_index(u_int width);
+void export_put_counter(u_char *p, u_int64_t v, u_int width);
+struct FLOW **export_group_flows(struct FLOW **flows, int num_flows,
+    int (*key)(const struct FLOW *), int nkeys);
+
+int export_init(size_t packet_size);
+void export_batch_begin(struct EXPORT_BATCH *batch,
+    struct NETFLOW_TARGET *target, struct FLOWTRACKPARAMETERS *param);
+u_char *export_batch_slot(struct EXPORT_BATCH *batch);
+void export_batch_commit(struct EXPORT_BATCH *batch, size_t len,
+    u_int flows, u_int records);
+int export_batch_finish(struct EXPORT_BATCH *batch);
+
+int export_queue_init(struct NETFLOW_TARGET *target,
+    const struct FLOWTRACKPARAMETERS *param);
+void export_queue_service(struct NETFLOW_TARGET *targets);
+int export_queue_pollfds(struct NETFLOW_TARGET *targets,
+    struct pollfd *pfd, int *timeout);
+void export_queue_drain(struct NETFLOW_TARGET *targets, int msec);
+void export_queue_set_wait(struct NETFLOW_TARGET *targets, int wait);
+const char *export_queue_state(const struct NETFLOW_TARGET *target);
+
+#endif /* _EXPORT_H */
@@ -27,6 +27,7 @@
 #include "log.h"
 #include "treetype.h"
 #include "softflowd.h"
+#include "export.h"
 
 #if defined (HAVE_DECL_HTONLL) && !defined (HAVE_DECL_HTOBE64)
 #define htobe64 htonll
@@ -117,6 +118,8 @@ struct IPFIX_VENDOR_FIELD_SPECIFIER {
 #define PSAMP_samplingPacketSpace	306
 
 #define PSAMP_selectorAlgorithm_count	1
+#define PSAMP_selectorAlgorithm_uniform	4	/* Uniform probabilistic */
+#define PSAMP_selectorAlgorithm_bob	6	/* Hash-based, BOB hash */
 
 /* Stuff pertaining to the templates that softflowd uses */
 #define IPFIX_SOFTFLOWD_TEMPLATE_COMMONRECORDS	14
@@ -154,7 +157,7 @@ struct IPFIX_SOFTFLOWD_OPTION_TEMPLATE {
 
 /* softflowd data set */
 struct IPFIX_SOFTFLOWD_DATA_COMMON {
-	u_int32_t octetDeltaCount, packetDeltaCount;
+	u_int8_t octetDeltaCount[8], packetDeltaCount[8];
 	u_int32_t ingressInterface, egressInterface;
 	u_int16_t sourceTransportPort, destinationTransportPort;
 	u_int8_t protocolIdentifier, tcpControlBits, ipVersion, ipClassOfService;
@@ -162,7 +165,7 @@ struct IPFIX_SOFTFLOWD_DATA_COMMON {
 } __packed;
 
 struct IPFIX_SOFTFLOWD_DATA_BIDIRECTION {
-	u_int32_t octetDeltaCount, packetDeltaCount;
+	u_int8_t octetDeltaCount[8], packetDeltaCount[8];
 	u_int8_t tcpControlBits, ipClassOfService;
 	u_int16_t icmpTypeCode;
 } __packed;
@@ -214,13 +217,10 @@ struct IPFIX_SOFTFLOWD_OPTION_DATA {
 } __packed;
 	
 /* Local data: templates and counters */
-#define IPFIX_SOFTFLOWD_MAX_PACKET_SIZE	512
 #define IPFIX_SOFTFLOWD_V4_TEMPLATE_ID	1024
 #define IPFIX_SOFTFLOWD_V6_TEMPLATE_ID	2048
 #define IPFIX_SOFTFLOWD_OPTION_TEMPLATE_ID	256
 
-#define IPFIX_DEFAULT_TEMPLATE_INTERVAL	16
-
 /* ... */
 #define IPFIX_OPTION_SCOPE_SYSTEM    1
 #define IPFIX_OPTION_SCOPE_INTERFACE 2
@@ -236,9 +236,29 @@ static struct IPFIX_SOFTFLOWD_TEMPLATE v4_template;
 static struct IPFIX_SOFTFLOWD_TEMPLATE v6_template;
 static struct IPFIX_SOFTFLOWD_BIDIRECTION_TEMPLATE v4_bidirection_template;
 static struct IPFIX_SOFTFLOWD_BIDIRECTION_TEMPLATE v6_bidirection_template;
+/*
+ * The templates actually sent are subsets of the ones above, one per
+ * export template (see export.h) and counter width: records are encoded
+ * in the full layout, with 8 byte counters, and the spans kept by the
+ * class are copied out. A reduced-size counter is the tail of the full
+ * big-endian one.
+ */
+struct IPFIX_CLASS_TEMPLATE {
+	u_int len;			/* Length of the template set */
+	u_char set[sizeof(struct IPFIX_SOFTFLOWD_BIDIRECTION_TEMPLATE)];
+	u_int16_t set_id;		/* Data set ID, network order */
+	u_int reclen;			/* Length of a data record */
+	u_int nspans;
+	struct {
+		u_int16_t off, len;
+	} span[IPFIX_SOFTFLOWD_TEMPLATE_BIDIRECTION_NRECORDS];
+};
+
+static struct IPFIX_CLASS_TEMPLATE ipfix_templates[EXPORT_MAX_GROUPS];
+static int ipfix_width = -1;	/* Counter width index, -1 = adaptive */
 static struct IPFIX_SOFTFLOWD_OPTION_TEMPLATE option_template;
 static struct IPFIX_SOFTFLOWD_OPTION_DATA option_data;
-static int ipfix_pkts_until_template = -1;
+static int ipfix_templates_ready = 0;
 
 static void
 ipfix_init_template(struct FLOWTRACKPARAMETERS *param)
@@ -253,9 +273,9 @@ ipfix_init_template(struct FLOWTRACKPARAMETERS *param)
 	v4_template.r[1].ie = htons(IPFIX_destinationIPv4Address);
 	v4_template.r[1].length = htons(4);
 	v4_template.r[2].ie = htons(IPFIX_octetDeltaCount);
-	v4_template.r[2].length = htons(4);
+	v4_template.r[2].length = htons(8);
 	v4_template.r[3].ie = htons(IPFIX_packetDeltaCount);
-	v4_template.r[3].length = htons(4);
+	v4_template.r[3].length = htons(8);
 	v4_template.r[4].ie = htons(IPFIX_ingressInterface);
 	v4_template.r[4].length = htons(4);
 	v4_template.r[5].ie = htons(IPFIX_egressInterface);
@@ -313,9 +333,9 @@ ipfix_init_template(struct FLOWTRACKPARAMETERS *param)
 	v6_template.r[1].ie = htons(IPFIX_destinationIPv6Address);
 	v6_template.r[1].length = htons(16);
 	v6_template.r[2].ie = htons(IPFIX_octetDeltaCount);
-	v6_template.r[2].length = htons(4);
+	v6_template.r[2].length = htons(8);
 	v6_template.r[3].ie = htons(IPFIX_packetDeltaCount);
-	v6_template.r[3].length = htons(4);
+	v6_template.r[3].length = htons(8);
 	v6_template.r[4].ie = htons(IPFIX_ingressInterface);
 	v6_template.r[4].length = htons(4);
 	v6_template.r[5].ie = htons(IPFIX_egressInterface);
@@ -377,9 +397,9 @@ ipfix_init_template_bidirection(struct FLOWTRACKPARAMETERS *param)
 	v4_bidirection_template.r[1].ie = htons(IPFIX_destinationIPv4Address);
 	v4_bidirection_template.r[1].length = htons(4);
 	v4_bidirection_template.r[2].ie = htons(IPFIX_octetDeltaCount);
-	v4_bidirection_template.r[2].length = htons(4);
+	v4_bidirection_template.r[2].length = htons(8);
 	v4_bidirection_template.r[3].ie = htons(IPFIX_packetDeltaCount);
-	v4_bidirection_template.r[3].length = htons(4);
+	v4_bidirection_template.r[3].length = htons(8);
 	v4_bidirection_template.r[4].ie = htons(IPFIX_ingressInterface);
 	v4_bidirection_template.r[4].length = htons(4);
 	v4_bidirection_template.r[5].ie = htons(IPFIX_egressInterface);
@@ -401,10 +421,10 @@ ipfix_init_template_bidirection(struct FLOWTRACKPARAMETERS *param)
 	v4_bidirection_template.r[13].ie = htons(IPFIX_vlanId);
 	v4_bidirection_template.r[13].length = htons(2);
 	v4_bidirection_template.v[0].ie = htons(IPFIX_octetDeltaCount | 0x8000);
-	v4_bidirection_template.v[0].length = htons(4);
+	v4_bidirection_template.v[0].length = htons(8);
 	v4_bidirection_template.v[0].pen = htonl(REVERSE_PEN);
 	v4_bidirection_template.v[1].ie = htons(IPFIX_packetDeltaCount | 0x8000);
-	v4_bidirection_template.v[1].length = htons(4);
+	v4_bidirection_template.v[1].length = htons(8);
 	v4_bidirection_template.v[1].pen = htonl(REVERSE_PEN);
 	v4_bidirection_template.v[2].ie = htons(IPFIX_tcpControlBits | 0x8000);
 	v4_bidirection_template.v[2].length = htons(1);
@@ -452,9 +472,9 @@ ipfix_init_template_bidirection(struct FLOWTRACKPARAMETERS *param)
 	v6_bidirection_template.r[1].ie = htons(IPFIX_destinationIPv6Address);
 	v6_bidirection_template.r[1].length = htons(16);
 	v6_bidirection_template.r[2].ie = htons(IPFIX_octetDeltaCount);
-	v6_bidirection_template.r[2].length = htons(4);
+	v6_bidirection_template.r[2].length = htons(8);
 	v6_bidirection_template.r[3].ie = htons(IPFIX_packetDeltaCount);
-	v6_bidirection_template.r[3].length = htons(4);
+	v6_bidirection_template.r[3].length = htons(8);
 	v6_bidirection_template.r[4].ie = htons(IPFIX_ingressInterface);
 	v6_bidirection_template.r[4].length = htons(4);
 	v6_bidirection_template.r[5].ie = htons(IPFIX_egressInterface);
@@ -476,10 +496,10 @@ ipfix_init_template_bidirection(struct FLOWTRACKPARAMETERS *param)
 	v6_bidirection_template.r[13].ie = htons(IPFIX_vlanId);
 	v6_bidirection_template.r[13].length = htons(2);
 	v6_bidirection_template.v[0].ie = htons(IPFIX_octetDeltaCount | 0x8000);
-	v6_bidirection_template.v[0].length = htons(4);
+	v6_bidirection_template.v[0].length = htons(8);
 	v6_bidirection_template.v[0].pen = htonl(REVERSE_PEN);
 	v6_bidirection_template.v[1].ie = htons(IPFIX_packetDeltaCount | 0x8000);
-	v6_bidirection_template.v[1].length = htons(4);
+	v6_bidirection_template.v[1].length = htons(8);
 	v6_bidirection_template.v[1].pen = htonl(REVERSE_PEN);
 	v6_bidirection_template.v[2].ie = htons(IPFIX_tcpControlBits | 0x8000);
 	v6_bidirection_template.v[2].length = htons(1);
@@ -519,6 +539,121 @@ ipfix_init_template_bidirection(struct FLOWTRACKPARAMETERS *param)
 }
 
 
+/* Whether a field applies to a protocol class */
+static int
+ipfix_class_has(u_int ie, int class)
+{
+	switch (ie & 0x7fff) {
+	case IPFIX_sourceTransportPort:
+	case IPFIX_destinationTransportPort:
+		return (class == EXPORT_CLASS_TCP || class == EXPORT_CLASS_UDP);
+	case IPFIX_tcpControlBits:
+		return (class == EXPORT_CLASS_TCP);
+	case IPFIX_icmpTypeCodeIPv4:
+	case IPFIX_icmpTypeCodeIPv6:
+		return (class == EXPORT_CLASS_ICMP);
+	}
+	return (1);
+}
+
+/* Whether a field is a packet or octet counter, in either direction */
+static int
+ipfix_is_counter(u_int ie)
+{
+	ie &= 0x7fff;
+	return (ie == IPFIX_octetDeltaCount || ie == IPFIX_packetDeltaCount);
+}
+
+/*
+ * Derive template "k" (export template plus EXPORT_NTEMPLATES times the
+ * counter width index) from a full template set
+ */
+static void
+ipfix_class_template(int k, const void *full)
+{
+	const struct IPFIX_TEMPLATE_SET_HEADER *fh = full;
+	const struct IPFIX_FIELD_SPECIFIER *f;
+	struct IPFIX_CLASS_TEMPLATE *ct = &ipfix_templates[k];
+	struct IPFIX_FIELD_SPECIFIER *nf;
+	struct IPFIX_TEMPLATE_SET_HEADER *h;
+	const u_char *p;
+	u_int i, n, off, flen, slen, keep;
+	int t = k % EXPORT_NTEMPLATES, w = k / EXPORT_NTEMPLATES;
+
+	bzero(ct, sizeof(*ct));
+	h = (struct IPFIX_TEMPLATE_SET_HEADER *)ct->set;
+	ct->len = sizeof(*h);
+	p = (const u_char *)full + sizeof(*fh);
+	for (n = off = i = 0; i < ntohs(fh->r.count);
+	    i++, p += slen, off += flen) {
+		f = (const struct IPFIX_FIELD_SPECIFIER *)p;
+		flen = ntohs(f->length);
+		slen = (ntohs(f->ie) & 0x8000) ?
+		    sizeof(struct IPFIX_VENDOR_FIELD_SPECIFIER) : sizeof(*f);
+		if (!ipfix_class_has(ntohs(f->ie), EXPORT_TEMPLATE_CLASS(t)))
+			continue;
+		nf = (struct IPFIX_FIELD_SPECIFIER *)(ct->set + ct->len);
+		memcpy(nf, p, slen);
+		ct->len += slen;
+		n++;
+		keep = flen;
+		if (ipfix_is_counter(ntohs(f->ie))) {
+			keep = EXPORT_WIDTH(w);
+			nf->length = htons(keep);
+		}
+		if (ct->nspans > 0 && ct->span[ct->nspans - 1].off +
+		    ct->span[ct->nspans - 1].len == off + flen - keep)
+			ct->span[ct->nspans - 1].len += keep;
+		else {
+			ct->span[ct->nspans].off = off + flen - keep;
+			ct->span[ct->nspans].len = keep;
+			ct->nspans++;
+		}
+		ct->reclen += keep;
+	}
+	h->c.set_id = htons(IPFIX_TEMPLATE_SET_ID);
+	h->c.length = htons(ct->len);
+	h->r.template_id = htons(ntohs(fh->r.template_id) +
+	    EXPORT_TEMPLATE_CLASS(t) + EXPORT_NCLASSES * w);
+	h->r.count = htons(n);
+	ct->set_id = h->r.template_id;
+}
+
+static void
+ipfix_init_class_templates(const void *v4, const void *v6,
+    struct FLOWTRACKPARAMETERS *param)
+{
+	int k;
+
+	ipfix_width = param->counter_width == COUNTER_WIDTH_AUTO ? -1 :
+	    export_width_index(param->counter_width);
+	for (k = 0; k < EXPORT_MAX_GROUPS; k++)
+		ipfix_class_template(k, EXPORT_TEMPLATE_AF(k %
+		    EXPORT_NTEMPLATES) == AF_INET ? v4 : v6);
+}
+
+/* Template a flow is exported with, see ipfix_class_template() */
+static int
+ipfix_flow_template(const struct FLOW *flow)
+{
+	return (export_flow_template(flow) + EXPORT_NTEMPLATES *
+	    (ipfix_width < 0 ? export_counter_width(flow) : ipfix_width));
+}
+
+/* Copy the fields of a full record that its template keeps */
+static void
+ipfix_copy_record(const struct IPFIX_CLASS_TEMPLATE *ct, u_char *out,
+    const void *rec)
+{
+	u_int i;
+
+	for (i = 0; i < ct->nspans; i++) {
+		memcpy(out, (const u_char *)rec + ct->span[i].off,
+		    ct->span[i].len);
+		out += ct->span[i].len;
+	}
+}
+
 static void
 ipfix_init_option(struct timeval *system_boot_time, struct OPTION *option) {
 	bzero(&option_template, sizeof(option_template));
@@ -545,7 +680,20 @@ ipfix_init_option(struct timeval *system_boot_time, struct OPTION *option) {
 #if defined(htobe64) || defined(HAVE_DECL_HTOBE64)
 	option_data.systemInitTimeMilliseconds = htobe64((u_int64_t)system_boot_time->tv_sec * 1000 + (u_int64_t)system_boot_time->tv_usec / 1000);
 #endif
-	option_data.samplingAlgorithm = htons(PSAMP_selectorAlgorithm_count);
+	switch (option->sample_algorithm) {
+	case SAMPLE_RANDOM:
+		option_data.samplingAlgorithm =
+		    htons(PSAMP_selectorAlgorithm_uniform);
+		break;
+	case SAMPLE_HASH:
+		option_data.samplingAlgorithm =
+		    htons(PSAMP_selectorAlgorithm_bob);
+		break;
+	default:
+		option_data.samplingAlgorithm =
+		    htons(PSAMP_selectorAlgorithm_count);
+		break;
+	}
 	option_data.samplingInterval = htons(1);
 	option_data.samplingSpace = htonl(option->sample > 0 ? option->sample - 1 : 0);
 }
@@ -561,16 +709,13 @@ ipfix_flow_to_flowset(const struct FLOW *flow, u_char *packet, u_int len,
 	} d[2];
 	struct IPFIX_SOFTFLOWD_DATA_COMMON *dc[2];
 	union IPFIX_SOFTFLOWD_DATA_TIME *dt[2];
-	u_int freclen, ret_len, nflows;
+	const struct IPFIX_CLASS_TEMPLATE *ct;
+	u_int ret_len, nflows;
 
 	bzero(d, sizeof(d));
 	*len_used = nflows = ret_len = 0;
 	switch (flow->af) {
 	case AF_INET:
-		freclen = sizeof(struct IPFIX_SOFTFLOWD_DATA_V4);
-		if (!(param->time_format == 'm' || param->time_format == 'M' || param->time_format == 'n')) {
-			freclen -= (sizeof(u_int64_t) - sizeof(u_int32_t)) * 2;
-		}
 		memcpy(&d[0].d4.sourceIPv4Address, &flow->addr[0].v4, 4);
 		memcpy(&d[0].d4.destinationIPv4Address, &flow->addr[1].v4, 4);
 		memcpy(&d[1].d4.sourceIPv4Address, &flow->addr[1].v4, 4);
@@ -582,10 +727,6 @@ ipfix_flow_to_flowset(const struct FLOW *flow, u_char *packet, u_int len,
 		dc[0]->ipVersion = dc[1]->ipVersion = 4;
 		break;
 	case AF_INET6:
-		freclen = sizeof(struct IPFIX_SOFTFLOWD_DATA_V6);
-		if (!(param->time_format == 'm' || param->time_format == 'M' || param->time_format == 'n')) {
-			freclen -= (sizeof(u_int64_t) - sizeof(u_int32_t)) * 2;
-		}
 		memcpy(&d[0].d6.sourceIPv6Address, &flow->addr[0].v6, 16);
 		memcpy(&d[0].d6.destinationIPv6Address, &flow->addr[1].v6, 16);
 		memcpy(&d[1].d6.sourceIPv6Address, &flow->addr[1].v6, 16);
@@ -630,12 +771,14 @@ ipfix_flow_to_flowset(const struct FLOW *flow, u_char *packet, u_int len,
 		dt[0]->u32.end = dt[1]->u32.end = 
 		    htonl(timeval_sub_ms(&flow->flow_last, system_boot_time));
 	}
-	dc[0]->octetDeltaCount = htonl(flow->octets[0]);
-	dc[1]->octetDeltaCount = htonl(flow->octets[1]);
-	dc[0]->packetDeltaCount = htonl(flow->packets[0]);
-	dc[1]->packetDeltaCount = htonl(flow->packets[1]);
-	dc[0]->ingressInterface = dc[0]->egressInterface = htonl(ifidx);
-	dc[1]->ingressInterface = dc[1]->egressInterface = htonl(ifidx);
+	export_put_counter(dc[0]->octetDeltaCount, flow->octets[0], 8);
+	export_put_counter(dc[1]->octetDeltaCount, flow->octets[1], 8);
+	export_put_counter(dc[0]->packetDeltaCount, flow->packets[0], 8);
+	export_put_counter(dc[1]->packetDeltaCount, flow->packets[1], 8);
+	dc[0]->ingressInterface = dc[0]->egressInterface =
+	    htonl(flow->if_index);
+	dc[1]->ingressInterface = dc[1]->egressInterface =
+	    htonl(flow->if_index);
 	dc[0]->sourceTransportPort = dc[1]->destinationTransportPort = flow->port[0];
 	dc[1]->sourceTransportPort = dc[0]->destinationTransportPort = flow->port[1];
 	dc[0]->protocolIdentifier = dc[1]->protocolIdentifier = flow->protocol;
@@ -649,18 +792,19 @@ ipfix_flow_to_flowset(const struct FLOW *flow, u_char *packet, u_int len,
 	}
 	dc[0]->vlanId = dc[1]->vlanId = htons(flow->vlanid);
 
+	ct = &ipfix_templates[ipfix_flow_template(flow)];
 	if (flow->octets[0] > 0) {
-		if (ret_len + freclen > len)
+		if (ret_len + ct->reclen > len)
 			return (-1);
-		memcpy(packet + ret_len, &d[0], freclen);
-		ret_len += freclen;
+		ipfix_copy_record(ct, packet + ret_len, &d[0]);
+		ret_len += ct->reclen;
 		nflows++;
 	}
 	if (flow->octets[1] > 0) {
-		if (ret_len + freclen > len)
+		if (ret_len + ct->reclen > len)
 			return (-1);
-		memcpy(packet + ret_len, &d[1], freclen);
-		ret_len += freclen;
+		ipfix_copy_record(ct, packet + ret_len, &d[1]);
+		ret_len += ct->reclen;
 		nflows++;
 	}
 
@@ -682,16 +826,13 @@ ipfix_flow_to_bidirection_flowset(const struct FLOW *flow, u_char *packet,
 	struct IPFIX_SOFTFLOWD_DATA_COMMON *dc;
 	struct IPFIX_SOFTFLOWD_DATA_BIDIRECTION *db;
 	union IPFIX_SOFTFLOWD_DATA_TIME *dt;
-	u_int freclen, ret_len, nflows;
+	const struct IPFIX_CLASS_TEMPLATE *ct;
+	u_int ret_len, nflows;
 
 	bzero(&d, sizeof(d));
 	*len_used = nflows = ret_len = 0;
 	switch (flow->af) {
 	case AF_INET:
-		freclen = sizeof(struct IPFIX_SOFTFLOWD_BIDIRECTION_DATA_V4);
-		if (!(param->time_format == 'm' || param->time_format == 'M' || param->time_format == 'n')) {
-			freclen -= (sizeof(u_int64_t) - sizeof(u_int32_t)) * 2;
-		}
 		memcpy(&d.d4.sourceIPv4Address, &flow->addr[0].v4, 4);
 		memcpy(&d.d4.destinationIPv4Address, &flow->addr[1].v4, 4);
 		dc = &d.d4.c;
@@ -700,10 +841,6 @@ ipfix_flow_to_bidirection_flowset(const struct FLOW *flow, u_char *packet,
 		dc->ipVersion = 4;
 		break;
 	case AF_INET6:
-		freclen = sizeof(struct IPFIX_SOFTFLOWD_BIDIRECTION_DATA_V6);
-		if (!(param->time_format == 'm' || param->time_format == 'M' || param->time_format == 'n')) {
-			freclen -= (sizeof(u_int64_t) - sizeof(u_int32_t)) * 2;
-		}
 		memcpy(&d.d6.sourceIPv6Address, &flow->addr[0].v6, 16);
 		memcpy(&d.d6.destinationIPv6Address, &flow->addr[1].v6, 16);
 		dc = &d.d6.c;
@@ -743,11 +880,11 @@ ipfix_flow_to_bidirection_flowset(const struct FLOW *flow, u_char *packet,
 		dt->u32.end =
 		    htonl(timeval_sub_ms(&flow->flow_last, system_boot_time));
 	}
-	dc->octetDeltaCount = htonl(flow->octets[0]);
-	db->octetDeltaCount = htonl(flow->octets[1]);
-	dc->packetDeltaCount = htonl(flow->packets[0]);
-	db->packetDeltaCount = htonl(flow->packets[1]);
-	dc->ingressInterface = dc->egressInterface = htonl(ifidx);
+	export_put_counter(dc->octetDeltaCount, flow->octets[0], 8);
+	export_put_counter(db->octetDeltaCount, flow->octets[1], 8);
+	export_put_counter(dc->packetDeltaCount, flow->packets[0], 8);
+	export_put_counter(db->packetDeltaCount, flow->packets[1], 8);
+	dc->ingressInterface = dc->egressInterface = htonl(flow->if_index);
 	dc->sourceTransportPort = flow->port[0];
 	dc->destinationTransportPort = flow->port[1];
 	dc->protocolIdentifier = flow->protocol;
@@ -761,11 +898,12 @@ ipfix_flow_to_bidirection_flowset(const struct FLOW *flow, u_char *packet,
 	}
 	dc->vlanId = htons(flow->vlanid);
 
+	ct = &ipfix_templates[ipfix_flow_template(flow)];
 	if (flow->octets[0] > 0 || flow->octets[1] > 0) {
-		if (ret_len + freclen > len)
+		if (ret_len + ct->reclen > len)
 			return (-1);
-		memcpy(packet + ret_len, &d, freclen);
-		ret_len += freclen;
+		ipfix_copy_record(ct, packet + ret_len, &d);
+		ret_len += ct->reclen;
 		nflows++;
 	}
 
@@ -774,57 +912,86 @@ ipfix_flow_to_bidirection_flowset(const struct FLOW *flow, u_char *packet,
 }
 
 
+/*
+ * Start a data set for template "k" at *offset. A template that is due
+ * in this refresh goes just before its first data set, if there is room
+ * for it and a record, so that only templates in use are sent. Returns
+ * NULL if the packet is full.
+ */
+static struct IPFIX_SET_HEADER *
+ipfix_open_set(u_char *packet, u_int *offset, int k,
+    struct TEMPLATE_STATE *ts, struct FLOWTRACKPARAMETERS *param)
+{
+	const struct IPFIX_CLASS_TEMPLATE *ct = &ipfix_templates[k];
+	struct IPFIX_SET_HEADER *dh;
+	u_int need;
+
+	need = sizeof(*dh);
+	if (ts->due[k])
+		need += ct->len + ct->reclen;
+	if (*offset + need > param->export_packet_size)
+		return (NULL);
+	if (ts->due[k]) {
+		memcpy(packet + *offset, ct->set, ct->len);
+		*offset += ct->len;
+		ts->due[k] = 0;
+	}
+	dh = (struct IPFIX_SET_HEADER *)(packet + *offset);
+	dh->set_id = ct->set_id;
+	dh->length = sizeof(*dh); /* Filled as we go */
+	*offset += sizeof(*dh);
+	return (dh);
+}
+
 /*
  * Given an array of expired flows, send netflow v9 report packets
  * Returns number of packets sent or -1 on error
  */
 int
-send_ipfix(struct FLOW **flows, int num_flows, int nfsock,
-		u_int16_t ifidx, struct FLOWTRACKPARAMETERS *param,
-		int verbose_flag)
+send_ipfix(struct FLOW **flows, int num_flows,
+		struct NETFLOW_TARGET *target, u_int16_t ifidx,
+		struct FLOWTRACKPARAMETERS *param, int verbose_flag)
 {
 	struct IPFIX_HEADER *ipfix;
 	struct IPFIX_SET_HEADER *dh;
 	struct timeval now;
-	u_int offset, last_af, i, j, num_packets, inc, last_valid;
-	socklen_t errsz;
-	int err, r;
+	u_int offset, i, j, inc, last_valid;
+	int r, t, last_t;
 	u_int records;
-	u_char packet[IPFIX_SOFTFLOWD_MAX_PACKET_SIZE];
+	u_char *packet;
+	struct EXPORT_BATCH batch;
 	struct timeval *system_boot_time = &param->system_boot_time;
-	u_int64_t *flows_exported = &param->flows_exported;
-	u_int64_t *records_sent = &param->records_sent;
 	struct OPTION *option = &param->option;
 
-	gettimeofday(&now, NULL);
+	flowtrack_gettime(param, &now);
 
-	if (ipfix_pkts_until_template == -1) {
+	if (!ipfix_templates_ready) {
 		ipfix_init_template(param);
-		ipfix_pkts_until_template = 0;
+		ipfix_init_class_templates(&v4_template, &v6_template,
+		    param);
+		ipfix_templates_ready = 1;
 		if (option != NULL){
 			ipfix_init_option(system_boot_time, option);
 		}
 	}		
 
-	last_valid = num_packets = 0;
+	flows = export_group_flows(flows, num_flows, ipfix_flow_template,
+	    EXPORT_MAX_GROUPS);
+
+	last_valid = 0;
+	export_batch_begin(&batch, target, param);
 	for (j = 0; j < num_flows;) {
-		bzero(packet, sizeof(packet));
+		packet = export_batch_slot(&batch);
 		ipfix = (struct IPFIX_HEADER *)packet;
 
 		ipfix->version = htons(10);
 		ipfix->length = 0; /* Filled as we go, htons at end */
-		ipfix->export_time = htonl(time(NULL));
+		ipfix->export_time = htonl(now.tv_sec);
 		ipfix->od_id = 0;
 		offset = sizeof(*ipfix);
 
 		/* Refresh template headers if we need to */
-		if (ipfix_pkts_until_template <= 0) {
-			memcpy(packet + offset, &v4_template,
-			    sizeof(v4_template));
-			offset += sizeof(v4_template);
-			memcpy(packet + offset, &v6_template,
-			    sizeof(v6_template));
-			offset += sizeof(v6_template);
+		if (export_template_refresh(&target->tmpl, param, &now)) {
 			if (option != NULL){
 				memcpy(packet + offset, &option_template,
 				       sizeof(option_template));
@@ -833,15 +1000,14 @@ send_ipfix(struct FLOW **flows, int num_flows, int nfsock,
 				       sizeof(option_data));
 				offset += sizeof(option_data);
 			}
-
-			ipfix_pkts_until_template = IPFIX_DEFAULT_TEMPLATE_INTERVAL;
 		}
 
 		dh = NULL;
-		last_af = 0;
+		last_t = -1;
 		records = 0;
 		for (i = 0; i + j < num_flows; i++) {
-			if (dh == NULL || flows[i + j]->af != last_af) {
+			t = ipfix_flow_template(flows[i + j]);
+			if (dh == NULL || t != last_t) {
 				if (dh != NULL) {
 					if (offset % 4 != 0) {
 						/* Pad to multiple of 4 */
@@ -851,25 +1017,18 @@ send_ipfix(struct FLOW **flows, int num_flows, int nfsock,
 					/* Finalise last header */
 					dh->length = htons(dh->length);
 				}
-				if (offset + sizeof(*dh) > sizeof(packet)) {
-					/* Mark header is finished */
-					dh = NULL;
+				/* NULL marks header is finished */
+				dh = ipfix_open_set(packet, &offset, t,
+				    &target->tmpl, param);
+				if (dh == NULL)
 					break;
-				}
-				dh = (struct IPFIX_SET_HEADER *)
-				    (packet + offset);
-				dh->set_id =
-				    (flows[i + j]->af == AF_INET) ?
-				    v4_template.h.r.template_id : 
-				    v6_template.h.r.template_id;
-				last_af = flows[i + j]->af;
-				last_valid = offset;
-				dh->length = sizeof(*dh); /* Filled as we go */
-				offset += sizeof(*dh);
+				last_t = t;
+				last_valid = (u_char *)dh - packet;
 			}
 
 			r = ipfix_flow_to_flowset(flows[i + j], packet + offset,
-			    sizeof(packet) - offset, ifidx, system_boot_time, &inc, param);
+			    param->export_packet_size - offset, ifidx,
+			    system_boot_time, &inc, param);
 			if (r <= 0) {
 				/* yank off data header, if we had to go back */
 				if (last_valid)
@@ -899,31 +1058,18 @@ send_ipfix(struct FLOW **flows, int num_flows, int nfsock,
 			dh->length = htons(dh->length);
 		}
 		ipfix->length = htons(offset);
-		*records_sent += records;
-		ipfix->sequence = htonl((u_int32_t)(*records_sent & 0x00000000ffffffff));
+		/* Data records sent before this message */
+		ipfix->sequence = htonl(target->sequence);
+		target->sequence += records;
 
 		if (verbose_flag)
 			logit(LOG_DEBUG, "Sending flow packet len = %d", offset);
-		errsz = sizeof(err);
-		/* Clear ICMP errors */
-		getsockopt(nfsock, SOL_SOCKET, SO_ERROR, &err, &errsz); 
-		if (send(nfsock, packet, (size_t)offset, 0) == -1)
-			return (-1);
-		num_packets++;
-		ipfix_pkts_until_template--;
+		export_batch_commit(&batch, offset, i, records);
 
 		j += i;
 	}
 
-	*flows_exported += j;
-	return (num_packets);
-}
-
-void
-ipfix_resend_template(void)
-{
-	if (ipfix_pkts_until_template > 0)
-		ipfix_pkts_until_template = 0;
+	return (export_batch_finish(&batch));
 }
 
 /*
@@ -931,52 +1077,50 @@ ipfix_resend_template(void)
  * Returns number of packets sent or -1 on error
  */
 int
-send_ipfix_bidirection(struct FLOW **flows, int num_flows, int nfsock,
-		       u_int16_t ifidx, struct FLOWTRACKPARAMETERS *param,
-		       int verbose_flag)
+send_ipfix_bidirection(struct FLOW **flows, int num_flows,
+		       struct NETFLOW_TARGET *target, u_int16_t ifidx,
+		       struct FLOWTRACKPARAMETERS *param, int verbose_flag)
 {
 	struct IPFIX_HEADER *ipfix;
 	struct IPFIX_SET_HEADER *dh;
 	struct timeval now;
-	u_int offset, last_af, i, j, num_packets, inc, last_valid;
-	socklen_t errsz;
-	int err, r;
+	u_int offset, i, j, inc, last_valid;
+	int r, t, last_t;
 	u_int records;
-	u_char packet[IPFIX_SOFTFLOWD_MAX_PACKET_SIZE];
+	u_char *packet;
+	struct EXPORT_BATCH batch;
 	struct timeval *system_boot_time = &param->system_boot_time;
-	u_int64_t *flows_exported = &param->flows_exported;
-	u_int64_t *records_sent = &param->records_sent;
 	struct OPTION *option = &param->option;
 
-	gettimeofday(&now, NULL);
+	flowtrack_gettime(param, &now);
 
-	if (ipfix_pkts_until_template == -1) {
+	if (!ipfix_templates_ready) {
 		ipfix_init_template_bidirection(param);
-		ipfix_pkts_until_template = 0;
+		ipfix_init_class_templates(&v4_bidirection_template,
+		    &v6_bidirection_template, param);
+		ipfix_templates_ready = 1;
 		if (option != NULL){
 			ipfix_init_option(system_boot_time, option);
 		}
 	}		
 
-	last_valid = num_packets = 0;
+	flows = export_group_flows(flows, num_flows, ipfix_flow_template,
+	    EXPORT_MAX_GROUPS);
+
+	last_valid = 0;
+	export_batch_begin(&batch, target, param);
 	for (j = 0; j < num_flows;) {
-		bzero(packet, sizeof(packet));
+		packet = export_batch_slot(&batch);
 		ipfix = (struct IPFIX_HEADER *)packet;
 
 		ipfix->version = htons(10);
 		ipfix->length = 0; /* Filled as we go, htons at end */
-		ipfix->export_time = htonl(time(NULL));
+		ipfix->export_time = htonl(now.tv_sec);
 		ipfix->od_id = 0;
 		offset = sizeof(*ipfix);
 
 		/* Refresh template headers if we need to */
-		if (ipfix_pkts_until_template <= 0) {
-			memcpy(packet + offset, &v4_bidirection_template,
-			       sizeof(v4_bidirection_template));
-			offset += sizeof(v4_bidirection_template);
-			memcpy(packet + offset, &v6_bidirection_template,
-			       sizeof(v6_bidirection_template));
-			offset += sizeof(v6_bidirection_template);
+		if (export_template_refresh(&target->tmpl, param, &now)) {
 			if (option != NULL){
 				memcpy(packet + offset, &option_template,
 				       sizeof(option_template));
@@ -985,15 +1129,14 @@ send_ipfix_bidirection(struct FLOW **flows, int num_flows, int nfsock,
 				       sizeof(option_data));
 				offset += sizeof(option_data);
 			}
-
-			ipfix_pkts_until_template = IPFIX_DEFAULT_TEMPLATE_INTERVAL;
 		}
 
 		dh = NULL;
-		last_af = 0;
+		last_t = -1;
 		records = 0;
 		for (i = 0; i + j < num_flows; i++) {
-			if (dh == NULL || flows[i + j]->af != last_af) {
+			t = ipfix_flow_template(flows[i + j]);
+			if (dh == NULL || t != last_t) {
 				if (dh != NULL) {
 					if (offset % 4 != 0) {
 						/* Pad to multiple of 4 */
@@ -1003,26 +1146,18 @@ send_ipfix_bidirection(struct FLOW **flows, int num_flows, int nfsock,
 					/* Finalise last header */
 					dh->length = htons(dh->length);
 				}
-				if (offset + sizeof(*dh) > sizeof(packet)) {
-					/* Mark header is finished */
-					dh = NULL;
+				/* NULL marks header is finished */
+				dh = ipfix_open_set(packet, &offset, t,
+				    &target->tmpl, param);
+				if (dh == NULL)
 					break;
-				}
-				dh = (struct IPFIX_SET_HEADER *)
-				    (packet + offset);
-				dh->set_id =
-				    (flows[i + j]->af == AF_INET) ?
-				    v4_bidirection_template.h.r.template_id : 
-				    v6_bidirection_template.h.r.template_id;
-				last_af = flows[i + j]->af;
-				last_valid = offset;
-				dh->length = sizeof(*dh); /* Filled as we go */
-				offset += sizeof(*dh);
+				last_t = t;
+				last_valid = (u_char *)dh - packet;
 			}
 
 			r = ipfix_flow_to_bidirection_flowset(flows[i + j],
 							      packet + offset,
-							      sizeof(packet) - offset,
+							      param->export_packet_size - offset,
 							      ifidx,
 							      system_boot_time,
 							      &inc, param);
@@ -1055,22 +1190,16 @@ send_ipfix_bidirection(struct FLOW **flows, int num_flows, int nfsock,
 			dh->length = htons(dh->length);
 		}
 		ipfix->length = htons(offset);
-		*records_sent += records;
-		ipfix->sequence = htonl((u_int32_t)(*records_sent & 0x00000000ffffffff));
+		/* Data records sent before this message */
+		ipfix->sequence = htonl(target->sequence);
+		target->sequence += records;
 
 		if (verbose_flag)
 			logit(LOG_DEBUG, "Sending flow packet len = %d", offset);
-		errsz = sizeof(err);
-		/* Clear ICMP errors */
-		getsockopt(nfsock, SOL_SOCKET, SO_ERROR, &err, &errsz); 
-		if (send(nfsock, packet, (size_t)offset, 0) == -1)
-			return (-1);
-		num_packets++;
-		ipfix_pkts_until_template--;
+		export_batch_commit(&batch, offset, i, records);
 
 		j += i;
 	}
 
-	*flows_exported += j;
-	return (num_packets);
+	return (export_batch_finish(&batch));
 }
@@ -0,0 +1,393 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Merged reading of several capture files (-r). See merge.h.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "merge.h"
+
+#include <glob.h>
+#include <pcap.h>
+
+struct MERGE_FILE {
+	char *path;
+	int group;
+	u_int order;			/* Position given, breaks ties */
+	int empty;			/* No packet passes the filter */
+	struct timeval first;		/* Time of the first packet */
+	int linktype;
+
+	/* While open */
+	pcap_t *pcap;
+	char *buf;
+	struct pcap_pkthdr *hdr;	/* Next packet */
+	const u_char *data;
+};
+
+struct MERGE {
+	struct MERGE_FILE *files;
+	u_int num_files, alloc_files;
+	u_int num_usable;		/* Files with packets, sorted first */
+	u_int next_file;		/* Next to open */
+	const char *bpf_prog;
+
+	/* Min-heap of the open files on their next packet */
+	struct MERGE_FILE **heap;
+	u_int heap_len;
+	struct MERGE_FILE *last;	/* Returned, to be advanced */
+
+	/* Statistics */
+	u_int files_read;
+	u_int max_open;
+	u_int read_errors;
+	u_int64_t packets;
+};
+
+struct MERGE *
+merge_new(void)
+{
+	struct MERGE *m;
+
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		fprintf(stderr, "Out of memory\n");
+	return (m);
+}
+
+/*
+ * Add the files matching pattern, in name order. A pattern that matches
+ * nothing is added as it is, for the open to report why. Returns the
+ * number of files added or -1 on failure.
+ */
+int
+merge_add(struct MERGE *m, const char *pattern, int group)
+{
+	struct MERGE_FILE *f;
+	glob_t g;
+	size_t i;
+	u_int n;
+
+	memset(&g, '\0', sizeof(g));
+	if (glob(pattern, GLOB_NOCHECK, NULL, &g) != 0) {
+		fprintf(stderr, "Couldn't expand \"%s\"\n", pattern);
+		globfree(&g);
+		return (-1);
+	}
+	for (i = 0; i < g.gl_pathc; i++) {
+		if (m->num_files == m->alloc_files) {
+			n = m->alloc_files == 0 ? 16 : m->alloc_files * 2;
+			if ((f = realloc(m->files, n * sizeof(*f))) == NULL)
+				goto oom;
+			m->files = f;
+			m->alloc_files = n;
+		}
+		f = &m->files[m->num_files];
+		memset(f, '\0', sizeof(*f));
+		if ((f->path = strdup(g.gl_pathv[i])) == NULL)
+			goto oom;
+		f->group = group;
+		f->order = m->num_files++;
+	}
+	globfree(&g);
+	return ((int)i);
+
+ oom:
+	fprintf(stderr, "Out of memory\n");
+	globfree(&g);
+	return (-1);
+}
+
+/* Open a file with read-ahead and its filter. Returns -1 on failure */
+static int
+merge_open_file(struct MERGE *m, struct MERGE_FILE *f, char *ebuf)
+{
+	struct bpf_program prog;
+	FILE *fp;
+	int r;
+
+	if ((fp = fopen(f->path, "rb")) == NULL) {
+		snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", strerror(errno));
+		return (-1);
+	}
+	if ((f->buf = malloc(MERGE_READAHEAD)) != NULL)
+		setvbuf(fp, f->buf, _IOFBF, MERGE_READAHEAD);
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	if ((f->pcap = pcap_fopen_offline(fp, ebuf)) == NULL) {
+		fclose(fp);
+		free(f->buf);
+		f->buf = NULL;
+		return (-1);
+	}
+	f->linktype = pcap_datalink(f->pcap);
+	if (m->bpf_prog != NULL) {
+		if (pcap_compile(f->pcap, &prog, m->bpf_prog, 1, 0) == -1) {
+			snprintf(ebuf, PCAP_ERRBUF_SIZE, "pcap_compile(\"%s\"): "
+			    "%s", m->bpf_prog, pcap_geterr(f->pcap));
+			return (-1);
+		}
+		r = pcap_setfilter(f->pcap, &prog);
+		pcap_freecode(&prog);
+		if (r == -1) {
+			snprintf(ebuf, PCAP_ERRBUF_SIZE, "pcap_setfilter: %s",
+			    pcap_geterr(f->pcap));
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static void
+merge_close_file(struct MERGE_FILE *f)
+{
+	if (f->pcap != NULL)
+		pcap_close(f->pcap);
+	f->pcap = NULL;
+	free(f->buf);
+	f->buf = NULL;
+}
+
+static int
+merge_before(const struct MERGE_FILE *a, const struct MERGE_FILE *b)
+{
+	if (timercmp(&a->hdr->ts, &b->hdr->ts, !=))
+		return (timercmp(&a->hdr->ts, &b->hdr->ts, <));
+	return (a->order < b->order);
+}
+
+static void
+merge_sift_up(struct MERGE *m, u_int i)
+{
+	struct MERGE_FILE *f = m->heap[i];
+
+	for (; i > 0 && merge_before(f, m->heap[(i - 1) / 2]);
+	    i = (i - 1) / 2)
+		m->heap[i] = m->heap[(i - 1) / 2];
+	m->heap[i] = f;
+}
+
+static void
+merge_sift_down(struct MERGE *m, u_int i)
+{
+	struct MERGE_FILE *f = m->heap[i];
+	u_int c;
+
+	while ((c = 2 * i + 1) < m->heap_len) {
+		if (c + 1 < m->heap_len &&
+		    merge_before(m->heap[c + 1], m->heap[c]))
+			c++;
+		if (!merge_before(m->heap[c], f))
+			break;
+		m->heap[i] = m->heap[c];
+		i = c;
+	}
+	m->heap[i] = f;
+}
+
+/* Files with packets first, in order of their first packet */
+static int
+merge_file_cmp(const void *a, const void *b)
+{
+	const struct MERGE_FILE *fa = a, *fb = b;
+
+	if (fa->empty != fb->empty)
+		return (fa->empty - fb->empty);
+	if (timercmp(&fa->first, &fb->first, !=))
+		return (timercmp(&fa->first, &fb->first, <) ? -1 : 1);
+	return (fa->order < fb->order ? -1 : 1);
+}
+
+/*
+ * Check every file can be read and find its first packet, so files can
+ * be opened in time order. Returns -1 (with the reason printed) if one
+ * can't be read or has a link type linktype_ok() rejects.
+ */
+int
+merge_start(struct MERGE *m, const char *bpf_prog, int (*linktype_ok)(int))
+{
+	char ebuf[PCAP_ERRBUF_SIZE];
+	struct MERGE_FILE *f;
+	u_int i, j;
+	int r;
+
+	m->bpf_prog = bpf_prog;
+	for (i = 0; i < m->num_files; i++) {
+		f = &m->files[i];
+		if (merge_open_file(m, f, ebuf) == -1) {
+			fprintf(stderr, "%s: %s\n", f->path, ebuf);
+			merge_close_file(f);
+			return (-1);
+		}
+		if (!linktype_ok(f->linktype)) {
+			fprintf(stderr, "%s: unsupported datalink type %d\n",
+			    f->path, f->linktype);
+			merge_close_file(f);
+			return (-1);
+		}
+		for (j = 0; j < i && m->files[j].group != f->group; j++)
+			;
+		if (j < i && m->files[j].linktype != f->linktype) {
+			fprintf(stderr, "%s: datalink type %d differs from "
+			    "%s\n", f->path, f->linktype, m->files[j].path);
+			merge_close_file(f);
+			return (-1);
+		}
+		if ((r = pcap_next_ex(f->pcap, &f->hdr, &f->data)) == 1)
+			f->first = f->hdr->ts;
+		else if (r == -1) {
+			fprintf(stderr, "%s: %s\n", f->path,
+			    pcap_geterr(f->pcap));
+			merge_close_file(f);
+			return (-1);
+		} else
+			f->empty = 1;
+		merge_close_file(f);
+		if (!f->empty)
+			m->num_usable++;
+	}
+	qsort(m->files, m->num_files, sizeof(*m->files), merge_file_cmp);
+	if (m->num_usable != 0 && (m->heap = calloc(m->num_usable,
+	    sizeof(*m->heap))) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return (-1);
+	}
+	return (0);
+}
+
+/* The link type of a group's files */
+int
+merge_linktype(const struct MERGE *m, int group)
+{
+	u_int i;
+
+	for (i = 0; i < m->num_files; i++) {
+		if (m->files[i].group == group)
+			return (m->files[i].linktype);
+	}
+	return (-1);
+}
+
+/* The path of the nth file in time order, or NULL if there are fewer */
+const char *
+merge_file(const struct MERGE *m, u_int n)
+{
+	return (n < m->num_files ? m->files[n].path : NULL);
+}
+
+/*
+ * Get the next packet in time order, which stays valid until the next
+ * call. Returns 1 for a packet, 0 once all files are read or -1 on
+ * failure. A file that turns out to be truncated or corrupt is logged
+ * and read no further.
+ */
+int
+merge_next(struct MERGE *m, struct pcap_pkthdr **hdr, const u_char **data,
+    int *group)
+{
+	char ebuf[PCAP_ERRBUF_SIZE];
+	struct MERGE_FILE *f;
+	int r;
+
+	/* Move the file whose packet was returned last time along */
+	if ((f = m->last) != NULL) {
+		m->last = NULL;
+		if ((r = pcap_next_ex(f->pcap, &f->hdr, &f->data)) == 1)
+			merge_sift_down(m, 0);
+		else {
+			if (r == -1) {
+				logit(LOG_WARNING, "%s: %s, skipping the rest "
+				    "of the file", f->path,
+				    pcap_geterr(f->pcap));
+				m->read_errors++;
+			}
+			merge_close_file(f);
+			if (--m->heap_len > 0) {
+				m->heap[0] = m->heap[m->heap_len];
+				merge_sift_down(m, 0);
+			}
+		}
+	}
+
+	/* Open the files whose packets have been reached */
+	while (m->next_file < m->num_usable && (m->heap_len == 0 ||
+	    !timercmp(&m->heap[0]->hdr->ts,
+	    &m->files[m->next_file].first, <))) {
+		f = &m->files[m->next_file++];
+		if (merge_open_file(m, f, ebuf) == -1) {
+			logit(LOG_ERR, "%s: %s", f->path, ebuf);
+			merge_close_file(f);
+			return (-1);
+		}
+		m->files_read++;
+		if ((r = pcap_next_ex(f->pcap, &f->hdr, &f->data)) != 1) {
+			if (r == -1) {
+				logit(LOG_WARNING, "%s: %s", f->path,
+				    pcap_geterr(f->pcap));
+				m->read_errors++;
+			}
+			merge_close_file(f);
+			continue;
+		}
+		m->heap[m->heap_len++] = f;
+		merge_sift_up(m, m->heap_len - 1);
+		m->max_open = MAX(m->max_open, m->heap_len);
+	}
+
+	if (m->heap_len == 0)
+		return (0);
+	m->last = f = m->heap[0];
+	*hdr = f->hdr;
+	*data = f->data;
+	*group = f->group;
+	m->packets++;
+	return (1);
+}
+
+void
+merge_close(struct MERGE *m)
+{
+	u_int i;
+
+	if (m == NULL)
+		return;
+	for (i = 0; i < m->num_files; i++) {
+		merge_close_file(&m->files[i]);
+		free(m->files[i].path);
+	}
+	free(m->files);
+	free(m->heap);
+	free(m);
+}
+
+void
+merge_statistics(struct MERGE *m, FILE *out)
+{
+	fprintf(out, "Capture files read: %u of %u (%u at once at most, "
+	    "%u with read errors), %"PRIu64" packets\n", m->files_read,
+	    m->num_files, m->max_open, m->read_errors, m->packets);
+}
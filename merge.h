@@ -0,0 +1,60 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _MERGE_H
+#define _MERGE_H
+
+#include "common.h"
+
+/*
+ * Reading a set of capture files (-r) as one.
+ *
+ * Each -r argument may be a glob, and its files belong to a group (one
+ * per interface the files were captured on), which must share a link
+ * type. Packets from all files are
+ * merged into timestamp order with a heap over the open files, keyed on
+ * each file's next packet. Files are opened only once the merge reaches
+ * their first packet, so a long series of rotated files from one
+ * interface keeps a single file open at a time, and each is read through
+ * a large buffer with sequential read-ahead.
+ */
+
+#define MERGE_READAHEAD		(1024 * 1024)	/* stdio buffer per file */
+
+struct MERGE;
+struct pcap_pkthdr;
+
+struct MERGE *merge_new(void);
+int merge_add(struct MERGE *m, const char *pattern, int group);
+int merge_start(struct MERGE *m, const char *bpf_prog,
+    int (*linktype_ok)(int));
+int merge_linktype(const struct MERGE *m, int group);
+const char *merge_file(const struct MERGE *m, u_int n);
+int merge_next(struct MERGE *m, struct pcap_pkthdr **hdr,
+    const u_char **data, int *group);
+void merge_close(struct MERGE *m);
+void merge_statistics(struct MERGE *m, FILE *out);
+
+#endif /* _MERGE_H */
@@ -0,0 +1,422 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * NDJSON file output (-j): expired flows are formatted as elasticsearch
+ * bulk requests into a set of large chunks, which are written out with
+ * a single writev() once full or held long enough. With gzip the chunks
+ * are instead fed through one deflate stream per file, sync flushed at
+ * each write so that a reader sees whole documents.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "convtime.h"
+#include "treetype.h"
+#include "softflowd.h"
+#include "esbulk.h"
+#include "ndjson.h"
+
+#include <sys/uio.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+struct NDJSON {
+	char path[1024];		/* File name prefix */
+	char name[1024 + 40];		/* Current file */
+	char part[1024 + 48];		/* Current file while being written */
+	int gzip;			/* Compression level, 0 for none */
+	long rotate_interval;		/* Seconds per file, 0 for none */
+	long flush_interval;		/* Max seconds output is held */
+
+	int fd;				/* Current file, -1 if none */
+	time_t started;			/* When the current file was started */
+	u_int file;			/* Files started so far */
+
+	struct iovec chunk[NDJSON_CHUNKS]; /* Formatted flows */
+	u_int nchunk;			/* Chunk being filled */
+	u_int pending;			/* Flows in the chunks */
+	time_t pending_since;		/* When the first was added */
+
+#ifdef HAVE_LIBZ
+	z_stream z;
+	u_char *zbuf;			/* Compressed output */
+#endif
+
+	/* Statistics */
+	u_int64_t flows;		/* Flows written */
+	u_int64_t bytes;		/* Bytes written, after compression */
+	u_int64_t writes;		/* Chunk sets written */
+	u_int64_t dropped;		/* Flows that could not be written */
+};
+
+/* Write iov[0..n-1] in full. Returns 0 on success or -1 on error */
+static int
+ndjson_writev(struct NDJSON *j, struct iovec *iov, int n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = writev(j->fd, iov, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		j->bytes += r;
+		for (; n > 0 && (size_t)r >= iov->iov_len; iov++, n--)
+			r -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return (0);
+}
+
+#ifdef HAVE_LIBZ
+/* Compress iov[0..n-1] and write the result. Returns 0 or -1 on error */
+static int
+ndjson_deflate(struct NDJSON *j, struct iovec *iov, int n, int flush)
+{
+	struct iovec out;
+	int i, last;
+
+	/* With no input, this just flushes or finishes the stream */
+	last = MAX(n, 1) - 1;
+	for (i = 0; i <= last; i++) {
+		j->z.next_in = n == 0 ? NULL : iov[i].iov_base;
+		j->z.avail_in = n == 0 ? 0 : iov[i].iov_len;
+		do {
+			j->z.next_out = j->zbuf;
+			j->z.avail_out = NDJSON_CHUNK_SIZE;
+			if (deflate(&j->z, i == last ? flush : Z_NO_FLUSH) ==
+			    Z_STREAM_ERROR) {
+				errno = EINVAL;
+				return (-1);
+			}
+			out.iov_base = j->zbuf;
+			out.iov_len = NDJSON_CHUNK_SIZE - j->z.avail_out;
+			if (out.iov_len != 0 && ndjson_writev(j, &out, 1) == -1)
+				return (-1);
+		} while (j->z.avail_out == 0);
+	}
+	return (0);
+}
+#endif
+
+/* Finish the current file and move it into place */
+static void
+ndjson_close_file(struct NDJSON *j)
+{
+	int r = 0;
+
+	if (j->fd == -1)
+		return;
+#ifdef HAVE_LIBZ
+	if (j->gzip) {
+		r = ndjson_deflate(j, NULL, 0, Z_FINISH);
+		deflateEnd(&j->z);
+	}
+#endif
+	if (r == -1 || close(j->fd) == -1) {
+		logit(LOG_ERR, "ndjson: %s: %s", j->part, strerror(errno));
+		unlink(j->part);
+	} else if (rename(j->part, j->name) == -1) {
+		logit(LOG_ERR, "ndjson: rename %s: %s", j->part,
+		    strerror(errno));
+	}
+	j->fd = -1;
+}
+
+/* Start a new file. Returns 0 on success or -1 on failure */
+static int
+ndjson_open(struct NDJSON *j, const struct timeval *now)
+{
+	char stamp[32];
+	time_t t;
+
+	t = now->tv_sec;
+	strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", gmtime(&t));
+	if ((size_t)snprintf(j->name, sizeof(j->name), "%s.%s.%u.ndjson%s",
+	    j->path, stamp, j->file++, j->gzip ? ".gz" : "") >=
+	    sizeof(j->name) || (size_t)snprintf(j->part, sizeof(j->part),
+	    "%s.part", j->name) >= sizeof(j->part))
+		errno = ENAMETOOLONG;
+	else
+		j->fd = open(j->part, O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (j->fd == -1) {
+		logit(LOG_ERR, "ndjson: %s: %s", j->part, strerror(errno));
+		return (-1);
+	}
+#ifdef HAVE_LIBZ
+	/* A gzip rather than zlib stream */
+	if (j->gzip && deflateInit2(&j->z, j->gzip, Z_DEFLATED, 15 + 16,
+	    8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		logit(LOG_ERR, "ndjson: deflateInit2 failed");
+		close(j->fd);
+		unlink(j->part);
+		j->fd = -1;
+		return (-1);
+	}
+#endif
+	j->started = now->tv_sec;
+	return (0);
+}
+
+/* Write out the formatted flows. Returns 0 or -1 on error */
+static int
+ndjson_flush(struct NDJSON *j, const struct timeval *now)
+{
+	struct iovec iov[NDJSON_CHUNKS];
+	u_int i, n;
+	int r;
+
+	if (j->pending == 0)
+		return (0);
+	n = j->nchunk;
+	if (n < NDJSON_CHUNKS && j->chunk[n].iov_len != 0)
+		n++;
+	/* ndjson_writev() advances the iovecs it is given */
+	memcpy(iov, j->chunk, n * sizeof(*iov));
+
+	r = 0;
+	if (j->fd == -1 && ndjson_open(j, now) == -1)
+		r = -1;
+#ifdef HAVE_LIBZ
+	else if (j->gzip)
+		r = ndjson_deflate(j, iov, n, Z_SYNC_FLUSH);
+#endif
+	else
+		r = ndjson_writev(j, iov, n);
+
+	if (r == -1) {
+		if (j->fd != -1) {
+			logit(LOG_ERR, "ndjson: %s: %s", j->part,
+			    strerror(errno));
+#ifdef HAVE_LIBZ
+			if (j->gzip)
+				deflateEnd(&j->z);
+#endif
+			close(j->fd);
+			unlink(j->part);
+			j->fd = -1;
+		}
+		j->dropped += j->pending;
+	} else {
+		j->flows += j->pending;
+		j->writes++;
+	}
+	for (i = 0; i < n; i++)
+		j->chunk[i].iov_len = 0;
+	j->nchunk = 0;
+	j->pending = 0;
+	return (r);
+}
+
+/* Format a flow into the chunks, writing them out if they are full */
+static int
+ndjson_add(struct NDJSON *j, const struct FLOW *flow,
+    const struct timeval *now)
+{
+	struct iovec *c;
+	int len, r;
+
+	r = 0;
+	for (;;) {
+		c = &j->chunk[j->nchunk];
+		if ((len = es_bulk_format((char *)c->iov_base + c->iov_len,
+		    NDJSON_CHUNK_SIZE - c->iov_len, flow, !flow->interim,
+		    ES_INDEX, ES_DOC_TYPE, now)) != -1)
+			break;
+		if (c->iov_len == 0) {
+			/* Cannot happen: a flow is at most MAX_LEN_ES_BULK */
+			j->dropped++;
+			return (-1);
+		}
+		if (++j->nchunk == NDJSON_CHUNKS && ndjson_flush(j, now) == -1)
+			r = -1;
+	}
+	if (j->pending++ == 0)
+		j->pending_since = now->tv_sec;
+	c->iov_len += len;
+	return (r);
+}
+
+/*
+ * Parse a -j argument, path[,gzip[=level]][,rotate=time][,flush=time],
+ * and set up the output. Files are started by the first write. Returns
+ * NULL, after printing why, if the argument is invalid.
+ */
+struct NDJSON *
+ndjson_setup(const char *spec)
+{
+	struct NDJSON *j;
+	char *copy, *opt, *cp, *ep;
+	const char *dir;
+	long v;
+	u_int i;
+
+	if ((j = calloc(1, sizeof(*j))) == NULL ||
+	    (copy = strdup(spec)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		free(j);
+		return (NULL);
+	}
+	j->fd = -1;
+	j->flush_interval = NDJSON_DEFAULT_FLUSH;
+
+	cp = copy;
+	opt = strsep(&cp, ",");
+	if (*opt == '\0' || strlcpy(j->path, opt, sizeof(j->path)) >=
+	    sizeof(j->path)) {
+		fprintf(stderr, "Invalid NDJSON output path \"%s\"\n", opt);
+		goto fail;
+	}
+	while ((opt = strsep(&cp, ",")) != NULL) {
+		if (strcmp(opt, "gzip") == 0)
+			j->gzip = NDJSON_GZIP_LEVEL;
+		else if (strncmp(opt, "gzip=", 5) == 0) {
+			v = strtol(opt + 5, &ep, 10);
+			if (opt[5] == '\0' || *ep != '\0' || v < 1 || v > 9)
+				goto bad;
+			j->gzip = v;
+		} else if (strncmp(opt, "rotate=", 7) == 0) {
+			if ((v = convtime(opt + 7)) == -1)
+				goto bad;
+			j->rotate_interval = v;
+		} else if (strncmp(opt, "flush=", 6) == 0) {
+			if ((v = convtime(opt + 6)) == -1)
+				goto bad;
+			j->flush_interval = v;
+		} else
+			goto bad;
+	}
+#ifndef HAVE_LIBZ
+	if (j->gzip) {
+		fprintf(stderr, "NDJSON compression requires zlib\n");
+		goto fail;
+	}
+#else
+	if (j->gzip && (j->zbuf = malloc(NDJSON_CHUNK_SIZE)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto fail;
+	}
+#endif
+	for (i = 0; i < NDJSON_CHUNKS; i++) {
+		if ((j->chunk[i].iov_base = malloc(NDJSON_CHUNK_SIZE)) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			goto fail;
+		}
+	}
+
+	/* Catch an unwritable directory now rather than at the first flow */
+	dir = copy;	/* Now just the path */
+	if ((cp = strrchr(dir, '/')) == NULL)
+		dir = ".";
+	else if (cp == dir)
+		dir = "/";
+	else
+		*cp = '\0';
+	if (access(dir, W_OK) == -1) {
+		fprintf(stderr, "NDJSON output directory %s: %s\n", dir,
+		    strerror(errno));
+		goto fail;
+	}
+	free(copy);
+	return (j);
+
+ bad:
+	fprintf(stderr, "Invalid NDJSON output option \"%s\"\n", opt);
+ fail:
+	for (i = 0; i < NDJSON_CHUNKS; i++)
+		free(j->chunk[i].iov_base);
+#ifdef HAVE_LIBZ
+	free(j->zbuf);
+#endif
+	free(copy);
+	free(j);
+	return (NULL);
+}
+
+/*
+ * Format flows for output, writing them out when the chunks are full or
+ * have been held longer than the flush interval, and starting a new file
+ * after the rotation interval. Returns -1 if any flow could not be
+ * written, 0 otherwise.
+ */
+int
+ndjson_write(struct NDJSON *j, struct FLOW **flows, int num_flows,
+    const struct timeval *now)
+{
+	int i, r;
+
+	r = 0;
+	if (j->pending != 0 && j->flush_interval != 0 &&
+	    now->tv_sec - j->pending_since >= j->flush_interval &&
+	    ndjson_flush(j, now) == -1)
+		r = -1;
+	if (j->fd != -1 && j->rotate_interval != 0 &&
+	    now->tv_sec - j->started >= j->rotate_interval) {
+		if (ndjson_flush(j, now) == -1)
+			r = -1;
+		ndjson_close_file(j);
+	}
+	for (i = 0; i < num_flows; i++) {
+		if (ndjson_add(j, flows[i], now) == -1)
+			r = -1;
+	}
+	return (r);
+}
+
+/* Write out what is held and finish the current file */
+void
+ndjson_close(struct NDJSON *j)
+{
+	struct timeval now;
+	u_int i;
+
+	if (j == NULL)
+		return;
+	gettimeofday(&now, NULL);
+	ndjson_flush(j, &now);
+	ndjson_close_file(j);
+	for (i = 0; i < NDJSON_CHUNKS; i++)
+		free(j->chunk[i].iov_base);
+#ifdef HAVE_LIBZ
+	free(j->zbuf);
+#endif
+	free(j);
+}
+
+void
+ndjson_statistics(struct NDJSON *j, FILE *out)
+{
+	fprintf(out, "NDJSON output: %"PRIu64" flows, %"PRIu64" bytes in "
+	    "%"PRIu64" writes, %u files (%"PRIu64" dropped)\n", j->flows,
+	    j->bytes, j->writes, j->file, j->dropped);
+	if (j->fd != -1)
+		fprintf(out, "NDJSON file: %s\n", j->part);
+}
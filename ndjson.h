@@ -0,0 +1,54 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NDJSON_H
+#define _NDJSON_H
+
+#include "common.h"
+
+/*
+ * NDJSON file output (-j): flows in the elasticsearch bulk API format
+ * (see esbulk.h), written to a series of files named
+ * <path>.<YYYYMMDDhhmmss>.<n>.ndjson (.ndjson.gz if compressed) that are
+ * renamed into place once complete, ready to be fed to _bulk.
+ */
+
+/* Flows are formatted into these chunks and written with one writev() */
+#define NDJSON_CHUNK_SIZE	(64 * 1024)
+#define NDJSON_CHUNKS		16
+
+/* Defaults for the -j options */
+#define NDJSON_DEFAULT_FLUSH	10		/* Max seconds output is held */
+#define NDJSON_GZIP_LEVEL	6
+
+struct NDJSON;
+struct FLOW;
+
+struct NDJSON *ndjson_setup(const char *spec);
+int ndjson_write(struct NDJSON *j, struct FLOW **flows, int num_flows,
+    const struct timeval *now);
+void ndjson_close(struct NDJSON *j);
+void ndjson_statistics(struct NDJSON *j, FILE *out);
+
+#endif /* _NDJSON_H */
@@ -26,6 +26,7 @@
 #include "log.h"
 #include "treetype.h"
 #include "softflowd.h"
+#include "export.h"
 
 /*
  * This is the Cisco Netflow(tm) version 1 packet format
@@ -60,41 +61,34 @@ struct NF1_FLOW {
  * Returns number of packets sent or -1 on error
  */
 int
-send_netflow_v1(struct FLOW **flows, int num_flows, int nfsock,
-		u_int16_t ifidx, struct FLOWTRACKPARAMETERS *param,
-		int verbose_flag)
+send_netflow_v1(struct FLOW **flows, int num_flows,
+		struct NETFLOW_TARGET *target, u_int16_t ifidx,
+		struct FLOWTRACKPARAMETERS *param, int verbose_flag)
 {
 	struct timeval now;
 	u_int32_t uptime_ms;
-	u_int8_t packet[NF1_MAXPACKET_SIZE];	/* Maximum allowed packet size (24 flows) */
+	u_int8_t *packet = NULL;
 	struct NF1_HEADER *hdr = NULL;
 	struct NF1_FLOW *flw = NULL;
-	int i, j, offset, num_packets, err;
-	socklen_t errsz;
+	int i, j, offset;
+	struct EXPORT_BATCH batch;
 	struct timeval *system_boot_time = &param->system_boot_time;
-	u_int64_t *flows_exported = &param->flows_exported;
 	
-	gettimeofday(&now, NULL);
+	flowtrack_gettime(param, &now);
 	uptime_ms = timeval_sub_ms(&now, system_boot_time);
 
-	hdr = (struct NF1_HEADER *)packet;
-	for(num_packets = offset = j = i = 0; i < num_flows; i++) {
+	export_batch_begin(&batch, target, param);
+	for (offset = j = i = 0; i < num_flows; i++) {
 		if (j >= NF1_MAXFLOWS - 1) {
 			if (verbose_flag)
 				logit(LOG_DEBUG, "Sending flow packet len = %d", offset);
-			param->records_sent += hdr->flows;
 			hdr->flows = htons(hdr->flows);
-			errsz = sizeof(err);
-			getsockopt(nfsock, SOL_SOCKET, SO_ERROR,
-			    &err, &errsz); /* Clear ICMP errors */
-			if (send(nfsock, packet, (size_t)offset, 0) == -1)
-				return (-1);
-			*flows_exported += j;
+			export_batch_commit(&batch, offset, j, j);
 			j = 0;
-			num_packets++;
 		}
 		if (j == 0) {
-			memset(&packet, '\0', sizeof(packet));
+			packet = export_batch_slot(&batch);
+			hdr = (struct NF1_HEADER *)packet;
 			hdr->version = htons(1);
 			hdr->flows = 0; /* Filled in as we go */
 			hdr->uptime_ms = htonl(uptime_ms);
@@ -104,7 +98,7 @@ send_netflow_v1(struct FLOW **flows, int num_flows, int nfsock,
 		}		
 
 		flw = (struct NF1_FLOW *)(packet + offset);
-		flw->if_index_in = flw->if_index_out = htons(ifidx);
+		flw->if_index_in = flw->if_index_out = htons(flows[i]->if_index);
 
 		/* NetFlow v.1 doesn't do IPv6 */
 		if (flows[i]->af != AF_INET)
@@ -131,7 +125,7 @@ send_netflow_v1(struct FLOW **flows, int num_flows, int nfsock,
 		}
 
 		flw = (struct NF1_FLOW *)(packet + offset);
-		flw->if_index_in = flw->if_index_out = htons(ifidx);
+		flw->if_index_in = flw->if_index_out = htons(flows[i]->if_index);
 		if (flows[i]->octets[1] > 0) {
 			flw->src_ip = flows[i]->addr[1].v4.s_addr;
 			flw->dest_ip = flows[i]->addr[0].v4.s_addr;
@@ -158,16 +152,9 @@ send_netflow_v1(struct FLOW **flows, int num_flows, int nfsock,
 	if (j != 0) {
 		if (verbose_flag)
 			logit(LOG_DEBUG, "Sending flow packet len = %d", offset);
-		param->records_sent += hdr->flows;
 		hdr->flows = htons(hdr->flows);
-		errsz = sizeof(err);
-		getsockopt(nfsock, SOL_SOCKET, SO_ERROR,
-		    &err, &errsz); /* Clear ICMP errors */
-		if (send(nfsock, packet, (size_t)offset, 0) == -1)
-			return (-1);
-		num_packets++;
+		export_batch_commit(&batch, offset, j, j);
 	}
 
-	*flows_exported += j;
-	return (num_packets);
+	return (export_batch_finish(&batch));
 }
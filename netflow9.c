@@ -26,6 +26,7 @@
 #include "log.h"
 #include "treetype.h"
 #include "softflowd.h"
+#include "export.h"
 
 /* Specific IDs */
 #define NF9_TEMPLATE_FLOWSET_ID		0
@@ -235,33 +236,59 @@ struct NF9_SOFTFLOWD_OPTION_TEMPLATE {
 	struct NF9_TEMPLATE_FLOWSET_RECORD r[NF9_SOFTFLOWD_OPTION_TEMPLATE_NRECORDS];
 } __packed;
 
-/* softflowd data flowset types */
-/*struct NF9_SOFTFLOWD_DATA_COMMON {
-	u_int32_t last_switched,
-                  first_switched;
-	u_int32_t bytes,
-                  packets;
-	u_int32_t if_index_in,
-                  if_index_out;
-	u_int16_t src_port,
-                  dst_port;
-	u_int8_t  protocol,
-                  tcp_flags,
-                  ipproto,
-                  tos;
+/*
+ * Record layout of NF9_SOFTFLOWD_DEFAULT_TEMPLATE, which is encoded by a
+ * specialised routine rather than the generic encoder program
+ */
+struct NF9_SOFTFLOWD_DATA_DEFAULT {
+	u_int32_t src_addr, dst_addr;
+	u_int32_t last_switched, first_switched;
+	u_int8_t bytes[8], packets[8];
+	u_int16_t if_index_in, if_index_out;
+	u_int16_t src_port, dst_port;
+	u_int8_t protocol, tcp_flags, ipproto, tos;
 } __packed;
 
+/* Fields of NF9_SOFTFLOWD_DEFAULT_TEMPLATE, in order */
+static const u_int16_t nf9_default_fields[][2] = {
+	{ NF9_IPV4_SRC_ADDR, 4 },	{ NF9_IPV4_DST_ADDR, 4 },
+	{ NF9_LAST_SWITCHED, 4 },	{ NF9_FIRST_SWITCHED, 4 },
+	{ NF9_IN_BYTES, 8 },		{ NF9_IN_PACKETS, 8 },
+	{ NF9_INPUT_SNMP, 2 },		{ NF9_OUTPUT_SNMP, 2 },
+	{ NF9_L4_SRC_PORT, 2 },		{ NF9_L4_DST_PORT, 2 },
+	{ NF9_PROTOCOL, 1 },		{ NF9_TCP_FLAGS, 1 },
+	{ NF9_IP_PROTOCOL_VERSION, 1 },	{ NF9_TOS, 1 },
+};
 
-struct NF9_SOFTFLOWD_DATA_V4 {
-	u_int32_t src_addr, dst_addr;
-	struct NF9_SOFTFLOWD_DATA_COMMON c;
-} __packed;
+/*
+ * A template is compiled into a flat encoder program: one op per field
+ * that carries data, saying where the value lives in struct FLOW for
+ * each direction, how it is converted and where it goes in the record.
+ * Fields that are always zero have no op, records are encoded into
+ * zeroed buffers.
+ */
+enum NF9_ENC_KIND {
+	NF9_ENC_COPY,		/* Already in network order */
+	NF9_ENC_CONST,		/* Constant byte */
+	NF9_ENC_CNT64,		/* 64 bit host counter */
+	NF9_ENC_CNT32,		/* 64 bit host counter, sent as 32 bits */
+	NF9_ENC_CNT16,		/* 64 bit host counter, sent as 16 bits */
+	NF9_ENC_U16,		/* 16 bit host value */
+	NF9_ENC_UPTIME,		/* struct timeval, as ms since boot */
+};
+struct NF9_ENC_OP {
+	u_int8_t kind, width;
+	u_int16_t dst;			/* Offset in record */
+	u_int16_t src[2];		/* Offset in struct FLOW, per direction */
+	u_int8_t value;			/* NF9_ENC_CONST only */
+};
+struct NF9_ENCODER {
+	int fast;			/* Use nf9_encode_default() */
+	u_int nops;
+	u_int reclen[2];		/* Record length, per direction */
+	struct NF9_ENC_OP op[NF9_SOFTFLOWD_MAX_NB_RECORDS];
+};
 
-struct NF9_SOFTFLOWD_DATA_V6 {
-	u_int8_t src_addr[16], dst_addr[16];
-	struct NF9_SOFTFLOWD_DATA_COMMON c;
-} __packed;
-*/
 struct NF9_SOFTFLOWD_OPTION_DATA {
 	struct NF9_FLOWSET_HEADER_COMMON c;
 	u_int32_t scope_ifidx;
@@ -271,13 +298,10 @@ struct NF9_SOFTFLOWD_OPTION_DATA {
 } __packed;
 
 /* Local data: templates and counters */
-#define NF9_SOFTFLOWD_MAX_PACKET_SIZE	        512
 #define NF9_SOFTFLOWD_V4_TEMPLATE_ID	        1024
 #define NF9_SOFTFLOWD_V6_TEMPLATE_ID            2048
 #define NF9_SOFTFLOWD_OPTION_TEMPLATE_ID	256
 
-#define NF9_DEFAULT_TEMPLATE_INTERVAL	16
-
 #define NF9_OPTION_SCOPE_SYSTEM    1
 #define NF9_OPTION_SCOPE_INTERFACE 2
 #define NF9_OPTION_SCOPE_LINECARD  3
@@ -287,27 +311,333 @@ struct NF9_SOFTFLOWD_OPTION_DATA {
 #define NF9_SAMPLING_ALGORITHM_DETERMINISTIC 1
 #define NF9_SAMPLING_ALGORITHM_RANDOM        2
 
-static struct NF9_SOFTFLOWD_TEMPLATE *v4_template = NULL;
-static struct NF9_SOFTFLOWD_TEMPLATE *v6_template = NULL;
-static struct NF9_SOFTFLOWD_OPTION_TEMPLATE *option_template = NULL;
-static struct NF9_SOFTFLOWD_OPTION_DATA *option_data = NULL;
-static int nf9_pkts_until_template = -1;
+/*
+ * Templates by export template number (see export.h). Classes whose
+ * field lists come out the same share one template, nf9_alias[] gives
+ * the number of the template that is actually used.
+ */
+static struct NF9_SOFTFLOWD_TEMPLATE *nf9_templates[EXPORT_NTEMPLATES];
+static struct NF9_ENCODER nf9_encoders[EXPORT_NTEMPLATES];
+static int nf9_alias[EXPORT_NTEMPLATES];
+static int nf9_templates_ready = 0;
+static struct NF9_SOFTFLOWD_OPTION_TEMPLATE option_template;
+static struct NF9_SOFTFLOWD_OPTION_DATA option_data;
+static int nf9_option_ready = 0;
+
+#define FLOW_OFF(f)	offsetof(struct FLOW, f)
+
+static void
+nf9_encoder_add(struct NF9_ENCODER *enc, u_int kind, u_int width,
+    u_int dst, size_t src_in, size_t src_out, u_int8_t value)
+{
+	struct NF9_ENC_OP *op = &enc->op[enc->nops++];
+
+	op->kind = kind;
+	op->width = width;
+	op->dst = dst;
+	op->src[0] = src_in;
+	op->src[1] = src_out;
+	op->value = value;
+}
+
+/* Compile the template for an address family into an encoder program */
+static void
+nf9_compile_template(const struct NF9_SOFTFLOWD_TEMPLATE *t, int af,
+    struct NF9_ENCODER *enc)
+{
+	u_int i, count, len, dst;
+
+	bzero(enc, sizeof(*enc));
+	count = ntohs(t->h.count);
+
+	enc->fast = af == AF_INET && (count == sizeof(nf9_default_fields) /
+	    sizeof(nf9_default_fields[0]));
+	for (dst = i = 0; i < count; i++, dst += len) {
+		len = ntohs(t->r[i].length);
+		if (enc->fast && (ntohs(t->r[i].type) !=
+		    nf9_default_fields[i][0] || len != nf9_default_fields[i][1]))
+			enc->fast = 0;
+
+		switch (ntohs(t->r[i].type)) {
+		case NF9_IN_BYTES:
+			nf9_encoder_add(enc, len == 8 ? NF9_ENC_CNT64 :
+			    NF9_ENC_CNT32, len, dst,
+			    FLOW_OFF(octets[0]), FLOW_OFF(octets[1]), 0);
+			break;
+		case NF9_OUT_BYTES:
+			nf9_encoder_add(enc, len == 8 ? NF9_ENC_CNT64 :
+			    NF9_ENC_CNT32, len, dst,
+			    FLOW_OFF(octets[1]), FLOW_OFF(octets[0]), 0);
+			break;
+		case NF9_IN_PACKETS:
+			nf9_encoder_add(enc, len == 8 ? NF9_ENC_CNT64 :
+			    NF9_ENC_CNT32, len, dst,
+			    FLOW_OFF(packets[0]), FLOW_OFF(packets[1]), 0);
+			break;
+		case NF9_OUT_PKTS:
+			nf9_encoder_add(enc, len == 8 ? NF9_ENC_CNT64 :
+			    NF9_ENC_CNT32, len, dst,
+			    FLOW_OFF(packets[1]), FLOW_OFF(packets[0]), 0);
+			break;
+		case NF9_PROTOCOL:
+			nf9_encoder_add(enc, NF9_ENC_COPY, len, dst,
+			    FLOW_OFF(protocol), FLOW_OFF(protocol), 0);
+			break;
+		case NF9_TOS:
+			nf9_encoder_add(enc, NF9_ENC_COPY, len, dst,
+			    FLOW_OFF(tos[0]), FLOW_OFF(tos[1]), 0);
+			break;
+		case NF9_DST_TOS:
+			nf9_encoder_add(enc, NF9_ENC_COPY, len, dst,
+			    FLOW_OFF(tos[1]), FLOW_OFF(tos[0]), 0);
+			break;
+		case NF9_TCP_FLAGS:
+			nf9_encoder_add(enc, NF9_ENC_COPY, len, dst,
+			    FLOW_OFF(tcp_flags[0]), FLOW_OFF(tcp_flags[1]), 0);
+			break;
+		case NF9_L4_SRC_PORT:
+			nf9_encoder_add(enc, NF9_ENC_COPY, len, dst,
+			    FLOW_OFF(port[0]), FLOW_OFF(port[1]), 0);
+			break;
+		case NF9_L4_DST_PORT:
+			nf9_encoder_add(enc, NF9_ENC_COPY, len, dst,
+			    FLOW_OFF(port[1]), FLOW_OFF(port[0]), 0);
+			break;
+		case NF9_IPV4_SRC_ADDR:
+		case NF9_IPV6_SRC_ADDR:
+			nf9_encoder_add(enc, NF9_ENC_COPY, len, dst,
+			    FLOW_OFF(addr[0]), FLOW_OFF(addr[1]), 0);
+			break;
+		case NF9_IPV4_DST_ADDR:
+		case NF9_IPV6_DST_ADDR:
+			nf9_encoder_add(enc, NF9_ENC_COPY, len, dst,
+			    FLOW_OFF(addr[1]), FLOW_OFF(addr[0]), 0);
+			break;
+		case NF9_SRC_MASK:
+		case NF9_DST_MASK:
+			/* We do not use a mask */
+			nf9_encoder_add(enc, NF9_ENC_CONST, len, dst, 0, 0, 32);
+			break;
+		case NF9_IPV6_SRC_MASK:
+		case NF9_IPV6_DST_MASK:
+			nf9_encoder_add(enc, NF9_ENC_CONST, len, dst, 0, 0, 128);
+			break;
+		case NF9_IP_PROTOCOL_VERSION:
+			nf9_encoder_add(enc, NF9_ENC_CONST, len, dst, 0, 0,
+			    af == AF_INET ? 4 : 6);
+			break;
+		case NF9_IPV6_FLOW_LABEL:
+			/* Low 24 bits of the network order label word */
+			nf9_encoder_add(enc, NF9_ENC_COPY, len, dst,
+			    FLOW_OFF(ip6_flowlabel[0]) + 1,
+			    FLOW_OFF(ip6_flowlabel[1]) + 1, 0);
+			break;
+		case NF9_LAST_SWITCHED:
+			nf9_encoder_add(enc, NF9_ENC_UPTIME, len, dst,
+			    FLOW_OFF(flow_last), FLOW_OFF(flow_last), 0);
+			break;
+		case NF9_FIRST_SWITCHED:
+			nf9_encoder_add(enc, NF9_ENC_UPTIME, len, dst,
+			    FLOW_OFF(flow_start), FLOW_OFF(flow_start), 0);
+			break;
+		case NF9_ICMP_TYPE:
+			/* Type and code are kept in the destination port */
+			nf9_encoder_add(enc, NF9_ENC_COPY, len, dst,
+			    FLOW_OFF(port[1]), FLOW_OFF(port[0]), 0);
+			break;
+		case NF9_INPUT_SNMP:
+		case NF9_OUTPUT_SNMP:
+			nf9_encoder_add(enc, NF9_ENC_U16, len, dst,
+			    FLOW_OFF(if_index), FLOW_OFF(if_index), 0);
+			break;
+		case NF9_SRC_VLAN:
+		case NF9_DST_VLAN:
+			nf9_encoder_add(enc, NF9_ENC_U16, len, dst,
+			    FLOW_OFF(vlanid), FLOW_OFF(vlanid), 0);
+			break;
+		case NF9_TCP_NB_ACK:
+			nf9_encoder_add(enc, NF9_ENC_CNT16, len, dst,
+			    FLOW_OFF(tcp_ack_nb[0]), FLOW_OFF(tcp_ack_nb[1]), 0);
+			break;
+		case NF9_TCP_NB_PUSH:
+			nf9_encoder_add(enc, NF9_ENC_CNT16, len, dst,
+			    FLOW_OFF(tcp_push_nb[0]), FLOW_OFF(tcp_push_nb[1]), 0);
+			break;
+		case NF9_TCP_NB_RESET:
+			nf9_encoder_add(enc, NF9_ENC_CNT16, len, dst,
+			    FLOW_OFF(tcp_reset_nb[0]),
+			    FLOW_OFF(tcp_reset_nb[1]), 0);
+			break;
+		case NF9_TCP_NB_SYN:
+			nf9_encoder_add(enc, NF9_ENC_CNT16, len, dst,
+			    FLOW_OFF(tcp_syn_nb[0]), FLOW_OFF(tcp_syn_nb[1]), 0);
+			break;
+		case NF9_TCP_NB_FIN:
+			nf9_encoder_add(enc, NF9_ENC_CNT16, len, dst,
+			    FLOW_OFF(tcp_fin_nb[0]), FLOW_OFF(tcp_fin_nb[1]), 0);
+			break;
+		default:
+			/* No routing, sampling or MAC data: left zero */
+			break;
+		}
+	}
+	enc->reclen[0] = enc->reclen[1] = dst;
+}
+
+/*
+ * Derive the field list of an export template from the -T template:
+ * address and mask fields become those of the address family, the flow
+ * label is carried only (and always) by IPv6 templates and fields that
+ * cannot apply to the protocol class are dropped. ICMP records carry
+ * the type and code as ICMP_TYPE instead of a destination port.
+ */
+static u_int
+nf9_class_fields(const struct NF9_TEMPLATE_FLOWSET_RECORD *spec, u_int count,
+    int af, int class, struct NF9_TEMPLATE_FLOWSET_RECORD *r)
+{
+	u_int i, j, n, type, len;
+	int v4 = (af == AF_INET);
+	int ports = (class < 0 || class == EXPORT_CLASS_TCP ||
+	    class == EXPORT_CLASS_UDP);
+
+	for (n = i = 0; i < count; i++) {
+		type = ntohs(spec[i].type);
+		len = ntohs(spec[i].length);
+		switch (type) {
+		case NF9_IPV4_SRC_ADDR:
+		case NF9_IPV6_SRC_ADDR:
+			type = v4 ? NF9_IPV4_SRC_ADDR : NF9_IPV6_SRC_ADDR;
+			len = v4 ? 4 : 16;
+			break;
+		case NF9_IPV4_DST_ADDR:
+		case NF9_IPV6_DST_ADDR:
+			type = v4 ? NF9_IPV4_DST_ADDR : NF9_IPV6_DST_ADDR;
+			len = v4 ? 4 : 16;
+			break;
+		case NF9_SRC_MASK:
+		case NF9_IPV6_SRC_MASK:
+			type = v4 ? NF9_SRC_MASK : NF9_IPV6_SRC_MASK;
+			break;
+		case NF9_DST_MASK:
+		case NF9_IPV6_DST_MASK:
+			type = v4 ? NF9_DST_MASK : NF9_IPV6_DST_MASK;
+			break;
+		case NF9_IPV6_FLOW_LABEL:
+			if (v4)
+				continue;
+			break;
+		case NF9_L4_SRC_PORT:
+			if (!ports)
+				continue;
+			break;
+		case NF9_L4_DST_PORT:
+			if (class == EXPORT_CLASS_ICMP)
+				type = NF9_ICMP_TYPE;
+			else if (!ports)
+				continue;
+			break;
+		case NF9_ICMP_TYPE:
+			if (class >= 0 && class != EXPORT_CLASS_ICMP)
+				continue;
+			break;
+		case NF9_TCP_FLAGS:
+		case NF9_TCP_NB_ACK:
+		case NF9_TCP_NB_PUSH:
+		case NF9_TCP_NB_RESET:
+		case NF9_TCP_NB_SYN:
+		case NF9_TCP_NB_FIN:
+			if (class >= 0 && class != EXPORT_CLASS_TCP)
+				continue;
+			break;
+		}
+		/* Both flavours of a field may have been given */
+		for (j = 0; j < n && ntohs(r[j].type) != type; j++)
+			;
+		if (j < n)
+			continue;
+		r[n].type = htons(type);
+		r[n].length = htons(len);
+		n++;
+	}
+	if (!v4 && n < NF9_SOFTFLOWD_MAX_NB_RECORDS) {
+		for (j = 0; j < n && ntohs(r[j].type) != NF9_IPV6_FLOW_LABEL;
+		    j++)
+			;
+		if (j == n) {
+			r[n].type = htons(NF9_IPV6_FLOW_LABEL);
+			r[n].length = htons(3);
+			n++;
+		}
+	}
+	/* Nothing left for this class: fall back to the whole template */
+	if (n == 0 && class >= 0)
+		return (nf9_class_fields(spec, count, af, -1, r));
+	return (n);
+}
+
+static void
+nf9_template_header(struct NF9_SOFTFLOWD_TEMPLATE *t, u_int template_id,
+    u_int count)
+{
+	t->h.c.flowset_id = htons(NF9_TEMPLATE_FLOWSET_ID);
+	t->h.c.length = htons(sizeof(t->h) + count * sizeof(t->r[0]));
+	t->h.template_id = htons(template_id);
+	t->h.count = htons(count);
+}
+
+/* Build export template "t", sharing an earlier one if they are the same */
+static void
+nf9_add_template(int t, const struct NF9_TEMPLATE_FLOWSET_RECORD *spec,
+    u_int count)
+{
+	struct NF9_SOFTFLOWD_TEMPLATE *tmpl;
+	int i, af = EXPORT_TEMPLATE_AF(t);
+	u_int n;
+
+	if ((tmpl = calloc(1, sizeof(*tmpl))) == NULL) {
+		fprintf(stderr, "Out of memory building templates\n");
+		exit(1);
+	}
+	n = nf9_class_fields(spec, count, af, EXPORT_TEMPLATE_CLASS(t),
+	    tmpl->r);
+	for (i = t - EXPORT_TEMPLATE_CLASS(t); i < t; i++) {
+		if (nf9_alias[i] == i &&
+		    ntohs(nf9_templates[i]->h.count) == n &&
+		    memcmp(nf9_templates[i]->r, tmpl->r,
+		    n * sizeof(tmpl->r[0])) == 0)
+			break;
+	}
+	if (i < t) {
+		free(tmpl);
+		nf9_templates[t] = NULL;
+		nf9_alias[t] = i;
+		return;
+	}
+	nf9_template_header(tmpl, EXPORT_TEMPLATE_CLASS(t) +
+	    (af == AF_INET ? NF9_SOFTFLOWD_V4_TEMPLATE_ID :
+	    NF9_SOFTFLOWD_V6_TEMPLATE_ID), n);
+	nf9_templates[t] = tmpl;
+	nf9_alias[t] = t;
+	nf9_compile_template(tmpl, af, &nf9_encoders[t]);
+}
 
-void nf9_init_template(char *str_template)
+/*
+ * Parse a -T template string. The packet and octet counters are sent
+ * with "counter_width" bytes: 4, or 8 for anything else since adaptive
+ * widths are only implemented for IPFIX.
+ */
+void nf9_init_template(char *str_template, u_int counter_width)
 {
+        u_int16_t counter_len = htons(counter_width == 4 ? 4 : 8);
+
         if(strlen(str_template) > NF9_SOFTFLOWD_STRING_TEMPLATE_MAX) {
           fprintf(stderr,"The template has too many characters");
         }
         char str_template_tokenized[NF9_SOFTFLOWD_STRING_TEMPLATE_MAX];
         strncpy(str_template_tokenized,str_template,NF9_SOFTFLOWD_STRING_TEMPLATE_MAX);
 
-        v4_template = malloc(sizeof(struct NF9_SOFTFLOWD_TEMPLATE));
-        v6_template = malloc(sizeof(struct NF9_SOFTFLOWD_TEMPLATE));
-        bzero(v4_template, sizeof(v4_template));
-        bzero(v6_template, sizeof(v6_template));
-
-        int count = 0;
-	v4_template->h.template_id = htons(NF9_SOFTFLOWD_V4_TEMPLATE_ID);
+        struct NF9_TEMPLATE_FLOWSET_RECORD spec[NF9_SOFTFLOWD_MAX_NB_RECORDS];
+        int t, count = 0;
 
         char *pch  = strtok(str_template_tokenized," \t\n\v\f\r");
         while(pch != NULL) {
@@ -316,231 +646,231 @@ void nf9_init_template(char *str_template)
             exit(-1);
           }
           if (strcmp(pch,NF9_STR_IN_BYTES)== 0) {
-	    v4_template->r[count].type = htons(NF9_IN_BYTES);
-	    v4_template->r[count].length = htons(4);//Default value
+	    spec[count].type = htons(NF9_IN_BYTES);
+	    spec[count].length = counter_len;
           } else if (strcmp(pch,NF9_STR_IN_PKTS)== 0) {
-	    v4_template->r[count].type = htons(NF9_IN_PACKETS);
-	    v4_template->r[count].length = htons(4);//Default value
+	    spec[count].type = htons(NF9_IN_PACKETS);
+	    spec[count].length = counter_len;
           /*
            *} else if (strcmp(pch,NF9_STR_FLOWS)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_FLOWS);
-	   *  v4_template->r[count].length = htons(4);//Default value
+	   *  spec[count].type = htons(NF9_FLOWS);
+	   *  spec[count].length = htons(4);//Default value
            */
           } else if (strcmp(pch,NF9_STR_PROTOCOL)== 0) {
-	    v4_template->r[count].type = htons(NF9_PROTOCOL);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_PROTOCOL);
+	    spec[count].length = htons(1);
           } else if (strcmp(pch,NF9_STR_TOS)== 0) {
-	    v4_template->r[count].type = htons(NF9_TOS);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_TOS);
+	    spec[count].length = htons(1);
           } else if (strcmp(pch,NF9_STR_TCP_FLAGS)== 0) {
-	    v4_template->r[count].type = htons(NF9_TCP_FLAGS);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_TCP_FLAGS);
+	    spec[count].length = htons(1);
           } else if (strcmp(pch,NF9_STR_L4_SRC_PORT)== 0) {
-	    v4_template->r[count].type = htons(NF9_L4_SRC_PORT);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_L4_SRC_PORT);
+	    spec[count].length = htons(2);
           } else if (strcmp(pch,NF9_STR_IPV4_SRC_ADDR)== 0) {
-	    v4_template->r[count].type = htons(NF9_IPV4_SRC_ADDR);
-	    v4_template->r[count].length = htons(4);
+	    spec[count].type = htons(NF9_IPV4_SRC_ADDR);
+	    spec[count].length = htons(4);
           } else if (strcmp(pch,NF9_STR_SRC_MASK)== 0) {
-	    v4_template->r[count].type = htons(NF9_SRC_MASK);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_SRC_MASK);
+	    spec[count].length = htons(1);
           } else if (strcmp(pch,NF9_STR_INPUT_SNMP)== 0) {
-	    v4_template->r[count].type = htons(NF9_INPUT_SNMP);
-	    v4_template->r[count].length = htons(2);//Default value
+	    spec[count].type = htons(NF9_INPUT_SNMP);
+	    spec[count].length = htons(2);//Default value
           } else if (strcmp(pch,NF9_STR_L4_DST_PORT)== 0) {
-	    v4_template->r[count].type = htons(NF9_L4_DST_PORT);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_L4_DST_PORT);
+	    spec[count].length = htons(2);
           } else if (strcmp(pch,NF9_STR_IPV4_DST_ADDR)== 0) {
-	    v4_template->r[count].type = htons(NF9_IPV4_DST_ADDR);
-	    v4_template->r[count].length = htons(4);
+	    spec[count].type = htons(NF9_IPV4_DST_ADDR);
+	    spec[count].length = htons(4);
           } else if (strcmp(pch,NF9_STR_DST_MASK)== 0) {
-	    v4_template->r[count].type = htons(NF9_DST_MASK);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_DST_MASK);
+	    spec[count].length = htons(1);
           } else if (strcmp(pch,NF9_STR_OUTPUT_SNMP)== 0) {
-	    v4_template->r[count].type = htons(NF9_OUTPUT_SNMP);
-	    v4_template->r[count].length = htons(2);//Default value
+	    spec[count].type = htons(NF9_OUTPUT_SNMP);
+	    spec[count].length = htons(2);//Default value
           /*
            *} else if (strcmp(pch,NF9_STR_IPV4_NEXT_HOP)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_IPV4_NEXT_HOP);
-	   *  v4_template->r[count].length = htons(4);
+	   *  spec[count].type = htons(NF9_IPV4_NEXT_HOP);
+	   *  spec[count].length = htons(4);
            */
           } else if (strcmp(pch,NF9_STR_SRC_AS)== 0) {
-	    v4_template->r[count].type = htons(NF9_SRC_AS);
-	    v4_template->r[count].length = htons(2);//Default value
+	    spec[count].type = htons(NF9_SRC_AS);
+	    spec[count].length = htons(2);//Default value
           } else if (strcmp(pch,NF9_STR_DST_AS)== 0) {
-	    v4_template->r[count].type = htons(NF9_DST_AS);
-	    v4_template->r[count].length = htons(2);//Default value
+	    spec[count].type = htons(NF9_DST_AS);
+	    spec[count].length = htons(2);//Default value
           /*
            *} else if (strcmp(pch,NF9_STR_BGP_IPV4_NEXT_HOP)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_BGP_IPV4_NEXT_HOP);
-	   *  v4_template->r[count].length = htons(4);
+	   *  spec[count].type = htons(NF9_BGP_IPV4_NEXT_HOP);
+	   *  spec[count].length = htons(4);
            *} else if (strcmp(pch,NF9_STR_MUL_DST_PKTS)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MUL_DST_PKTS);
-	   *  v4_template->r[count].length = htons(4);//Default value
+	   *  spec[count].type = htons(NF9_MUL_DST_PKTS);
+	   *  spec[count].length = htons(4);//Default value
            *} else if (strcmp(pch,NF9_STR_MUL_DST_BYTES)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MUL_DST_BYTES);
-	   *  v4_template->r[count].length = htons(4);//Default value
+	   *  spec[count].type = htons(NF9_MUL_DST_BYTES);
+	   *  spec[count].length = htons(4);//Default value
            */
           } else if (strcmp(pch,NF9_STR_LAST_SWITCHED)== 0) {
-	    v4_template->r[count].type = htons(NF9_LAST_SWITCHED);
-	    v4_template->r[count].length = htons(4);
+	    spec[count].type = htons(NF9_LAST_SWITCHED);
+	    spec[count].length = htons(4);
           } else if (strcmp(pch,NF9_STR_FIRST_SWITCHED)== 0) {
-	    v4_template->r[count].type = htons(NF9_FIRST_SWITCHED);
-	    v4_template->r[count].length = htons(4);
+	    spec[count].type = htons(NF9_FIRST_SWITCHED);
+	    spec[count].length = htons(4);
           } else if (strcmp(pch,NF9_STR_OUT_BYTES)== 0) {
-	    v4_template->r[count].type = htons(NF9_OUT_BYTES);
-	    v4_template->r[count].length = htons(4);//Default value
+	    spec[count].type = htons(NF9_OUT_BYTES);
+	    spec[count].length = counter_len;
           } else if (strcmp(pch,NF9_STR_OUT_PKTS)== 0) {
-	    v4_template->r[count].type = htons(NF9_OUT_PKTS);
-	    v4_template->r[count].length = htons(4);//Default value
+	    spec[count].type = htons(NF9_OUT_PKTS);
+	    spec[count].length = counter_len;
           } else if (strcmp(pch,NF9_STR_IPV6_SRC_ADDR)== 0) {
-	    v4_template->r[count].type = htons(NF9_IPV6_SRC_ADDR);
-	    v4_template->r[count].length = htons(16);
+	    spec[count].type = htons(NF9_IPV6_SRC_ADDR);
+	    spec[count].length = htons(16);
           } else if (strcmp(pch,NF9_STR_IPV6_DST_ADDR)== 0) {
-	    v4_template->r[count].type = htons(NF9_IPV6_DST_ADDR);
-	    v4_template->r[count].length = htons(16);
+	    spec[count].type = htons(NF9_IPV6_DST_ADDR);
+	    spec[count].length = htons(16);
           } else if (strcmp(pch,NF9_STR_IPV6_SRC_MASK)== 0) {
-	    v4_template->r[count].type = htons(NF9_IPV6_SRC_MASK);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_IPV6_SRC_MASK);
+	    spec[count].length = htons(1);
           } else if (strcmp(pch,NF9_STR_IPV6_DST_MASK)== 0) {
-	    v4_template->r[count].type = htons(NF9_IPV6_DST_MASK);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_IPV6_DST_MASK);
+	    spec[count].length = htons(1);
           } else if (strcmp(pch,NF9_STR_IPV6_FLOW_LABEL)== 0) {
-	    v4_template->r[count].type = htons(NF9_IPV6_FLOW_LABEL);
-	    v4_template->r[count].length = htons(3);
+	    spec[count].type = htons(NF9_IPV6_FLOW_LABEL);
+	    spec[count].length = htons(3);
           } else if (strcmp(pch,NF9_STR_ICMP_TYPE)== 0) {
-	    v4_template->r[count].type = htons(NF9_ICMP_TYPE);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_ICMP_TYPE);
+	    spec[count].length = htons(2);
           /*
            *} else if (strcmp(pch,NF9_STR_MUL_IGMP_TYPE)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MUL_IGMP_TYPE);
-	   *  v4_template->r[count].length = htons(2);
+	   *  spec[count].type = htons(NF9_MUL_IGMP_TYPE);
+	   *  spec[count].length = htons(2);
            */
           } else if (strcmp(pch,NF9_STR_SAMPLING_INTERVAL)== 0) {
-	    v4_template->r[count].type = htons(NF9_SAMPLING_INTERVAL);
-	    v4_template->r[count].length = htons(4);
+	    spec[count].type = htons(NF9_SAMPLING_INTERVAL);
+	    spec[count].length = htons(4);
           } else if (strcmp(pch,NF9_STR_SAMPLING_ALGORITHM)== 0) {
-	    v4_template->r[count].type = htons(NF9_SAMPLING_ALGORITHM);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_SAMPLING_ALGORITHM);
+	    spec[count].length = htons(1);
           } else if (strcmp(pch,NF9_STR_FLOW_ACTIVE_TIMEOUT)== 0) {
-	    v4_template->r[count].type = htons(NF9_FLOW_ACTIVE_TIMEOUT);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_FLOW_ACTIVE_TIMEOUT);
+	    spec[count].length = htons(2);
           } else if (strcmp(pch,NF9_STR_FLOW_INACTIVE_TIMEOUT)== 0) {
-	    v4_template->r[count].type = htons(NF9_FLOW_INACTIVE_TIMEOUT);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_FLOW_INACTIVE_TIMEOUT);
+	    spec[count].length = htons(2);
           /*
            *} else if (strcmp(pch,NF9_STR_ENGINE_TYPE)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_ENGINE_TYPE);
-	   *  v4_template->r[count].length = htons(1);
+	   *  spec[count].type = htons(NF9_ENGINE_TYPE);
+	   *  spec[count].length = htons(1);
            *} else if (strcmp(pch,NF9_STR_ENGINE_ID)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_ENGINE_ID);
-	   *  v4_template->r[count].length = htons(1);
+	   *  spec[count].type = htons(NF9_ENGINE_ID);
+	   *  spec[count].length = htons(1);
            */
           } else if (strcmp(pch,NF9_STR_TOTAL_BYTES_EXP)== 0) {
-	    v4_template->r[count].type = htons(NF9_TOTAL_BYTES_EXP);
-	    v4_template->r[count].length = htons(4);//Default value
+	    spec[count].type = htons(NF9_TOTAL_BYTES_EXP);
+	    spec[count].length = htons(4);//Default value
           } else if (strcmp(pch,NF9_STR_TOTAL_PKTS_EXP)== 0) {
-	    v4_template->r[count].type = htons(NF9_TOTAL_PKTS_EXP);
-	    v4_template->r[count].length = htons(4);//Default value
+	    spec[count].type = htons(NF9_TOTAL_PKTS_EXP);
+	    spec[count].length = htons(4);//Default value
           } else if (strcmp(pch,NF9_STR_TOTAL_FLOWS_EXP)== 0) {
-	    v4_template->r[count].type = htons(NF9_TOTAL_FLOWS_EXP);
-	    v4_template->r[count].length = htons(4);//Default value
+	    spec[count].type = htons(NF9_TOTAL_FLOWS_EXP);
+	    spec[count].length = htons(4);//Default value
           /*
            *} else if (strcmp(pch,NF9_STR_MPLS_TOP_LABEL_TYPE)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_TOP_LABEL_TYPE);
-	   *  v4_template->r[count].length = htons(1);
+	   *  spec[count].type = htons(NF9_MPLS_TOP_LABEL_TYPE);
+	   *  spec[count].length = htons(1);
            *} else if (strcmp(pch,NF9_STR_MPLS_TOP_LABEL_IP_ADDR)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_TOP_LABEL_IP_ADDR);
-	   *  v4_template->r[count].length = htons(4);
+	   *  spec[count].type = htons(NF9_MPLS_TOP_LABEL_IP_ADDR);
+	   *  spec[count].length = htons(4);
            *} else if (strcmp(pch,NF9_STR_FLOW_SAMPLER_ID)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_FLOW_SAMPLER_ID);
-	   *  v4_template->r[count].length = htons(1);
+	   *  spec[count].type = htons(NF9_FLOW_SAMPLER_ID);
+	   *  spec[count].length = htons(1);
            *} else if (strcmp(pch,NF9_STR_FLOW_SAMPLER_MODE)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_FLOW_SAMPLER_MODE);
-	   *  v4_template->r[count].length = htons(1);
+	   *  spec[count].type = htons(NF9_FLOW_SAMPLER_MODE);
+	   *  spec[count].length = htons(1);
            *} else if (strcmp(pch,NF9_STR_FLOW_SAMPLER_RANDOM_INTERVAL)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_FLOW_SAMPLER_RANDOM_INTERVAL);
-	   *  v4_template->r[count].length = htons(4);
+	   *  spec[count].type = htons(NF9_FLOW_SAMPLER_RANDOM_INTERVAL);
+	   *  spec[count].length = htons(4);
            */
           } else if (strcmp(pch,NF9_STR_DST_TOS)== 0) {
-	    v4_template->r[count].type = htons(NF9_DST_TOS);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_DST_TOS);
+	    spec[count].length = htons(1);
           } else if (strcmp(pch,NF9_STR_SRC_MAC)== 0) {
-	    v4_template->r[count].type = htons(NF9_SRC_MAC);
-	    v4_template->r[count].length = htons(6);
+	    spec[count].type = htons(NF9_SRC_MAC);
+	    spec[count].length = htons(6);
           } else if (strcmp(pch,NF9_STR_DST_MAC)== 0) {
-	    v4_template->r[count].type = htons(NF9_DST_MAC);
-	    v4_template->r[count].length = htons(6);
+	    spec[count].type = htons(NF9_DST_MAC);
+	    spec[count].length = htons(6);
           } else if (strcmp(pch,NF9_STR_SRC_VLAN)== 0) {
-	    v4_template->r[count].type = htons(NF9_SRC_VLAN);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_SRC_VLAN);
+	    spec[count].length = htons(2);
           } else if (strcmp(pch,NF9_STR_DST_VLAN)== 0) {
-	    v4_template->r[count].type = htons(NF9_DST_VLAN);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_DST_VLAN);
+	    spec[count].length = htons(2);
           } else if (strcmp(pch,NF9_STR_IP_PROTOCOL_VERSION)== 0) {
-	    v4_template->r[count].type = htons(NF9_IP_PROTOCOL_VERSION);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_IP_PROTOCOL_VERSION);
+	    spec[count].length = htons(1);
           } else if (strcmp(pch,NF9_STR_DIRECTION)== 0) {
-	    v4_template->r[count].type = htons(NF9_DIRECTION);
-	    v4_template->r[count].length = htons(1);
+	    spec[count].type = htons(NF9_DIRECTION);
+	    spec[count].length = htons(1);
           /*
            *} else if (strcmp(pch,NF9_STR_IPV6_NEXT_HOP)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_IPV6_NEXT_HOP);
-	   *  v4_template->r[count].length = htons(16);
+	   *  spec[count].type = htons(NF9_IPV6_NEXT_HOP);
+	   *  spec[count].length = htons(16);
            *} else if (strcmp(pch,NF9_STR_BGP_IPV6_NEXT_HOP)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_BGP_IPV6_NEXT_HOP);
-	   *  v4_template->r[count].length = htons(16);
+	   *  spec[count].type = htons(NF9_BGP_IPV6_NEXT_HOP);
+	   *  spec[count].length = htons(16);
            */
           } else if (strcmp(pch,NF9_STR_IPV6_OPTION_HEADERS)== 0) {
-	    v4_template->r[count].type = htons(NF9_IPV6_OPTION_HEADERS);
-	    v4_template->r[count].length = htons(4);
+	    spec[count].type = htons(NF9_IPV6_OPTION_HEADERS);
+	    spec[count].length = htons(4);
           /*
            *} else if (strcmp(pch,NF9_STR_MPLS_LABEL_1)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_LABEL_1);
-	   *  v4_template->r[count].length = htons(3);
+	   *  spec[count].type = htons(NF9_MPLS_LABEL_1);
+	   *  spec[count].length = htons(3);
            *} else if (strcmp(pch,NF9_STR_MPLS_LABEL_2)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_LABEL_2);
-	   *  v4_template->r[count].length = htons(3);
+	   *  spec[count].type = htons(NF9_MPLS_LABEL_2);
+	   *  spec[count].length = htons(3);
            *} else if (strcmp(pch,NF9_STR_MPLS_LABEL_3)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_LABEL_3);
-	   *  v4_template->r[count].length = htons(3);
+	   *  spec[count].type = htons(NF9_MPLS_LABEL_3);
+	   *  spec[count].length = htons(3);
            *} else if (strcmp(pch,NF9_STR_MPLS_LABEL_4)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_LABEL_4);
-	   *  v4_template->r[count].length = htons(3);
+	   *  spec[count].type = htons(NF9_MPLS_LABEL_4);
+	   *  spec[count].length = htons(3);
            *} else if (strcmp(pch,NF9_STR_MPLS_LABEL_5)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_LABEL_5);
-	   *  v4_template->r[count].length = htons(3);
+	   *  spec[count].type = htons(NF9_MPLS_LABEL_5);
+	   *  spec[count].length = htons(3);
            *} else if (strcmp(pch,NF9_STR_MPLS_LABEL_6)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_LABEL_6);
-	   *  v4_template->r[count].length = htons(3);
+	   *  spec[count].type = htons(NF9_MPLS_LABEL_6);
+	   *  spec[count].length = htons(3);
            *} else if (strcmp(pch,NF9_STR_MPLS_LABEL_7)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_LABEL_7);
-	   *  v4_template->r[count].length = htons(3);
+	   *  spec[count].type = htons(NF9_MPLS_LABEL_7);
+	   *  spec[count].length = htons(3);
            *} else if (strcmp(pch,NF9_STR_MPLS_LABEL_8)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_LABEL_8);
-	   *  v4_template->r[count].length = htons(3);
+	   *  spec[count].type = htons(NF9_MPLS_LABEL_8);
+	   *  spec[count].length = htons(3);
            *} else if (strcmp(pch,NF9_STR_MPLS_LABEL_9)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_LABEL_9);
-	   *  v4_template->r[count].length = htons(3);
+	   *  spec[count].type = htons(NF9_MPLS_LABEL_9);
+	   *  spec[count].length = htons(3);
            *} else if (strcmp(pch,NF9_STR_MPLS_LABEL_10)== 0) {
-	   *  v4_template->r[count].type = htons(NF9_MPLS_LABEL_10);
-	   *  v4_template->r[count].length = htons(3);
+	   *  spec[count].type = htons(NF9_MPLS_LABEL_10);
+	   *  spec[count].length = htons(3);
            */
           } else if (strcmp(pch,NF9_STR_TCP_NB_ACK)== 0) {
-	    v4_template->r[count].type = htons(NF9_TCP_NB_ACK);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_TCP_NB_ACK);
+	    spec[count].length = htons(2);
           } else if (strcmp(pch,NF9_STR_TCP_NB_PUSH)== 0) {
-	    v4_template->r[count].type = htons(NF9_TCP_NB_PUSH);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_TCP_NB_PUSH);
+	    spec[count].length = htons(2);
           } else if (strcmp(pch,NF9_STR_TCP_NB_RESET)== 0) {
-	    v4_template->r[count].type = htons(NF9_TCP_NB_RESET);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_TCP_NB_RESET);
+	    spec[count].length = htons(2);
           } else if (strcmp(pch,NF9_STR_TCP_NB_SYN)== 0) {
-	    v4_template->r[count].type = htons(NF9_TCP_NB_SYN);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_TCP_NB_SYN);
+	    spec[count].length = htons(2);
           } else if (strcmp(pch,NF9_STR_TCP_NB_FIN)== 0) {
-	    v4_template->r[count].type = htons(NF9_TCP_NB_FIN);
-	    v4_template->r[count].length = htons(2);
+	    spec[count].type = htons(NF9_TCP_NB_FIN);
+	    spec[count].length = htons(2);
           } else {
             fprintf(stderr,"Malformed template. %s is not a valid field type !\n",pch);
             exit(1);
@@ -550,384 +880,143 @@ void nf9_init_template(char *str_template)
           pch = strtok(NULL," \t\n\v\f\r");
         }
 
-	v4_template->h.c.flowset_id = htons(NF9_TEMPLATE_FLOWSET_ID);
-	v4_template->h.c.length = htons(count*4+4);
-        v4_template->h.template_id = htons(NF9_SOFTFLOWD_V4_TEMPLATE_ID);
-        v4_template->h.count = htons(count);
-
-        /*TODO: v6_template */
+	for (t = 0; t < EXPORT_NTEMPLATES; t++) {
+		free(nf9_templates[t]);
+		nf9_add_template(t, spec, count);
+	}
+	nf9_templates_ready = 1;
 }
 
 static void
 nf9_init_option( u_int16_t ifidx,
                  struct OPTION *option) {
-        option_template = malloc(sizeof(struct NF9_SOFTFLOWD_OPTION_TEMPLATE));
-        option_template = malloc(sizeof(struct NF9_SOFTFLOWD_OPTION_DATA));
-
 	bzero(&option_template, sizeof(option_template));
-	option_template->h.c.flowset_id = htons(NF9_OPTIONS_FLOWSET_ID);
-	option_template->h.c.length = htons(sizeof(option_template));
-	option_template->h.template_id = htons(NF9_SOFTFLOWD_OPTION_TEMPLATE_ID);
-	option_template->h.scope_length = htons(sizeof(option_template->s));
-	option_template->h.option_length = htons(sizeof(option_template->r));
-	option_template->s[0].type = htons(NF9_OPTION_SCOPE_INTERFACE);
-	option_template->s[0].length = htons(sizeof(option_data->scope_ifidx));
-	option_template->r[0].type = htons(NF9_SAMPLING_INTERVAL);
-	option_template->r[0].length = htons(sizeof(option_data->sampling_interval));
-	option_template->r[1].type = htons(NF9_SAMPLING_ALGORITHM);
-	option_template->r[1].length = htons(sizeof(option_data->sampling_algorithm));
+	option_template.h.c.flowset_id = htons(NF9_OPTIONS_FLOWSET_ID);
+	option_template.h.c.length = htons(sizeof(option_template));
+	option_template.h.template_id = htons(NF9_SOFTFLOWD_OPTION_TEMPLATE_ID);
+	option_template.h.scope_length = htons(sizeof(option_template.s));
+	option_template.h.option_length = htons(sizeof(option_template.r));
+	option_template.s[0].type = htons(NF9_OPTION_SCOPE_INTERFACE);
+	option_template.s[0].length = htons(sizeof(option_data.scope_ifidx));
+	option_template.r[0].type = htons(NF9_SAMPLING_INTERVAL);
+	option_template.r[0].length = htons(sizeof(option_data.sampling_interval));
+	option_template.r[1].type = htons(NF9_SAMPLING_ALGORITHM);
+	option_template.r[1].length = htons(sizeof(option_data.sampling_algorithm));
 
 	bzero(&option_data, sizeof(option_data));
-	option_data->c.flowset_id = htons(NF9_SOFTFLOWD_OPTION_TEMPLATE_ID);
-	option_data->c.length = htons(sizeof(option_data));
-	option_data->scope_ifidx = htonl(ifidx);
-	option_data->sampling_interval = htonl(option->sample);
-	option_data->sampling_algorithm = NF9_SAMPLING_ALGORITHM_DETERMINISTIC;
+	option_data.c.flowset_id = htons(NF9_SOFTFLOWD_OPTION_TEMPLATE_ID);
+	option_data.c.length = htons(sizeof(option_data));
+	option_data.scope_ifidx = htonl(ifidx);
+	option_data.sampling_interval = htonl(option->sample);
+	/* NetFlow v9 has no code for hash sampling; it looks random */
+	option_data.sampling_algorithm =
+	    option->sample_algorithm == SAMPLE_DETERMINISTIC ?
+	    NF9_SAMPLING_ALGORITHM_DETERMINISTIC :
+	    NF9_SAMPLING_ALGORITHM_RANDOM;
+	nf9_option_ready = 1;
 }
 
 
 
 
-/* copy the flows into the packet */
-static int
-nf_flow_to_flowset( const struct FLOW *flow,
-                    u_char *packet,
-                    u_int len,
-                    u_int16_t ifidx,
-                    const struct timeval *system_boot_time,
-                    u_int *len_used) {
-
-        char buffer_in[512];
-        char buffer_out[512];
-        int offset = 0;
-        int i;
-        for(i=0; i<ntohs(v4_template->h.count);i++) {
-          switch(ntohs(v4_template->r[i].type)) {
-            case NF9_IN_BYTES                    :
-              *((int*)(buffer_in  + offset)) = htonl(flow->octets[0]);
-	      *((int*)(buffer_out + offset)) = htonl(flow->octets[1]);
-              break;
-            case NF9_IN_PACKETS                  :
-              *((int*)(buffer_in  + offset)) = htonl(flow->packets[0]);
-	      *((int*)(buffer_out + offset)) = htonl(flow->packets[1]);
-              break;
-            case NF9_FLOWS                       : //TODO
-              break;
-            case NF9_PROTOCOL                    :
-              *(buffer_in  + offset) = flow->protocol;
-	      *(buffer_out + offset) = flow->protocol;
-                break;
-            case NF9_TOS                         :
-              *(buffer_in  + offset) = flow->tos[0];
-	      *(buffer_out + offset) = flow->tos[1];
-              break;
-            case NF9_TCP_FLAGS                   :
-              *(buffer_in  + offset) = flow->tcp_flags[0];
-	      *(buffer_out + offset) = flow->tcp_flags[1];
-              break;
-            case NF9_L4_SRC_PORT                 :
-              *((short*)(buffer_in  + offset)) = flow->port[0];
-              *((short*)(buffer_out + offset)) = flow->port[1];
-              break;
-            case NF9_IPV4_SRC_ADDR               :
-              if(flow->af == AF_INET) {
-                memcpy(buffer_in  + offset, &flow->addr[0].v4, 4);
-	        memcpy(buffer_out + offset, &flow->addr[1].v4, 4);
-              } else {
-                bzero(buffer_in  + offset, 4);
-                bzero(buffer_out + offset, 4);
-              }
-              break;
-            case NF9_SRC_MASK                    : //We do not use a mask
-              *(buffer_in  + offset) = 32;
-              *(buffer_out + offset) = 32;
-              break;
-            case NF9_INPUT_SNMP                  : //No routing
-              bzero(buffer_in  + offset, 2);
-              bzero(buffer_out + offset, 2);
-              break;
-            case NF9_L4_DST_PORT                 :
-              *((short*)(buffer_in  + offset)) = flow->port[1];
-              *((short*)(buffer_out + offset)) = flow->port[0];
-              break;
-            case NF9_IPV4_DST_ADDR               :
-              if(flow->af == AF_INET) {
-	        memcpy(buffer_in + offset,  &flow->addr[1].v4, 4);
-	        memcpy(buffer_out + offset, &flow->addr[0].v4, 4);
-              } else {
-                bzero(buffer_in  + offset, 4);
-                bzero(buffer_out + offset, 4);
-              }
-              break;
-            case NF9_DST_MASK                    : //We do not use a mask
-              *(buffer_in  + offset) = 32;
-              *(buffer_out + offset) = 32;
-              break;
-            case NF9_OUTPUT_SNMP                 : //No routing
-              bzero(buffer_in  + offset, 2);
-              bzero(buffer_out + offset, 2);
-              break;
-            case NF9_IPV4_NEXT_HOP               : //No routing
-              bzero(buffer_in  + offset, 4);
-              bzero(buffer_out + offset, 4);
-              break;
-            case NF9_SRC_AS                      : //No routing
-              bzero(buffer_in  + offset, 2);
-              bzero(buffer_out + offset, 2);
-              break;
-            case NF9_DST_AS                      :
-              bzero(buffer_in  + offset, 2);
-              bzero(buffer_out + offset, 2);
-              break;
-            case NF9_BGP_IPV4_NEXT_HOP           : //No routing
-              break;
-            case NF9_MUL_DST_PKTS                : //No multicast
-              break;
-            case NF9_MUL_DST_BYTES               : //No multicast
-              break;
-            case NF9_LAST_SWITCHED               :
-	      *((int*)(buffer_in  + offset)) = htonl(timeval_sub_ms(&flow->flow_last, system_boot_time));
-	      *((int*)(buffer_out + offset)) = htonl(timeval_sub_ms(&flow->flow_last, system_boot_time));
-              break;
-            case NF9_FIRST_SWITCHED              :
-	      *((int*)(buffer_in  + offset)) = htonl(timeval_sub_ms(&flow->flow_start, system_boot_time));
-	      *((int*)(buffer_out + offset)) = htonl(timeval_sub_ms(&flow->flow_start, system_boot_time));
-              break;
-            case NF9_OUT_BYTES                   :
-              *((int*)(buffer_in  + offset)) = htonl(flow->octets[1]);
-	      *((int*)(buffer_out + offset)) = htonl(flow->octets[0]);
-              break;
-            case NF9_OUT_PKTS                    :
-              *((int*)(buffer_in  + offset)) = htonl(flow->packets[1]);
-	      *((int*)(buffer_out + offset)) = htonl(flow->packets[0]);
-              break;
-            case NF9_IPV6_SRC_ADDR               :
-	      memcpy(buffer_in + offset,  &flow->addr[0].v6, 16);
-	      memcpy(buffer_out + offset, &flow->addr[1].v6, 16);
-              break;
-            case NF9_IPV6_DST_ADDR               :
-	      memcpy(buffer_in + offset,  &flow->addr[1].v6, 16);
-	      memcpy(buffer_out + offset, &flow->addr[0].v6, 16);
-              break;
-            case NF9_IPV6_SRC_MASK               :
-              *(buffer_in  + offset) = 128;
-              *(buffer_out + offset) = 128;
-              break;
-            case NF9_IPV6_DST_MASK               :
-              *(buffer_in  + offset) = 128;
-              *(buffer_out + offset) = 128;
-              break;
-            case NF9_IPV6_FLOW_LABEL             :
-              *((int*)(buffer_in  + offset)) = flow->ip6_flowlabel[0];
-              *((int*)(buffer_out + offset)) = flow->ip6_flowlabel[1];
-              break;
-            case NF9_ICMP_TYPE                   : //TODO
-              bzero(buffer_in  + offset, 2);
-              bzero(buffer_out + offset, 2);
-              break;
-            case NF9_MUL_IGMP_TYPE               :
-              break;
-            case NF9_SAMPLING_INTERVAL           : //TODO
-              bzero(buffer_in  + offset, 4);
-              bzero(buffer_out + offset, 4);
-              break;
-            case NF9_SAMPLING_ALGORITHM          : //TODO
-              *(buffer_in  + offset)  = 0;
-              *(buffer_out + offset)  = 0;
-              break;
-            case NF9_FLOW_ACTIVE_TIMEOUT         : //TODO
-              bzero(buffer_in  + offset, 2);
-              bzero(buffer_out + offset, 2);
-              break;
-            case NF9_FLOW_INACTIVE_TIMEOUT       : //TODO
-              bzero(buffer_in  + offset, 2);
-              bzero(buffer_out + offset, 2);
-              break;
-            case NF9_ENGINE_TYPE                 :
-              break;
-            case NF9_ENGINE_ID                   :
-              break;
-            case NF9_TOTAL_BYTES_EXP             :
-              bzero(buffer_in  + offset, 4);
-              bzero(buffer_out + offset, 4);
-              break;
-            case NF9_TOTAL_PKTS_EXP              :
-              bzero(buffer_in  + offset, 4);
-              bzero(buffer_out + offset, 4);
-              break;
-            case NF9_TOTAL_FLOWS_EXP             :
-              bzero(buffer_in  + offset, 4);
-              bzero(buffer_out + offset, 4);
-              break;
-            case NF9_MPLS_TOP_LABEL_TYPE         :
-              break;
-            case NF9_MPLS_TOP_LABEL_IP_ADDR      :
-              break;
-            case NF9_FLOW_SAMPLER_ID             :
-              break;
-            case NF9_FLOW_SAMPLER_MODE           :
-              break;
-            case NF9_FLOW_SAMPLER_RANDOM_INTERVAL:
-              break;
-            case NF9_DST_TOS		         :
-              *(buffer_in  + offset) = flow->tos[1];
-	      *(buffer_out + offset) = flow->tos[0];
-              break;
-            case NF9_SRC_MAC			 : //TODO
-              bzero(buffer_in  + offset, 6);
-              bzero(buffer_out + offset, 6);
-              break;
-            case NF9_DST_MAC		   	 : //TODO
-              bzero(buffer_in  + offset, 6);
-              bzero(buffer_out + offset, 6);
-              break;
-            case NF9_SRC_VLAN			 :
-              *((short*)(buffer_in  + offset)) = htons(flow->vlanid);
-	      *((short*)(buffer_out + offset)) = htons(flow->vlanid);
-              break;
-            case NF9_DST_VLAN			 :
-              *((short*)(buffer_in  + offset)) = htons(flow->vlanid);
-	      *((short*)(buffer_out + offset)) = htons(flow->vlanid);
-              break;
-            case NF9_IP_PROTOCOL_VERSION	 :
-              *(buffer_in  + offset)  = 4;
-              *(buffer_out + offset)  = 4;
-              break;
-            case NF9_DIRECTION			 :
-              *(buffer_in  + offset)  = 0;
-              *(buffer_out + offset)  = 0;
-              break;
-            case NF9_IPV6_NEXT_HOP	         : //No routing
-              break;
-            case NF9_BGP_IPV6_NEXT_HOP	         :
-              break;
-            case NF9_IPV6_OPTION_HEADERS         :
-              bzero(buffer_in  + offset, 4);
-              bzero(buffer_out + offset, 4);
-              break;
-            case NF9_MPLS_LABEL_1                :
-              break;
-            case NF9_MPLS_LABEL_2                :
-              break;
-            case NF9_MPLS_LABEL_3                :
-              break;
-            case NF9_MPLS_LABEL_4                :
-              break;
-            case NF9_MPLS_LABEL_5                :
-              break;
-            case NF9_MPLS_LABEL_6                :
-              break;
-            case NF9_MPLS_LABEL_7                :
-              break;
-            case NF9_MPLS_LABEL_8                :
-              break;
-            case NF9_MPLS_LABEL_9                :
-              break;
-            case NF9_MPLS_LABEL_10               :
-              break;
-            case NF9_TCP_NB_ACK                  :
-              *((short*)(buffer_in  + offset)) = htons(flow->tcp_ack_nb[0]);
-              *((short*)(buffer_out + offset)) = htons(flow->tcp_ack_nb[1]);
-              break;
-            case NF9_TCP_NB_PUSH                 :
-              *((short*)(buffer_in  + offset)) = htons(flow->tcp_push_nb[0]);
-              *((short*)(buffer_out + offset)) = htons(flow->tcp_push_nb[1]);
-              break;
-            case NF9_TCP_NB_RESET                :
-              *((short*)(buffer_in  + offset)) = htons(flow->tcp_reset_nb[0]);
-              *((short*)(buffer_out + offset)) = htons(flow->tcp_reset_nb[1]);
-              break;
-            case NF9_TCP_NB_SYN                  :
-              *((short*)(buffer_in  + offset)) = htons(flow->tcp_syn_nb[0]);
-              *((short*)(buffer_out + offset)) = htons(flow->tcp_syn_nb[1]);
-              break;
-            case NF9_TCP_NB_FIN                :
-              *((short*)(buffer_in  + offset)) = htons(flow->tcp_fin_nb[0]);
-              *((short*)(buffer_out + offset)) = htons(flow->tcp_fin_nb[1]);
-              break;
-          }
-          offset += ntohs(v4_template->r[i].length);
-        }
-
-
-
-        /*if(flow->af == AF_INET6) {
-          return 0;
-        }
-
-
-
-	union {
-		struct NF9_SOFTFLOWD_DATA_V4 d4;
-		struct NF9_SOFTFLOWD_DATA_V6 d6;
-	} d[2];
-	struct NF9_SOFTFLOWD_DATA_COMMON *dc[2];
-
+/* Run the encoder program for one direction of a flow */
+static void
+nf9_encode(const struct NF9_ENCODER *enc, const struct FLOW *flow, int dir,
+    u_char *rec, const struct timeval *system_boot_time)
+{
+	const struct NF9_ENC_OP *op;
+	const u_char *src;
+	u_int32_t v32;
+	u_int16_t v16;
+	u_int i;
+
+	for (i = 0; i < enc->nops; i++) {
+		op = &enc->op[i];
+		src = (const u_char *)flow + op->src[dir];
+		switch (op->kind) {
+		case NF9_ENC_COPY:
+			memcpy(rec + op->dst, src, op->width);
+			break;
+		case NF9_ENC_CONST:
+			rec[op->dst] = op->value;
+			break;
+		case NF9_ENC_CNT64:
+			export_put_counter(rec + op->dst,
+			    *(const u_int64_t *)src, 8);
+			break;
+		case NF9_ENC_CNT32:
+			v32 = htonl(*(const u_int64_t *)src);
+			memcpy(rec + op->dst, &v32, 4);
+			break;
+		case NF9_ENC_CNT16:
+			v16 = htons(*(const u_int64_t *)src);
+			memcpy(rec + op->dst, &v16, 2);
+			break;
+		case NF9_ENC_U16:
+			v16 = htons(*(const u_int16_t *)src);
+			memcpy(rec + op->dst, &v16, 2);
+			break;
+		case NF9_ENC_UPTIME:
+			v32 = htonl(timeval_sub_ms((const struct timeval *)src,
+			    system_boot_time));
+			memcpy(rec + op->dst, &v32, 4);
+			break;
+		}
+	}
+}
 
-	u_int freclen, ret_len, nflows;
+/* Specialised encoder for NF9_SOFTFLOWD_DEFAULT_TEMPLATE */
+static void
+nf9_encode_default(const struct FLOW *flow, int dir, u_char *rec,
+    const struct timeval *system_boot_time)
+{
+	struct NF9_SOFTFLOWD_DATA_DEFAULT d;
+
+	bzero(&d, sizeof(d));
+	d.src_addr = flow->addr[dir].v4.s_addr;
+	d.dst_addr = flow->addr[dir ^ 1].v4.s_addr;
+	d.last_switched = htonl(timeval_sub_ms(&flow->flow_last,
+	    system_boot_time));
+	d.first_switched = htonl(timeval_sub_ms(&flow->flow_start,
+	    system_boot_time));
+	export_put_counter(d.bytes, flow->octets[dir], sizeof(d.bytes));
+	export_put_counter(d.packets, flow->packets[dir], sizeof(d.packets));
+	d.if_index_in = d.if_index_out = htons(flow->if_index);
+	d.src_port = flow->port[dir];
+	d.dst_port = flow->port[dir ^ 1];
+	d.protocol = flow->protocol;
+	d.tcp_flags = flow->tcp_flags[dir];
+	d.ipproto = 4;
+	d.tos = flow->tos[dir];
+	memcpy(rec, &d, sizeof(d));
+}
 
-	bzero(d, sizeof(d));
-	*len_used = nflows = ret_len = 0;
-	switch (flow->af) {
-	case AF_INET:
-		freclen = sizeof(struct NF9_SOFTFLOWD_DATA_V4);
-		memcpy(&d[0].d4.src_addr, &flow->addr[0].v4, 4);
-		memcpy(&d[0].d4.dst_addr, &flow->addr[1].v4, 4);
-		memcpy(&d[1].d4.src_addr, &flow->addr[1].v4, 4);
-		memcpy(&d[1].d4.dst_addr, &flow->addr[0].v4, 4);
-		dc[0] = &d[0].d4.c;
-		dc[1] = &d[1].d4.c;
-		dc[0]->ipproto = dc[1]->ipproto = 4;
-		break;
-	case AF_INET6:
-		freclen = sizeof(struct NF9_SOFTFLOWD_DATA_V6);
-		memcpy(&d[0].d6.src_addr, &flow->addr[0].v6, 16);
-		memcpy(&d[0].d6.dst_addr, &flow->addr[1].v6, 16);
-		memcpy(&d[1].d6.src_addr, &flow->addr[1].v6, 16);
-		memcpy(&d[1].d6.dst_addr, &flow->addr[0].v6, 16);
-		dc[0] = &d[0].d6.c;
-		dc[1] = &d[1].d6.c;
-		dc[0]->ipproto = dc[1]->ipproto = 6;
-		break;
-	default:
-		return (-1);
-	}
+/*
+ * Copy the flows into the packet, which must be zeroed. Returns the
+ * number of records written or -1 if they do not fit.
+ */
+static int
+nf_flow_to_flowset(const struct FLOW *flow, u_char *packet, u_int len,
+    u_int16_t ifidx, const struct timeval *system_boot_time, u_int *len_used)
+{
+	const struct NF9_ENCODER *enc;
+	u_int ret_len, nflows;
+	int dir;
 
-	dc[0]->first_switched = dc[1]->first_switched =
-	    htonl(timeval_sub_ms(&flow->flow_start, system_boot_time));
-	dc[0]->last_switched = dc[1]->last_switched =
-	    htonl(timeval_sub_ms(&flow->flow_last, system_boot_time));
-	dc[0]->bytes = htonl(flow->octets[0]);
-	dc[1]->bytes = htonl(flow->octets[1]);
-	dc[0]->packets = htonl(flow->packets[0]);
-	dc[1]->packets = htonl(flow->packets[1]);
-	dc[0]->if_index_in = dc[0]->if_index_out = htonl(ifidx);
-	dc[1]->if_index_in = dc[1]->if_index_out = htonl(ifidx);
-	dc[0]->src_port = dc[1]->dst_port = flow->port[0];
-	dc[1]->src_port = dc[0]->dst_port = flow->port[1];
-	dc[0]->protocol = dc[1]->protocol = flow->protocol;
-	dc[0]->tcp_flags = flow->tcp_flags[0];
-	dc[1]->tcp_flags = flow->tcp_flags[1];
-	dc[0]->tos = flow->tos[0];
-	dc[1]->tos = flow->tos[1];
-
-        */
-
-
-	u_int freclen, ret_len, nflows;
 	*len_used = nflows = ret_len = 0;
-        if (flow->octets[0] > 0) {
-		if (ret_len + offset > len)
-			return (-1);
-		memcpy(packet + ret_len, buffer_in, offset);
-		ret_len += offset;
-		nflows++;
-	}
-	if (flow->octets[1] > 0) {
-		if (ret_len + offset > len)
+	enc = &nf9_encoders[nf9_alias[export_flow_template(flow)]];
+	for (dir = 0; dir < 2; dir++) {
+		if (flow->octets[dir] == 0)
+			continue;
+		if (ret_len + enc->reclen[dir] > len)
 			return (-1);
-		memcpy(packet + ret_len, buffer_out, offset);
-		ret_len += offset;
+		if (enc->fast)
+			nf9_encode_default(flow, dir, packet + ret_len,
+			    system_boot_time);
+		else
+			nf9_encode(enc, flow, dir, packet + ret_len,
+			    system_boot_time);
+		ret_len += enc->reclen[dir];
 		nflows++;
 	}
 
@@ -936,23 +1025,6 @@ nf_flow_to_flowset( const struct FLOW *flow,
 	return (nflows);
 }
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
 /*
  * Given an array of expired flows, send netflow v9 report packets
  * Returns number of packets sent or -1 on error
@@ -960,7 +1032,7 @@ nf_flow_to_flowset( const struct FLOW *flow,
 int
 send_netflow_v9(  struct FLOW **flows,
                   int num_flows,
-                  int nfsock,
+                  struct NETFLOW_TARGET *target,
 		  u_int16_t ifidx,
                   struct FLOWTRACKPARAMETERS *param,
 		  int verbose_flag)
@@ -968,69 +1040,60 @@ send_netflow_v9(  struct FLOW **flows,
 	struct NF9_HEADER *nf9;
 	struct NF9_DATA_FLOWSET_HEADER *dh;
 	struct timeval now;
-	u_int offset, last_af, i, j, num_packets, inc, last_valid;
-	socklen_t errsz;
-	int err, r;
-	u_char packet[NF9_SOFTFLOWD_MAX_PACKET_SIZE];
+	u_int offset, i, j, inc, last_valid, records, tlen;
+	int r, t, last_t;
+	struct NF9_SOFTFLOWD_TEMPLATE *tmpl;
+	u_char *packet;
+	struct EXPORT_BATCH batch;
 	struct timeval *system_boot_time = &param->system_boot_time;
-	u_int64_t *flows_exported = &param->flows_exported;
-	u_int64_t *packets_sent = &param->packets_sent;
 	struct OPTION *option = &param->option;
+	struct TEMPLATE_STATE *ts = &target->tmpl;
 
-	gettimeofday(&now, NULL);
+	flowtrack_gettime(param, &now);
 
-	if (nf9_pkts_until_template == -1) {
-                if(v4_template == NULL || v6_template == NULL) {
-                        nf9_init_template(NF9_SOFTFLOWD_DEFAULT_TEMPLATE);
-                }
-		nf9_pkts_until_template = 0;
-		if (option != NULL && option->sample > 1 && option_template == NULL) {
-			nf9_init_option(ifidx, option);
-		}
+	if (!nf9_templates_ready) {
+		nf9_init_template(NF9_SOFTFLOWD_DEFAULT_TEMPLATE,
+		    param->counter_width);
+	}
+	if (option != NULL && option->sample > 1 && !nf9_option_ready) {
+		nf9_init_option(ifidx, option);
 	}
 
-	last_valid = num_packets = 0;
+	flows = export_group_flows(flows, num_flows, export_flow_template,
+	    EXPORT_NTEMPLATES);
+
+	last_valid = 0;
+	export_batch_begin(&batch, target, param);
 	for (j = 0; j < num_flows;) {
-		bzero(packet, sizeof(packet));
+		packet = export_batch_slot(&batch);
 		nf9 = (struct NF9_HEADER *)packet;
 
 		nf9->version = htons(9);
 		nf9->flows = 0; /* Filled as we go, htons at end */
 		nf9->uptime_ms = htonl(timeval_sub_ms(&now, system_boot_time));
-		nf9->time_sec = htonl(time(NULL));
+		nf9->time_sec = htonl(now.tv_sec);
 		nf9->source_id = 0;
 		offset = sizeof(*nf9);
 
 		/* Refresh template headers if we need to */
-		if (nf9_pkts_until_template <= 0) {
-			memcpy(packet + offset, &(v4_template->h), sizeof(v4_template->h));
-			offset += sizeof(v4_template->h);
-			memcpy(packet + offset, v4_template->r, ntohs(v4_template->h.count) * 4);
-                        offset += ntohs(v4_template->h.count) * 4;
-                        nf9->flows++;
-
-                        /*memcpy(packet + offset, v6_template,
-			    sizeof(v6_template));
-			offset += sizeof(v6_template);
-			nf9->flows++;*/
+		if (export_template_refresh(ts, param, &now)) {
 			if (option != NULL && option->sample > 1){
-				memcpy(packet + offset, option_template,
+				memcpy(packet + offset, &option_template,
 				       sizeof(option_template));
 				offset += sizeof(option_template);
 				nf9->flows++;
-				memcpy(packet + offset, option_data,
+				memcpy(packet + offset, &option_data,
 				       sizeof(option_data));
 				offset += sizeof(option_data);
 				nf9->flows++;
 			}
-
-			nf9_pkts_until_template = NF9_DEFAULT_TEMPLATE_INTERVAL;
 		}
 
 		dh = NULL;
-		last_af = 0;
+		last_t = -1;
 		for (i = 0; i + j < num_flows; i++) {
-			if (dh == NULL || flows[i + j]->af != last_af) {
+			t = nf9_alias[export_flow_template(flows[i + j])];
+			if (dh == NULL || t != last_t) {
 				if (dh != NULL) {
 					if (offset % 4 != 0) {
 						/* Pad to multiple of 4 */
@@ -1040,18 +1103,30 @@ send_netflow_v9(  struct FLOW **flows,
 					/* Finalise last header */
 					dh->c.length = htons(dh->c.length);
 				}
-				if (offset + sizeof(*dh) > sizeof(packet)) {
+				/*
+				 * A template due in this refresh goes just
+				 * before its first data, with room for a record
+				 */
+				tmpl = nf9_templates[t];
+				tlen = ts->due[t] ? ntohs(tmpl->h.c.length) +
+				    nf9_encoders[t].reclen[0] : 0;
+				if (offset + tlen + sizeof(*dh) >
+				    param->export_packet_size) {
 					/* Mark header is finished */
 					dh = NULL;
 					break;
 				}
+				if (ts->due[t]) {
+					memcpy(packet + offset, tmpl,
+					    ntohs(tmpl->h.c.length));
+					offset += ntohs(tmpl->h.c.length);
+					nf9->flows++;
+					ts->due[t] = 0;
+				}
 				dh = (struct NF9_DATA_FLOWSET_HEADER *)
 				    (packet + offset);
-				dh->c.flowset_id =
-				    (flows[i + j]->af == AF_INET) ?
-				    v4_template->h.template_id :
-				    v6_template->h.template_id;
-				last_af = flows[i + j]->af;
+				dh->c.flowset_id = tmpl->h.template_id;
+				last_t = t;
 				last_valid = offset;
 				dh->c.length = sizeof(*dh); /* Filled as we go */
 				offset += sizeof(*dh);
@@ -1059,7 +1134,7 @@ send_netflow_v9(  struct FLOW **flows,
 
 			r = nf_flow_to_flowset( flows[i + j],
                                                 packet + offset,
-			                        sizeof(packet) - offset,
+			                        param->export_packet_size - offset,
                                                 ifidx,
                                                 system_boot_time,
                                                 &inc);
@@ -1091,30 +1166,17 @@ send_netflow_v9(  struct FLOW **flows,
 			/* Finalise last header */
 			dh->c.length = htons(dh->c.length);
 		}
-		param->records_sent += nf9->flows;
+		records = nf9->flows;
 		nf9->flows = htons(nf9->flows);
-		nf9->package_sequence = htonl((u_int32_t)((*packets_sent + num_packets + 1) & 0x00000000ffffffff));
+		nf9->package_sequence = htonl(++target->sequence);
 
 		if (verbose_flag)
 			logit(LOG_DEBUG, "Sending flow packet len = %d", offset);
-		errsz = sizeof(err);
-		/* Clear ICMP errors */
-		getsockopt(nfsock, SOL_SOCKET, SO_ERROR, &err, &errsz);
-		if (send(nfsock, packet, (size_t)offset, 0) == -1)
-			return (-1);
-		num_packets++;
-		nf9_pkts_until_template--;
+		export_batch_commit(&batch, offset, i, records);
 
 		j += i;
 	}
 
-	*flows_exported += j;
-	return (num_packets);
+	return (export_batch_finish(&batch));
 }
 
-void
-netflow9_resend_template(void)
-{
-	if (nf9_pkts_until_template > 0)
-		nf9_pkts_until_template = 0;
-}
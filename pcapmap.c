@@ -0,0 +1,203 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Memory mapped pcap files, read in place by the parallel workers (-J).
+ * See pcapmap.h.
+ */
+
+#include "common.h"
+#include "pcapmap.h"
+
+#include <sys/mman.h>
+#include <pcap.h>
+
+#define PCAP_MAGIC_USEC		0xa1b2c3d4U
+#define PCAP_MAGIC_NSEC		0xa1b23c4dU
+
+/* Timestamps of consecutive records found by resync may be this far apart */
+#define RESYNC_MAX_STEP		3600
+
+static u_int32_t
+swap32(u_int32_t v)
+{
+	return ((v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) |
+	    (v << 24));
+}
+
+static u_int32_t
+get32(const struct PCAPMAP *pm, size_t off)
+{
+	u_int32_t v;
+
+	memcpy(&v, pm->base + off, sizeof(v));
+	return (pm->swapped ? swap32(v) : v);
+}
+
+/* Map path and check its header. Returns -1, with the reason printed */
+int
+pcapmap_open(struct PCAPMAP *pm, const char *path)
+{
+	struct stat st;
+	u_int32_t magic;
+	int fd;
+
+	memset(pm, '\0', sizeof(*pm));
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return (-1);
+	}
+	if ((size_t)st.st_size < PCAPMAP_HDRLEN) {
+		fprintf(stderr, "%s: too short\n", path);
+		close(fd);
+		return (-1);
+	}
+	pm->len = st.st_size;
+	if ((pm->base = mmap(NULL, pm->len, PROT_READ, MAP_SHARED, fd,
+	    0)) == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s\n", path, strerror(errno));
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+
+	memcpy(&magic, pm->base, sizeof(magic));
+	if (magic == swap32(PCAP_MAGIC_USEC) ||
+	    magic == swap32(PCAP_MAGIC_NSEC)) {
+		pm->swapped = 1;
+		magic = swap32(magic);
+	}
+	if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+		fprintf(stderr, "%s: not a pcap file (pcapng can't be read "
+		    "in parallel)\n", path);
+		pcapmap_close(pm);
+		return (-1);
+	}
+	pm->nsec = magic == PCAP_MAGIC_NSEC;
+	pm->snaplen = get32(pm, 16);
+	return (0);
+}
+
+void
+pcapmap_close(struct PCAPMAP *pm)
+{
+	if (pm->base != NULL)
+		munmap(pm->base, pm->len);
+	pm->base = NULL;
+}
+
+/*
+ * Decode the record at off. Returns the offset of the one after it, or 0
+ * if there is no complete record at off.
+ */
+size_t
+pcapmap_record(const struct PCAPMAP *pm, size_t off, struct pcap_pkthdr *hdr,
+    const u_char **data)
+{
+	u_int32_t frac, caplen;
+
+	if (off + PCAPMAP_RECHDRLEN > pm->len)
+		return (0);
+	caplen = get32(pm, off + 8);
+	if (caplen > PCAPMAP_MAX_CAPLEN ||
+	    caplen > pm->len - off - PCAPMAP_RECHDRLEN)
+		return (0);
+	frac = get32(pm, off + 4);
+	hdr->ts.tv_sec = get32(pm, off);
+	hdr->ts.tv_usec = pm->nsec ? frac / 1000 : frac;
+	hdr->caplen = caplen;
+	hdr->len = get32(pm, off + 12);
+	*data = pm->base + off + PCAPMAP_RECHDRLEN;
+	return (off + PCAPMAP_RECHDRLEN + caplen);
+}
+
+/* Whether off looks like the start of a record; sets its time and end */
+static int
+plausible(const struct PCAPMAP *pm, size_t off, u_int32_t *sec, size_t *next)
+{
+	u_int32_t frac, caplen, len;
+
+	if (off + PCAPMAP_RECHDRLEN > pm->len)
+		return (0);
+	*sec = get32(pm, off);
+	frac = get32(pm, off + 4);
+	caplen = get32(pm, off + 8);
+	len = get32(pm, off + 12);
+	if (frac >= (pm->nsec ? 1000000000U : 1000000U) ||
+	    caplen > len || len > PCAPMAP_MAX_CAPLEN ||
+	    (pm->snaplen != 0 && caplen > pm->snaplen) ||
+	    caplen > pm->len - off - PCAPMAP_RECHDRLEN)
+		return (0);
+	*next = off + PCAPMAP_RECHDRLEN + caplen;
+	return (1);
+}
+
+/*
+ * Find the first record starting in [off, end): the first offset from
+ * which PCAPMAP_RESYNC_RUN plausible headers with close timestamps chain
+ * together, or end the file. Returns end if there is none. This is a
+ * heuristic, so readers must cope with a record being missed.
+ */
+size_t
+pcapmap_resync(const struct PCAPMAP *pm, size_t off, size_t end)
+{
+	u_int32_t sec, prev = 0;
+	size_t p, q, next, limit;
+	int n;
+
+	if (off <= PCAPMAP_HDRLEN)
+		return (MIN(PCAPMAP_HDRLEN, end));
+	/* The record under off ends within this */
+	limit = MIN(end, off + PCAPMAP_RECHDRLEN + PCAPMAP_MAX_CAPLEN);
+	for (p = off; p < limit; p++) {
+		for (n = 0, q = p; n < PCAPMAP_RESYNC_RUN; n++, q = next) {
+			if (n > 0 && q == pm->len)
+				return (p);
+			if (!plausible(pm, q, &sec, &next))
+				break;
+			if (n > 0 && (sec > prev + RESYNC_MAX_STEP ||
+			    prev > sec + RESYNC_MAX_STEP))
+				break;
+			prev = sec;
+		}
+		if (n == PCAPMAP_RESYNC_RUN)
+			return (p);
+	}
+	return (end);
+}
+
+/* Start reading [off, end) in ahead of use */
+void
+pcapmap_prefetch(const struct PCAPMAP *pm, size_t off, size_t end)
+{
+#ifdef MADV_WILLNEED
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+	off -= off % page;
+	if (end > off)
+		madvise(pm->base + off, end - off, MADV_WILLNEED);
+#endif
+}
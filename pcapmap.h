@@ -0,0 +1,59 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PCAPMAP_H
+#define _PCAPMAP_H
+
+#include "common.h"
+
+/*
+ * Direct access to a memory mapped pcap file, for reading one capture
+ * in parallel (-J). Records are decoded in place, and a reader starting
+ * at an arbitrary offset can find the next record by resynchronising on
+ * a run of plausible record headers.
+ */
+
+#define PCAPMAP_HDRLEN		24		/* File header */
+#define PCAPMAP_RECHDRLEN	16		/* Per packet header */
+#define PCAPMAP_MAX_CAPLEN	262144		/* Largest packet accepted */
+#define PCAPMAP_RESYNC_RUN	8		/* Headers that must chain */
+
+struct pcap_pkthdr;
+
+struct PCAPMAP {
+	u_char *base;
+	size_t len;
+	int swapped;			/* Written with the other byte order */
+	int nsec;			/* Nanosecond timestamps */
+	u_int32_t snaplen;
+};
+
+int pcapmap_open(struct PCAPMAP *pm, const char *path);
+void pcapmap_close(struct PCAPMAP *pm);
+size_t pcapmap_record(const struct PCAPMAP *pm, size_t off,
+    struct pcap_pkthdr *hdr, const u_char **data);
+size_t pcapmap_resync(const struct PCAPMAP *pm, size_t off, size_t end);
+void pcapmap_prefetch(const struct PCAPMAP *pm, size_t off, size_t end);
+
+#endif /* _PCAPMAP_H */
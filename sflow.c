@@ -0,0 +1,648 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * sFlow version 5 agent (-S). See sflow.h for an overview and
+ * https://sflow.org/sflow_version_5.txt for the datagram format.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* Needed for sendmmsg() on Linux */
+#endif
+
+#include "common.h"
+#include "log.h"
+#include "convtime.h"
+#include "treetype.h"
+#include "softflowd.h"
+#include "sflow.h"
+
+#include <pcap.h>
+
+/* sFlow structure formats (enterprise 0) */
+#define SFLOW_VERSION			5
+#define SFLOW_ADDRESS_IP_V4		1
+#define SFLOW_ADDRESS_IP_V6		2
+#define SFLOW_FLOW_SAMPLE		1
+#define SFLOW_COUNTERS_SAMPLE		2
+#define SFLOW_FLOW_HEADER		1
+#define SFLOW_FLOW_EX_SWITCH		1001
+#define SFLOW_COUNTERS_GENERIC		1
+
+/* header_protocol values of a sampled header */
+#define SFLOW_HEADER_ETHERNET		1
+#define SFLOW_HEADER_IPV4		11
+#define SFLOW_HEADER_IPV6		12
+
+/* Generic interface counters */
+#define SFLOW_IFTYPE_OTHER		1
+#define SFLOW_IFTYPE_ETHERNET		6
+#define SFLOW_IFSTATUS_UP		3	/* Admin and operational */
+#define SFLOW_COUNTERS_GENERIC_LEN	88
+#define SFLOW_UNKNOWN32			0xffffffffU
+#define SFLOW_UNKNOWN64			0xffffffffffffffffULL
+
+/* Largest datagram header (IPv6 agent) and flow sample */
+#define SFLOW_DATAGRAM_HEADER_MAX	40
+#define SFLOW_FLOW_SAMPLE_MAX		(8 + 32 + 8 + 16 + SFLOW_MAX_HEADER + \
+					 8 + 16)
+
+/* Bytes added to the length of an Ethernet frame for its FCS */
+#define SFLOW_ETHER_FCS			4
+
+/* A data source: one capture interface */
+struct SFLOW_SOURCE {
+	pcap_t *pcap;			/* NULL when reading files */
+	int linktype;
+	u_int32_t ifindex;
+	u_int32_t skip;			/* Packets until the next sample */
+	u_int32_t flow_seq;
+	u_int32_t counter_seq;
+
+	/* Interface counters, kept for every packet seen */
+	u_int64_t pool;
+	u_int64_t in_octets;
+	u_int64_t in_unicast;
+	u_int64_t in_multicast;
+	u_int64_t in_broadcast;
+};
+
+struct SFLOW {
+	char collector[NI_MAXHOST + NI_MAXSERV + 4];
+	u_int rate;			/* Sample 1 in rate packets */
+	u_int header;			/* Max bytes of packet sent */
+	long counter_interval;		/* Seconds between counter samples */
+	int only;			/* Skip flow tracking */
+
+	int fd;
+	struct SFLOW_SOURCE source[MAX_CAPTURES];
+	int num_sources;
+	const struct FLOWTRACKPARAMETERS *param;
+	int agent_af;			/* Agent address, from the socket */
+	u_char agent_addr[16];
+	size_t agent_len;
+
+	/* Datagram ring: datagrams 0 .. cur are queued, cur is open */
+	u_char *buf;
+	size_t len[SFLOW_DATAGRAMS];	/* 0 if not started */
+	u_int32_t samples[SFLOW_DATAGRAMS];
+	u_int cur;
+	struct timeval pending_since;	/* When the ring was started */
+	struct timeval next_counters;
+
+	u_int32_t rnd;			/* xorshift state */
+	u_int32_t datagram_seq;
+	u_int32_t drops;		/* Samples lost with their datagram */
+
+	/* Statistics */
+	u_int64_t packets;		/* Packets seen on all sources */
+	u_int64_t flow_samples;
+	u_int64_t counter_samples;
+	u_int64_t datagrams_sent;
+	u_int64_t datagrams_failed;
+};
+
+#define SFLOW_BUF(s, i)	((s)->buf + (i) * SFLOW_DATAGRAM_SIZE)
+
+/*
+ * XDR encoder. Space is reserved before anything is encoded, so the
+ * put functions don't need to check it.
+ */
+struct XDR {
+	u_char *p;
+};
+
+static inline void
+xdr_put32(struct XDR *x, u_int32_t v)
+{
+	v = htonl(v);
+	memcpy(x->p, &v, sizeof(v));
+	x->p += sizeof(v);
+}
+
+static inline void
+xdr_put64(struct XDR *x, u_int64_t v)
+{
+	xdr_put32(x, v >> 32);
+	xdr_put32(x, v & 0xffffffff);
+}
+
+/* Fixed length opaque data, zero padded to a multiple of four bytes */
+static inline void
+xdr_opaque(struct XDR *x, const void *data, size_t len)
+{
+	memcpy(x->p, data, len);
+	x->p += len;
+	for (; len & 3; len++)
+		*x->p++ = 0;
+}
+
+/* Random skip count with a mean of s->rate */
+static u_int32_t
+sflow_next_skip(struct SFLOW *s)
+{
+	if (s->rate == 1)
+		return (1);
+	s->rnd ^= s->rnd << 13;
+	s->rnd ^= s->rnd >> 17;
+	s->rnd ^= s->rnd << 5;
+	return (1 + s->rnd % (2 * s->rate - 1));
+}
+
+/* Send every queued datagram and empty the ring */
+static void
+sflow_send(struct SFLOW *s)
+{
+	u_int i, n;
+	int r;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[SFLOW_DATAGRAMS];
+	struct iovec iov[SFLOW_DATAGRAMS];
+#endif
+
+	n = s->cur + (s->len[s->cur] != 0);
+	if (n == 0)
+		return;
+
+#ifdef HAVE_SENDMMSG
+	memset(msgs, '\0', sizeof(msgs));
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = SFLOW_BUF(s, i);
+		iov[i].iov_len = s->len[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	for (i = 0; i < n;) {
+		r = sendmmsg(s->fd, msgs + i, n - i, 0);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			/* Drop the datagram that failed and carry on */
+			s->datagrams_failed++;
+			s->drops += s->samples[i];
+			i++;
+			continue;
+		}
+		s->datagrams_sent += r;
+		i += r;
+	}
+#else
+	for (i = 0; i < n; i++) {
+		while ((r = send(s->fd, SFLOW_BUF(s, i), s->len[i], 0)) ==
+		    -1 && errno == EINTR)
+			;
+		if (r == -1) {
+			s->datagrams_failed++;
+			s->drops += s->samples[i];
+		} else
+			s->datagrams_sent++;
+	}
+#endif
+	memset(s->len, '\0', sizeof(s->len));
+	memset(s->samples, '\0', sizeof(s->samples));
+	s->cur = 0;
+}
+
+/*
+ * Reserve space for a sample of up to need bytes, starting a new
+ * datagram (and sending the ring if it is full) as required. Positions
+ * the encoder x where the sample goes.
+ */
+static void
+sflow_reserve(struct SFLOW *s, size_t need, struct XDR *x)
+{
+	struct timeval now;
+
+	if (s->len[s->cur] != 0 &&
+	    s->len[s->cur] + need > SFLOW_DATAGRAM_SIZE) {
+		if (s->cur + 1 == SFLOW_DATAGRAMS)
+			sflow_send(s);
+		else
+			s->cur++;
+	}
+	x->p = SFLOW_BUF(s, s->cur) + s->len[s->cur];
+	if (s->len[s->cur] != 0)
+		return;
+
+	/* Start the datagram; the sample count is filled in as we go */
+	flowtrack_gettime(s->param, &now);
+	if (s->cur == 0)
+		s->pending_since = now;
+	xdr_put32(x, SFLOW_VERSION);
+	xdr_put32(x, s->agent_af == AF_INET6 ?
+	    SFLOW_ADDRESS_IP_V6 : SFLOW_ADDRESS_IP_V4);
+	xdr_opaque(x, s->agent_addr, s->agent_len);
+	xdr_put32(x, 0);				/* sub_agent_id */
+	xdr_put32(x, ++s->datagram_seq);
+	xdr_put32(x, timeval_sub_ms(&now, &s->param->system_boot_time));
+	xdr_put32(x, 0);				/* num_samples */
+	s->len[s->cur] = x->p - SFLOW_BUF(s, s->cur);
+}
+
+/* Queue the sample just encoded up to x */
+static void
+sflow_commit(struct SFLOW *s, const struct XDR *x)
+{
+	u_char *dgram = SFLOW_BUF(s, s->cur);
+	u_int32_t n;
+
+	s->len[s->cur] = x->p - dgram;
+	/* num_samples is the last field of the datagram header */
+	n = htonl(++s->samples[s->cur]);
+	memcpy(dgram + 20 + s->agent_len, &n, sizeof(n));
+}
+
+/*
+ * Count a packet captured on data source src and decide whether to
+ * sample it. Returns 1 if the caller should pass it to sflow_sample().
+ */
+int
+sflow_packet(struct SFLOW *s, int src, const u_char *pkt, u_int caplen,
+    u_int len)
+{
+	static const u_char bcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	struct SFLOW_SOURCE *ds = &s->source[src];
+
+	s->packets++;
+	ds->pool++;
+	ds->in_octets += len;
+	if (ds->linktype == DLT_EN10MB && caplen >= sizeof(bcast) &&
+	    (pkt[0] & 1) != 0) {
+		if (memcmp(pkt, bcast, sizeof(bcast)) == 0)
+			ds->in_broadcast++;
+		else
+			ds->in_multicast++;
+	} else
+		ds->in_unicast++;
+
+	if (--ds->skip != 0)
+		return (0);
+	ds->skip = sflow_next_skip(s);
+	return (1);
+}
+
+/*
+ * Send a flow sample for a packet. l2len, af and vlanid are as found by
+ * datalink_check(); l2len is negative if the packet isn't IP. Ethernet
+ * frames are sent whole, IP packets on other links without their link
+ * layer header.
+ */
+void
+sflow_sample(struct SFLOW *s, int src, const u_char *pkt, u_int caplen,
+    u_int len, int l2len, int af, u_int16_t vlanid)
+{
+	struct SFLOW_SOURCE *ds = &s->source[src];
+	struct XDR x;
+	u_char *sample;
+	u_int32_t proto, frame_len, stripped, hlen;
+
+	if (ds->linktype == DLT_EN10MB) {
+		proto = SFLOW_HEADER_ETHERNET;
+		frame_len = len + SFLOW_ETHER_FCS;
+		stripped = SFLOW_ETHER_FCS;
+	} else if (l2len >= 0 && (u_int)l2len <= caplen) {
+		proto = af == AF_INET6 ? SFLOW_HEADER_IPV6 : SFLOW_HEADER_IPV4;
+		pkt += l2len;
+		caplen -= l2len;
+		frame_len = len - l2len;
+		stripped = l2len;
+	} else {
+		/* Nothing a collector could decode */
+		return;
+	}
+	hlen = MIN(caplen, s->header);
+
+	sflow_reserve(s, SFLOW_FLOW_SAMPLE_MAX, &x);
+	xdr_put32(&x, SFLOW_FLOW_SAMPLE);
+	sample = x.p;
+	xdr_put32(&x, 0);			/* Length, filled in below */
+	xdr_put32(&x, ++ds->flow_seq);
+	xdr_put32(&x, ds->ifindex);		/* source_id: ifIndex */
+	xdr_put32(&x, s->rate);
+	xdr_put32(&x, (u_int32_t)ds->pool);
+	xdr_put32(&x, s->drops);
+	xdr_put32(&x, ds->ifindex);		/* input */
+	xdr_put32(&x, 0);			/* output: unknown */
+	xdr_put32(&x, vlanid != 0 ? 2 : 1);	/* Number of records */
+
+	xdr_put32(&x, SFLOW_FLOW_HEADER);
+	xdr_put32(&x, 16 + ((hlen + 3) & ~3U));
+	xdr_put32(&x, proto);
+	xdr_put32(&x, frame_len);
+	xdr_put32(&x, stripped);
+	xdr_put32(&x, hlen);
+	xdr_opaque(&x, pkt, hlen);
+
+	if (vlanid != 0) {
+		xdr_put32(&x, SFLOW_FLOW_EX_SWITCH);
+		xdr_put32(&x, 16);
+		xdr_put32(&x, vlanid);		/* src_vlan */
+		xdr_put32(&x, 0);		/* src_priority */
+		xdr_put32(&x, vlanid);		/* dst_vlan */
+		xdr_put32(&x, 0);		/* dst_priority */
+	}
+
+	hlen = htonl(x.p - sample - 4);
+	memcpy(sample, &hlen, sizeof(hlen));
+	sflow_commit(s, &x);
+	s->flow_samples++;
+}
+
+/*
+ * Send a counter sample for a capture interface. Decoding errors are
+ * only counted across all interfaces, so are reported with the first.
+ */
+static void
+sflow_counters(struct SFLOW *s, struct SFLOW_SOURCE *ds)
+{
+	struct XDR x;
+	struct pcap_stat ps;
+	u_int32_t discards, errors, unknown;
+
+	discards = SFLOW_UNKNOWN32;
+	if (ds->pcap != NULL && pcap_stats(ds->pcap, &ps) == 0)
+		discards = ps.ps_drop + ps.ps_ifdrop;
+	errors = unknown = SFLOW_UNKNOWN32;
+	if (ds == &s->source[0]) {
+		errors = (u_int32_t)s->param->bad_packets;
+		unknown = (u_int32_t)s->param->non_ip_packets;
+	}
+
+	sflow_reserve(s, 8 + 12 + 8 + SFLOW_COUNTERS_GENERIC_LEN, &x);
+	xdr_put32(&x, SFLOW_COUNTERS_SAMPLE);
+	xdr_put32(&x, 12 + 8 + SFLOW_COUNTERS_GENERIC_LEN);
+	xdr_put32(&x, ++ds->counter_seq);
+	xdr_put32(&x, ds->ifindex);		/* source_id: ifIndex */
+	xdr_put32(&x, 1);			/* Number of records */
+
+	xdr_put32(&x, SFLOW_COUNTERS_GENERIC);
+	xdr_put32(&x, SFLOW_COUNTERS_GENERIC_LEN);
+	xdr_put32(&x, ds->ifindex);
+	xdr_put32(&x, ds->linktype == DLT_EN10MB ?
+	    SFLOW_IFTYPE_ETHERNET : SFLOW_IFTYPE_OTHER);
+	xdr_put64(&x, 0);			/* ifSpeed: unknown */
+	xdr_put32(&x, 0);			/* ifDirection: unknown */
+	xdr_put32(&x, SFLOW_IFSTATUS_UP);
+	xdr_put64(&x, ds->in_octets);
+	xdr_put32(&x, (u_int32_t)ds->in_unicast);
+	xdr_put32(&x, (u_int32_t)ds->in_multicast);
+	xdr_put32(&x, (u_int32_t)ds->in_broadcast);
+	xdr_put32(&x, discards);
+	xdr_put32(&x, errors);			/* ifInErrors */
+	xdr_put32(&x, unknown);
+	xdr_put64(&x, SFLOW_UNKNOWN64);		/* Nothing is sent on it */
+	xdr_put32(&x, SFLOW_UNKNOWN32);
+	xdr_put32(&x, SFLOW_UNKNOWN32);
+	xdr_put32(&x, SFLOW_UNKNOWN32);
+	xdr_put32(&x, SFLOW_UNKNOWN32);
+	xdr_put32(&x, SFLOW_UNKNOWN32);
+	xdr_put32(&x, 1);			/* ifPromiscuousMode */
+
+	sflow_commit(s, &x);
+	s->counter_samples++;
+}
+
+/*
+ * Send counters when they are due, and the datagram ring once its
+ * oldest sample has been held long enough.
+ */
+void
+sflow_service(struct SFLOW *s)
+{
+	struct timeval now, t;
+	int i;
+
+	flowtrack_gettime(s->param, &now);
+	/* Replayed captures have no time until the first packet */
+	if (!timerisset(&now))
+		return;
+	if (s->counter_interval != 0) {
+		if (!timerisset(&s->next_counters)) {
+			s->next_counters = now;
+			s->next_counters.tv_sec += s->counter_interval;
+		} else if (timercmp(&now, &s->next_counters, >=)) {
+			for (i = 0; i < s->num_sources; i++)
+				sflow_counters(s, &s->source[i]);
+			s->next_counters = now;
+			s->next_counters.tv_sec += s->counter_interval;
+		}
+	}
+	if (s->len[0] != 0) {
+		timersub(&now, &s->pending_since, &t);
+		if (t.tv_sec < 0 || t.tv_sec * 1000 + t.tv_usec / 1000 >=
+		    SFLOW_FLUSH_MSEC)
+			sflow_send(s);
+	}
+}
+
+/* Shorten a poll() timeout so that sflow_service() runs in time */
+void
+sflow_timeout(const struct SFLOW *s, int *timeout)
+{
+	struct timeval now, t, due;
+	int ms;
+
+	timerclear(&due);
+	if (s->counter_interval != 0)
+		due = s->next_counters;
+	if (s->len[0] != 0) {
+		t.tv_sec = SFLOW_FLUSH_MSEC / 1000;
+		t.tv_usec = (SFLOW_FLUSH_MSEC % 1000) * 1000;
+		timeradd(&s->pending_since, &t, &t);
+		if (!timerisset(&due) || timercmp(&t, &due, <))
+			due = t;
+	}
+	if (!timerisset(&due))
+		return;
+
+	gettimeofday(&now, NULL);
+	ms = 0;
+	if (timercmp(&due, &now, >)) {
+		timersub(&due, &now, &t);
+		ms = t.tv_sec * 1000 + (t.tv_usec + 999) / 1000;
+	}
+	if (*timeout == -1 || ms < *timeout)
+		*timeout = ms;
+}
+
+/*
+ * Parse a -S argument: host:port[,rate=N][,header=bytes][,counters=time]
+ * [,only]. Prints the reason and returns NULL if it is invalid.
+ */
+struct SFLOW *
+sflow_setup(const char *spec)
+{
+	struct SFLOW *s;
+	char *copy, *opt, *cp, *ep;
+	long v;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL ||
+	    (copy = strdup(spec)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		free(s);
+		return (NULL);
+	}
+	s->fd = -1;
+	s->rate = SFLOW_DEFAULT_RATE;
+	s->header = SFLOW_DEFAULT_HEADER;
+	s->counter_interval = SFLOW_DEFAULT_COUNTERS;
+
+	cp = copy;
+	opt = strsep(&cp, ",");
+	if (*opt == '\0' || strchr(opt, ':') == NULL ||
+	    strlcpy(s->collector, opt, sizeof(s->collector)) >=
+	    sizeof(s->collector)) {
+		fprintf(stderr, "Invalid sFlow collector \"%s\"\n", opt);
+		goto fail;
+	}
+	while ((opt = strsep(&cp, ",")) != NULL) {
+		if (strncmp(opt, "rate=", 5) == 0) {
+			v = strtol(opt + 5, &ep, 10);
+			if (opt[5] == '\0' || *ep != '\0' || v < 1 ||
+			    v > 0x7fffffff)
+				goto bad;
+			s->rate = v;
+		} else if (strncmp(opt, "header=", 7) == 0) {
+			v = strtol(opt + 7, &ep, 10);
+			if (opt[7] == '\0' || *ep != '\0' || v < 1 ||
+			    v > SFLOW_MAX_HEADER)
+				goto bad;
+			s->header = v;
+		} else if (strncmp(opt, "counters=", 9) == 0) {
+			if ((v = convtime(opt + 9)) == -1)
+				goto bad;
+			s->counter_interval = v;
+		} else if (strcmp(opt, "only") == 0)
+			s->only = 1;
+		else
+			goto bad;
+	}
+	if ((s->buf = calloc(SFLOW_DATAGRAMS, SFLOW_DATAGRAM_SIZE)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto fail;
+	}
+	free(copy);
+	return (s);
+
+ bad:
+	fprintf(stderr, "Invalid sFlow option \"%s\"\n", opt);
+ fail:
+	free(copy);
+	free(s);
+	return (NULL);
+}
+
+/* The host:port part of the -S argument */
+const char *
+sflow_collector(const struct SFLOW *s)
+{
+	return (s->collector);
+}
+
+/* Whether packets are only sampled, not tracked as flows */
+int
+sflow_only(const struct SFLOW *s)
+{
+	return (s->only);
+}
+
+/*
+ * Start sampling, sending to the socket fd (connected to the
+ * collector). The agent address is the one the socket sends from.
+ */
+void
+sflow_open(struct SFLOW *s, int fd, const struct FLOWTRACKPARAMETERS *param)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	struct timeval tv;
+
+	s->fd = fd;
+	s->param = param;
+
+	s->agent_af = AF_INET;
+	s->agent_len = 4;
+	sslen = sizeof(ss);
+	if (getsockname(fd, (struct sockaddr *)&ss, &sslen) == 0) {
+		if (ss.ss_family == AF_INET6) {
+			s->agent_af = AF_INET6;
+			s->agent_len = 16;
+			memcpy(s->agent_addr,
+			    &((struct sockaddr_in6 *)&ss)->sin6_addr, 16);
+		} else if (ss.ss_family == AF_INET) {
+			memcpy(s->agent_addr,
+			    &((struct sockaddr_in *)&ss)->sin_addr, 4);
+		}
+	}
+
+	gettimeofday(&tv, NULL);
+	s->rnd = (u_int32_t)(tv.tv_sec ^ tv.tv_usec ^ (getpid() << 16));
+	if (s->rnd == 0)
+		s->rnd = 1;
+}
+
+/*
+ * Add a capture interface as a data source. Returns the number to pass
+ * to sflow_packet() and sflow_sample() for its packets.
+ */
+int
+sflow_add_source(struct SFLOW *s, pcap_t *pcap, int linktype,
+    u_int32_t ifindex)
+{
+	struct SFLOW_SOURCE *ds;
+
+	if (s->num_sources == MAX_CAPTURES)
+		return (-1);
+	ds = &s->source[s->num_sources];
+	ds->pcap = pcap;
+	ds->linktype = linktype;
+	ds->ifindex = ifindex;
+	ds->skip = sflow_next_skip(s);
+	return (s->num_sources++);
+}
+
+/* Send what is queued and stop */
+void
+sflow_close(struct SFLOW *s)
+{
+	if (s == NULL)
+		return;
+	if (s->fd != -1) {
+		sflow_send(s);
+		close(s->fd);
+	}
+	free(s->buf);
+	free(s);
+}
+
+void
+sflow_statistics(struct SFLOW *s, FILE *out)
+{
+	fprintf(out, "sFlow: %"PRIu64" of %"PRIu64" packets sampled "
+	    "(1 in %u), %"PRIu64" counter samples\n", s->flow_samples,
+	    s->packets, s->rate, s->counter_samples);
+	fprintf(out, "sFlow datagrams: %"PRIu64" sent, %"PRIu64" failed "
+	    "(%u samples lost) to %s\n", s->datagrams_sent,
+	    s->datagrams_failed, s->drops, s->collector);
+}
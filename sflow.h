@@ -0,0 +1,75 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SFLOW_H
+#define _SFLOW_H
+
+#include "common.h"
+
+/*
+ * sFlow version 5 agent (-S).
+ *
+ * Packets are sampled 1 in N as they arrive, before flow tracking, with
+ * a randomised skip count. Each sample is sent as a flow sample carrying
+ * the first bytes of the packet (the whole Ethernet frame, or the IP
+ * header onwards on other links) and, for VLAN tagged packets, an
+ * extended switch record. Each capture interface is a data source with
+ * its own sample pool and sequence numbers, and periodic counter
+ * samples of its generic interface counters. Samples are
+ * XDR encoded straight into a preallocated ring of datagrams, which is
+ * sent in one go once full or once a datagram has waited long enough.
+ */
+
+/* Defaults and limits for the -S options */
+#define SFLOW_DEFAULT_RATE	1000		/* Sample 1 in N packets */
+#define SFLOW_DEFAULT_HEADER	128		/* Bytes of packet to send */
+#define SFLOW_MAX_HEADER	256
+#define SFLOW_DEFAULT_COUNTERS	20		/* Seconds between counters */
+
+/* Datagram ring */
+#define SFLOW_DATAGRAM_SIZE	1400
+#define SFLOW_DATAGRAMS		16
+#define SFLOW_FLUSH_MSEC	1000		/* Max time a sample is held */
+
+struct SFLOW;
+struct FLOWTRACKPARAMETERS;
+struct pcap;
+
+struct SFLOW *sflow_setup(const char *spec);
+const char *sflow_collector(const struct SFLOW *s);
+int sflow_only(const struct SFLOW *s);
+void sflow_open(struct SFLOW *s, int fd,
+    const struct FLOWTRACKPARAMETERS *param);
+int sflow_add_source(struct SFLOW *s, struct pcap *pcap, int linktype,
+    u_int32_t ifindex);
+int sflow_packet(struct SFLOW *s, int src, const u_char *pkt, u_int caplen,
+    u_int len);
+void sflow_sample(struct SFLOW *s, int src, const u_char *pkt,
+    u_int caplen, u_int len, int l2len, int af, u_int16_t vlanid);
+void sflow_timeout(const struct SFLOW *s, int *timeout);
+void sflow_service(struct SFLOW *s);
+void sflow_close(struct SFLOW *s);
+void sflow_statistics(struct SFLOW *s, FILE *out);
+
+#endif /* _SFLOW_H */
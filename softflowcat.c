@@ -0,0 +1,212 @@
+/*
+ * Copyright 2026 The softflowd contributors. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Print the contents of softflowd flow archive (-w) segments */
+
+#include "common.h"
+#include "archive.h"
+
+#include <sys/mman.h>
+
+struct SUMMARY {
+	u_int64_t records, octets, packets;
+	u_int64_t first_usec, last_usec;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: softflowcat [-s] segment [segment ...]\n");
+	fprintf(stderr, "  -s  Print only a summary of each segment\n");
+}
+
+static const char *
+format_usec(u_int64_t usec)
+{
+	static char buf[64];
+	char stamp[32];
+	time_t t;
+
+	t = usec / 1000000;
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+	snprintf(buf, sizeof(buf), "%s.%06u", stamp,
+	    (u_int)(usec % 1000000));
+	return (buf);
+}
+
+static void
+print_record(const struct ARCHIVE_RECORD *r)
+{
+	char addr[2][INET6_ADDRSTRLEN], iface[16];
+	int i, af;
+
+	af = r->af == 4 ? AF_INET : AF_INET6;
+	for (i = 0; i < 2; i++) {
+		if (inet_ntop(af, r->addr[i], addr[i],
+		    sizeof(addr[i])) == NULL)
+			strlcpy(addr[i], "?", sizeof(addr[i]));
+	}
+	/* Zero unless an interface index was set */
+	iface[0] = '\0';
+	if (le16toh(r->if_index) != 0)
+		snprintf(iface, sizeof(iface), " if %u",
+		    le16toh(r->if_index));
+	printf("%s%s proto %u %s%s%s:%u > %s%s%s:%u %"PRIu64" packets "
+	    "%"PRIu64" octets, %"PRIu64" packets %"PRIu64" octets "
+	    "back, %.3fs%s\n", format_usec(le64toh(r->start_usec)), iface,
+	    r->protocol,
+	    af == AF_INET6 ? "[" : "", addr[0], af == AF_INET6 ? "]" : "",
+	    le16toh(r->port[0]),
+	    af == AF_INET6 ? "[" : "", addr[1], af == AF_INET6 ? "]" : "",
+	    le16toh(r->port[1]),
+	    le64toh(r->packets[0]), le64toh(r->octets[0]),
+	    le64toh(r->packets[1]), le64toh(r->octets[1]),
+	    (le64toh(r->finish_usec) - le64toh(r->start_usec)) / 1e6,
+	    r->flags & ARCHIVE_R_INTERIM ? " (interim)" : "");
+}
+
+/* Scan one segment. Returns 0 on success or -1 if it is unreadable */
+static int
+scan_segment(const char *path, int summary_only, struct SUMMARY *sum)
+{
+	const struct ARCHIVE_HEADER *hdr;
+	const struct ARCHIVE_RECORD *r;
+	const u_char *p, *end;
+	u_char *map;
+	struct stat st;
+	u_int64_t count, n, start;
+	size_t hsize, rsize;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return (-1);
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "%s: too short\n", path);
+		close(fd);
+		return (-1);
+	}
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd,
+	    0)) == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s\n", path, strerror(errno));
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+
+	hdr = (const struct ARCHIVE_HEADER *)map;
+	hsize = le16toh(hdr->header_size);
+	rsize = le16toh(hdr->record_size);
+	if (memcmp(hdr->magic, ARCHIVE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    le16toh(hdr->version) < 1 ||
+	    le16toh(hdr->version) > ARCHIVE_VERSION ||
+	    hsize < sizeof(*hdr) || hsize > (size_t)st.st_size ||
+	    rsize < sizeof(*r)) {
+		fprintf(stderr, "%s: not a flow archive segment\n", path);
+		munmap(map, st.st_size);
+		return (-1);
+	}
+
+	/* Records may be larger in later versions; skip what we don't know */
+	count = ((size_t)st.st_size - hsize) / rsize;
+	if (le16toh(hdr->flags) & ARCHIVE_F_CLOSED)
+		count = MIN(count, le64toh(hdr->record_count));
+	end = map + hsize + count * rsize;
+
+	n = 0;
+	start = 0;
+	for (p = map + hsize; p < end; p += rsize) {
+		r = (const struct ARCHIVE_RECORD *)p;
+		/* Unused slots of a segment that was never closed */
+		if (r->af == 0)
+			break;
+		n++;
+		sum->octets += le64toh(r->octets[0]) + le64toh(r->octets[1]);
+		sum->packets += le64toh(r->packets[0]) +
+		    le64toh(r->packets[1]);
+		start = le64toh(r->start_usec);
+		if (sum->first_usec == 0 || start < sum->first_usec)
+			sum->first_usec = start;
+		sum->last_usec = MAX(sum->last_usec, le64toh(r->finish_usec));
+		if (!summary_only)
+			print_record(r);
+	}
+	sum->records += n;
+	if (summary_only)
+		printf("%s: %"PRIu64" records%s\n", path, n,
+		    le16toh(hdr->flags) & ARCHIVE_F_CLOSED ? "" :
+		    " (not closed)");
+
+	munmap(map, st.st_size);
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct SUMMARY sum;
+	int ch, i, summary_only, ret;
+
+	summary_only = 0;
+	while ((ch = getopt(argc, argv, "hs")) != -1) {
+		switch (ch) {
+		case 's':
+			summary_only = 1;
+			break;
+		case 'h':
+			usage();
+			return (0);
+		default:
+			usage();
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0) {
+		usage();
+		return (1);
+	}
+
+	memset(&sum, '\0', sizeof(sum));
+	for (ret = 0, i = 0; i < argc; i++) {
+		if (scan_segment(argv[i], summary_only, &sum) == -1)
+			ret = 1;
+	}
+	if (summary_only) {
+		printf("Total: %"PRIu64" records, %"PRIu64" packets, "
+		    "%"PRIu64" octets\n", sum.records, sum.packets,
+		    sum.octets);
+		if (sum.records != 0) {
+			printf("First flow start: %s\n",
+			    format_usec(sum.first_usec));
+			printf("Last flow end: %s\n",
+			    format_usec(sum.last_usec));
+		}
+	}
+	return (ret);
+}
@@ -46,13 +46,51 @@
 #include "sys-tree.h"
 #include "convtime.h"
 #include "softflowd.h"
+#include "export.h"
 #include "treetype.h"
 #include "freelist.h"
 #include "log.h"
+#include "archive.h"
+#include "arrow.h"
+#include "esbulk.h"
+#include "ndjson.h"
+#include "sflow.h"
+#include "dedup.h"
+#include "merge.h"
+#include "pcapmap.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <net/if.h>
 #include <pcap.h>
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 
+/* Local flow archive (-w) */
+static struct ARCHIVE *archive = NULL;
+
+/* Columnar (Arrow) output (-o) */
+static struct ARROW *arrow = NULL;
+
+/* NDJSON (elasticsearch bulk format) file output (-j) */
+static struct NDJSON *ndjson = NULL;
+
+/* sFlow agent (-S) */
+static struct SFLOW *sflow = NULL;
+
+/* Cross-interface duplicate suppression (-u) */
+static struct DEDUP *dedup = NULL;
+
+/* Capture files (-r), merged in time order */
+static struct MERGE *merge = NULL;
+
+/* Parallel reading of one capture file (-J) */
+static int num_workers = 0;
+static FILE *shard_out = NULL;		/* In a worker, to the parent */
+static u_int64_t shard_rescanned = 0;	/* Packets the chunk scan missed */
+
 #ifdef USE_ELASTICSEARCH
 #include "elasticsearch.h"
 struct ES_CON* elasticsearch = NULL;
@@ -60,7 +98,26 @@ struct ES_CON* elasticsearch = NULL;
 
 /* Global variables */
 static int verbose_flag = 0;		/* Debugging flag */
-static u_int16_t if_index = 0;		/* "manual" interface index */
+
+/*
+ * Packet sources: the -i interfaces, or the interfaces the -r files were
+ * captured on. Flows are tracked separately per interface, and carry its
+ * index (given as -i idx:name or -r idx:file) as their input and output
+ * interface.
+ */
+struct CAPTURE {
+	char *name;			/* Interface or first file name */
+	pcap_t *pcap;			/* NULL for files */
+	int linktype;
+	u_int16_t if_index;
+	int default_index;		/* -i given without idx: */
+	int kernel_sampling;		/* -s done by its socket filter */
+	int sflow_source;		/* sFlow data source number */
+	int dedup_trusted;		/* Never suppressed as a duplicate */
+	u_int64_t duplicates;		/* Packets suppressed by -u */
+};
+static struct CAPTURE captures[MAX_CAPTURES];
+static int num_captures = 0;
 
 /* Signal handler flags */
 static volatile sig_atomic_t graceful_shutdown_request = 0;
@@ -68,9 +125,11 @@ static volatile sig_atomic_t graceful_shutdown_request = 0;
 /* Context for libpcap callback functions */
 struct CB_CTXT {
 	struct FLOWTRACK *ft;
-	int linktype;
+	struct NETFLOW_TARGET *target;
+	struct CAPTURE *cap;	/* Being read from */
 	int fatal;
 	int want_v6;
+	int track;		/* Not just sampling for sFlow */
 };
 
 /* Describes a datalink header and how to extract v4/v6 frames from it */
@@ -103,7 +162,7 @@ static const struct DATALINK lt[] = {
 /* Netflow send functions */
 typedef int (netflow_send_func_t)(struct FLOW **,
                                   int,
-                                  int,
+                                  struct NETFLOW_TARGET *,
                                   u_int16_t,
 				  struct FLOWTRACKPARAMETERS *,
                                   int);
@@ -123,12 +182,6 @@ static const struct NETFLOW_SENDER nf[] = {
 	{ -1, NULL, NULL, 0 },
 };
 
-/* Describes a location where we send NetFlow packets to */
-struct NETFLOW_TARGET {
-	int fd;
-	const struct NETFLOW_SENDER *dialect;
-};
-
 /* Signal handlers */
 static void sighand_graceful_shutdown(int signum)
 {
@@ -152,6 +205,9 @@ flow_compare(struct FLOW *a, struct FLOW *b)
 	/* Be careful to avoid signed vs unsigned issues here */
 	int r;
 
+	if (a->if_index != b->if_index)
+		return (a->if_index > b->if_index ? 1 : -1);
+
 	if (a->vlanid != b->vlanid)
 		return (a->vlanid > b->vlanid ? 1 : -1);
 
@@ -489,8 +545,9 @@ flow_update_expiry(struct FLOWTRACK *ft, struct FLOW *flow)
 {
 	EXPIRY_REMOVE(EXPIRIES, &ft->expiries, flow->expiry);
 
-	/* Flows over 2 GiB traffic */
-	if (flow->octets[0] > (1U << 31) || flow->octets[1] > (1U << 31)) {
+	/* Flows over 2 GiB traffic, unless exported with 64 bit counters */
+	if (!ft->param.wide_counters &&
+	    (flow->octets[0] > (1U << 31) || flow->octets[1] > (1U << 31))) {
 		flow->expiry->expires_at = 0;
 		flow->expiry->reason = R_OVERBYTES;
 		goto out;
@@ -563,9 +620,91 @@ flow_update_expiry(struct FLOWTRACK *ft, struct FLOW *flow)
 		    flow->flow_start.tv_sec + ft->param.maximum_lifetime);
 	}
 
+	/* Schedule an interim report if there is unreported traffic */
+	if (ft->param.active_timeout != 0 && flow->expiry->expires_at != 0 &&
+	    timerisset(&flow->flow_report) &&
+	    flow->flow_report.tv_sec + ft->param.active_timeout <
+	    flow->expiry->expires_at) {
+		flow->expiry->expires_at = flow->flow_report.tv_sec +
+		    ft->param.active_timeout;
+		flow->expiry->reason = R_ACTIVE;
+	}
+
 	EXPIRY_INSERT(EXPIRIES, &ft->expiries, flow->expiry);
 }
 
+/* Mixing step of the BOB hash */
+#define BOB_MIX(a, b, c) do {					\
+	a -= b; a -= c; a ^= (c >> 13);				\
+	b -= c; b -= a; b ^= (a << 8);				\
+	c -= a; c -= b; c ^= (b >> 13);				\
+	a -= b; a -= c; a ^= (c >> 12);				\
+	b -= c; b -= a; b ^= (a << 16);				\
+	c -= a; c -= b; c ^= (b >> 5);				\
+	a -= b; a -= c; a ^= (c >> 3);				\
+	b -= c; b -= a; b ^= (a << 10);				\
+	c -= a; c -= b; c ^= (b >> 15);				\
+} while (0)
+
+/* Bob Jenkins' hash of len bytes, as specified for PSAMP (RFC 5475) */
+static u_int32_t
+bob_hash(const u_char *k, size_t len, u_int32_t initval)
+{
+	u_int32_t a, b, c;
+	size_t left;
+
+	a = b = 0x9e3779b9;
+	c = initval;
+	for (left = len; left >= 12; left -= 12, k += 12) {
+		a += k[0] + (k[1] << 8) + (k[2] << 16) + ((u_int32_t)k[3] << 24);
+		b += k[4] + (k[5] << 8) + (k[6] << 16) + ((u_int32_t)k[7] << 24);
+		c += k[8] + (k[9] << 8) + (k[10] << 16) +
+		    ((u_int32_t)k[11] << 24);
+		BOB_MIX(a, b, c);
+	}
+	c += len;
+	switch (left) {
+	case 11: c += (u_int32_t)k[10] << 24;	/* FALLTHROUGH */
+	case 10: c += k[9] << 16;		/* FALLTHROUGH */
+	case 9: c += k[8] << 8;			/* FALLTHROUGH */
+	case 8: b += (u_int32_t)k[7] << 24;	/* FALLTHROUGH */
+	case 7: b += k[6] << 16;		/* FALLTHROUGH */
+	case 6: b += k[5] << 8;			/* FALLTHROUGH */
+	case 5: b += k[4];			/* FALLTHROUGH */
+	case 4: a += (u_int32_t)k[3] << 24;	/* FALLTHROUGH */
+	case 3: a += k[2] << 16;		/* FALLTHROUGH */
+	case 2: a += k[1] << 8;			/* FALLTHROUGH */
+	case 1: a += k[0];
+	}
+	BOB_MIX(a, b, c);
+	return (c);
+}
+
+/*
+ * Flow-consistent sampling (-s rate:hash). The decision depends only on
+ * the flow's key, with its endpoints in canonical order, so all packets
+ * of a flow are kept or none are. The hash has no secret, so probes
+ * sampling at the same rate select the same flows.
+ */
+static int
+sample_flow(const struct FLOW *flow, u_int32_t rate)
+{
+	u_char key[8 + 2 * 16];
+	size_t len;
+
+	len = flow->af == AF_INET ? 4 : 16;
+	key[0] = flow->af == AF_INET ? 4 : 6;
+	key[1] = flow->protocol;
+	key[2] = flow->vlanid >> 8;
+	key[3] = flow->vlanid & 0xff;
+	memcpy(key + 4, flow->port, sizeof(flow->port));
+	memcpy(key + 8, &flow->addr[0], len);
+	memcpy(key + 8 + len, &flow->addr[1], len);
+
+	/* Keep the flows that hash into the lowest 1/rate of the range */
+	return ((u_int64_t)bob_hash(key, 8 + 2 * len, 0) * rate <
+	    ((u_int64_t)1 << 32));
+}
 
 /* Return values from process_packet */
 #define PP_OK		0
@@ -587,6 +726,7 @@ process_packet( struct FLOWTRACK *ft,
 	        const u_int32_t caplen,
                 const u_int32_t len,
                 u_int16_t vlanid,
+                u_int16_t if_index,
                 const struct timeval *received_time)
 {
 	struct FLOW tmp, *flow;
@@ -596,6 +736,7 @@ process_packet( struct FLOWTRACK *ft,
 
 	/* Convert the IP packet to a flow identity */
 	memset(&tmp, 0, sizeof(tmp));
+	tmp.if_index = if_index;
 	switch (af) {
 	case AF_INET:
 	  if (ipv4_to_flowrec(&tmp, pkt, caplen, len, &frag, af, vlanid) == -1)
@@ -611,9 +752,6 @@ process_packet( struct FLOWTRACK *ft,
 		return (PP_BAD_PACKET);
 	}
 
-	if (frag)
-		ft->param.frag_packets++;
-
 	/* Zero out bits of the flow that aren't relevant to tracking level */
 	switch (ft->param.track_level) {
 	case TRACK_IP_ONLY:
@@ -634,6 +772,17 @@ process_packet( struct FLOWTRACK *ft,
 		break;
 	}
 
+	if (ft->param.option.sample != 0 &&
+	    ft->param.option.sample_algorithm == SAMPLE_HASH &&
+	    !sample_flow(&tmp, ft->param.option.sample)) {
+		/* Counted as not sampled rather than as seen */
+		ft->param.total_packets--;
+		ft->param.non_sampled_packets++;
+		return (PP_OK);
+	}
+	if (frag)
+		ft->param.frag_packets++;
+
 	/* If a matching flow does not exist, create and insert one */
 	if ((flow = FLOW_FIND(FLOWS, &ft->flows, &tmp)) == NULL) {
 		/* Allocate and fill in the flow */
@@ -686,14 +835,19 @@ process_packet( struct FLOWTRACK *ft,
 	}
 
 	memcpy(&flow->flow_last, received_time, sizeof(flow->flow_last));
+	/* First packet since the flow was created or last reported */
+	if (!timerisset(&flow->flow_report))
+		flow->flow_report = flow->flow_last;
 
 	if (flow->expiry->expires_at != 0)
 		flow_update_expiry(ft, flow);
 
 #ifdef USE_ELASTICSEARCH
 	if (elasticsearch) {
-		time_t now = time(NULL);
-		log2elasticserch(elasticsearch, flow, (long int)flow->expiry->expires_at - now < 0);
+		struct timeval now;
+
+		flowtrack_gettime(&ft->param, &now);
+		log2elasticserch(elasticsearch, flow, (long int)flow->expiry->expires_at - now.tv_sec < 0);
 	}
 #endif
 
@@ -717,6 +871,19 @@ timeval_sub_ms(const struct timeval *t1, const struct timeval *t2)
 	return ((u_int32_t)res.tv_sec * 1000 + (u_int32_t)res.tv_usec / 1000);
 }
 
+/*
+ * Current time as seen by the flow engine: normally the wall clock, but
+ * the timestamp of the latest packet when replaying a capture with -a.
+ */
+void
+flowtrack_gettime(const struct FLOWTRACKPARAMETERS *param, struct timeval *tv)
+{
+	if (param->packet_clock)
+		*tv = param->packet_time;
+	else
+		gettimeofday(tv, NULL);
+}
+
 static void
 update_statistic(struct STATISTIC *s, double new, double n)
 {
@@ -763,6 +930,17 @@ update_statistics(struct FLOWTRACK *ft, struct FLOW *flow)
 	n++;
 }
 
+/* Interim reports only contribute to the traffic totals */
+static void
+update_interim_statistics(struct FLOWTRACK *ft, struct FLOW *flow)
+{
+	ft->param.flows_interim++;
+	ft->param.octets_pp[flow->protocol] +=
+	    flow->octets[0] + flow->octets[1];
+	ft->param.packets_pp[flow->protocol] +=
+	    flow->packets[0] + flow->packets[1];
+}
+
 static void
 update_expiry_stats(struct FLOWTRACK *ft, struct EXPIRY *e)
 {
@@ -797,6 +975,9 @@ update_expiry_stats(struct FLOWTRACK *ft, struct EXPIRY *e)
 	case R_FLUSH:
 		ft->param.expired_flush++;
 		break;
+	case R_ACTIVE:
+		/* Interim reports are not expiries */
+		break;
 	}
 }
 
@@ -808,11 +989,15 @@ next_expire(struct FLOWTRACK *ft)
 	struct timeval now;
 	u_int32_t expires_at, ret, fudge;
 
-	gettimeofday(&now, NULL);
+	flowtrack_gettime(&ft->param, &now);
 
 	if ((expiry = EXPIRY_MIN(EXPIRIES, &ft->expiries)) == NULL)
 		return (-1); /* indefinite */
 
+	/* Resume immediately if the last expiry pass ran out of budget */
+	if (timerisset(&ft->param.expiry_backlog_since))
+		return (0);
+
 	expires_at = expiry->expires_at;
 
 	/* Don't cluster urgent expiries */
@@ -833,37 +1018,327 @@ next_expire(struct FLOWTRACK *ft)
 	return (ret);
 }
 
+/* Send flows to a target and the targets sharing its datagrams */
+static int
+send_flows(struct FLOWTRACK *ft, struct NETFLOW_TARGET *target,
+    struct FLOW **flows, int num_flows)
+{
+	netflow_send_func_t *func;
+	int sent;
+
+	func = ft->param.bidirection == 1 ?
+		target->dialect->bidir_func :
+		target->dialect->func;
+	if (func == NULL) {
+		func = target->dialect->func;
+	}
+	/* Senders account for sent and dropped flows themselves */
+	sent = func(flows, num_flows,
+		 target, captures[0].if_index, &ft->param, verbose_flag);
+	if (verbose_flag)
+		logit(LOG_DEBUG, "sent %d netflow packets to %s",
+		    sent, target->name);
+	return (sent == -1 ? -1 : 0);
+}
+
+/* FNV-1a hash of len bytes, continuing from h */
+static u_int32_t
+balance_hash_bytes(u_int32_t h, const void *p, size_t len)
+{
+	const u_char *c = p;
+
+	while (len-- > 0) {
+		h ^= *c++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+/*
+ * Hash deciding which target a flow is balanced to. A flow carries both
+ * directions with its endpoints in canonical order, so the hash does
+ * not depend on which side sent the traffic.
+ */
+static u_int32_t
+balance_hash(const struct FLOW *flow, const struct FLOWTRACKPARAMETERS *param)
+{
+	u_char addr[2][16], key[2];
+	u_int32_t h;
+	int i, j, len, bits;
+
+	len = flow->af == AF_INET ? 4 : 16;
+	memcpy(addr[0], &flow->addr[0], len);
+	memcpy(addr[1], &flow->addr[1], len);
+	key[0] = flow->af == AF_INET ? 4 : 6;
+	key[1] = flow->protocol;
+
+	h = 2166136261U;
+	if (param->balance == BALANCE_PREFIX) {
+		/* Mask both endpoints to the prefix length */
+		bits = param->balance_prefix[flow->af == AF_INET ? 0 : 1];
+		for (i = 0; i < 2; i++) {
+			for (j = 0; j < len; j++) {
+				if (bits <= 8 * j)
+					addr[i][j] = 0;
+				else if (bits < 8 * (j + 1))
+					addr[i][j] &= 0xff << (8 * (j + 1) - bits);
+			}
+		}
+		h = balance_hash_bytes(h, key, 1);
+	} else {
+		h = balance_hash_bytes(h, key, 2);
+		h = balance_hash_bytes(h, flow->port, sizeof(flow->port));
+	}
+	h = balance_hash_bytes(h, addr[0], len);
+	h = balance_hash_bytes(h, addr[1], len);
+
+	return (h);
+}
+
+/*
+ * Partition flows across the targets by balance_hash(). The share of a
+ * target that is down goes to the remaining ones, spread by the same
+ * hash. Returns -1 if any datagram could not be sent, 0 otherwise.
+ */
+static int
+balance_flows(struct FLOWTRACK *ft, struct NETFLOW_TARGET *targets,
+    struct FLOW **flows, int num_flows)
+{
+	static struct FLOW **part = NULL;
+	static u_char *keys = NULL;
+	static int part_alloc = 0;
+	struct NETFLOW_TARGET *t[MAX_EXPORT_TARGETS], *target;
+	int alive[MAX_EXPORT_TARGETS], pos[MAX_EXPORT_TARGETS + 1];
+	int i, k, n, nalive, r;
+	u_int32_t h;
+	struct FLOW **tmp;
+	u_char *tkeys;
+	time_t now;
+
+	if (num_flows > part_alloc) {
+		if ((tmp = realloc(part, num_flows * sizeof(*part))) != NULL)
+			part = tmp;
+		if ((tkeys = realloc(keys, num_flows)) != NULL)
+			keys = tkeys;
+		if (tmp == NULL || tkeys == NULL) {
+			logit(LOG_WARNING, "Unable to balance flows: "
+			    "out of memory");
+			return (send_flows(ft, targets, flows, num_flows));
+		}
+		part_alloc = num_flows;
+	}
+
+	now = time(NULL);
+	for (n = nalive = 0, target = targets; target != NULL;
+	    target = target->next) {
+		if (target->down_until <= now)
+			alive[nalive++] = n;
+		t[n++] = target;
+	}
+
+	bzero(pos, sizeof(pos));
+	for (i = 0; i < num_flows; i++) {
+		h = balance_hash(flows[i], &ft->param);
+		k = h % n;
+		if (t[k]->down_until > now && nalive > 0)
+			k = alive[h % nalive];
+		keys[i] = k;
+		pos[k + 1]++;
+	}
+	for (k = 1; k <= n; k++)
+		pos[k] += pos[k - 1];
+	for (i = 0; i < num_flows; i++)
+		part[pos[keys[i]]++] = flows[i];
+
+	/* pos[k] is now the end of target k's flows */
+	r = 0;
+	for (k = 0, i = 0; k < n; i = pos[k++]) {
+		if (pos[k] == i)
+			continue;
+		t[k]->flows_balanced += pos[k] - i;
+		if (send_flows(ft, t[k], part + i, pos[k] - i) == -1)
+			r = -1;
+	}
+	return (r);
+}
+
+/*
+ * Messages from the -J workers to the parent. Each is a SHARD_MSG,
+ * followed for FLOWS and ACCOUNT by count flows and for DONE by the
+ * worker's FLOWTRACKPARAMETERS, whose counters the parent adds up.
+ */
+#define SHARD_MSG_MAPPED	1	/* Window count has been mapped */
+#define SHARD_MSG_FLOWS		2	/* Expired flows to export */
+#define SHARD_MSG_ACCOUNT	3	/* Expired flows only to count */
+#define SHARD_MSG_DONE		4	/* End of file; count is rescans */
+struct SHARD_MSG {
+	int type;
+	u_int64_t count;
+	struct timeval now;		/* The worker's clock */
+	struct timeval boot;		/* and its start */
+};
+
+static int
+shard_send(struct FLOWTRACK *ft, int type, u_int64_t count,
+    const void *payload, size_t len)
+{
+	struct SHARD_MSG msg;
+
+	memset(&msg, '\0', sizeof(msg));
+	msg.type = type;
+	msg.count = count;
+	msg.now = ft->param.packet_time;
+	msg.boot = ft->param.system_boot_time;
+	if (fwrite(&msg, sizeof(msg), 1, shard_out) != 1 ||
+	    (len != 0 && fwrite(payload, len, 1, shard_out) != 1))
+		return (-1);
+	return (0);
+}
+
+/* In a -J worker, hand expired flows to the parent, then free them */
+static int
+shard_send_flows(struct FLOWTRACK *ft, int type, struct FLOW **flows,
+    int num_flows)
+{
+	int i, j, n, r;
+
+	r = 0;
+	for (i = 0; i < num_flows; i += n) {
+		n = MIN(num_flows - i, SHARD_BATCH);
+		if (shard_send(ft, type, n, NULL, 0) == -1)
+			r = -1;
+		for (j = i; j < i + n; j++) {
+			if (fwrite(flows[j], sizeof(*flows[j]), 1,
+			    shard_out) != 1)
+				r = -1;
+		}
+	}
+	for (i = 0; i < num_flows; i++)
+		flow_put(ft, flows[i]);
+	return (r);
+}
+
+/*
+ * Export an array of flows that have been removed from the flow and
+ * expiry trees to the targets in the list, then free them. Every target
+ * gets all flows unless they are balanced across them (-H). Returns -1
+ * if any datagram could not be sent, 0 otherwise.
+ */
+static int
+export_flows(struct FLOWTRACK *ft, struct NETFLOW_TARGET *target,
+    struct FLOW **flows, int num_flows)
+{
+	struct timeval now;
+	int i, r;
+
+	/* A -J worker's flows are exported by the parent */
+	if (shard_out != NULL)
+		return (shard_send_flows(ft, SHARD_MSG_FLOWS, flows,
+		    num_flows));
+
+	r = 0;
+	flowtrack_gettime(&ft->param, &now);
+	if (archive != NULL &&
+	    archive_write(archive, flows, num_flows, &now) == -1)
+		r = -1;
+	if (arrow != NULL && arrow_write(arrow, flows, num_flows, &now) == -1)
+		r = -1;
+	if (ndjson != NULL &&
+	    ndjson_write(ndjson, flows, num_flows, &now) == -1)
+		r = -1;
+	if (ft->param.balance != BALANCE_NONE && target != NULL) {
+		if (balance_flows(ft, target, flows, num_flows) == -1)
+			r = -1;
+	} else {
+		for (; target != NULL; target = target->next) {
+			/* Targets on a share chain get the head's datagrams */
+			if (!target->shared &&
+			    send_flows(ft, target, flows, num_flows) == -1)
+				r = -1;
+		}
+	}
+	for (i = 0; i < num_flows; i++) {
+		if (verbose_flag) {
+			logit(LOG_DEBUG, "EXPIRED: %s (%p)",
+			    format_flow(flows[i]), flows[i]);
+		}
+		if (flows[i]->interim)
+			update_interim_statistics(ft, flows[i]);
+		else
+			update_statistics(ft, flows[i]);
+		flow_put(ft, flows[i]);
+	}
+
+	return (r);
+}
+
 /*
  * Scan the tree of expiry events and process expired flows. If zap_all
  * is set, then forcibly expire all flows.
+ *
+ * Unless all flows are being expired, the amount of work done in one
+ * call is bounded by the expiry_max_flows and expiry_max_usec budgets.
+ * Flows left over stay in the expiry tree and are picked up on the next
+ * call; next_expire() returns zero while such a backlog exists.
  */
 #define CE_EXPIRE_NORMAL	0  /* Normal expiry processing */
 #define CE_EXPIRE_ALL		-1 /* Expire all flows immediately */
 #define CE_EXPIRE_FORCED	1  /* Only expire force-expired flows */
+
+/* Returns non-zero if an expiry event is due in scan mode "ex" */
+static int
+expiry_due(struct EXPIRY *expiry, int ex, time_t now)
+{
+	if (expiry->expires_at == 0 || ex == CE_EXPIRE_ALL)
+		return (1);
+	return (ex != CE_EXPIRE_FORCED && expiry->expires_at < now);
+}
+
 static int
 check_expired(struct FLOWTRACK *ft, struct NETFLOW_TARGET *target, int ex)
 {
-	struct FLOW **expired_flows, **oldexp;
-	int num_expired, i, r;
-	struct timeval now;
+	struct FLOW **expired_flows, **oldexp, *flow;
+	int num_expired, total_expired, num_alloc, chunk, truncated, r;
+	u_int max_flows, max_usec;
+	struct timeval start, now, clock;
+	double age;
 
 	struct EXPIRY *expiry, *nexpiry;
 
-	gettimeofday(&now, NULL);
+	gettimeofday(&start, NULL);
+	flowtrack_gettime(&ft->param, &clock);
 	r = 0;
-	num_expired = 0;
+	total_expired = num_alloc = truncated = 0;
 	expired_flows = NULL;
 
+	if (ex == CE_EXPIRE_ALL)
+		max_flows = max_usec = 0;
+	else {
+		max_flows = ft->param.expiry_max_flows;
+		max_usec = ft->param.expiry_max_usec;
+	}
+	/* Size of each batch handed to the exporter (0 = unlimited) */
+	chunk = max_flows;
+	if (max_usec != 0 && (chunk == 0 || chunk > EXPIRY_CHUNK))
+		chunk = EXPIRY_CHUNK;
+
 	if (verbose_flag)
 		logit(LOG_DEBUG, "Starting expiry scan: mode %d", ex);
 
-	for(expiry = EXPIRY_MIN(EXPIRIES, &ft->expiries);
-	    expiry != NULL;
-	    expiry = nexpiry) {
-		nexpiry = EXPIRY_NEXT(EXPIRIES, &ft->expiries, expiry);
-		if ((expiry->expires_at == 0) || (ex == CE_EXPIRE_ALL) ||
-		    (ex != CE_EXPIRE_FORCED &&
-		    (expiry->expires_at < now.tv_sec))) {
+	expiry = EXPIRY_MIN(EXPIRIES, &ft->expiries);
+	while (expiry != NULL) {
+		num_expired = 0;
+		for(; expiry != NULL; expiry = nexpiry) {
+			if (chunk != 0 && num_expired >= chunk) {
+				nexpiry = expiry;
+				break;
+			}
+			nexpiry = EXPIRY_NEXT(EXPIRIES, &ft->expiries, expiry);
+			/* The tree is sorted by expiry time */
+			if (!expiry_due(expiry, ex, clock.tv_sec)) {
+				nexpiry = NULL;
+				break;
+			}
 			/* Flow has expired */
 
 			if (ft->param.maximum_lifetime != 0 &&
@@ -872,78 +1347,152 @@ check_expired(struct FLOWTRACK *ft, struct NETFLOW_TARGET *target, int ex)
 	    		    ft->param.maximum_lifetime)
 					expiry->reason = R_MAXLIFE;
 
+			/* Make room in the array of expired flows */
+			if (num_expired >= num_alloc) {
+				oldexp = expired_flows;
+				num_alloc = num_alloc == 0 ? 64 : num_alloc * 2;
+				expired_flows = realloc(expired_flows,
+				    sizeof(*expired_flows) * num_alloc);
+				/* Don't fatal on realloc failures */
+				if (expired_flows == NULL) {
+					expired_flows = oldexp;
+					num_alloc = num_expired;
+					/* Process what we have so far */
+					nexpiry = expiry;
+					break;
+				}
+			}
+
+			/*
+			 * Active timeout: report the traffic seen since the
+			 * last report and keep tracking the flow. If no copy
+			 * can be made, expire the flow outright instead.
+			 */
+			if (expiry->reason == R_ACTIVE && ex != CE_EXPIRE_ALL) {
+				flow = expiry->flow;
+				if ((expired_flows[num_expired] =
+				    flow_get(ft)) != NULL) {
+					memcpy(expired_flows[num_expired],
+					    flow, sizeof(*flow));
+					expired_flows[num_expired]->expiry =
+					    NULL;
+					expired_flows[num_expired]->interim = 1;
+					expired_flows[num_expired]->flow_start =
+					    flow->flow_report;
+					num_expired++;
+					if (verbose_flag)
+						logit(LOG_DEBUG, "Interim "
+						    "report for flow "
+						    "seq:%"PRIu64" (%p)",
+						    flow->flow_seq, flow);
+
+					flow->octets[0] = flow->octets[1] = 0;
+					flow->packets[0] = flow->packets[1] = 0;
+					bzero(flow->tcp_ack_nb,
+					    sizeof(flow->tcp_ack_nb));
+					bzero(flow->tcp_push_nb,
+					    sizeof(flow->tcp_push_nb));
+					bzero(flow->tcp_reset_nb,
+					    sizeof(flow->tcp_reset_nb));
+					bzero(flow->tcp_syn_nb,
+					    sizeof(flow->tcp_syn_nb));
+					bzero(flow->tcp_fin_nb,
+					    sizeof(flow->tcp_fin_nb));
+					timerclear(&flow->flow_report);
+
+					/* Reschedule on the idle timeout */
+					flow_update_expiry(ft, flow);
+					continue;
+				}
+				logit(LOG_ERR, "check_expired: flow_get failed, "
+				    "expiring flow seq:%"PRIu64, flow->flow_seq);
+			}
+
 			if (verbose_flag)
 				logit(LOG_DEBUG,
 				    "Queuing flow seq:%"PRIu64" (%p) for expiry "
 				    "reason %d", expiry->flow->flow_seq,
 				    expiry->flow, expiry->reason);
 
-			/* Add to array of expired flows */
-			oldexp = expired_flows;
-			expired_flows = realloc(expired_flows,
-			    sizeof(*expired_flows) * (num_expired + 1));
-			/* Don't fatal on realloc failures */
-			if (expired_flows == NULL)
-				expired_flows = oldexp;
-			else {
-				expired_flows[num_expired] = expiry->flow;
-				num_expired++;
-			}
-
 			if (ex == CE_EXPIRE_ALL)
 				expiry->reason = R_FLUSH;
 
 			update_expiry_stats(ft, expiry);
 
 			/* Remove from flow tree, destroy expiry event */
-			FLOW_REMOVE(FLOWS, &ft->flows, expiry->flow);
+			flow = expiry->flow;
+			FLOW_REMOVE(FLOWS, &ft->flows, flow);
 			EXPIRY_REMOVE(EXPIRIES, &ft->expiries, expiry);
-			expiry->flow->expiry = NULL;
+			flow->expiry = NULL;
 			expiry_put(ft, expiry);
 
 			ft->param.num_flows--;
-		}
-	}
 
-	if (verbose_flag)
-		logit(LOG_DEBUG, "Finished scan %d flow(s) to be evicted",
-		    num_expired);
-
-	/* Processing for expired flows */
-	if (num_expired > 0) {
-		if (target != NULL && target->fd != -1) {
-			netflow_send_func_t *func =
-				ft->param.bidirection == 1 ?
-				target->dialect->bidir_func :
-				target->dialect->func;
-			if (func == NULL) {
-				func = target->dialect->func;
-			}
-			r = func(expired_flows, num_expired,
-				 target->fd, if_index, &ft->param, verbose_flag);
-			if (verbose_flag)
-				logit(LOG_DEBUG, "sent %d netflow packets", r);
-			if (r > 0) {
-				ft->param.packets_sent += r;
-				/* XXX what if r < num_expired * 2 ? */
-			} else {
-				ft->param.flows_dropped += num_expired * 2;
+			/*
+			 * Add to array of expired flows, unless everything
+			 * has already been sent in an interim report
+			 */
+			if (!timerisset(&flow->flow_report)) {
+				if (shard_out != NULL)
+					shard_send_flows(ft, SHARD_MSG_ACCOUNT,
+					    &flow, 1);
+				else {
+					update_statistics(ft, flow);
+					flow_put(ft, flow);
+				}
+				continue;
 			}
+			flow->flow_start = flow->flow_report;
+			expired_flows[num_expired++] = flow;
+		}
+		expiry = nexpiry;
+
+		if (num_expired == 0)
+			break;
+
+		/* Processing for expired flows */
+		if (export_flows(ft, target, expired_flows, num_expired) == -1)
+			r = -1;
+		total_expired += num_expired;
+
+		if (expiry == NULL)
+			break;
+		/* Only a budget cut with a flow already due leaves a backlog */
+		if (max_flows != 0 && total_expired >= max_flows) {
+			truncated = expiry_due(expiry, ex, clock.tv_sec);
+			break;
 		}
-		for (i = 0; i < num_expired; i++) {
-			if (verbose_flag) {
-				logit(LOG_DEBUG, "EXPIRED: %s (%p)",
-				    format_flow(expired_flows[i]),
-				    expired_flows[i]);
+		if (max_usec != 0) {
+			gettimeofday(&now, NULL);
+			if ((now.tv_sec - start.tv_sec) * 1000000L +
+			    (now.tv_usec - start.tv_usec) >= (long)max_usec) {
+				truncated = expiry_due(expiry, ex,
+				    clock.tv_sec);
+				break;
 			}
-			update_statistics(ft, expired_flows[i]);
-			flow_put(ft, expired_flows[i]);
 		}
+	}
+	free(expired_flows);
 
-		free(expired_flows);
+	if (verbose_flag)
+		logit(LOG_DEBUG, "Finished scan %d flow(s) evicted%s",
+		    total_expired, truncated ? " (budget exhausted)" : "");
+
+	/* Track how long overdue flows have been waiting for export */
+	ft->param.expiry_slices++;
+	if (truncated) {
+		ft->param.expiry_slices_truncated++;
+		if (!timerisset(&ft->param.expiry_backlog_since))
+			ft->param.expiry_backlog_since = start;
+	} else if (timerisset(&ft->param.expiry_backlog_since)) {
+		age = timeval_sub_ms(&start,
+		    &ft->param.expiry_backlog_since) / 1000.0;
+		if (age > ft->param.expiry_backlog_max)
+			ft->param.expiry_backlog_max = age;
+		timerclear(&ft->param.expiry_backlog_since);
 	}
 
-	return (r == -1 ? -1 : num_expired);
+	return (r == -1 ? -1 : total_expired);
 }
 
 /*
@@ -953,7 +1502,7 @@ static void
 force_expire(struct FLOWTRACK *ft, u_int32_t num_to_expire)
 {
 	struct EXPIRY *expiry, **expiryv;
-	int i;
+	int i, pending;
 
 	/* XXX move all overflow processing here (maybe) */
 	if (verbose_flag)
@@ -984,13 +1533,21 @@ force_expire(struct FLOWTRACK *ft, u_int32_t num_to_expire)
 		return;
 	}
 
-	/* Make the list of flows to expire */
-	i = 0;
+	/*
+	 * Make the list of flows to expire. Flows already queued for
+	 * immediate expiry (e.g. left over from a budget-limited expiry
+	 * pass) count towards the total.
+	 */
+	i = pending = 0;
 	EXPIRY_FOREACH(expiry, EXPIRIES, &ft->expiries) {
-		if (i >= num_to_expire)
+		if (pending + i >= num_to_expire)
 			break;
-		expiryv[i++] = expiry;
+		if (expiry->expires_at == 0)
+			pending++;
+		else
+			expiryv[i++] = expiry;
 	}
+	num_to_expire -= pending;
 	if (i < num_to_expire) {
 		logit(LOG_ERR, "Needed to expire %d flows, "
 		    "but only %d active", num_to_expire, i);
@@ -1008,6 +1565,43 @@ force_expire(struct FLOWTRACK *ft, u_int32_t num_to_expire)
 	/* XXX - this is overcomplicated, perhaps use a separate queue */
 }
 
+/*
+ * Expiry processing happens every recheck_rate seconds or whenever we
+ * have exceeded the maximum number of active flows
+ */
+static void
+expire_flows(struct FLOWTRACK *ft, struct NETFLOW_TARGET *targets,
+    int offline)
+{
+	if (ft->param.num_flows <= ft->param.max_flows &&
+	    next_expire(ft) != 0)
+		return;
+	for (;;) {
+		/*
+		 * If we are reading from a capture file, we never
+		 * expire flows based on time - instead we only
+		 * expire flows when the flow table is full. The
+		 * exception is when time is taken from the packets.
+		 */
+		if (check_expired(ft, targets,
+		    !offline || ft->param.packet_clock ?
+		    CE_EXPIRE_NORMAL : CE_EXPIRE_FORCED) < 0)
+			logit(LOG_WARNING, "Unable to export flows");
+
+		/*
+		 * If we are over max_flows, force-expire the oldest
+		 * out first and immediately reprocess to evict them,
+		 * unless the expiry budget has run out - in that case
+		 * they will be evicted on the next pass.
+		 */
+		if (ft->param.num_flows <= ft->param.max_flows)
+			break;
+		force_expire(ft, ft->param.num_flows - ft->param.max_flows);
+		if (timerisset(&ft->param.expiry_backlog_since))
+			break;
+	}
+}
+
 /* Delete all flows that we know about without processing */
 static int
 delete_all_flows(struct FLOWTRACK *ft)
@@ -1037,8 +1631,10 @@ delete_all_flows(struct FLOWTRACK *ft)
  * and the tree of expiry events.
  */
 static int
-statistics(struct FLOWTRACK *ft, FILE *out, pcap_t *pcap)
+statistics(struct FLOWTRACK *ft, struct NETFLOW_TARGET *targets, FILE *out)
 {
+	struct NETFLOW_TARGET *target;
+	struct EXPORT_QUEUE *q;
 	int i;
 	struct protoent *pe;
 	char proto[32];
@@ -1047,8 +1643,9 @@ statistics(struct FLOWTRACK *ft, FILE *out, pcap_t *pcap)
 	fprintf(out, "Number of active flows: %d\n", ft->param.num_flows);
 	fprintf(out, "Packets processed: %"PRIu64"\n", ft->param.total_packets);
 	if (ft->param.non_sampled_packets)
-		fprintf(out, "Packets non-sampled: %"PRIu64"\n",
-			ft->param.non_sampled_packets);
+		fprintf(out, "Packets non-sampled: %"PRIu64"%s\n",
+			ft->param.non_sampled_packets,
+			ft->param.kernel_sampling ? " (estimated)" : "");
 	fprintf(out, "Fragments: %"PRIu64"\n", ft->param.frag_packets);
 	fprintf(out, "Ignored packets: %"PRIu64" (%"PRIu64" non-IP, %"PRIu64" too short)\n",
 	    ft->param.non_ip_packets + ft->param.bad_packets, ft->param.non_ip_packets, ft->param.bad_packets);
@@ -1056,14 +1653,118 @@ statistics(struct FLOWTRACK *ft, FILE *out, pcap_t *pcap)
 	    ft->param.flows_expired, ft->param.flows_force_expired);
 	fprintf(out, "Flows exported: %"PRIu64" (%"PRIu64" records) in %"PRIu64" packets (%"PRIu64" failures)\n",
 	    ft->param.flows_exported, ft->param.records_sent, ft->param.packets_sent, ft->param.flows_dropped);
+	if (ft->param.packets_sent != 0)
+		fprintf(out, "Records per packet: %.1f\n",
+		    (double)ft->param.records_sent / ft->param.packets_sent);
+	for (target = targets; target != NULL; target = target->next) {
+		fprintf(out, "Target %s: %"PRIu64" packets sent, %"PRIu64
+		    " failed%s\n", target->name, target->packets_sent,
+		    target->packets_failed,
+		    target->shared ? " (shared encoding)" : "");
+		if ((q = target->queue) != NULL && q->stream)
+			fprintf(out, "Target %s: %s, %"PRIu64" connections, "
+			    "%"PRIu64" packets discarded on disconnect\n",
+			    target->name, export_queue_state(target),
+			    q->connects, q->discarded);
+		if (q != NULL) {
+			fprintf(out, "Target %s: %u packets (%zu bytes) "
+			    "queued, %u at most, %"PRIu64" dropped on "
+			    "overflow\n", target->name, q->msgs, q->len,
+			    q->max_msgs, q->overflows);
+			fprintf(out, "Target %s: queueing delay %.1f ms "
+			    "average, %.1f ms max\n", target->name,
+			    target->packets_sent == 0 ? 0.0 :
+			    q->delay_usec / 1000.0 / target->packets_sent,
+			    q->max_delay_usec / 1000.0);
+		}
+		if (ft->param.balance != BALANCE_NONE)
+			fprintf(out, "Target %s: %"PRIu64" flows balanced, "
+			    "%"PRIu64" failures%s\n", target->name,
+			    target->flows_balanced, target->failures,
+			    target->down_until > time(NULL) ? " (down)" : "");
+	}
+	if (archive != NULL)
+		archive_statistics(archive, out);
+	if (arrow != NULL)
+		arrow_statistics(arrow, out);
+	if (ndjson != NULL)
+		ndjson_statistics(ndjson, out);
+	if (sflow != NULL)
+		sflow_statistics(sflow, out);
+	if (dedup != NULL)
+		dedup_statistics(dedup, out);
+	if (merge != NULL)
+		merge_statistics(merge, out);
+	if (num_workers > 1)
+		fprintf(out, "Read by %d workers, %"PRIu64" packets missed "
+		    "by the parallel scan\n", num_workers, shard_rescanned);
+	if (ft->param.active_timeout != 0)
+		fprintf(out, "Interim reports: %"PRIu64"\n",
+		    ft->param.flows_interim);
+
+	if (ft->param.expiry_max_flows != 0 || ft->param.expiry_max_usec != 0) {
+		struct timeval now;
+		double age = 0.0;
+
+		if (timerisset(&ft->param.expiry_backlog_since)) {
+			gettimeofday(&now, NULL);
+			age = timeval_sub_ms(&now,
+			    &ft->param.expiry_backlog_since) / 1000.0;
+		}
+		fprintf(out, "Expiry passes: %"PRIu64" (%"PRIu64" over budget)\n",
+		    ft->param.expiry_slices, ft->param.expiry_slices_truncated);
+		fprintf(out, "Expiry backlog age: %.3fs (max %.3fs)\n",
+		    age, age > ft->param.expiry_backlog_max ?
+		    age : ft->param.expiry_backlog_max);
+	}
+
+	if (ft->param.replay && ft->param.replay_packets != 0) {
+		struct timeval now;
+		struct rusage ru;
+		double wall, span, cpu;
+
+		gettimeofday(&now, NULL);
+		wall = timeval_sub_ms(&now, &ft->param.replay_wall_start) /
+		    1000.0;
+		span = timeval_sub_ms(&ft->param.packet_time,
+		    &ft->param.replay_first) / 1000.0;
+		if (wall < 0.001)
+			wall = 0.001;
+		fprintf(out, "Replay: %"PRIu64" packets in %.3fs "
+		    "(%.0f pps, %.2fx real time)\n", ft->param.replay_packets,
+		    wall, ft->param.replay_packets / wall, span / wall);
+		fprintf(out, "Replay export rate: %.0f flows/s, "
+		    "%.0f packets/s\n", ft->param.flows_exported / wall,
+		    ft->param.packets_sent / wall);
+		if (getrusage(RUSAGE_SELF, &ru) == 0) {
+			cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+			    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) /
+			    1000000.0;
+			fprintf(out, "Replay CPU time: %.3fs (%.2f us/packet, "
+			    "%.2f us/record)\n", cpu,
+			    cpu * 1e6 / ft->param.replay_packets,
+			    ft->param.records_sent == 0 ? 0.0 :
+			    cpu * 1e6 / ft->param.records_sent);
+		}
+	}
 
-	if (pcap_stats(pcap, &ps) == 0) {
-		fprintf(out, "Packets received by libpcap: %lu\n",
-		    (unsigned long)ps.ps_recv);
-		fprintf(out, "Packets dropped by libpcap: %lu\n",
-		    (unsigned long)ps.ps_drop);
-		fprintf(out, "Packets dropped by interface: %lu\n",
-		    (unsigned long)ps.ps_ifdrop);
+	for (i = 0; i < num_captures; i++) {
+		if (num_captures > 1)
+			fprintf(out, "Interface %s (idx: %u):\n",
+			    captures[i].name, captures[i].if_index);
+		if (captures[i].pcap != NULL &&
+		    pcap_stats(captures[i].pcap, &ps) == 0) {
+			fprintf(out, "Packets received by libpcap: %lu\n",
+			    (unsigned long)ps.ps_recv);
+			fprintf(out, "Packets dropped by libpcap: %lu\n",
+			    (unsigned long)ps.ps_drop);
+			fprintf(out, "Packets dropped by interface: %lu\n",
+			    (unsigned long)ps.ps_ifdrop);
+		}
+		if (dedup != NULL)
+			fprintf(out, "Duplicate packets suppressed: %"PRIu64
+			    "%s\n", captures[i].duplicates,
+			    captures[i].dedup_trusted ? " (trusted)" : "");
 	}
 
 	fprintf(out, "\n");
@@ -1116,9 +1817,11 @@ static void
 dump_flows(struct FLOWTRACK *ft, FILE *out)
 {
 	struct EXPIRY *expiry;
+	struct timeval tv;
 	time_t now;
 
-	now = time(NULL);
+	flowtrack_gettime(&ft->param, &tv);
+	now = tv.tv_sec;
 
 	EXPIRY_FOREACH(expiry, EXPIRIES, &ft->expiries) {
 		fprintf(out, "ACTIVE %s\n", format_flow(expiry->flow));
@@ -1208,6 +1911,79 @@ datalink_check(int linktype, const u_int8_t *pkt, u_int32_t caplen, int *af, u_i
 	return (dl->skiplen + vlan_size);
 }
 
+static int
+linktype_supported(int linktype)
+{
+	return (datalink_check(linktype, NULL, 0, NULL, NULL) != -1);
+}
+
+/*
+ * Delay a replayed packet until its offset from the first packet,
+ * scaled by the replay speed, has elapsed on the wall clock.
+ */
+static void
+replay_pace(struct FLOWTRACKPARAMETERS *param, const struct timeval *ts)
+{
+	struct timeval now;
+	struct timespec ts_wait;
+	double due, elapsed;
+
+	gettimeofday(&now, NULL);
+	if (param->replay_packets++ == 0) {
+		param->replay_wall_start = now;
+		param->replay_first = *ts;
+		return;
+	}
+	if (param->replay_speed <= 0.0)
+		return;
+
+	due = ((ts->tv_sec - param->replay_first.tv_sec) +
+	    (ts->tv_usec - param->replay_first.tv_usec) / 1000000.0) /
+	    param->replay_speed;
+	elapsed = (now.tv_sec - param->replay_wall_start.tv_sec) +
+	    (now.tv_usec - param->replay_wall_start.tv_usec) / 1000000.0;
+	/* Don't bother sleeping for less than a millisecond */
+	if (due - elapsed < 0.001)
+		return;
+
+	ts_wait.tv_sec = (time_t)(due - elapsed);
+	ts_wait.tv_nsec = (long)((due - elapsed - ts_wait.tv_sec) * 1e9);
+	while (nanosleep(&ts_wait, &ts_wait) == -1 && errno == EINTR &&
+	    !graceful_shutdown_request)
+		;
+}
+
+/*
+ * Advance the virtual clock (-a), running expiry processing inline as
+ * it passes each second so that flows leave the table when they would
+ * have on a live probe.
+ */
+static void
+packet_clock_tick(struct CB_CTXT *cb_ctxt, const struct pcap_pkthdr *phdr)
+{
+	struct FLOWTRACKPARAMETERS *param = &cb_ctxt->ft->param;
+	struct timeval tv;
+	int new_second;
+
+	if (!param->packet_clock)
+		return;
+	tv.tv_sec = phdr->ts.tv_sec;
+	tv.tv_usec = phdr->ts.tv_usec;
+	if (param->replay)
+		replay_pace(param, &tv);
+	if (!timerisset(&param->packet_time))
+		param->system_boot_time = tv;
+	/* Don't let the clock go backwards on reordered packets */
+	if (timercmp(&tv, &param->packet_time, >)) {
+		new_second = tv.tv_sec != param->packet_time.tv_sec;
+		param->packet_time = tv;
+		if (new_second && next_expire(cb_ctxt->ft) == 0 &&
+		    check_expired(cb_ctxt->ft, cb_ctxt->target,
+		    CE_EXPIRE_NORMAL) < 0)
+			logit(LOG_WARNING, "Unable to export flows");
+	}
+}
+
 /*
  * Per-packet callback function from libpcap. Pass the packet (if it is IP)
  * sans datalink headers to process_packet.
@@ -1218,48 +1994,664 @@ flow_cb(u_char *user_data, const struct pcap_pkthdr* phdr,
 {
 	int s, af = 0;
 	struct CB_CTXT *cb_ctxt = (struct CB_CTXT *)user_data;
+	struct FLOWTRACKPARAMETERS *param = &cb_ctxt->ft->param;
+	struct CAPTURE *cap = cb_ctxt->cap;
 	struct timeval tv;
 	u_int16_t vlanid = 0;
 
-	if (cb_ctxt->ft->param.option.sample &&
-	    (cb_ctxt->ft->param.total_packets +
-	     cb_ctxt->ft->param.non_sampled_packets) %
-	    cb_ctxt->ft->param.option.sample > 0) {
-		cb_ctxt->ft->param.non_sampled_packets++;
+	packet_clock_tick(cb_ctxt, phdr);
+
+	/* sFlow samples every packet captured, ahead of -s sampling */
+	if (sflow != NULL) {
+		if (sflow_packet(sflow, cap->sflow_source, pkt, phdr->caplen,
+		    phdr->len)) {
+			s = datalink_check(cap->linktype, pkt, phdr->caplen,
+			    &af, &vlanid);
+			sflow_sample(sflow, cap->sflow_source, pkt,
+			    phdr->caplen, phdr->len, s, af, vlanid);
+		}
+		if (!cb_ctxt->track)
+			return;
+	}
+
+	/* Copies of a packet already seen on another interface */
+	s = -1;
+	if (dedup != NULL) {
+		s = datalink_check(cap->linktype, pkt, phdr->caplen,
+		    &af, &vlanid);
+		if (s >= 0 && !cap->dedup_trusted &&
+		    dedup_check(dedup, cap - captures, af, pkt + s,
+		    phdr->caplen - s, (u_int64_t)phdr->ts.tv_sec * 1000 +
+		    phdr->ts.tv_usec / 1000)) {
+			cap->duplicates++;
+			return;
+		}
+	}
+
+	/* Hash sampling needs the flow key, so is done in process_packet */
+	if (cap->kernel_sampling) {
+		/* The socket filter passes one packet for every rate seen */
+		param->non_sampled_packets += param->option.sample - 1;
+	} else if (param->option.sample != 0 &&
+	    ((param->option.sample_algorithm == SAMPLE_DETERMINISTIC &&
+	    (param->total_packets + param->non_sampled_packets) %
+	    param->option.sample > 0) ||
+	    (param->option.sample_algorithm == SAMPLE_RANDOM &&
+	    random() % param->option.sample > 0))) {
+		param->non_sampled_packets++;
 		return;
 	}
-	s = datalink_check(cb_ctxt->linktype, pkt, phdr->caplen, &af, &vlanid);
+	if (dedup == NULL)
+		s = datalink_check(cap->linktype, pkt, phdr->caplen,
+		    &af, &vlanid);
 	if (s < 0 || (!cb_ctxt->want_v6 && af == AF_INET6)) {
 		cb_ctxt->ft->param.non_ip_packets++;
 	} else {
 		tv.tv_sec = phdr->ts.tv_sec;
 		tv.tv_usec = phdr->ts.tv_usec;
 		if (process_packet(cb_ctxt->ft, pkt + s, af, phdr->caplen - s,
-				   phdr->len - s, vlanid, &tv) == PP_MALLOC_FAIL)
+				   phdr->len - s, vlanid, cap->if_index,
+				   &tv) == PP_MALLOC_FAIL)
 			cb_ctxt->fatal = 1;
 	}
 }
 
-static void
-print_timeouts(struct FLOWTRACK *ft, FILE *out)
+/*
+ * Feed up to max packets from the -r files to flow_cb(), in time order.
+ * Returns the number fed, 0 once the files are read or -1 on error.
+ */
+static int
+merge_dispatch(struct CB_CTXT *cb_ctxt, int max)
 {
-	fprintf(out, "           TCP timeout: %ds\n", ft->param.tcp_timeout);
-	fprintf(out, "  TCP post-RST timeout: %ds\n", ft->param.tcp_rst_timeout);
-	fprintf(out, "  TCP post-FIN timeout: %ds\n", ft->param.tcp_fin_timeout);
-	fprintf(out, "           UDP timeout: %ds\n", ft->param.udp_timeout);
-	fprintf(out, "          ICMP timeout: %ds\n", ft->param.icmp_timeout);
-	fprintf(out, "       General timeout: %ds\n", ft->param.general_timeout);
-	fprintf(out, "      Maximum lifetime: %ds\n", ft->param.maximum_lifetime);
-	fprintf(out, "       Expiry interval: %ds\n", ft->param.expiry_interval);
+	struct pcap_pkthdr *hdr;
+	const u_char *data;
+	int n, r, group;
+
+	for (n = 0; n < max && !cb_ctxt->fatal; n++) {
+		if ((r = merge_next(merge, &hdr, &data, &group)) == -1)
+			return (-1);
+		if (r == 0)
+			break;
+		cb_ctxt->cap = &captures[group];
+		flow_cb((u_char *)cb_ctxt, hdr, data);
+	}
+	return (n);
 }
 
-static int
-accept_control(int lsock, struct NETFLOW_TARGET *target, struct FLOWTRACK *ft,
-    pcap_t *pcap, int *exit_request, int *stop_collection_flag)
-{
-	char buf[64], *p;
+/*
+ * Parallel reading of one capture file (-J).
+ *
+ * Each worker process tracks the flows of a share of the address pairs,
+ * chosen by a hash of the pair that is the same in both directions, in
+ * a flow table of its own. The file is mapped by every worker and read
+ * in windows: first each worker scans its own slice of a window,
+ * resynchronising on the record headers where the slice starts, and
+ * notes in a shared map which worker owns each packet. Once the whole
+ * window is mapped, every worker walks all of it, feeding its own
+ * packets to flow_cb() and just advancing the clock on the others', so
+ * flows expire at the same packet times as in a sequential read. Each
+ * worker sends its expired flows to the parent, which exports them.
+ */
+
+/*
+ * A map entry is the owning worker + 1 (or SHARD_FILTERED) above the
+ * low bits of the record's offset. Zero means unmapped.
+ */
+#define SHARD_HASH_INIT		0x5eed5eedU
+#define SHARD_FILTERED		0xff
+#define SHARD_ENTRY(owner, off)	((u_int16_t)((owner) << 4 | ((off) & 15)))
+#define SHARD_WINDOW_MAP	(SHARD_WINDOW / 16)	/* Entries per window */
+
+struct SHARD_CTX {
+	struct PCAPMAP pm;
+	u_int16_t *maps;		/* SHARD_MAPS windows, shared */
+	size_t num_windows;
+	int linktype;
+	struct bpf_program *filter;	/* NULL if none */
+
+	/* Parent only */
+	int go_fd[MAX_WORKERS];		/* Window release, -1 once stopped */
+	u_int *mapped;			/* Workers done mapping each window */
+	size_t next_go;			/* First window not released */
+	int done;			/* Workers finished */
+	int finished[MAX_WORKERS];	/* Each worker has sent DONE */
+};
+
+/* The worker tracking a packet's flow */
+static int
+packet_owner(int linktype, const u_char *pkt, u_int32_t caplen)
+{
+	u_char key[2 * 16];
+	const u_char *a, *b, *t;
+	u_int16_t vlanid;
+	size_t len;
+	int s, af;
+
+	/* Worker 0 counts the packets that aren't IP */
+	if ((s = datalink_check(linktype, pkt, caplen, &af, &vlanid)) < 0)
+		return (0);
+	pkt += s;
+	caplen -= s;
+	if (af == AF_INET && caplen >= sizeof(struct ip)) {
+		a = pkt + offsetof(struct ip, ip_src);
+		len = 4;
+	} else if (af == AF_INET6 && caplen >= sizeof(struct ip6_hdr)) {
+		a = pkt + offsetof(struct ip6_hdr, ip6_src);
+		len = 16;
+	} else
+		return (0);
+	/* The destination follows the source in both headers */
+	b = a + len;
+	if (memcmp(a, b, len) > 0) {
+		t = a;
+		a = b;
+		b = t;
+	}
+	memcpy(key, a, len);
+	memcpy(key + len, b, len);
+	return (bob_hash(key, 2 * len, SHARD_HASH_INIT) % num_workers);
+}
+
+static u_int16_t
+shard_classify(const struct SHARD_CTX *sc, size_t off,
+    const struct pcap_pkthdr *hdr, const u_char *data)
+{
+	if (sc->filter != NULL && !pcap_offline_filter(sc->filter, hdr, data))
+		return (SHARD_ENTRY(SHARD_FILTERED, off));
+	return (SHARD_ENTRY(packet_owner(sc->linktype, data,
+	    hdr->caplen) + 1, off));
+}
+
+/* The bytes of the file in window w, and its map */
+static u_int16_t *
+shard_window(const struct SHARD_CTX *sc, size_t w, size_t *start,
+    size_t *end)
+{
+	*start = PCAPMAP_HDRLEN + w * (size_t)SHARD_WINDOW;
+	*end = MIN(*start + SHARD_WINDOW, sc->pm.len);
+	return (sc->maps + (w % SHARD_MAPS) * SHARD_WINDOW_MAP);
+}
+
+/* Note the owner of the packets starting in worker me's slice of window w */
+static void
+shard_map(const struct SHARD_CTX *sc, int me, size_t w)
+{
+	struct pcap_pkthdr hdr;
+	const u_char *data;
+	u_int16_t *map;
+	size_t start, end, first, last, off, next;
+
+	map = shard_window(sc, w, &start, &end);
+	/* Slices start on an entry boundary, so none share an entry */
+	first = start + ((u_int64_t)(end - start) * me / num_workers &
+	    ~(u_int64_t)15);
+	last = me == num_workers - 1 ? end : start +
+	    ((u_int64_t)(end - start) * (me + 1) / num_workers &
+	    ~(u_int64_t)15);
+	if (first >= last)
+		return;
+	memset(map + (first - start) / 16, '\0',
+	    (last - first + 15) / 16 * sizeof(*map));
+	pcapmap_prefetch(&sc->pm, first, last);
+
+	memset(&hdr, '\0', sizeof(hdr));
+	for (off = pcapmap_resync(&sc->pm, first, last); off < last;
+	    off = next) {
+		if ((next = pcapmap_record(&sc->pm, off, &hdr, &data)) == 0)
+			break;
+		map[(off - start) / 16] = shard_classify(sc, off, &hdr, data);
+	}
+}
+
+/* Worker me of the -J set. Never returns */
+static void
+shard_worker(struct SHARD_CTX *sc, struct CB_CTXT *cb_ctxt, int me,
+    int out_fd, int go_fd)
+{
+	struct FLOWTRACK *ft = cb_ctxt->ft;
+	struct pcap_pkthdr hdr;
+	const u_char *data;
+	u_int16_t *map, entry;
+	size_t w, start, end, off, next, bufsize;
+	u_int64_t rescanned;
+	u_int batch;
+	char go;
+
+	/* Room for a full batch of flows in one write */
+	bufsize = sizeof(struct SHARD_MSG) + SHARD_BATCH * sizeof(struct FLOW);
+	if ((shard_out = fdopen(out_fd, "w")) == NULL ||
+	    setvbuf(shard_out, malloc(bufsize), _IOFBF, bufsize) != 0)
+		_exit(1);
+	cb_ctxt->cap = &captures[0];
+
+	memset(&hdr, '\0', sizeof(hdr));
+	rescanned = 0;
+	batch = 0;
+	off = PCAPMAP_HDRLEN;
+	if (sc->num_windows > 0) {
+		shard_map(sc, me, 0);
+		shard_send(ft, SHARD_MSG_MAPPED, 0, NULL, 0);
+	}
+	for (w = 0; w < sc->num_windows && !graceful_shutdown_request; w++) {
+		/* Map the next window while the others finish this one */
+		if (w + 1 < sc->num_windows) {
+			shard_map(sc, me, w + 1);
+			shard_send(ft, SHARD_MSG_MAPPED, w + 1, NULL, 0);
+		}
+		if (fflush(shard_out) == EOF)
+			_exit(1);
+		/* The parent closes the pipe to stop early */
+		if (read(go_fd, &go, 1) != 1)
+			break;
+
+		map = shard_window(sc, w, &start, &end);
+		while (off < end && !graceful_shutdown_request) {
+			if ((next = pcapmap_record(&sc->pm, off, &hdr,
+			    &data)) == 0) {
+				if (me == 0)
+					logit(LOG_WARNING, "%s: truncated or "
+					    "corrupt record at offset %zu, "
+					    "skipping the rest of the file",
+					    cb_ctxt->cap->name, off);
+				goto done;
+			}
+			entry = map[(off - start) / 16];
+			if (entry == 0 || (entry & 15) != (off & 15)) {
+				entry = shard_classify(sc, off, &hdr, data);
+				rescanned++;
+			}
+			off = next;
+			if (entry >> 4 == SHARD_FILTERED)
+				continue;
+			if ((entry >> 4) - 1 == me) {
+				flow_cb((u_char *)cb_ctxt, &hdr, data);
+				if (cb_ctxt->fatal)
+					_exit(1);
+			} else
+				packet_clock_tick(cb_ctxt, &hdr);
+			/* Expire where a sequential read's main loop would */
+			if (++batch == ft->param.max_flows) {
+				expire_flows(ft, cb_ctxt->target, 1);
+				batch = 0;
+			}
+		}
+	}
+ done:
+	if (batch != 0)
+		expire_flows(ft, cb_ctxt->target, 1);
+	check_expired(ft, cb_ctxt->target, CE_EXPIRE_ALL);
+	if (shard_send(ft, SHARD_MSG_DONE, rescanned, &ft->param,
+	    sizeof(ft->param)) == -1 || fclose(shard_out) == EOF)
+		_exit(1);
+	_exit(0);
+}
+
+/* Add a worker's packet and expiry counters to the parent's */
+static void
+shard_add_counters(struct FLOWTRACKPARAMETERS *p,
+    const struct FLOWTRACKPARAMETERS *w)
+{
+	p->total_packets += w->total_packets;
+	p->non_sampled_packets += w->non_sampled_packets;
+	p->frag_packets += w->frag_packets;
+	p->non_ip_packets += w->non_ip_packets;
+	p->bad_packets += w->bad_packets;
+	p->flows_force_expired += w->flows_force_expired;
+	p->expired_general += w->expired_general;
+	p->expired_tcp += w->expired_tcp;
+	p->expired_tcp_rst += w->expired_tcp_rst;
+	p->expired_tcp_fin += w->expired_tcp_fin;
+	p->expired_udp += w->expired_udp;
+	p->expired_icmp += w->expired_icmp;
+	p->expired_maxlife += w->expired_maxlife;
+	p->expired_overbytes += w->expired_overbytes;
+	p->expired_maxflows += w->expired_maxflows;
+	p->expired_flush += w->expired_flush;
+	p->expiry_slices += w->expiry_slices;
+	p->expiry_slices_truncated += w->expiry_slices_truncated;
+	p->expiry_backlog_max = MAX(p->expiry_backlog_max,
+	    w->expiry_backlog_max);
+}
+
+/* Let the workers go no further than the windows already released */
+static void
+shard_stop(struct SHARD_CTX *sc)
+{
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		if (sc->go_fd[i] != -1)
+			close(sc->go_fd[i]);
+		sc->go_fd[i] = -1;
+	}
+}
+
+/* Stop the workers still running; the others would wait for them forever */
+static void
+shard_abort(struct SHARD_CTX *sc, const pid_t *pid, const int *out_fd)
+{
+	int i;
+
+	shard_stop(sc);
+	for (i = 0; i < num_workers; i++) {
+		if (out_fd[i] != -1)
+			kill(pid[i], SIGKILL);
+	}
+}
+
+static size_t
+shard_payload(const struct SHARD_MSG *msg)
+{
+	switch (msg->type) {
+	case SHARD_MSG_FLOWS:
+	case SHARD_MSG_ACCOUNT:
+		return (MIN(msg->count, SHARD_BATCH) * sizeof(struct FLOW));
+	case SHARD_MSG_DONE:
+		return (sizeof(struct FLOWTRACKPARAMETERS));
+	}
+	return (0);
+}
+
+/* Handle a message from worker. Returns -1 on failure */
+static int
+shard_message(struct FLOWTRACK *ft, struct NETFLOW_TARGET *targets,
+    struct SHARD_CTX *sc, int worker, const struct SHARD_MSG *msg,
+    const u_char *payload)
+{
+	struct FLOW *flows[SHARD_BATCH];
+	struct FLOWTRACKPARAMETERS wp;
+	u_int i, n;
+	ssize_t r;
+	int j;
+
+	/* Export with the worker's clock, as a sequential read would */
+	ft->param.packet_time = msg->now;
+	ft->param.system_boot_time = msg->boot;
+
+	switch (msg->type) {
+	case SHARD_MSG_MAPPED:
+		if (msg->count >= sc->num_windows)
+			break;
+		sc->mapped[msg->count]++;
+		while (sc->next_go < sc->num_windows &&
+		    sc->mapped[sc->next_go] == (u_int)num_workers) {
+			for (j = 0; j < num_workers; j++) {
+				if (sc->go_fd[j] == -1)
+					continue;
+				while ((r = write(sc->go_fd[j], "", 1)) == -1 &&
+				    errno == EINTR)
+					;
+				if (r != 1) {
+					logit(LOG_ERR, "Worker %d: write: %s",
+					    j, r == -1 ? strerror(errno) :
+					    "short write");
+					close(sc->go_fd[j]);
+					sc->go_fd[j] = -1;
+					return (-1);
+				}
+			}
+			sc->next_go++;
+		}
+		return (0);
+	case SHARD_MSG_FLOWS:
+	case SHARD_MSG_ACCOUNT:
+		if (msg->count > SHARD_BATCH)
+			break;
+		n = msg->count;
+		for (i = 0; i < n; i++) {
+			if ((flows[i] = flow_get(ft)) == NULL) {
+				logit(LOG_ERR, "Out of memory");
+				while (i > 0)
+					flow_put(ft, flows[--i]);
+				return (-1);
+			}
+			memcpy(flows[i], payload + i * sizeof(struct FLOW),
+			    sizeof(struct FLOW));
+			flows[i]->expiry = NULL;
+			/* Flow IDs are only unique within a worker */
+			flows[i]->flow_seq = flows[i]->flow_seq * num_workers +
+			    worker;
+		}
+		if (msg->type == SHARD_MSG_FLOWS) {
+			if (export_flows(ft, targets, flows, n) < 0)
+				logit(LOG_WARNING, "Unable to export flows");
+			return (0);
+		}
+		for (i = 0; i < n; i++) {
+			update_statistics(ft, flows[i]);
+			flow_put(ft, flows[i]);
+		}
+		return (0);
+	case SHARD_MSG_DONE:
+		memcpy(&wp, payload, sizeof(wp));
+		shard_add_counters(&ft->param, &wp);
+		shard_rescanned += msg->count;
+		sc->finished[worker] = 1;
+		sc->done++;
+		return (0);
+	}
+	logit(LOG_ERR, "Bad message from worker %d", worker);
+	return (-1);
+}
+
+/*
+ * Read the capture file at path with num_workers worker processes,
+ * exporting the flows they expire. Returns -1 on failure.
+ */
+static int
+shard_run(struct FLOWTRACK *ft, struct NETFLOW_TARGET *targets,
+    struct CB_CTXT *cb_ctxt, const char *path, const char *bpf_prog)
+{
+	struct pollfd pl[MAX_WORKERS + MAX_EXPORT_TARGETS];
+	struct SHARD_CTX sc;
+	struct SHARD_MSG msg;
+	struct bpf_program prog;
+	pcap_t *dead = NULL;
+	pid_t pid[MAX_WORKERS];
+	int out_fd[MAX_WORKERS], pfd[2], gfd[2];
+	u_char *buf[MAX_WORKERS];
+	size_t have[MAX_WORKERS], bufsize, used, need;
+	ssize_t n;
+	int i, j, nfds, timeout, running, status, ret;
+
+	memset(&sc, '\0', sizeof(sc));
+	if (pcapmap_open(&sc.pm, path) == -1)
+		return (-1);
+	sc.linktype = captures[0].linktype;
+	sc.num_windows = (sc.pm.len - PCAPMAP_HDRLEN + SHARD_WINDOW - 1) /
+	    SHARD_WINDOW;
+	if ((sc.mapped = calloc(sc.num_windows + 1,
+	    sizeof(*sc.mapped))) == NULL) {
+		logit(LOG_ERR, "Out of memory");
+		pcapmap_close(&sc.pm);
+		return (-1);
+	}
+	if ((sc.maps = mmap(NULL, SHARD_MAPS * SHARD_WINDOW_MAP *
+	    sizeof(*sc.maps), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON,
+	    -1, 0)) == MAP_FAILED) {
+		logit(LOG_ERR, "mmap: %s", strerror(errno));
+		free(sc.mapped);
+		pcapmap_close(&sc.pm);
+		return (-1);
+	}
+	if (bpf_prog != NULL) {
+		if ((dead = pcap_open_dead(sc.linktype,
+		    sc.pm.snaplen != 0 ? sc.pm.snaplen :
+		    PCAPMAP_MAX_CAPLEN)) == NULL ||
+		    pcap_compile(dead, &prog, bpf_prog, 1, 0) == -1) {
+			logit(LOG_ERR, "pcap_compile(\"%s\"): %s", bpf_prog,
+			    dead == NULL ? "out of memory" : pcap_geterr(dead));
+			ret = -1;
+			goto out;
+		}
+		sc.filter = &prog;
+	}
+
+	/* Workers inherit anything still buffered */
+	fflush(NULL);
+	bufsize = sizeof(msg) + MAX(SHARD_BATCH * sizeof(struct FLOW),
+	    sizeof(struct FLOWTRACKPARAMETERS));
+	ret = 0;
+	for (running = 0; running < num_workers; running++) {
+		i = running;
+		if ((buf[i] = malloc(bufsize)) == NULL) {
+			logit(LOG_ERR, "Out of memory");
+			ret = -1;
+			break;
+		}
+		if (pipe(pfd) == -1 || pipe(gfd) == -1) {
+			logit(LOG_ERR, "pipe: %s", strerror(errno));
+			free(buf[i]);
+			ret = -1;
+			break;
+		}
+		if ((pid[i] = fork()) == -1) {
+			logit(LOG_ERR, "fork: %s", strerror(errno));
+			close(pfd[0]);
+			close(pfd[1]);
+			close(gfd[0]);
+			close(gfd[1]);
+			free(buf[i]);
+			ret = -1;
+			break;
+		}
+		if (pid[i] == 0) {
+			for (j = 0; j < i; j++) {
+				close(out_fd[j]);
+				close(sc.go_fd[j]);
+			}
+			close(pfd[0]);
+			close(gfd[1]);
+			shard_worker(&sc, cb_ctxt, i, pfd[1], gfd[0]);
+		}
+		close(pfd[1]);
+		close(gfd[0]);
+		out_fd[i] = pfd[0];
+		sc.go_fd[i] = gfd[1];
+		have[i] = 0;
+	}
+	num_workers = running;
+	if (ret == -1)
+		shard_stop(&sc);
+
+	/* Export what the workers send until they have all finished */
+	while (running > 0) {
+		export_queue_service(targets);
+		if (graceful_shutdown_request || ret == -1 || sc.done > 0)
+			shard_stop(&sc);
+
+		timeout = -1;
+		for (i = 0; i < num_workers; i++) {
+			pl[i].fd = out_fd[i];
+			pl[i].events = POLLIN;
+			pl[i].revents = 0;
+		}
+		nfds = num_workers + export_queue_pollfds(targets,
+		    pl + num_workers, &timeout);
+		if (poll(pl, nfds, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			logit(LOG_ERR, "poll: %s", strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < num_workers; i++) {
+			if (pl[i].revents == 0)
+				continue;
+			n = read(out_fd[i], buf[i] + have[i],
+			    bufsize - have[i]);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				if (n == -1)
+					logit(LOG_ERR, "read: %s",
+					    strerror(errno));
+				close(out_fd[i]);
+				out_fd[i] = -1;
+				running--;
+				if (!sc.finished[i]) {
+					if (n == 0 && ret == 0)
+						logit(LOG_ERR, "Worker %d "
+						    "exited early", i);
+					ret = -1;
+					shard_abort(&sc, pid, out_fd);
+				}
+				continue;
+			}
+			have[i] += n;
+			for (used = 0; have[i] - used >= sizeof(msg);
+			    used += need) {
+				memcpy(&msg, buf[i] + used, sizeof(msg));
+				need = sizeof(msg) + shard_payload(&msg);
+				if (have[i] - used < need)
+					break;
+				if (shard_message(ft, targets, &sc, i, &msg,
+				    buf[i] + used + sizeof(msg)) == -1) {
+					ret = -1;
+					shard_abort(&sc, pid, out_fd);
+				}
+			}
+			memmove(buf[i], buf[i] + used, have[i] - used);
+			have[i] -= used;
+		}
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		if (ret == -1 && out_fd[i] != -1)
+			kill(pid[i], SIGKILL);
+		if (out_fd[i] != -1)
+			close(out_fd[i]);
+		free(buf[i]);
+	}
+	shard_stop(&sc);
+	for (i = 0; i < num_workers; i++) {
+		if (waitpid(pid[i], &status, 0) == -1 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			if (ret == 0)
+				logit(LOG_ERR, "Worker %d failed", i);
+			ret = -1;
+		}
+	}
+	if (sc.filter != NULL)
+		pcap_freecode(&prog);
+ out:
+	if (dead != NULL)
+		pcap_close(dead);
+	munmap(sc.maps, SHARD_MAPS * SHARD_WINDOW_MAP * sizeof(*sc.maps));
+	free(sc.mapped);
+	pcapmap_close(&sc.pm);
+	if (ret == 0)
+		logit(LOG_NOTICE, "Shutting down after pcap EOF");
+	return (ret);
+}
+
+static void
+print_timeouts(struct FLOWTRACK *ft, FILE *out)
+{
+	fprintf(out, "           TCP timeout: %ds\n", ft->param.tcp_timeout);
+	fprintf(out, "  TCP post-RST timeout: %ds\n", ft->param.tcp_rst_timeout);
+	fprintf(out, "  TCP post-FIN timeout: %ds\n", ft->param.tcp_fin_timeout);
+	fprintf(out, "           UDP timeout: %ds\n", ft->param.udp_timeout);
+	fprintf(out, "          ICMP timeout: %ds\n", ft->param.icmp_timeout);
+	fprintf(out, "       General timeout: %ds\n", ft->param.general_timeout);
+	fprintf(out, "      Maximum lifetime: %ds\n", ft->param.maximum_lifetime);
+	fprintf(out, "       Expiry interval: %ds\n", ft->param.expiry_interval);
+	fprintf(out, "        Active timeout: %ds\n", ft->param.active_timeout);
+	fprintf(out, "     Template interval: %ds\n",
+	    ft->param.template_interval);
+	fprintf(out, "      Template packets: %u\n",
+	    ft->param.template_packets);
+}
+
+static int
+accept_control(int lsock, struct NETFLOW_TARGET *target, struct FLOWTRACK *ft,
+    int *exit_request, int *stop_collection_flag)
+{
+	char buf[64], *p;
 	FILE *ctlf;
 	int fd, ret;
+	struct NETFLOW_TARGET *t;
 
 	if ((fd = accept(lsock, NULL, NULL)) == -1) {
 		logit(LOG_ERR, "ctl accept: %s - exiting",
@@ -1304,12 +2696,14 @@ accept_control(int lsock, struct NETFLOW_TARGET *target, struct FLOWTRACK *ft,
 		*exit_request = 1;
 		ret = 1;
 	} else if (strcmp(buf, "expire-all") == 0) {
-		netflow9_resend_template();
+		for (t = target; t != NULL; t = t->next)
+			export_template_reset(&t->tmpl);
 		fprintf(ctlf, "softflowd[%u]: Expired %d flows.\n", (unsigned int)getpid(),
 		    check_expired(ft, target, CE_EXPIRE_ALL));
 		ret = 0;
 	} else if (strcmp(buf, "send-template") == 0) {
-		netflow9_resend_template();
+		for (t = target; t != NULL; t = t->next)
+			export_template_reset(&t->tmpl);
 		fprintf(ctlf, "softflowd[%u]: Template will be sent at "
 		    "next flow export\n", (unsigned int)getpid());
 		ret = 0;
@@ -1321,7 +2715,7 @@ accept_control(int lsock, struct NETFLOW_TARGET *target, struct FLOWTRACK *ft,
 		fprintf(ctlf, "softflowd[%u]: Accumulated statistics "
 		    "since %s UTC:\n", (unsigned int)getpid(),
 		    format_time(ft->param.system_boot_time.tv_sec));
-		statistics(ft, ctlf, pcap);
+		statistics(ft, target, ctlf);
 		ret = 0;
 	} else if (strcmp(buf, "debug+") == 0) {
 		fprintf(ctlf, "softflowd[%u]: Debug level increased.\n",
@@ -1460,38 +2854,83 @@ unix_listener(const char *path)
 	return (s);
 }
 
-static void
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER) && \
+    defined(SKF_AD_RANDOM)
+/*
+ * Attach a socket filter that passes 1 in rate packets at random ahead
+ * of the compiled filter prog, so unsampled packets are dropped in the
+ * kernel instead of being copied to us. Returns 0 on success or -1 if
+ * the kernel won't take it.
+ */
+static int
+attach_sampling_filter(pcap_t *pcap, const struct bpf_program *prog,
+    u_int32_t rate)
+{
+	struct sock_filter *insns;
+	struct sock_fprog fprog;
+	u_int i, n;
+	int r;
+
+	n = 4 + prog->bf_len;
+	if (n > BPF_MAXINSNS ||
+	    (insns = calloc(n, sizeof(*insns))) == NULL)
+		return (-1);
+
+	/* A = random() % rate; if (A != 0) drop */
+	insns[0].code = BPF_LD|BPF_W|BPF_ABS;
+	insns[0].k = SKF_AD_OFF + SKF_AD_RANDOM;
+	insns[1].code = BPF_ALU|BPF_MOD|BPF_K;
+	insns[1].k = rate;
+	insns[2].code = BPF_JMP|BPF_JEQ|BPF_K;
+	insns[2].jt = 1;
+	insns[3].code = BPF_RET|BPF_K;
+	insns[3].k = 0;
+	/* Jumps are relative, so the filter can follow unchanged */
+	for (i = 0; i < prog->bf_len; i++) {
+		insns[4 + i].code = prog->bf_insns[i].code;
+		insns[4 + i].jt = prog->bf_insns[i].jt;
+		insns[4 + i].jf = prog->bf_insns[i].jf;
+		insns[4 + i].k = prog->bf_insns[i].k;
+	}
+
+	fprog.len = n;
+	fprog.filter = insns;
+	r = setsockopt(pcap_fileno(pcap), SOL_SOCKET, SO_ATTACH_FILTER,
+	    &fprog, sizeof(fprog));
+	free(insns);
+	return (r);
+}
+#endif
+
+/*
+ * Open an interface and attach the filter. With sample non-zero, try to
+ * have the kernel sample packets at random 1 in sample. Returns 1 if it
+ * does, 0 otherwise.
+ */
+static int
 setup_packet_capture( struct pcap **pcap,
                       int *linktype,
                       char *dev,
-                      char *capfile,
                       char *bpf_prog,
-                      int need_v6)
+                      int need_v6,
+                      u_int32_t sample)
 {
 	char ebuf[PCAP_ERRBUF_SIZE];
 	struct bpf_program prog_c;
 	u_int32_t bpf_mask, bpf_net;
+	int kernel_sampling = 0;
 
 	/* Open pcap */
-	if (dev != NULL) {
-		if ((*pcap = pcap_open_live(dev,
-		    need_v6 ? LIBPCAP_SNAPLEN_V6 : LIBPCAP_SNAPLEN_V4,
-		    1, 0, ebuf)) == NULL) {
-			fprintf(stderr, "pcap_open_live: %s\n", ebuf);
-			exit(1);
-		}
-		if (pcap_lookupnet(dev, &bpf_net, &bpf_mask, ebuf) == -1)
-			bpf_net = bpf_mask = 0;
-	} else {
-		if ((*pcap = pcap_open_offline(capfile, ebuf)) == NULL) {
-			fprintf(stderr, "pcap_open_offline(%s): %s\n",
-			    capfile, ebuf);
-			exit(1);
-		}
-		bpf_net = bpf_mask = 0;
+	if ((*pcap = pcap_open_live(dev,
+	    need_v6 ? LIBPCAP_SNAPLEN_V6 : LIBPCAP_SNAPLEN_V4,
+	    1, 0, ebuf)) == NULL) {
+		fprintf(stderr, "pcap_open_live: %s\n", ebuf);
+		exit(1);
 	}
+	if (pcap_lookupnet(dev, &bpf_net, &bpf_mask, ebuf) == -1)
+		bpf_net = bpf_mask = 0;
 	*linktype = pcap_datalink(*pcap);
-	if (datalink_check(*linktype, NULL, 0, NULL, NULL) == -1) {
+	if (!linktype_supported(*linktype)) {
 		fprintf(stderr, "Unsupported datalink type %d\n", *linktype);
 		exit(1);
 	}
@@ -1509,18 +2948,47 @@ setup_packet_capture( struct pcap **pcap,
 		}
 	}
 
+	/*
+	 * Sample in the kernel. The compiled filter is used as it is, so
+	 * this isn't done for "cooked" captures, where libpcap rewrites it
+	 * to suit the kernel.
+	 */
+	if (sample != 0) {
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER) && \
+    defined(SKF_AD_RANDOM)
+		if (bpf_prog == NULL &&
+		    pcap_compile(*pcap, &prog_c, "", 1, bpf_mask) == -1) {
+			fprintf(stderr, "pcap_compile(\"\"): %s\n",
+			    pcap_geterr(*pcap));
+			exit(1);
+		}
+#ifdef DLT_LINUX_SLL
+		if (*linktype != DLT_LINUX_SLL &&
+		    attach_sampling_filter(*pcap, &prog_c, sample) == 0)
+#else
+		if (attach_sampling_filter(*pcap, &prog_c, sample) == 0)
+#endif
+			kernel_sampling = 1;
+		pcap_freecode(&prog_c);
+#endif
+		if (!kernel_sampling)
+			fprintf(stderr, "Kernel sampling unavailable, "
+			    "sampling in userspace\n");
+	} else if (bpf_prog != NULL)
+		pcap_freecode(&prog_c);
+
 #ifdef BIOCLOCK
 	/*
-	 * If we are reading from an device (not a file), then
-	 * lock the underlying BPF device to prevent changes in the
+	 * Lock the underlying BPF device to prevent changes in the
 	 * unprivileged child
 	 */
-	if (dev != NULL && ioctl(pcap_fileno(*pcap), BIOCLOCK) < 0) {
+	if (ioctl(pcap_fileno(*pcap), BIOCLOCK) < 0) {
 		fprintf(stderr, "ioctl(BIOCLOCK) failed: %s\n",
 		    strerror(errno));
 		exit(1);
 	}
 #endif
+	return (kernel_sampling);
 }
 
 static void
@@ -1547,6 +3015,11 @@ init_flowtrack(struct FLOWTRACK *ft)
 	ft->param.general_timeout = DEFAULT_GENERAL_TIMEOUT;
 	ft->param.maximum_lifetime = DEFAULT_MAXIMUM_LIFETIME;
 	ft->param.expiry_interval = DEFAULT_EXPIRY_INTERVAL;
+	ft->param.active_timeout = DEFAULT_ACTIVE_TIMEOUT;
+	ft->param.export_packet_size = DEFAULT_EXPORT_PACKET_SIZE;
+	ft->param.counter_width = DEFAULT_COUNTER_WIDTH;
+	ft->param.template_interval = DEFAULT_TEMPLATE_INTERVAL;
+	ft->param.template_packets = DEFAULT_TEMPLATE_PACKETS;
 }
 
 static char *
@@ -1577,6 +3050,13 @@ argv_join(int argc, char **argv)
 	return (ret);
 }
 
+/* Where reports go: stdout, unless the Arrow stream (-o -) is on it */
+static FILE *
+report_out(void)
+{
+	return (arrow != NULL && arrow_to_stdout(arrow) ? stderr : stdout);
+}
+
 /* Display commandline usage information */
 static void
 usage(void)
@@ -1584,11 +3064,26 @@ usage(void)
 	fprintf(stderr,
 "Usage: %s [options] [bpf_program]\n"
 "This is %s version %s. Valid commandline options:\n"
-"  -i [idx:]interface      Specify interface to listen on\n"
-"  -r pcap_file            Specify packet capture file to read\n"
+"  -i [idx:]interface      Specify interface to listen on (may be repeated)\n"
+"  -r [idx:]pcap_file      Specify packet capture file(s) to read (may be a\n"
+"                          glob, and may be repeated)\n"
+"  -a                      Expire flows using packet timestamps (needs -r)\n"
+"  -R speed                Replay -r file at speed times real time (0: unpaced)\n"
+"  -J workers              Read a single -r file with this many processes\n"
 "  -t timeout=time         Specify named timeout\n"
 "  -m max_flows            Specify maximum number of flows to track (default %d)\n"
-"  -n host:port            Send Cisco NetFlow(tm)-compatible packets to host:port\n"
+"  -B flows[:usec]         Limit flows (and microseconds) spent per expiry pass\n"
+"  -n host:port[/ver[/proto]]\n"
+"                          Send Cisco NetFlow(tm)-compatible packets to host:port\n"
+"                          (may be given more than once)\n"
+"  -H flow|prefix[/len[/len6]]\n"
+"                          Balance flows across the -n targets by hash\n"
+"  -E packets[:bytes]      Limit export rate per target (per second)\n"
+"  -w path[,opts]          Write flows to a local archive\n"
+"  -o path|-[,opts]        Write flows as Apache Arrow IPC files (or stream)\n"
+"  -j path[,opts]          Write flows as elasticsearch bulk NDJSON files\n"
+"  -S host:port[,opts]     Act as an sFlow agent sending to host:port\n"
+"  -u msec[,opts]          Drop packets already seen on another interface\n"
 #ifdef USE_ELASTICSEARCH
 "  -e URL                  Send flows to elasticsearch node (index softflowd-YYYY.MM.DD, type softflow)\n"
 #endif
@@ -1598,6 +3093,10 @@ usage(void)
 "                          (default: %s)\n"
 "  -v 1|5|9|10             NetFlow export packet version\n"
 "                          (10 means IPFIX)\n"
+"  -M size                 Maximum NetFlow v9/IPFIX packet size (default %d)\n"
+"  -W 4|8|auto             NetFlow v9/IPFIX counter width in bytes (default %d)\n"
+"  -K packets              Resend v9/IPFIX templates after this many packets\n"
+"                          (default %d, 0: only by time)\n"
 "  -T                      NetFlow v9 template (needs netflow v9)\n"
 "  -L hoplimit             Set TTL/hoplimit for export datagrams\n"
 "  -l full|port|proto|ip|  Set flow tracking level (default: full)\n"
@@ -1608,7 +3107,8 @@ usage(void)
 "  -D                      Debug mode: foreground + verbosity + track v6 flows\n"
 "  -P udp|tcp|sctp         Specify transport layer protocol for exporting packets\n"
 "  -A sec|milli|micro|nano Specify absolute time format form exporting records\n"
-"  -s sampling_rate        Specify periodical sampling rate (denominator)\n"
+"  -s rate[:algorithm]     Sample 1 in rate packets; algorithm is\n"
+"                          deterministic (default), random or hash\n"
 "  -h                      Display this help\n"
 "\n"
 "Valid timeout names and default values:\n"
@@ -1619,13 +3119,17 @@ usage(void)
 "  icmp    (default %6d)"
 "  general (default %6d)\n"
 "  maxlife (default %6d)"
-"  expint  (default %6d)\n"
+"  expint  (default %6d)"
+"  active  (default %6d)"
+"  template (default %5d)\n"
 "\n" ,
 	    PROGNAME, PROGNAME, PROGVER, DEFAULT_MAX_FLOWS, DEFAULT_PIDFILE,
-	    DEFAULT_CTLSOCK, DEFAULT_TCP_TIMEOUT, DEFAULT_TCP_RST_TIMEOUT,
+	    DEFAULT_CTLSOCK, DEFAULT_EXPORT_PACKET_SIZE, DEFAULT_COUNTER_WIDTH,
+	    DEFAULT_TEMPLATE_PACKETS, DEFAULT_TCP_TIMEOUT, DEFAULT_TCP_RST_TIMEOUT,
 	    DEFAULT_TCP_FIN_TIMEOUT, DEFAULT_UDP_TIMEOUT, DEFAULT_ICMP_TIMEOUT,
 	    DEFAULT_GENERAL_TIMEOUT, DEFAULT_MAXIMUM_LIFETIME,
-	    DEFAULT_EXPIRY_INTERVAL);
+	    DEFAULT_EXPIRY_INTERVAL, DEFAULT_ACTIVE_TIMEOUT,
+	    DEFAULT_TEMPLATE_INTERVAL);
 }
 
 static void
@@ -1668,6 +3172,10 @@ set_timeout(struct FLOWTRACK *ft,
 		ft->param.maximum_lifetime = timeout;
 	else if (strcmp(name, "expint") == 0)
 		ft->param.expiry_interval = timeout;
+	else if (strcmp(name, "active") == 0)
+		ft->param.active_timeout = timeout;
+	else if (strcmp(name, "template") == 0)
+		ft->param.template_interval = timeout;
 	else {
 		fprintf(stderr, "Invalid -t name.\n");
 		usage();
@@ -1730,6 +3238,228 @@ parse_hostport( const char *s,
 	*len = res->ai_addrlen;
 }
 
+/* Look up the sender for a NetFlow version, or NULL if there is none */
+static const struct NETFLOW_SENDER *
+lookup_dialect(const char *version)
+{
+	int i, v;
+
+	for (i = 0, v = atoi(version); nf[i].version != -1; i++) {
+		if (nf[i].version == v)
+			return (&nf[i]);
+	}
+	return (NULL);
+}
+
+/* Look up an export transport protocol, or -1 if it is unknown */
+static int
+lookup_protocol(const char *name)
+{
+	if (strcasecmp(name, "udp") == 0)
+		return (IPPROTO_UDP);
+	if (strcasecmp(name, "tcp") == 0)
+		return (IPPROTO_TCP);
+#ifdef IPPROTO_SCTP
+	if (strcasecmp(name, "sctp") == 0)
+		return (IPPROTO_SCTP);
+#endif
+	return (-1);
+}
+
+/* Parse a -s argument: "rate[:deterministic|random|hash]" */
+static void
+parse_sampling(const char *s, struct OPTION *option)
+{
+	char *ep;
+	long rate;
+
+	rate = strtol(s, &ep, 10);
+	if (ep == s || rate < 0 || rate > 0x7fffffff)
+		goto bad;
+	option->sample_algorithm = SAMPLE_DETERMINISTIC;
+	if (*ep == ':') {
+		if (strcmp(ep + 1, "deterministic") == 0)
+			option->sample_algorithm = SAMPLE_DETERMINISTIC;
+		else if (strcmp(ep + 1, "random") == 0)
+			option->sample_algorithm = SAMPLE_RANDOM;
+		else if (strcmp(ep + 1, "hash") == 0)
+			option->sample_algorithm = SAMPLE_HASH;
+		else
+			goto bad;
+	} else if (*ep != '\0')
+		goto bad;
+	/* A rate of 0 or 1 means every packet */
+	option->sample = rate < 2 ? 0 : rate;
+	return;
+
+ bad:
+	fprintf(stderr, "Invalid sampling rate \"%s\"\n\n", s);
+	usage();
+	exit(1);
+}
+
+/*
+ * Parse a "first[:second]" pair of unsigned numbers, as taken by -B and
+ * -E. *second is left alone if it is not given. Returns -1 if s is
+ * malformed or out of range.
+ */
+static int
+parse_uint_pair(const char *s, u_int *first, u_int *second)
+{
+	unsigned long v[2];
+	char *ep;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (*s < '0' || *s > '9')
+			return (-1);
+		errno = 0;
+		v[i] = strtoul(s, &ep, 10);
+		if (errno != 0 || v[i] > UINT_MAX)
+			return (-1);
+		if (*ep == '\0')
+			break;
+		if (i == 1 || *ep != ':')
+			return (-1);
+		s = ep + 1;
+	}
+	*first = v[0];
+	if (i == 1)
+		*second = v[1];
+	return (0);
+}
+
+/* Parse a -H argument: "flow" or "prefix[/len4[/len6]]" */
+static void
+parse_balance(const char *s, struct FLOWTRACKPARAMETERS *param)
+{
+	char junk;
+	int n;
+
+	param->balance_prefix[0] = 32;
+	param->balance_prefix[1] = 128;
+	if (strcmp(s, "flow") == 0) {
+		param->balance = BALANCE_FLOW;
+		return;
+	}
+	if (strncmp(s, "prefix", 6) == 0 && (s[6] == '\0' || s[6] == '/')) {
+		n = s[6] == '\0' ? 0 : sscanf(s + 6, "/%d/%d%c",
+		    &param->balance_prefix[0], &param->balance_prefix[1],
+		    &junk);
+		if (n <= 2 && (s[6] == '\0' || n >= 1) &&
+		    strspn(s + 6, "0123456789/") == strlen(s + 6) &&
+		    param->balance_prefix[0] >= 0 &&
+		    param->balance_prefix[0] <= 32 &&
+		    param->balance_prefix[1] >= 0 &&
+		    param->balance_prefix[1] <= 128) {
+			param->balance = BALANCE_PREFIX;
+			return;
+		}
+	}
+	fprintf(stderr, "Invalid balancing key \"%s\"\n\n", s);
+	usage();
+	exit(1);
+}
+
+/*
+ * Parse a -n argument of the form host:port[/version[/protocol]] and
+ * append the target to the list ending at **tail. A version or protocol
+ * that is not given is left unset, to be taken from -v and -P.
+ */
+static void
+parse_target(const char *s, struct NETFLOW_TARGET ***tail)
+{
+	static int ntargets = 0;
+	struct NETFLOW_TARGET *target;
+	char *spec, *version, *protocol;
+
+	if (++ntargets > MAX_EXPORT_TARGETS) {
+		fprintf(stderr, "Too many export targets (maximum %d)\n",
+		    MAX_EXPORT_TARGETS);
+		exit(1);
+	}
+	if ((target = calloc(1, sizeof(*target))) == NULL ||
+	    (spec = strdup(s)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	target->fd = -1;
+	if ((version = strchr(spec, '/')) != NULL) {
+		*version++ = '\0';
+		if ((protocol = strchr(version, '/')) != NULL) {
+			*protocol++ = '\0';
+			if ((target->protocol =
+			    lookup_protocol(protocol)) == -1) {
+				fprintf(stderr, "Unknown transport layer "
+				    "protocol \"%s\"\n", protocol);
+				usage();
+				exit(1);
+			}
+		}
+		if ((target->dialect = lookup_dialect(version)) == NULL) {
+			fprintf(stderr, "Invalid NetFlow version \"%s\"\n",
+			    version);
+			exit(1);
+		}
+	}
+	target->addrlen = sizeof(target->addr);
+	/* Will exit on failure */
+	parse_hostport(spec, (struct sockaddr *)&target->addr,
+	    &target->addrlen);
+	free(spec);
+
+	**tail = target;
+	*tail = &target->next;
+}
+
+/*
+ * Give each target the -v dialect and -P protocol unless it has its own.
+ * If "share" is set, put UDP targets with the same dialect as an earlier
+ * one on that target's share chain. Stream targets are never shared, as
+ * each connection needs its own templates.
+ */
+static void
+setup_targets(struct NETFLOW_TARGET *targets,
+    const struct NETFLOW_SENDER *dialect, int protocol, int share)
+{
+	struct NETFLOW_TARGET *target, *head, *last;
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+	int err;
+
+	for (target = targets; target != NULL; target = target->next) {
+		if (target->dialect == NULL)
+			target->dialect = dialect;
+		if (target->protocol == 0)
+			target->protocol = protocol;
+		target->tmpl.stream = target->protocol != IPPROTO_UDP;
+		if ((err = getnameinfo((struct sockaddr *)&target->addr,
+		    target->addrlen, host, sizeof(host), serv, sizeof(serv),
+		    NI_NUMERICHOST | NI_NUMERICSERV)) != 0) {
+			fprintf(stderr, "getnameinfo: %s\n",
+			    gai_strerror(err));
+			exit(1);
+		}
+		snprintf(target->name, sizeof(target->name), "[%s]:%s",
+		    host, serv);
+
+		if (target->protocol != IPPROTO_UDP)
+			continue;
+		for (head = targets; share && head != target;
+		    head = head->next) {
+			if (!head->shared && head->dialect == target->dialect &&
+			    head->protocol == target->protocol)
+				break;
+		}
+		if (share && head != target) {
+			for (last = head; last->share != NULL;
+			    last = last->share)
+				;
+			last->share = target;
+			target->shared = 1;
+		}
+	}
+}
+
 /*
  * Drop privileges and chroot, will exit on failure
  */
@@ -1791,19 +3521,19 @@ drop_privs(void)
 int
 main(int argc, char **argv)
 {
-	char *dev, *capfile, *bpf_prog, dest_addr[256], dest_serv[256];
+	char *capfile, *bpf_prog, *cp;
 	const char *pidfile_path, *ctlsock_path;
 	extern char *optarg;
 	extern int optind;
-	int ch, dontfork_flag, linktype, ctlsock, i, err, always_v6, r;
+	int ch, dontfork_flag, ctlsock, always_v6, r, i, j, idx;
+	int want_v6, want_v9, nfds, timeout;
 	int stop_collection_flag, exit_request, hoplimit;
-	pcap_t *pcap = NULL;
-	struct sockaddr_storage dest;
+	struct CAPTURE *cap;
 	struct FLOWTRACK flowtrack;
-	socklen_t dest_len;
-	struct NETFLOW_TARGET target;
+	struct NETFLOW_TARGET *targets, **targets_tail, *target;
+	const struct NETFLOW_SENDER *dialect;
 	struct CB_CTXT cb_ctxt;
-	struct pollfd pl[2];
+	struct pollfd pl[1 + MAX_CAPTURES + MAX_EXPORT_TARGETS];
 	int protocol = IPPROTO_UDP;
         char *netflow_str_template;
 
@@ -1811,34 +3541,47 @@ main(int argc, char **argv)
 
 	init_flowtrack(&flowtrack);
 
-	memset(&dest, '\0', sizeof(dest));
-	dest_len = 0;
-	memset(&target, '\0', sizeof(target));
-	target.fd = -1;
-	target.dialect = &nf[0];
+	targets = NULL;
+	targets_tail = &targets;
+	dialect = &nf[0];
 	hoplimit = -1;
 	bpf_prog = NULL;
 	ctlsock = -1;
-	dev = capfile = NULL;
+	capfile = NULL;
 	pidfile_path = DEFAULT_PIDFILE;
 	ctlsock_path = DEFAULT_CTLSOCK;
 	dontfork_flag = 0;
 	always_v6 = 0;
 
 #if USE_ELASTICSEARCH
-	while ((ch = getopt(argc, argv, "6hdDL:l:i:r:f:t:n:m:p:c:v:T:s:P:A:e:b")) != -1) {
+	while ((ch = getopt(argc, argv, "6ahdDL:l:i:r:R:f:t:n:H:m:M:W:K:E:w:o:j:S:u:J:p:c:v:T:s:P:A:B:e:b")) != -1) {
 #else
-	while ((ch = getopt(argc, argv, "6hdDL:l:i:r:f:t:n:m:p:c:v:T:s:P:A:b")) != -1) {
+	while ((ch = getopt(argc, argv, "6ahdDL:l:i:r:R:f:t:n:H:m:M:W:K:E:w:o:j:S:u:J:p:c:v:T:s:P:A:B:b")) != -1) {
 #endif
 		switch (ch) {
 #ifdef USE_ELASTICSEARCH
 		case 'e':
-			elasticsearch = setup_elasticsearch(optarg, "softflowd", "softflow");
+			elasticsearch = setup_elasticsearch(optarg, ES_INDEX,
+			    ES_DOC_TYPE);
 			break;
 #endif
 		case '6':
 			always_v6 = 1;
 			break;
+		case 'a':
+			flowtrack.param.packet_clock = 1;
+			break;
+		case 'R':
+			flowtrack.param.replay_speed = strtod(optarg, &cp);
+			if (*optarg == '\0' || *cp != '\0' ||
+			    flowtrack.param.replay_speed < 0.0) {
+				fprintf(stderr, "Invalid replay speed\n\n");
+				usage();
+				exit(1);
+			}
+			flowtrack.param.replay = 1;
+			flowtrack.param.packet_clock = 1;
+			break;
 		case 'h':
 			usage();
 			return (0);
@@ -1850,32 +3593,74 @@ main(int argc, char **argv)
 			dontfork_flag = 1;
 			break;
 		case 'i':
-			if (capfile != NULL || dev != NULL) {
+			if (capfile != NULL) {
 				fprintf(stderr, "Packet source already "
 				    "specified.\n\n");
 				usage();
 				exit(1);
 			}
-#if defined(HAVE_STRSEP)
-			dev = strsep(&optarg, ":");
-#else /* defined(HAVE_STRSEP) */
-			dev = strtok(optarg, ":");
-#endif /* defined(HAVE_STRSEP) */
-			if (optarg != NULL) {
-				if_index = (u_int16_t) atoi(dev);
-				dev = optarg;
+			if (num_captures >= MAX_CAPTURES) {
+				fprintf(stderr, "Too many interfaces (max %d)"
+				    "\n\n", MAX_CAPTURES);
+				usage();
+				exit(1);
+			}
+			cap = &captures[num_captures++];
+			if ((cp = strchr(optarg, ':')) != NULL) {
+				*cp++ = '\0';
+				cap->if_index = (u_int16_t)atoi(optarg);
+				cap->name = cp;
+			} else {
+				cap->name = optarg;
+				cap->default_index = 1;
+			}
+			for (i = 0; i < num_captures - 1; i++) {
+				if (strcmp(captures[i].name, cap->name) == 0) {
+					fprintf(stderr, "Interface %s "
+					    "specified twice\n\n", cap->name);
+					usage();
+					exit(1);
+				}
 			}
 			if (verbose_flag)
-				fprintf(stderr, "Using %s (idx: %d)\n", dev, if_index);
+				fprintf(stderr, "Using %s (idx: %d)\n",
+				    cap->name, cap->if_index);
 			break;
 		case 'r':
-			if (capfile != NULL || dev != NULL) {
+			if (capfile == NULL && num_captures != 0) {
 				fprintf(stderr, "Packet source already "
 				    "specified.\n\n");
 				usage();
 				exit(1);
 			}
+			if (merge == NULL && (merge = merge_new()) == NULL)
+				exit(1);
+			/* File names may contain ':', only digits are an index */
 			capfile = optarg;
+			idx = 0;
+			if ((cp = strchr(optarg, ':')) != NULL && cp > optarg &&
+			    strspn(optarg, "0123456789") ==
+			    (size_t)(cp - optarg)) {
+				idx = atoi(optarg);
+				capfile = cp + 1;
+			}
+			for (i = 0; i < num_captures &&
+			    captures[i].if_index != idx; i++)
+				;
+			if (i == num_captures) {
+				if (num_captures >= MAX_CAPTURES) {
+					fprintf(stderr, "Too many interfaces "
+					    "(max %d)\n\n", MAX_CAPTURES);
+					usage();
+					exit(1);
+				}
+				captures[i].name = capfile;
+				captures[i].if_index = idx;
+				num_captures++;
+			}
+			/* Prints the reason on failure */
+			if (merge_add(merge, capfile, i) == -1)
+				exit(1);
 			dontfork_flag = 1;
 			ctlsock_path = NULL;
 			break;
@@ -1916,11 +3701,116 @@ main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 'M':
+			flowtrack.param.export_packet_size =
+			    strtoul(optarg, &cp, 10);
+			if (*optarg == '\0' || *cp != '\0' ||
+			    flowtrack.param.export_packet_size <
+			    MIN_EXPORT_PACKET_SIZE ||
+			    flowtrack.param.export_packet_size >
+			    MAX_EXPORT_PACKET_SIZE) {
+				fprintf(stderr, "Invalid export packet size "
+				    "(must be %d-%d)\n\n",
+				    MIN_EXPORT_PACKET_SIZE,
+				    MAX_EXPORT_PACKET_SIZE);
+				usage();
+				exit(1);
+			}
+			break;
+		case 'H':
+			/* Will exit on failure */
+			parse_balance(optarg, &flowtrack.param);
+			break;
+		case 'K':
+			flowtrack.param.template_packets =
+			    strtoul(optarg, &cp, 10);
+			if (*optarg == '\0' || *cp != '\0') {
+				fprintf(stderr, "Invalid template refresh "
+				    "packet count\n\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 'W':
+			if (strcmp(optarg, "auto") == 0)
+				flowtrack.param.counter_width =
+				    COUNTER_WIDTH_AUTO;
+			else if (strcmp(optarg, "4") == 0 ||
+			    strcmp(optarg, "8") == 0)
+				flowtrack.param.counter_width = atoi(optarg);
+			else {
+				fprintf(stderr, "Invalid counter width "
+				    "(must be 4, 8 or auto)\n\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 'w':
+			/* Prints the reason on failure */
+			if ((archive = archive_setup(optarg)) == NULL) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'o':
+			/* Prints the reason on failure */
+			if ((arrow = arrow_setup(optarg)) == NULL) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'j':
+			/* Prints the reason on failure */
+			if ((ndjson = ndjson_setup(optarg)) == NULL) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'S':
+			/* Prints the reason on failure */
+			if ((sflow = sflow_setup(optarg)) == NULL) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'u':
+			/* Prints the reason on failure */
+			if ((dedup = dedup_setup(optarg)) == NULL) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'J':
+			num_workers = strtol(optarg, &cp, 10);
+			if (*optarg == '\0' || *cp != '\0' ||
+			    num_workers < 1 || num_workers > MAX_WORKERS) {
+				fprintf(stderr, "Invalid number of workers "
+				    "(1-%d)\n\n", MAX_WORKERS);
+				usage();
+				exit(1);
+			}
+			break;
+		case 'E':
+			if (parse_uint_pair(optarg,
+			    &flowtrack.param.pace_packets,
+			    &flowtrack.param.pace_bytes) == -1) {
+				fprintf(stderr, "Invalid export rate\n\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 'B':
+			if (parse_uint_pair(optarg,
+			    &flowtrack.param.expiry_max_flows,
+			    &flowtrack.param.expiry_max_usec) == -1) {
+				fprintf(stderr, "Invalid expiry budget\n\n");
+				usage();
+				exit(1);
+			}
+			break;
 		case 'n':
 			/* Will exit on failure */
-			dest_len = sizeof(dest);
-			parse_hostport(optarg, (struct sockaddr *)&dest,
-			    &dest_len);
+			parse_target(optarg, &targets_tail);
 			break;
 		case 'p':
 			pidfile_path = optarg;
@@ -1932,35 +3822,20 @@ main(int argc, char **argv)
 				ctlsock_path = optarg;
 			break;
 		case 'v':
-			for(i = 0, r = atoi(optarg); nf[i].version != -1; i++) {
-				if (nf[i].version == r)
-					break;
-			}
-			if (nf[i].version == -1) {
+			if ((dialect = lookup_dialect(optarg)) == NULL) {
 				fprintf(stderr, "Invalid NetFlow version\n");
 				exit(1);
 			}
-			target.dialect = &nf[i];
 			break;
                 case 'T':
                         netflow_str_template = optarg;
                         break;
                 case 's':
-			flowtrack.param.option.sample = atoi(optarg);
-			if (flowtrack.param.option.sample < 2) {
-				flowtrack.param.option.sample = 0;
-			}
+			/* Will exit on failure */
+			parse_sampling(optarg, &flowtrack.param.option);
 			break;
 		case 'P':
-			if (strcasecmp(optarg, "udp") == 0)
-				protocol = IPPROTO_UDP;
-			else if (strcasecmp(optarg, "tcp") == 0)
-				protocol = IPPROTO_TCP;
-#ifdef IPPROTO_SCTP
-			else if (strcasecmp(optarg, "sctp") == 0)
-				protocol = IPPROTO_SCTP;
-#endif
-			else {
+			if ((protocol = lookup_protocol(optarg)) == -1) {
 				fprintf(stderr, "Unknown transport layer protocol"
 				    "\n");
 				usage();
@@ -1993,16 +3868,119 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (capfile == NULL && dev == NULL) {
+	if (num_captures == 0) {
 		fprintf(stderr, "-i or -r option not specified.\n");
 		usage();
 		exit(1);
 	}
 
+	/*
+	 * The index is part of the flow key, so interfaces listened on
+	 * together default to the system's index and must not share one.
+	 */
+	for (i = 0; capfile == NULL && num_captures > 1 &&
+	    i < num_captures; i++) {
+		cap = &captures[i];
+		if (cap->default_index)
+			cap->if_index = (u_int16_t)if_nametoindex(cap->name);
+		for (j = 0; j < i; j++) {
+			if (captures[j].if_index == cap->if_index) {
+				fprintf(stderr, "Interfaces %s and %s have the "
+				    "same index %d\n\n", captures[j].name,
+				    cap->name, cap->if_index);
+				usage();
+				exit(1);
+			}
+		}
+	}
+
+	if (dedup != NULL) {
+		const char *unknown;
+
+		if (num_captures < 2) {
+			fprintf(stderr, "-u requires more than one "
+			    "interface.\n");
+			usage();
+			exit(1);
+		}
+		for (i = 0; i < num_captures; i++) {
+			captures[i].dedup_trusted =
+			    dedup_trusted(dedup, captures[i].name);
+		}
+		if ((unknown = dedup_unknown_trust(dedup)) != NULL) {
+			fprintf(stderr, "Trusted interface %s is not "
+			    "captured on.\n", unknown);
+			usage();
+			exit(1);
+		}
+	}
+
+	/* A daemon's stdout is /dev/null */
+	if (arrow != NULL && arrow_to_stdout(arrow) && !dontfork_flag) {
+		fprintf(stderr, "-o - needs -d or -r.\n");
+		usage();
+		exit(1);
+	}
+
+	/*
+	 * The workers of -J each see only their own flows' packets, and
+	 * don't share the single clock pacing -R or a packet count.
+	 */
+	if (num_workers > 1) {
+		if (merge == NULL || merge_file(merge, 0) == NULL ||
+		    merge_file(merge, 1) != NULL) {
+			fprintf(stderr, "-J needs a single capture file.\n");
+			usage();
+			exit(1);
+		}
+		if (sflow != NULL || flowtrack.param.replay ||
+		    (flowtrack.param.option.sample > 1 &&
+		    flowtrack.param.option.sample_algorithm != SAMPLE_HASH)) {
+			fprintf(stderr, "-J can't be used with -S, -R or "
+			    "packet sampling.\n");
+			usage();
+			exit(1);
+		}
+	}
+
+	if (export_init(flowtrack.param.export_packet_size) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if (flowtrack.param.packet_clock && capfile == NULL) {
+		fprintf(stderr, "-a and -R options require -r.\n");
+		usage();
+		exit(1);
+	}
+
+	/* Balanced targets each keep their own sequence and templates */
+	setup_targets(targets, dialect, protocol,
+	    flowtrack.param.balance == BALANCE_NONE);
+
+	/*
+	 * Only NetFlow v9 and IPFIX records can carry 64 bit counters. With
+	 * no target, the -v dialect still decides what is tracked.
+	 */
+	flowtrack.param.wide_counters = flowtrack.param.counter_width != 4 &&
+	    (targets != NULL || dialect->version >= 9);
+	want_v6 = always_v6 || archive != NULL || arrow != NULL ||
+	    ndjson != NULL || (targets == NULL && dialect->v6_capable);
+	want_v9 = targets == NULL && dialect->version == 9;
+	for (target = targets; target != NULL; target = target->next) {
+		if (target->dialect->version < 9)
+			flowtrack.param.wide_counters = 0;
+		if (target->dialect->v6_capable)
+			want_v6 = 1;
+		if (target->dialect->version == 9)
+			want_v9 = 1;
+	}
+
         /* check the netflow version when we use the template -T option */
         if(netflow_str_template != NULL) {
-          if (target.dialect->version == 9) {
-            nf9_init_template(netflow_str_template);
+          if (want_v9) {
+            nf9_init_template(netflow_str_template,
+                flowtrack.param.counter_width);
           } else {
             printf("[WARNING] The template option (-T) is only compatible with netflow v9, and thus will be ignored.\n");
           }
@@ -2011,20 +3989,65 @@ main(int argc, char **argv)
 	/* join remaining arguments (if any) into bpf program */
 	bpf_prog = argv_join(argc - optind, argv + optind);
 
-	/* Will exit on failure */
-	setup_packet_capture(&pcap, &linktype, dev, capfile, bpf_prog,
-	    target.dialect->v6_capable || always_v6);
-
-	/* Netflow send socket */
-	if (dest.ss_family != 0) {
-		if ((err = getnameinfo((struct sockaddr *)&dest,
-		    dest_len, dest_addr, sizeof(dest_addr),
-		    dest_serv, sizeof(dest_serv), NI_NUMERICHOST)) == -1) {
-			fprintf(stderr, "getnameinfo: %d\n", err);
+	/*
+	 * Random sampling can be done by the kernel, unless the sFlow
+	 * agent needs to see every packet or duplicates have to be
+	 * dropped first. Will exit on failure.
+	 */
+	for (i = 0; capfile == NULL && i < num_captures; i++) {
+		cap = &captures[i];
+		cap->kernel_sampling = setup_packet_capture(&cap->pcap,
+		    &cap->linktype, cap->name, bpf_prog, want_v6,
+		    flowtrack.param.option.sample_algorithm == SAMPLE_RANDOM &&
+		    sflow == NULL && dedup == NULL ?
+		    flowtrack.param.option.sample : 0);
+		if (cap->kernel_sampling)
+			flowtrack.param.kernel_sampling = 1;
+	}
+	if (capfile != NULL) {
+		/* Prints the reason on failure */
+		if (merge_start(merge, bpf_prog, linktype_supported) == -1)
+			exit(1);
+		for (i = 0; i < num_captures; i++)
+			captures[i].linktype = merge_linktype(merge, i);
+	}
+
+	/*
+	 * Netflow send sockets. Stream targets connect in the background;
+	 * they, and rate limited targets, send through a queue.
+	 */
+	for (target = targets; target != NULL; target = target->next) {
+		if (target->protocol == IPPROTO_UDP)
+			target->fd = connsock(&target->addr, target->addrlen,
+			    hoplimit, target->protocol);
+		if ((target->protocol != IPPROTO_UDP ||
+		    flowtrack.param.pace_packets != 0 ||
+		    flowtrack.param.pace_bytes != 0) &&
+		    export_queue_init(target, &flowtrack.param) == -1) {
+			fprintf(stderr, "Out of memory\n");
 			exit(1);
 		}
-		target.fd = connsock(&dest, dest_len, hoplimit, protocol);
 	}
+	/* Flows from a file expire faster than a collector takes them */
+	if (capfile != NULL)
+		export_queue_set_wait(targets, 1);
+	if (sflow != NULL) {
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+
+		/* Will exit on failure */
+		parse_hostport(sflow_collector(sflow),
+		    (struct sockaddr *)&addr, &addrlen);
+		sflow_open(sflow, connsock(&addr, addrlen, hoplimit,
+		    IPPROTO_UDP), &flowtrack.param);
+		for (i = 0; i < num_captures; i++) {
+			captures[i].sflow_source = sflow_add_source(sflow,
+			    captures[i].pcap, captures[i].linktype,
+			    captures[i].if_index);
+		}
+	}
+	/* A collector may close its connection while we write to it */
+	signal(SIGPIPE, SIG_IGN);
 
 	/* Control socket */
 	if (ctlsock_path != NULL)
@@ -2056,23 +4079,43 @@ main(int argc, char **argv)
 
 	logit(LOG_NOTICE, "%s v%s starting data collection",
 	    PROGNAME, PROGVER);
-	if (dest.ss_family != 0) {
-		logit(LOG_NOTICE, "Exporting flows to [%s]:%s", dest_addr, dest_serv);
-                if(target.dialect->version == 9 && netflow_str_template != NULL) {
-                    printf("Initializing with template: %s\n", netflow_str_template);
-                }
+	for (target = targets; target != NULL; target = target->next) {
+		logit(LOG_NOTICE, "Exporting flows to %s (version %d%s)",
+		    target->name, target->dialect->version,
+		    target->protocol == IPPROTO_UDP ? "" : ", stream");
 	}
+	if (sflow != NULL)
+		logit(LOG_NOTICE, "Sending sFlow samples to %s",
+		    sflow_collector(sflow));
+	if (want_v9 && targets != NULL && netflow_str_template != NULL)
+		fprintf(report_out(), "Initializing with template: %s\n",
+		    netflow_str_template);
 	flowtrack.param.option.meteringProcessId = getpid();
+	srandom((u_int)time(NULL) ^ (u_int)getpid()); /* -s rate:random */
 
 	/* Main processing loop */
 	gettimeofday(&flowtrack.param.system_boot_time, NULL);
 	stop_collection_flag = 0;
+	exit_request = 0;
 	memset(&cb_ctxt, '\0', sizeof(cb_ctxt));
 	cb_ctxt.ft = &flowtrack;
-	cb_ctxt.linktype = linktype;
-	cb_ctxt.want_v6 = target.dialect->v6_capable || always_v6;
+	cb_ctxt.target = targets;
+	cb_ctxt.want_v6 = want_v6;
+	cb_ctxt.track = sflow == NULL || !sflow_only(sflow);
+
+	/* With -J, the file is read by the workers instead of this loop */
+	r = 0;
+	if (num_workers > 1) {
+		if ((r = shard_run(&flowtrack, targets, &cb_ctxt,
+		    merge_file(merge, 0), bpf_prog)) == 0)
+			graceful_shutdown_request = 1;
+		merge_close(merge);
+		merge = NULL;
+	}
+	for (; num_workers <= 1 && graceful_shutdown_request == 0; r = 0) {
+		/* Reconnect and write out send queues without blocking */
+		export_queue_service(targets);
 
-	for (r = 0; graceful_shutdown_request == 0; r = 0) {
 		/*
 		 * Silly libpcap's timeout function doesn't work, so we
 		 * do it here (only if we are reading live)
@@ -2080,18 +4123,22 @@ main(int argc, char **argv)
 		if (capfile == NULL) {
 			memset(pl, '\0', sizeof(pl));
 
-			/* This can only be set via the control socket */
-			if (!stop_collection_flag) {
+			pl[0].fd = ctlsock;
+			if (ctlsock != -1)
 				pl[0].events = POLLIN|POLLERR|POLLHUP;
-				pl[0].fd = pcap_fileno(pcap);
-			}
-			if (ctlsock != -1) {
-				pl[1].fd = ctlsock;
-				pl[1].events = POLLIN|POLLERR|POLLHUP;
+			for (i = 0; i < num_captures; i++) {
+				pl[1 + i].fd = pcap_fileno(captures[i].pcap);
+				/* This can only be set via the control socket */
+				if (!stop_collection_flag)
+					pl[1 + i].events = POLLIN|POLLERR|POLLHUP;
 			}
+			timeout = next_expire(&flowtrack);
+			if (sflow != NULL)
+				sflow_timeout(sflow, &timeout);
+			nfds = 1 + num_captures + export_queue_pollfds(targets,
+			    pl + 1 + num_captures, &timeout);
 
-			r = poll(pl, (ctlsock == -1) ? 1 : 2,
-			    next_expire(&flowtrack));
+			r = poll(pl, nfds, timeout);
 			if (r == -1 && errno != EINTR) {
 				logit(LOG_ERR, "Exiting on poll: %s",
 				    strerror(errno));
@@ -2100,87 +4147,90 @@ main(int argc, char **argv)
 		}
 
 		/* Accept connection on control socket if present */
-		if (ctlsock != -1 && pl[1].revents != 0) {
-			if (accept_control(ctlsock, &target, &flowtrack, pcap,
+		if (capfile == NULL && ctlsock != -1 && pl[0].revents != 0) {
+			if (accept_control(ctlsock, targets, &flowtrack,
 			    &exit_request, &stop_collection_flag) != 0)
 				break;
 		}
 
 		/* If we have data, run it through libpcap */
-		if (!stop_collection_flag &&
-		    (capfile != NULL || pl[0].revents != 0)) {
-			r = pcap_dispatch(pcap, flowtrack.param.max_flows, flow_cb,
-			    (void*)&cb_ctxt);
-			if (r == -1) {
-				logit(LOG_ERR, "Exiting on pcap_dispatch: %s",
-				    pcap_geterr(pcap));
-				break;
-			} else if (r == 0 && capfile != NULL) {
+		r = 0;
+		if (capfile != NULL) {
+			r = merge_dispatch(&cb_ctxt, flowtrack.param.max_flows);
+			if (r == -1)
+				logit(LOG_ERR, "Exiting on capture file error");
+			else if (r == 0) {
 				logit(LOG_NOTICE, "Shutting down after "
 				    "pcap EOF");
 				graceful_shutdown_request = 1;
+			}
+		}
+		for (i = 0; capfile == NULL && !stop_collection_flag &&
+		    i < num_captures; i++) {
+			if (pl[1 + i].revents == 0)
+				continue;
+			cb_ctxt.cap = cap = &captures[i];
+			r = pcap_dispatch(cap->pcap, flowtrack.param.max_flows,
+			    flow_cb, (void*)&cb_ctxt);
+			if (r == -1) {
+				logit(LOG_ERR, "Exiting on pcap_dispatch "
+				    "(%s): %s", cap->name,
+				    pcap_geterr(cap->pcap));
 				break;
 			}
 		}
+		if (r == -1 || graceful_shutdown_request)
+			break;
 		r = 0;
 
+		/* Send sFlow counters and any samples held long enough */
+		if (sflow != NULL)
+			sflow_service(sflow);
+
 		/* Fatal error from per-packet functions */
 		if (cb_ctxt.fatal) {
 			logit(LOG_WARNING, "Fatal error - exiting immediately");
 			break;
 		}
 
-		/*
-		 * Expiry processing happens every recheck_rate seconds
-		 * or whenever we have exceeded the maximum number of active
-		 * flows
-		 */
-		if (flowtrack.param.num_flows > flowtrack.param.max_flows ||
-		    next_expire(&flowtrack) == 0) {
-expiry_check:
-			/*
-			 * If we are reading from a capture file, we never
-			 * expire flows based on time - instead we only
-			 * expire flows when the flow table is full.
-			 */
-			if (check_expired(&flowtrack, &target,
-			    capfile == NULL ? CE_EXPIRE_NORMAL :
-			    CE_EXPIRE_FORCED) < 0)
-				logit(LOG_WARNING, "Unable to export flows");
-
-			/*
-			 * If we are over max_flows, force-expire the oldest
-			 * out first and immediately reprocess to evict them
-			 */
-			if (flowtrack.param.num_flows > flowtrack.param.max_flows) {
-				force_expire(&flowtrack,
-				    flowtrack.param.num_flows - flowtrack.param.max_flows);
-				goto expiry_check;
-			}
-		}
+		expire_flows(&flowtrack, targets, capfile != NULL);
 	}
 
 	/* Flags set by signal handlers or control socket */
 	if (graceful_shutdown_request) {
 		logit(LOG_WARNING, "Shutting down on user request");
-		check_expired(&flowtrack, &target, CE_EXPIRE_ALL);
+		export_queue_set_wait(targets, 1);
+		check_expired(&flowtrack, targets, CE_EXPIRE_ALL);
+		export_queue_drain(targets, EXPORT_DRAIN_MSEC);
 	} else if (exit_request)
 		logit(LOG_WARNING, "Exiting immediately on user request");
 	else
 		logit(LOG_ERR, "Exiting immediately on internal error");
 
 	if (capfile != NULL && dontfork_flag)
-		statistics(&flowtrack, stdout, pcap);
+		statistics(&flowtrack, targets, report_out());
 
-	pcap_close(pcap);
+	for (i = 0; i < num_captures; i++) {
+		if (captures[i].pcap != NULL)
+			pcap_close(captures[i].pcap);
+	}
+	merge_close(merge);
 
-	if (target.fd != -1)
-		close(target.fd);
+	for (target = targets; target != NULL; target = target->next) {
+		if (target->fd != -1)
+			close(target->fd);
+	}
 
 	unlink(pidfile_path);
 	if (ctlsock_path != NULL)
 		unlink(ctlsock_path);
 
+	archive_close(archive);
+	arrow_close(arrow);
+	ndjson_close(ndjson);
+	sflow_close(sflow);
+	dedup_close(dedup);
+
 #ifdef USE_ELASTICSEARCH
 	cleanup_elasticsearch(elasticsearch);
 #endif
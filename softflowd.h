@@ -56,6 +56,88 @@
 #define DEFAULT_GENERAL_TIMEOUT		3600
 #define DEFAULT_MAXIMUM_LIFETIME	(3600*24*7)
 #define DEFAULT_EXPIRY_INTERVAL		60
+#define DEFAULT_ACTIVE_TIMEOUT		0	/* Disabled */
+
+/*
+ * Size limits for NetFlow v9 and IPFIX export datagrams. The maximum is
+ * the largest UDP payload that fits in an IPv4 packet.
+ */
+#define DEFAULT_EXPORT_PACKET_SIZE	512
+#define MIN_EXPORT_PACKET_SIZE		512
+#define MAX_EXPORT_PACKET_SIZE		65507
+
+/*
+ * Width in bytes of the packet and octet counters in NetFlow v9 and
+ * IPFIX records (-W). COUNTER_WIDTH_AUTO lets IPFIX pick the smallest
+ * reduced-size encoding that holds each flow's counters.
+ */
+#define COUNTER_WIDTH_AUTO		0
+#define DEFAULT_COUNTER_WIDTH		8
+
+/*
+ * NetFlow v9 and IPFIX templates (and option data) are sent again after
+ * this many datagrams (-K) or seconds (-t template=...), whichever comes
+ * first. Zero disables either trigger.
+ */
+#define DEFAULT_TEMPLATE_PACKETS	256
+#define DEFAULT_TEMPLATE_INTERVAL	60
+
+/* Interfaces that can be captured on at once (-i) */
+#define MAX_CAPTURES			32
+
+/*
+ * Export targets (-n). With -H, expired flows are partitioned across the
+ * targets by a hash of the flow instead of being sent to all of them.
+ * A target that fails is given no flows for TARGET_RETRY_INTERVAL
+ * seconds; its share goes to the remaining targets meanwhile.
+ */
+#define MAX_EXPORT_TARGETS		32
+#define TARGET_RETRY_INTERVAL		30
+
+#define BALANCE_NONE			0	/* Every target gets all flows */
+#define BALANCE_FLOW			1	/* Hash canonical flow key */
+#define BALANCE_PREFIX			2	/* Hash endpoint prefixes */
+
+/*
+ * TCP and SCTP targets, and UDP targets with a rate limit (-E), are
+ * written without blocking through a send queue of up to
+ * EXPORT_QUEUE_SIZE bytes and EXPORT_QUEUE_MESSAGES packets; packets
+ * that do not fit are dropped, except when reading capture files and
+ * at exit, when up to EXPORT_DRAIN_MSEC is spent waiting for room,
+ * checking every EXPORT_WAIT_POLL_MSEC. A UDP target whose socket
+ * buffer is full (ENOBUFS) is retried after EXPORT_RETRY_MSEC. The rate
+ * limit allows bursts of EXPORT_PACE_BURST_MSEC worth of packets. A
+ * lost stream connection is retried after a delay doubling from
+ * STREAM_BACKOFF_MIN up to STREAM_BACKOFF_MAX seconds. At exit, up to
+ * EXPORT_DRAIN_MSEC is spent sending what is still queued.
+ */
+#define EXPORT_QUEUE_SIZE		(1024 * 1024)	/* Bytes */
+#define EXPORT_QUEUE_MESSAGES		4096		/* Packets */
+#define EXPORT_PACE_BURST_MSEC		10
+#define EXPORT_DRAIN_MSEC		5000
+#define EXPORT_WAIT_POLL_MSEC		100
+#define EXPORT_RETRY_MSEC		10
+#define STREAM_BACKOFF_MIN		1
+#define STREAM_BACKOFF_MAX		64
+
+/*
+ * Number of flows exported at a time when expiry is limited by a time
+ * budget. The budget is checked between each chunk.
+ */
+#define EXPIRY_CHUNK			256
+
+/*
+ * Parallel reading of one capture file (-J). The file is processed in
+ * windows of SHARD_WINDOW bytes: the workers first split each window
+ * between them to work out which worker owns each packet, then each
+ * walks the whole window handling its own packets. Up to SHARD_MAPS
+ * windows can be in flight. Expired flows go to the parent in batches
+ * of up to SHARD_BATCH.
+ */
+#define MAX_WORKERS			64
+#define SHARD_WINDOW			(64 * 1024 * 1024)
+#define SHARD_MAPS			4
+#define SHARD_BATCH			1024
 
 /*
  * Default maximum number of flow to track simultaneously
@@ -81,9 +163,15 @@ struct STATISTIC {
  */
 struct OPTION {
 	uint32_t sample;
+	u_int sample_algorithm;
 	pid_t meteringProcessId;
 };
 
+/* Packet sampling algorithms (-s rate:algorithm) */
+#define SAMPLE_DETERMINISTIC		0	/* Every Nth packet */
+#define SAMPLE_RANDOM			1	/* Each packet with p = 1/N */
+#define SAMPLE_HASH			2	/* Whole flows, by key hash */
+
 struct FLOWTRACKPARAMETERS {
 	unsigned int num_flows;			/* # of active flows */
 	unsigned int max_flows;			/* Max # of active flows */
@@ -91,6 +179,17 @@ struct FLOWTRACKPARAMETERS {
 
 	/* Stuff related to flow export */
 	struct timeval system_boot_time;	/* SysUptime */
+
+	/* Virtual clock driven by packet timestamps (-a) */
+	int packet_clock;			/* Use packet_time as "now" */
+	struct timeval packet_time;		/* Latest packet timestamp */
+
+	/* Paced replay of capture files (-R) */
+	int replay;				/* Replay mode enabled */
+	double replay_speed;			/* Speed factor, 0 = unpaced */
+	struct timeval replay_wall_start;	/* Wall time of first packet */
+	struct timeval replay_first;		/* Timestamp of first packet */
+	u_int64_t replay_packets;		/* Packets read from file */
 	int track_level;			/* See TRACK_* above */
 
 	/* Flow timeouts */
@@ -102,10 +201,25 @@ struct FLOWTRACKPARAMETERS {
 	int general_timeout;			/* Everything else */
 	int maximum_lifetime;			/* Maximum life for flows */
 	int expiry_interval;			/* Interval between expiries */
+	int active_timeout;			/* Interim report interval */
+	int template_interval;			/* Seconds between templates */
+	u_int template_packets;			/* Datagrams between templates */
+	u_int export_packet_size;		/* Max v9/IPFIX datagram size */
+	u_int counter_width;			/* v9/IPFIX counter bytes (-W) */
+	int wide_counters;			/* Export has 64 bit counters */
+	int balance;				/* BALANCE_* (-H) */
+	int balance_prefix[2];			/* IPv4, IPv6 prefix lengths */
+	u_int pace_packets;			/* Export packets/s (-E) */
+	u_int pace_bytes;			/* Export bytes/s (-E) */
+
+	/* Limits on expiry work per main loop iteration (0 = unlimited) */
+	unsigned int expiry_max_flows;		/* Flows per expiry slice */
+	unsigned int expiry_max_usec;		/* Time per expiry slice */
 
 	/* Statistics */
 	u_int64_t total_packets;		/* # of good packets */
 	u_int64_t non_sampled_packets;		/* # of not sampled packets */
+	int kernel_sampling;			/* -s done by socket filter */
 	u_int64_t frag_packets;			/* # of fragmented packets */
 	u_int64_t non_ip_packets;		/* # of not-IP packets */
 	u_int64_t bad_packets;			/* # of bad packets */
@@ -136,6 +250,13 @@ struct FLOWTRACKPARAMETERS {
 	u_int64_t expired_overbytes;
 	u_int64_t expired_maxflows;
 	u_int64_t expired_flush;
+	u_int64_t flows_interim;		/* # of interim reports sent */
+
+	/* Expiry slice statistics */
+	u_int64_t expiry_slices;		/* # of expiry passes */
+	u_int64_t expiry_slices_truncated;	/* # cut short by budget */
+	struct timeval expiry_backlog_since;	/* Start of current backlog */
+	double expiry_backlog_max;		/* Oldest backlog seen (s) */
 
 	/* Optional information */
 	struct OPTION option;
@@ -175,6 +296,7 @@ struct FLOW {
 	u_int64_t flow_seq;			/* Flow ID */
 	struct timeval flow_start;		/* Time of creation */
 	struct timeval flow_last;		/* Time of last traffic */
+	struct timeval flow_report;		/* Start of report interval */
 
 	/* Per-endpoint statistics (all in _host_ byte order) */
 	u_int64_t octets[2];			/* Octets so far */
@@ -199,7 +321,9 @@ struct FLOW {
 
 	u_int8_t tos[2];			/* Tos */
         u_int16_t vlanid;                       /* vlanid */
+	u_int16_t if_index;			/* Capture interface index */
 	u_int8_t protocol;			/* Protocol */
+	u_int8_t interim;			/* Copy for an interim report */
 };
 
 /*
@@ -215,6 +339,8 @@ struct FLOW {
  * Expiry scans operate by starting at the head of the tree and expiring
  * each entry with expires_at < now
  *
+ * Entries with reason R_ACTIVE are not discarded when they come due:
+ * instead an interim report is sent for the flow and it is rescheduled.
  */
 struct EXPIRY {
 	EXPIRY_ENTRY(EXPIRY) trp;		/* Tree pointer */
@@ -223,53 +349,95 @@ struct EXPIRY {
 	u_int32_t expires_at;			/* time_t */
 	enum {
 		R_GENERAL, R_TCP, R_TCP_RST, R_TCP_FIN, R_UDP, R_ICMP,
-		R_MAXLIFE, R_OVERBYTES, R_OVERFLOWS, R_FLUSH
+		R_MAXLIFE, R_OVERBYTES, R_OVERFLOWS, R_FLUSH, R_ACTIVE
 	} reason;
 };
 
 /* Prototype for functions shared from softflowd.c */
 u_int32_t timeval_sub_ms(const struct timeval *t1, const struct timeval *t2);
+void flowtrack_gettime(const struct FLOWTRACKPARAMETERS *param,
+    struct timeval *tv);
+
+/*
+ * Template refresh state of an export target. Over UDP the templates are
+ * due again whenever a refresh starts; over TCP and SCTP they are only
+ * sent once per connection.
+ */
+#define MAX_EXPORT_TEMPLATES	32
+struct TEMPLATE_STATE {
+	int stream;			/* Connection oriented transport */
+	int started;			/* A refresh has been started */
+	int pkts_left;			/* Datagrams until next refresh */
+	time_t next_refresh;		/* Time of next refresh */
+	u_char due[MAX_EXPORT_TEMPLATES]; /* Not sent since last refresh */
+};
+
+/*
+ * Describes a location where we send NetFlow packets to. Targets form a
+ * list; a target with the same dialect and transport as an earlier one
+ * is put on that target's "share" chain and sent the datagrams encoded
+ * for it, so each flow is only encoded once per dialect.
+ */
+struct NETFLOW_SENDER;
+struct EXPORT_QUEUE;
+struct NETFLOW_TARGET {
+	int fd;
+	const struct NETFLOW_SENDER *dialect;
+	int protocol;			/* IPPROTO_UDP, _TCP or _SCTP */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char name[NI_MAXHOST + NI_MAXSERV + 4];	/* [host]:port */
+	struct TEMPLATE_STATE tmpl;
+	u_int32_t sequence;		/* Export sequence number */
+	int shared;			/* Sent another target's datagrams */
+	time_t down_until;		/* Failed, skip when balancing */
+	struct EXPORT_QUEUE *queue;	/* Send queue, see export.h */
+	struct NETFLOW_TARGET *share;	/* Next target sent our datagrams */
+	struct NETFLOW_TARGET *next;
+
+	/* Statistics */
+	u_int64_t packets_sent;		/* Datagrams sent */
+	u_int64_t packets_failed;	/* Datagrams that could not be sent */
+	u_int64_t failures;		/* Times the target was marked down */
+	u_int64_t flows_balanced;	/* Flows given to it by -H */
+};
 
 /* Prototypes for functions to send NetFlow packets, from netflow*.c */
 int send_netflow_v1(struct FLOW **flows,
                     int num_flows,
-                    int nfsock,
+                    struct NETFLOW_TARGET *target,
 		    u_int16_t ifidx,
                     struct FLOWTRACKPARAMETERS *param,
 		    int verbose_flag);
 
 int send_netflow_v5(struct FLOW **flows,
                     int num_flows,
-                    int nfsock,
+                    struct NETFLOW_TARGET *target,
 		    u_int16_t ifidx,
                     struct FLOWTRACKPARAMETERS *param,
 		    int verbose_flag);
 
 int send_netflow_v9(struct FLOW **flows,
                     int num_flows,
-                    int nfsock,
+                    struct NETFLOW_TARGET *target,
 		    u_int16_t ifidx,
                     struct FLOWTRACKPARAMETERS *param,
 		    int verbose_flag);
 
-void nf9_init_template(char *str_template);
+void nf9_init_template(char *str_template, u_int counter_width);
 
 int send_ipfix(     struct FLOW **flows,
                     int num_flows,
-                    int nfsock,
+                    struct NETFLOW_TARGET *target,
 	            u_int16_t ifidx,
                     struct FLOWTRACKPARAMETERS *param,
 	            int verbose_flag);
 
 int send_ipfix_bidirection( struct FLOW **flows,
                             int num_flows,
-                            int nfsock,
+                            struct NETFLOW_TARGET *target,
 			    u_int16_t ifidx,
 			    struct FLOWTRACKPARAMETERS *param,
 			    int verbose_flag);
 
-/* Force a resend of the flow template */
-void netflow9_resend_template(void);
-void ipfix_resend_template(void);
-
 #endif /* _SOFTFLOWD_H */